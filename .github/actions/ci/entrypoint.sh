@@ -10,6 +10,9 @@ case "$1" in
 	"shellcheck")
 		make shellcheck
 		;;
+	"test")
+		make test
+		;;
 	"clang")
 		make all -j
 		;;
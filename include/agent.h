@@ -0,0 +1,128 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "invocation.h"
+
+// The agent listens on a socket with this name in $XDG_RUNTIME_DIR, which is
+// private to the user; without $XDG_RUNTIME_DIR there is no agent.
+#define AGENT_SOCKET_NAME APPNAME "-agent.socket"
+
+// Bumped whenever requests or responses change, so that an agent left running
+// across an upgrade refuses clients it cannot understand.
+#define AGENT_PROTOCOL_VERSION 1
+
+// How long the agent keeps a passphrase-derived key, unless it is given
+// --kdf-cache-ttl
+#ifndef AGENT_DEFAULT_KEY_TTL_SECONDS
+#define AGENT_DEFAULT_KEY_TTL_SECONDS (10 * 60)
+#endif
+
+// The most requests the agent serves at once (each on its own thread); beyond
+// this, clients are told it is busy.
+#ifndef AGENT_MAX_CONNECTIONS
+#define AGENT_MAX_CONNECTIONS 16
+#endif
+
+// The most passphrase-derived keys the agent keeps at once; beyond this, the
+// one which would expire first is dropped.
+#ifndef AGENT_MAX_CACHED_KEYS
+#define AGENT_MAX_CACHED_KEYS 32
+#endif
+
+// How long the agent waits for a client to send its request (or to read the
+// response) before giving up on it
+#ifndef AGENT_CLIENT_TIMEOUT_SECONDS
+#define AGENT_CLIENT_TIMEOUT_SECONDS 5
+#endif
+
+// Messages are read into the secure arena, so must be small. Each is a 4-byte
+// big-endian length followed by that many bytes of fields, each of which is a
+// 1-byte tag, a 4-byte big-endian length and the value.
+#define AGENT_MAX_MESSAGE_SIZE (8 * 1024)
+#define AGENT_MESSAGE_LENGTH_SIZE 4
+#define AGENT_FIELD_HEADER_SIZE 5
+
+typedef enum agent_field_t {
+	agent_field_version = 1,
+	// Request fields
+	agent_field_keyfile,
+	agent_field_passphrase,
+	agent_field_pin,
+	agent_field_mixin,
+	agent_field_second_mixin,
+	agent_field_race,
+	// Response fields
+	agent_field_status,
+	agent_field_exit_code,
+	agent_field_message,
+	agent_field_secret,
+	agent_field_derive_subkeys,
+} agent_field_t;
+
+typedef enum agent_status_t {
+	agent_status_ok,
+	// The passphrase-derived key is not cached, so the request must be sent
+	// again with the passphrase
+	agent_status_need_passphrase,
+	// An authenticator needs a PIN, so the request must be sent again with
+	// it; the message is what to prompt for
+	agent_status_need_pin,
+	// The exit code and message say what went wrong
+	agent_status_failed,
+} agent_status_t;
+
+/**
+ * What generate --agent asks the agent for. The passphrase and PIN are in the
+ * secure arena, and each of them (and the mixins) may be NULL.
+ */
+typedef struct agent_request_t {
+	unsigned char *keyfile;
+	size_t keyfile_size;
+	char *passphrase;
+	char *pin;
+	char *mixin;
+	char *second_mixin;
+	bool race_authenticators;
+} agent_request_t;
+
+/**
+ * What the agent answers with. If status is agent_status_ok, secret (in the
+ * secure arena) is the authenticator's output and derive_subkeys is as
+ * recorded in the keyfile; otherwise secret is NULL and message is set.
+ */
+typedef struct agent_response_t {
+	agent_status_t status;
+	unsigned char exit_code;
+	char *message;
+	unsigned char *secret;
+	size_t secret_size;
+	bool derive_subkeys;
+} agent_response_t;
+
+/**
+ * Returns the path of the agent's socket (which must be freed), or NULL if
+ * there is no $XDG_RUNTIME_DIR to keep it in.
+ */
+char *get_agent_socket_path(void);
+/**
+ * Returns whether an agent is listening on its socket, by connecting to it and
+ * closing the connection without sending a request.
+ */
+bool agent_is_listening(void);
+/**
+ * Serves generate requests on the agent's socket until interrupted, keeping
+ * passphrase-derived keys in the secure arena in between. SIGHUP forgets the
+ * keys. Frees invocation.
+ */
+unsigned short int run_agent(invocation_state_t *invocation);
+/**
+ * Sends request to the agent and returns its response, which must be freed
+ * with free_agent_response(). Exits if the agent cannot be reached.
+ */
+agent_response_t *request_secret_from_agent(agent_request_t *request);
+void free_agent_response(agent_response_t *response);
+
+#endif
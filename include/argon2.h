@@ -0,0 +1,99 @@
+#ifndef ARGON2_H
+#define ARGON2_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Argon2 types, numbered as in the Argon2 specification (RFC 9106). Note that
+// these values are the same as libsodium's crypto_pwhash_ALG_ARGON2I13 and
+// crypto_pwhash_ALG_ARGON2ID13, so they can be stored in the same field.
+#define ARGON2_TYPE_I 1
+#define ARGON2_TYPE_ID 2
+
+#define ARGON2_VERSION_NUMBER 0x13
+
+#define ARGON2_BLOCK_SIZE 1024
+#define ARGON2_QWORDS_IN_BLOCK (ARGON2_BLOCK_SIZE / 8)
+#define ARGON2_ADDRESSES_IN_BLOCK 128
+#define ARGON2_SYNC_POINTS 4
+#define ARGON2_PREHASH_DIGEST_LENGTH 64
+#define ARGON2_PREHASH_SEED_LENGTH (ARGON2_PREHASH_DIGEST_LENGTH + 8)
+
+// We store the number of lanes in an 8 bit field, so this is our limit even
+// though Argon2 itself permits up to 2^24 - 1 lanes.
+#define ARGON2_MAX_LANES 255
+
+// We use libsodium's BLAKE2b, which cannot produce digests shorter than this.
+#define ARGON2_MIN_OUTPUT_SIZE 16
+
+typedef enum argon2_memory_backing_t {
+	ARGON2_MEMORY_BACKING_HUGETLB,
+	ARGON2_MEMORY_BACKING_TRANSPARENT_HUGE_PAGES,
+	ARGON2_MEMORY_BACKING_NORMAL_PAGES,
+} argon2_memory_backing_t;
+
+/**
+ * Computes Argon2 (of type ARGON2_TYPE_I or ARGON2_TYPE_ID, version 0x13) over
+ * the passphrase and salt, filling each of the lanes on its own thread. With
+ * lanes == 1 the output is identical to libsodium's crypto_pwhash() given the
+ * same type, opslimit (t_cost) and memlimit (m_cost_kib * 1024).
+ *
+ * The work memory is taken from huge pages where possible. If memory_backing
+ * is not NULL, the kind of pages actually used is stored there.
+ *
+ * Returns 0 on success, or -1 if the parameters are invalid or memory or
+ * threads could not be allocated.
+ */
+int argon2_hash(unsigned char *output, size_t output_size,
+                const char *passphrase, size_t passphrase_size,
+                const unsigned char *salt, size_t salt_size, uint32_t t_cost,
+                uint32_t m_cost_kib, uint32_t lanes, int type,
+                argon2_memory_backing_t *memory_backing);
+
+/**
+ * Work memory for argon2_hash_in_memory(), which can be allocated (and
+ * prefaulted) ahead of time. Freeing it zeroes it.
+ */
+typedef struct argon2_memory_t argon2_memory_t;
+
+/**
+ * Returns memory for m_cost_kib and lanes, or NULL if the parameters are
+ * invalid or the memory could not be mapped.
+ */
+argon2_memory_t *argon2_allocate_memory(uint32_t m_cost_kib, uint32_t lanes);
+/**
+ * Touches every page of memory, so that computing the hash doesn't have to
+ * wait for the kernel to fault them in.
+ */
+void argon2_prefault_memory(argon2_memory_t *memory);
+argon2_memory_backing_t argon2_memory_backing(const argon2_memory_t *memory);
+void argon2_free_memory(argon2_memory_t *memory);
+
+/**
+ * As argon2_hash(), but using memory from argon2_allocate_memory() with the
+ * same m_cost_kib and lanes (or -1 is returned). The memory is left dirty;
+ * it may be used again or passed to argon2_free_memory().
+ */
+int argon2_hash_in_memory(unsigned char *output, size_t output_size,
+                          const char *passphrase, size_t passphrase_size,
+                          const unsigned char *salt, size_t salt_size,
+                          uint32_t t_cost, uint32_t m_cost_kib, uint32_t lanes,
+                          int type, argon2_memory_t *memory);
+
+/**
+ * As argon2_hash_in_memory(), but if cancelled is not NULL, gives up and
+ * returns -1 within a millisecond or so of it becoming true.
+ */
+int argon2_hash_in_memory_cancellable(
+    unsigned char *output, size_t output_size, const char *passphrase,
+    size_t passphrase_size, const unsigned char *salt, size_t salt_size,
+    uint32_t t_cost, uint32_t m_cost_kib, uint32_t lanes, int type,
+    argon2_memory_t *memory, const atomic_bool *cancelled);
+
+/**
+ * Returns a human-readable description of backing, like "normal pages".
+ */
+const char *argon2_memory_backing_name(argon2_memory_backing_t backing);
+
+#endif
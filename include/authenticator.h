@@ -11,7 +11,23 @@
 
 #define CLIENT_DATA_HASH_SIZE_BYTES 32
 
+// How long an authenticator has to return the secret for an unattended
+// keyfile, as nobody is there to touch one which waits for a touch anyway
+#ifndef UNATTENDED_ASSERTION_TIMEOUT_MS
+#define UNATTENDED_ASSERTION_TIMEOUT_MS 2000
+#endif
+
+// How long probe_devices() waits for devices to open and describe themselves
+#ifndef DEVICE_PROBE_TIMEOUT_MS
+#define DEVICE_PROBE_TIMEOUT_MS 3000
+#endif
+
+// hmac-secret takes one or two salts of this size, and returns an HMAC of the
+// same size for each
+#define HMAC_SECRET_SALT_SIZE 32
+
 #include <fido.h>
+#include <stdbool.h>
 
 typedef struct secret_t {
 	unsigned char *secret;
@@ -32,6 +48,16 @@ typedef struct authenticator_parameters_t {
 	unsigned char *salt;
 	size_t salt_size;
 	char *authenticator_pin;
+	// Not sent to the authenticator: whether its output is a root secret for
+	// deriving subkeys (see derive_subkey())
+	bool derive_subkeys;
+	// Whether to ask for the secret without user presence (and without the
+	// PIN), as recorded in the keyfile
+	bool unattended;
+	// Not sent to the authenticator: the USB vendor and product IDs recorded
+	// in the keyfile, or 0 if none were
+	int16_t device_vendor;
+	int16_t device_product;
 } authenticator_parameters_t;
 
 typedef struct devices_list_t {
@@ -39,12 +65,87 @@ typedef struct devices_list_t {
 	fido_dev_info_t *list;
 } devices_list_t;
 
+typedef enum device_probe_status_t {
+	device_probe_ok,
+	device_probe_failed,
+	device_probe_timed_out,
+	// Not wanted on the strength of its entry in the devices list alone
+	device_probe_not_wanted,
+} device_probe_status_t;
+
+// AAGUIDs are always this long, though we allow for shorter ones
+#define DEVICE_AAGUID_MAX_SIZE 16
+
+/**
+ * What we need to know about a device from its CBOR info, which does not
+ * change for as long as it is plugged in (so can be cached; see
+ * device_cache.h). If fido2 is false, the rest is unset.
+ */
+typedef struct device_facts_t {
+	bool fido2;
+	bool supports_hmac_secret;
+	size_t aaguid_size;
+	unsigned char aaguid[DEVICE_AAGUID_MAX_SIZE];
+} device_facts_t;
+
+/**
+ * Decides whether probe_devices() should keep a device open. It is first
+ * called with facts NULL, to rule out a device from its entry in the devices
+ * list (such as its USB vendor and product IDs) before opening it, and then
+ * again with the device's facts.
+ */
+typedef bool (*device_wanted_t)(const fido_dev_info_t *device_info,
+                                const device_facts_t *facts, void *context);
+
+/**
+ * A device from a devices_list_t, as probed by probe_devices(). If status is
+ * device_probe_ok, facts are set, and device is open if it was wanted. If
+ * status is device_probe_failed, error says why. If status is
+ * device_probe_not_wanted, nothing is known about the device. The strings
+ * belong to the devices list.
+ */
+typedef struct probed_device_t {
+	const char *path;
+	const char *manufacturer_string;
+	const char *product_string;
+	device_probe_status_t status;
+	int error;
+	fido_dev_t *device;
+	device_facts_t facts;
+} probed_device_t;
+
+typedef struct probed_devices_t {
+	size_t count;
+	probed_device_t *list;
+} probed_devices_t;
+
 devices_list_t *list_devices(void);
 void free_devices_list(devices_list_t *devices_list);
+/**
+ * Finds out the facts about every device in devices_list, from the device
+ * cache or otherwise by opening the device and getting its CBOR info, each on
+ * its own thread so that one slow device does not hold up the others. Devices
+ * for which wanted returns true are left open; others are closed, or if their
+ * facts were cached (or wanted ruled them out from the devices list), never
+ * opened. Devices which have not finished within DEVICE_PROBE_TIMEOUT_MS are
+ * reported as timed out; their requests time out then too, and every thread is
+ * joined (and those devices closed) before this returns. The results are in
+ * the same order as devices_list, which must outlive them.
+ */
+probed_devices_t *probe_devices(devices_list_t *devices_list,
+                                device_wanted_t wanted, void *context);
+/**
+ * Closes and frees the devices in probed, other than any device which has been
+ * set to NULL because the caller has taken it.
+ */
+void free_probed_devices(probed_devices_t *probed);
+const char *describe_device_probe_failure(probed_device_t *probed);
 
 fido_dev_t *get_device_even_if_not_fido2(const char *path);
 fido_dev_t *get_device(const char *path);
 bool device_supports_hmac_secret(fido_cbor_info_t *device_info);
+void get_device_facts(fido_dev_t *device, fido_cbor_info_t *device_info,
+                      device_facts_t *facts);
 fido_cbor_info_t *get_device_info(fido_dev_t *device);
 void free_device_info(fido_cbor_info_t *cbor_info);
 void close_and_free_device_ignoring_errors(fido_dev_t *device);
@@ -59,12 +160,47 @@ allocate_parameters_except_rpid(size_t credential_id_size, size_t salt_size);
  */
 void free_parameters(authenticator_parameters_t *params);
 
-void create_credential(fido_dev_t *device, authenticator_parameters_t *params);
+/**
+ * Creates a credential for params on device, storing its ID in params.
+ * Returns FIDO_OK, or the error which stopped it, having freed nothing.
+ */
+int create_credential(fido_dev_t *device, authenticator_parameters_t *params);
 
 secret_t *allocate_secret(size_t size);
+/**
+ * Asks device for the secret for params, copying it into secret_struct.
+ * Returns FIDO_OK, or the error which stopped it, having freed nothing:
+ * FIDO_ERR_UNSUPPORTED_EXTENSION if the device answered without the secret.
+ */
 int get_secret_from_authenticator_params(fido_dev_t *device,
                                          authenticator_parameters_t *params,
                                          secret_t *secret_struct);
+
+typedef struct assertion_attempt_t {
+	fido_dev_t *device;
+	const char *pin;
+	// Set to how the attempt ended: FIDO_OK if it returned a secret
+	int result;
+} assertion_attempt_t;
+
+/**
+ * Asks every device in attempts for the secret at once, and returns the index
+ * of the first to return it (copying the secret into secret_struct), having
+ * cancelled the requests to the others. Returns attempt_count if no device
+ * returned the secret, leaving each device's error in its attempt.
+ */
+size_t race_for_secret_from_authenticator_params(
+    assertion_attempt_t *attempts, size_t attempt_count,
+    authenticator_parameters_t *params, secret_t *secret_struct);
+/**
+ * Asks every device in attempts at once, without user presence (so without
+ * needing a touch, or a PIN), whether it holds the credential in params. Each
+ * attempt's result is set to FIDO_OK if it does, FIDO_ERR_NO_CREDENTIALS if
+ * it does not, or another error if the device could not say.
+ */
+void probe_for_credential_on_devices(assertion_attempt_t *attempts,
+                                     size_t attempt_count,
+                                     authenticator_parameters_t *params);
 void free_secret(secret_t *secret_struct);
 
 #endif
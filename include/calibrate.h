@@ -0,0 +1,49 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+#include <stddef.h>
+
+#include "invocation.h"
+
+#define MEBIBYTE (1024 * 1024)
+
+// The smallest amount of memory we will calibrate the key derivation function
+// to use; anything smaller offers little resistance to brute forcing.
+#define CALIBRATION_MINIMUM_MEMORY_BYTES (8 * MEBIBYTE)
+
+// The largest opslimit in the table printed by kdf-calibrate.
+#define CALIBRATION_TABLE_MAXIMUM_OPSLIMIT 4
+
+// Measurements longer than this (or than twice --kdf-target-ms, if that is
+// larger) are not taken when printing the calibration table.
+#define CALIBRATION_TABLE_TIME_LIMIT_MS 2000
+
+/**
+ * Returns the number of bytes of memory this process can expect to be able to
+ * allocate, being the smallest of physical memory, MemAvailable in
+ * /proc/meminfo and the headroom left by any cgroup memory limit.
+ */
+size_t get_available_memory(void);
+
+/**
+ * Returns the most memory kdf-calibrate or enrol should use for key
+ * derivation: the --kdf-max-memory given in invocation, or half of
+ * get_available_memory() if that was not given (or is larger).
+ */
+size_t get_maximum_kdf_memory(invocation_state_t *invocation);
+
+/**
+ * Measures the key derivation function on this machine and chooses the
+ * parameters which use as much memory as possible (up to maximum_memory) while
+ * taking about target_ms milliseconds, increasing opslimit once maximum_memory
+ * is reached.
+ */
+void choose_kdf_parameters_for_target_time(unsigned int target_ms,
+                                           size_t maximum_memory,
+                                           unsigned int lanes,
+                                           unsigned long long *opslimit,
+                                           size_t *memlimit);
+
+void print_kdf_calibration(invocation_state_t *invocation);
+
+#endif
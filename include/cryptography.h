@@ -1,13 +1,35 @@
 #ifndef CRYPTOGRAPHY_H
 #define CRYPTOGRAPHY_H
 
+#include "argon2.h"
+#include "exit.h"
 #include "invocation.h"
+#include "memory.h"
 #include "serialization_types.h"
 #include "stdlib.h"
+#include <pthread.h>
 #include <sodium.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
 #define KEY_SIZE crypto_secretbox_KEYBYTES
 
+// Subkeys are as long as the secret generate otherwise prints
+#define SUBKEY_SIZE crypto_generichash_blake2b_BYTES_MAX
+
+/**
+ * Memory for the key derivation function, being allocated and prefaulted on a
+ * worker thread as started by start_preparing_kdf_memory(). It must be given
+ * to a key spec with the same memlimit and lanes (which then owns it), or
+ * passed to free_kdf_memory().
+ */
+typedef struct kdf_memory_t {
+	pthread_t thread;
+	size_t memlimit;
+	uint8_t lanes;
+	argon2_memory_t *memory;
+} kdf_memory_t;
+
 typedef struct key_spec_t {
 	char *passphrase;
 	unsigned char *kdf_salt;
@@ -15,14 +37,96 @@ typedef struct key_spec_t {
 	unsigned long long opslimit;
 	size_t memlimit;
 	int algorithm;
+	uint8_t lanes;
+	// Used (and then freed) by derive_key() if not NULL
+	kdf_memory_t *prepared_memory;
 } key_spec_t;
 
+/**
+ * A key derivation running on a worker thread, as started by
+ * start_deriving_key_consuming_key_spec(). Every derivation must be passed to
+ * exactly one of finish_deriving_key() or cancel_key_derivation().
+ */
+typedef struct key_derivation_t {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t key_ready_condition;
+	key_spec_t *key_spec;
+	unsigned char *key_bytes;
+	// The key is available, though the work memory may still be being zeroed
+	bool key_ready;
+	// If the derivation failed, what the worker would have exited with, for
+	// take_derived_key() to exit with (or have caught) instead
+	int failure_exit_code;
+	char failure_message[FAILURE_MESSAGE_SIZE];
+	// The secure allocation scope of the thread which started the derivation
+	// (see start_secure_allocation_scope()), which the worker's key joins
+	secure_allocation_scope_t allocation_scope;
+	atomic_bool cancelled;
+	// The worker has finished with the secure arena; guarded by the lock on
+	// the list of running derivations, not by lock
+	bool finished;
+	struct key_derivation_t *next_running;
+} key_derivation_t;
+
 unsigned char *derive_key(key_spec_t *key_spec);
+/**
+ * As derive_key(), but also stores the kind of pages used for the key
+ * derivation function's work memory in memory_backing.
+ */
+unsigned char *
+derive_key_reporting_memory_backing(key_spec_t *key_spec,
+                                    argon2_memory_backing_t *memory_backing);
+key_derivation_t *start_deriving_key_consuming_key_spec(key_spec_t *key_spec);
+kdf_memory_t *start_preparing_kdf_memory(size_t memlimit, uint8_t lanes);
+void free_kdf_memory(kdf_memory_t *kdf_memory);
+/**
+ * Waits for the derivation to complete and returns the key, which must be
+ * freed with free_key(). Frees the derivation. If the derivation failed, this
+ * fails (on the calling thread) as the worker would have.
+ */
+unsigned char *finish_deriving_key(key_derivation_t *derivation);
+/**
+ * Waits for the key and returns it, like finish_deriving_key(), but without
+ * waiting for the worker thread to zero the key derivation function's work
+ * memory. The derivation must then be passed to
+ * finish_scrubbing_and_free_key_derivation(), unless the derivation failed,
+ * in which case this frees it and fails as the worker would have.
+ */
+unsigned char *take_derived_key(key_derivation_t *derivation);
+void finish_scrubbing_and_free_key_derivation(key_derivation_t *derivation);
+/**
+ * Stops the derivation, waiting only for the worker thread to notice and zero
+ * the work memory, and frees it.
+ */
+void cancel_key_derivation(key_derivation_t *derivation);
+/**
+ * Derives the subkey for label into subkey (which must be SUBKEY_SIZE bytes)
+ * from root, the authenticator's output for a keyfile enrolled with
+ * --derive-subkeys. This is keyed BLAKE2b of the label, personalized so that
+ * subkeys are not the same as any other hash of the root.
+ */
+void derive_subkey(unsigned char *subkey, const unsigned char *root,
+                   size_t root_size, const char *label);
+/**
+ * Returns whether a key can be derived with cleartext's key derivation
+ * parameters without failing: that they are valid, and need no more memory
+ * than is available. For keyfiles from elsewhere, as the agent gets them.
+ */
+bool kdf_parameters_are_usable(const deserialized_cleartext *cleartext);
+key_spec_t *copy_key_spec(key_spec_t *spec);
 void free_key_spec(key_spec_t *spec);
 void free_key(unsigned char *key);
 key_spec_t *
 make_key_spec_from_passphrase_and_cleartext(char *passphrase,
                                             deserialized_cleartext *cleartext);
 key_spec_t *make_new_key_spec_from_invocation(invocation_state_t *invocation);
+/**
+ * As make_new_key_spec_from_invocation(), but for a passphrase other than the
+ * one in invocation (such as rekey's new passphrase).
+ */
+key_spec_t *
+make_new_key_spec_from_invocation_and_passphrase(invocation_state_t *invocation,
+                                                 const char *passphrase);
 
 #endif
@@ -0,0 +1,29 @@
+#ifndef CRYPTSETUP_TOKEN_KHEFIN_H
+#define CRYPTSETUP_TOKEN_KHEFIN_H
+
+#include <stddef.h>
+
+// The field of the token's JSON holding the keyfile, base64 encoded; the
+// token's type is APPNAME, which is how libcryptsetup finds the plugin
+#define CRYPTSETUP_TOKEN_KHEFIN_KEYFILE_FIELD "keyfile"
+
+// Keyfiles are a few hundred bytes, so anything much bigger is not one
+#define CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE (64 * 1024)
+
+// Messages passed to crypt_log() longer than this are truncated
+#define CRYPTSETUP_TOKEN_KHEFIN_MESSAGE_SIZE 512
+
+// The functions libcryptsetup looks up in a token plugin, for version 1.0 of
+// its ABI (CRYPT_TOKEN_ABI_VERSION1); each returns 0 or a negative errno
+struct crypt_device;
+const char *cryptsetup_token_version(void);
+int cryptsetup_token_open(struct crypt_device *cd, int token, char **buffer,
+                          size_t *buffer_len, void *usrptr);
+int cryptsetup_token_open_pin(struct crypt_device *cd, int token,
+                              const char *pin, size_t pin_size, char **buffer,
+                              size_t *buffer_len, void *usrptr);
+void cryptsetup_token_buffer_free(void *buffer, size_t buffer_len);
+int cryptsetup_token_validate(struct crypt_device *cd, const char *json);
+void cryptsetup_token_dump(struct crypt_device *cd, const char *json);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <fido.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "authenticator.h"
+
+// The cache is kept in this file in $XDG_RUNTIME_DIR, which is private to the
+// user and emptied when they log out; without $XDG_RUNTIME_DIR there is no
+// cache.
+#define DEVICE_CACHE_FILE_NAME APPNAME "-devices.cbor"
+#define DEVICE_CACHE_VERSION 1
+
+// Larger cache files are ignored
+#define DEVICE_CACHE_MAX_FILE_SIZE 65536
+
+/**
+ * Identifies one plugging-in of a device: its path, USB vendor and product,
+ * and the device node's number, inode and change time, which are new each
+ * time the node is created.
+ */
+typedef struct device_identity_t {
+	char *path;
+	int16_t vendor;
+	int16_t product;
+	uint64_t device_number;
+	uint64_t inode;
+	uint64_t change_seconds;
+	uint64_t change_nanoseconds;
+} device_identity_t;
+
+typedef struct device_cache_entry_t {
+	device_identity_t identity;
+	device_facts_t facts;
+} device_cache_entry_t;
+
+typedef struct device_cache_t {
+	// NULL if there is nowhere to keep the cache
+	char *path;
+	size_t count;
+	device_cache_entry_t *list;
+	bool changed;
+} device_cache_t;
+
+/**
+ * Reads the device cache. A cache which is missing, unreadable or malformed is
+ * treated as empty, as it can always be rebuilt from the devices.
+ */
+device_cache_t *load_device_cache(void);
+/**
+ * Sets facts to those cached for the device described by device_info and
+ * returns true, if they were cached since it was plugged in.
+ */
+bool get_cached_device_facts(device_cache_t *cache,
+                             const fido_dev_info_t *device_info,
+                             device_facts_t *facts);
+void cache_device_facts(device_cache_t *cache,
+                        const fido_dev_info_t *device_info,
+                        const device_facts_t *facts);
+void forget_device_facts(device_cache_t *cache,
+                         const fido_dev_info_t *device_info);
+/**
+ * Writes the cache back if it has changed, leaving out devices which have since
+ * been unplugged, and frees it. Failure to write the cache is only a warning.
+ */
+void save_and_free_device_cache(device_cache_t *cache);
+
+#endif
@@ -2,6 +2,8 @@
 #define EXIT_H
 
 #include <err.h>
+#include <setjmp.h>
+#include <stdbool.h>
 
 // Three categories of error:
 //  - user errors, like a bad passphrase
@@ -31,6 +33,9 @@
 #define EXIT_CRYPTOGRAPHY_ERROR (2 | EXIT_H_RUNTIME_ERROR_BITS)
 #define EXIT_OVER_PRIVILEGED (3 | EXIT_H_RUNTIME_ERROR_BITS)
 #define EXIT_UNABLE_TO_GET_USER_SECRET (4 | EXIT_H_RUNTIME_ERROR_BITS)
+#define EXIT_KEYRING_ERROR (5 | EXIT_H_RUNTIME_ERROR_BITS)
+#define EXIT_AGENT_ERROR (6 | EXIT_H_RUNTIME_ERROR_BITS)
+#define EXIT_OUTPUT_ERROR (7 | EXIT_H_RUNTIME_ERROR_BITS)
 
 #define EXIT_PROGRAMMER_ERROR (0 | EXIT_H_PROGRAMMER_ERROR_BITS)
 
@@ -38,4 +43,66 @@
 #define EXIT_FAILURE 1
 #endif
 
+// Longer messages are truncated when a failure is caught
+#define FAILURE_MESSAGE_SIZE 256
+
+/**
+ * Where failures on a thread go instead of exiting while they are being caught
+ * (see catch_failures()).
+ */
+typedef struct failure_catcher_t {
+	jmp_buf jump;
+	int exit_code;
+	char message[FAILURE_MESSAGE_SIZE];
+} failure_catcher_t;
+
+/**
+ * Prints the message (followed by strerror(errno) if with_errno) and exits
+ * with exit_code, as err() and errx() do, unless failures on this thread are
+ * being caught, in which case the exit code and message are stored in the
+ * catcher and it is jumped to instead. err() and errx() are redefined below to
+ * call this, so that libkhefin (see khefin.h) can return an error code where
+ * the command line tool exits.
+ */
+void fail(int exit_code, bool with_errno, const char *format, ...)
+    __attribute__((noreturn, format(printf, 3, 4)));
+/**
+ * Makes the next failure on this thread jump to catcher, which must have been
+ * set up with setjmp(catcher->jump) in a function which has not yet returned,
+ * until stop_catching_failures() is called. Nothing is freed on the way, so
+ * anything allocated since then is leaked.
+ */
+void catch_failures(failure_catcher_t *catcher);
+void stop_catching_failures(void);
+
+/**
+ * Where warnings on a thread go instead of standard error while they are being
+ * redirected (see redirect_warnings()). The message has no program name or
+ * newline.
+ */
+typedef void (*warning_handler_t)(const char *message, void *data);
+
+/**
+ * Prints the message (followed by strerror(errno) if with_errno) to standard
+ * error, as warn() and warnx() do, unless warnings on this thread are being
+ * redirected, in which case it is passed to the handler instead. warn() and
+ * warnx() are redefined below to call this, so that libkhefin can pass
+ * warnings to its caller rather than writing to the host's standard error.
+ */
+void warning(bool with_errno, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+/**
+ * Passes the next warnings on this thread to handler, with data, until
+ * stop_redirecting_warnings() is called. A NULL handler leaves them on
+ * standard error. Warnings on other threads (such as those probing devices)
+ * are not redirected.
+ */
+void redirect_warnings(warning_handler_t handler, void *data);
+void stop_redirecting_warnings(void);
+
+#define err(exit_code, ...) fail(exit_code, true, __VA_ARGS__)
+#define errx(exit_code, ...) fail(exit_code, false, __VA_ARGS__)
+#define warn(...) warning(true, __VA_ARGS__)
+#define warnx(...) warning(false, __VA_ARGS__)
+
 #endif
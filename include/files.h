@@ -1,6 +1,9 @@
 #ifndef FILES_H
 #define FILES_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "serialization_types.h"
 
 #ifndef LARGEST_VALID_PAYLOAD_SIZE_BYTES
@@ -8,7 +11,18 @@
 #endif
 
 encoded_file *read_file(const char *path);
+/**
+ * As read_file(), but returns NULL rather than failing if the file cannot be
+ * read, having written why into error (which has room for error_size bytes).
+ */
+encoded_file *try_read_file(const char *path, char *error, size_t error_size);
 void write_file(encoded_file *file);
+/**
+ * Writes file to a temporary file alongside file->path, syncs it and renames
+ * it over file->path, so that readers see either the old or the new contents.
+ * Unlike write_file(), warns and returns false rather than exiting on failure.
+ */
+bool write_file_atomically(encoded_file *file);
 void free_encoded_file(encoded_file *file);
 
 #endif
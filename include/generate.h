@@ -1,14 +1,97 @@
 #ifndef GENERATE_H
 #define GENERATE_H
 
+#include <stdio.h>
+
 #include "authenticator.h"
+#include "cryptography.h"
 #include "invocation.h"
 #include "serialization_types.h"
 
+/**
+ * A keyfile read ahead of prompting for the passphrase, along with the memory
+ * for its key derivation, which is prepared in the background meanwhile. If
+ * --kdf-cache-ttl was given and the passphrase-derived key is cached,
+ * cached_key holds it instead, and there is no need for a passphrase.
+ */
+typedef struct loaded_keyfile_t {
+	deserialized_cleartext *cleartext;
+	kdf_memory_t *kdf_memory;
+	unsigned char *cached_key;
+} loaded_keyfile_t;
+
+loaded_keyfile_t *
+load_keyfile_and_start_preparing_kdf_memory(invocation_state_t *invocation);
+void free_loaded_keyfile(loaded_keyfile_t *keyfile);
+unsigned short int
+print_secret_consuming_invocation_and_keyfile(invocation_state_t *invocation,
+                                              loaded_keyfile_t *keyfile);
+/**
+ * As print_secret_consuming_invocation_and_keyfile(), but asks the agent (see
+ * agent.h) for the secret, prompting for the passphrase or a PIN only if the
+ * agent needs them.
+ */
+unsigned short int
+print_secret_from_agent_consuming_invocation(invocation_state_t *invocation);
+/**
+ * Prints the secret as the generate subcommand does: from the agent with
+ * --agent, and otherwise loading the keyfile and prompting for the passphrase
+ * if it is needed. Returns as print_secret_consuming_invocation_and_keyfile()
+ * does.
+ */
 unsigned short int
-print_secret_consuming_invocation(invocation_state_t *invocation,
-                                  devices_list_t *devices_list);
+print_secret_consuming_invocation(invocation_state_t *invocation);
+/**
+ * Prints data to stream in lowercase hex, followed by a newline, as generate
+ * prints secrets.
+ */
+void print_hex(FILE *stream, const unsigned char *data, size_t size);
+/**
+ * Exits with generate's message for a result from
+ * print_secret_consuming_invocation() other than EXIT_SUCCESS.
+ */
+void exit_unless_secret_printed(unsigned short int result);
+/**
+ * Replaces the second of the two hmac-secret salts in params with the first
+ * salt for second_mixin, so that a single assertion returns the first half of
+ * the secret for the mixin in params followed by the first half of the secret
+ * for second_mixin.
+ */
+void use_second_salt_for_second_mixin(authenticator_parameters_t *params,
+                                      deserialized_cleartext *cleartext,
+                                      unsigned char *key_bytes,
+                                      char *second_mixin);
+/**
+ * Whether a device could hold the credential in the cleartext given as
+ * context (this is a device_wanted_t for probe_devices()): going by the
+ * devices list alone if facts is NULL, and otherwise by the device's facts
+ * too.
+ */
+bool device_may_be_candidate(const fido_dev_info_t *device_info,
+                             const device_facts_t *facts, void *context);
+/**
+ * Asks the devices left open in probed (as probed from devices_list) which
+ * could hold the credential in cleartext for the secret for params, as
+ * generate does, and unlike generate never exits for want of a device or PIN.
+ * Returns EXIT_SUCCESS, having set secret, or the exit code generate would
+ * fail with. If a device needs a PIN and pin is NULL, no device is asked, and
+ * this sets *needs_pin to that device and returns EXIT_BAD_PIN; if pin is
+ * empty, devices which need a PIN are skipped. Sets *transport_error if there
+ * was no secret and a device could not be talked to, as happens if it has
+ * been unplugged since it was opened.
+ */
+unsigned short int get_secret_from_open_devices(
+    devices_list_t *devices_list, probed_devices_t *probed,
+    deserialized_cleartext *cleartext, authenticator_parameters_t *params,
+    const char *pin, bool race, secret_t *secret, probed_device_t **needs_pin,
+    bool *transport_error);
 bool device_aaguid_matches(deserialized_cleartext *cleartext,
-                           fido_cbor_info_t *device_info);
+                           const device_facts_t *facts);
+/**
+ * Whether the USB vendor and product IDs of a device in the devices list are
+ * those recorded in cleartext, if any were.
+ */
+bool device_ids_match(deserialized_cleartext *cleartext,
+                      const fido_dev_info_t *device_info);
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdbool.h>
+#include <time.h>
+
+// Authenticators appear as device nodes in this directory whose names start
+// with HOTPLUG_DEVICE_PREFIX
+#define HOTPLUG_DEVICE_DIRECTORY "/dev"
+#define HOTPLUG_DEVICE_PREFIX "hidraw"
+
+// Once a device node changes, how long to wait for it to stop changing
+#ifndef HOTPLUG_SETTLE_MS
+#define HOTPLUG_SETTLE_MS 250
+#endif
+
+typedef struct hotplug_watch_t {
+	int inotify_fd;
+	// Whether the deadline applies; otherwise we wait indefinitely
+	bool has_deadline;
+	struct timespec deadline;
+} hotplug_watch_t;
+
+/**
+ * Starts watching for device nodes being created (or their permissions being
+ * changed, as udev does once it has set them up) until timeout_seconds from
+ * now, or indefinitely if timeout_seconds is 0. Start watching before listing
+ * devices, so that none which appear in between are missed.
+ */
+hotplug_watch_t *start_watching_for_devices(unsigned int timeout_seconds);
+/**
+ * Waits until a device node has been created or changed since the watch
+ * started or this was last called, returning true, or until the deadline
+ * passes, returning false.
+ */
+bool wait_for_device_change(hotplug_watch_t *watch);
+/**
+ * Reads the events waiting on watch without waiting for more, returning true
+ * if any of them was about a device node which could be an authenticator. The
+ * watch's inotify_fd can be polled to find out when there are some.
+ */
+bool read_device_changes(hotplug_watch_t *watch);
+void stop_watching_for_devices(hotplug_watch_t *watch);
+/**
+ * Says on STDERR that we are waiting (for up to timeout_seconds, unless that
+ * is 0) for a compatible authenticator to be connected.
+ */
+void warn_waiting_for_authenticator(unsigned int timeout_seconds);
+
+#endif
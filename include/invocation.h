@@ -12,6 +12,35 @@
 // https://fidoalliance.org/specs/fido-v2.0-rd-20170927/fido-client-to-authenticator-protocol-v2.0-rd-20170927.html#client-pin-support-requirements
 #define LONGEST_VALID_PIN 255
 
+// When --kdf-lanes is not given, enrol uses one lane per online processor, up
+// to this many.
+#ifndef DEFAULT_MAXIMUM_KDF_LANES
+#define DEFAULT_MAXIMUM_KDF_LANES 16
+#endif
+
+// The longest --kdf-target-ms we accept (ten minutes).
+#define MAXIMUM_KDF_TARGET_MS (10 * 60 * 1000)
+
+// The longest --kdf-cache-ttl we accept (one day).
+#define MAXIMUM_KDF_CACHE_TTL_SECONDS (24 * 60 * 60)
+
+// The longest --wait we accept (one day).
+#define MAXIMUM_WAIT_SECONDS (24 * 60 * 60)
+
+// The most --jobs we accept for rekey.
+#define MAXIMUM_REKEY_JOBS 256
+
+// The most labels we accept in --derive.
+#define MAXIMUM_SUBKEYS 64
+
+// The most --attempts we accept for unlock-dir.
+#define MAXIMUM_PASSPHRASE_ATTEMPTS 100
+
+// getopt_long returns these for the options with no short form; they have the
+// 0x20 bit set, so LOWERCASE() leaves them as they are
+#define OPTION_SAME_PASSPHRASE 0x120
+#define OPTION_ATTEMPTS 0x121
+
 #define NL_CHARACTER_TO_STRIP 0x0a
 
 #define LOWERCASE(x) ((x) | 0x20)
@@ -24,6 +53,12 @@ typedef enum subcommand_t {
 	subcommand_enrol,
 	subcommand_generate,
 	subcommand_enumerate,
+	subcommand_kdf_calibrate,
+	subcommand_kdf_cache_flush,
+	subcommand_rekey,
+	subcommand_agent,
+	subcommand_ssh_askpass,
+	subcommand_unlock_dir,
 } subcommand_t;
 
 typedef enum kdf_hardness_t {
@@ -32,20 +67,79 @@ typedef enum kdf_hardness_t {
 	kdf_hardness_low,
 	kdf_hardness_medium,
 	kdf_hardness_high,
+	kdf_hardness_calibrated,
 } kdf_hardness_t;
 
 typedef struct invocation_state_t {
 	subcommand_t subcommand;
 	char *device;
+	// The keyfile, or for unlock-dir, the directory of keyfiles
 	char *file;
+	// The keyfiles given to rekey
+	char **files;
+	size_t file_count;
 	char *passphrase;
+	char *new_passphrase;
 	char *authenticator_pin;
 	bool obfuscate_device_info;
+	bool derive_subkeys;
+	// Whether generate asks every authenticator for the secret at once
+	bool race_authenticators;
+	// Whether enrol makes a keyfile whose secret is got without a touch
+	bool unattended;
+	// Whether enrol records the device's USB vendor and product IDs
+	bool record_device_ids;
+	// Whether generate waits for an authenticator to be connected, and for
+	// how long (0 meaning indefinitely)
+	bool wait_for_device;
+	unsigned int wait_seconds;
+	// Whether generate asks the agent for the secret (see agent.h)
+	bool use_agent;
+	// The subkeys generate should derive, from --derive
+	char **subkey_labels;
+	size_t subkey_label_count;
 	kdf_hardness_t kdf_hardness;
+	unsigned int kdf_lanes;
+	unsigned int kdf_target_ms;
+	size_t kdf_max_memory;
+	unsigned int kdf_cache_ttl;
+	unsigned int jobs;
+	// Whether unlock-dir asks for one passphrase for every keyfile, rather
+	// than one for each, and how many times it asks for a wrong one
+	bool same_passphrase;
+	unsigned int passphrase_attempts;
 	char *mixin;
+	// With --second-mixin, generate also gives a secret for this mixin
+	char *second_mixin;
+	char *second_output;
+	// What ssh-askpass was asked: the prompt OpenSSH gave, or for
+	// get-passphrase, the SSH key to print the passphrase for
+	char *prompt;
+	char *ssh_key;
 } invocation_state_t;
 
-invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv);
+/**
+ * Allocates an invocation with nothing given, as if no options were, for
+ * subcommand.
+ */
+invocation_state_t *new_invocation_state(subcommand_t subcommand);
+invocation_state_t *parse_arguments(int argc, char **argv);
+/**
+ * Fills in the key derivation parameters which were not given, as is done
+ * once the arguments have been parsed.
+ */
+void choose_default_kdf_parameters(invocation_state_t *invocation);
+/**
+ * Prompts for the passphrase unless it was given with --passphrase or
+ * --passphrase-file. This is separate from parse_arguments() so that generate
+ * can get on with other work while the user types.
+ */
+void get_passphrase_if_not_given(invocation_state_t *invocation);
+/**
+ * Prompts for the passphrase rekey should encrypt keyfiles with, unless it was
+ * given with --new-passphrase or --new-passphrase-file.
+ */
+void get_new_passphrase_if_not_given(invocation_state_t *invocation);
 void prompt_for_secret(const char *description, size_t maximum_size,
                        char *result);
 void free_invocation(invocation_state_t *invocation);
@@ -0,0 +1,42 @@
+#ifndef KDF_CACHE_H
+#define KDF_CACHE_H
+
+#include "serialization_types.h"
+
+// Keys are cached in the kernel keyring as "user" keys whose descriptions
+// start with this, followed by a hash of the keyfile's salt and parameters.
+#define KDF_CACHE_DESCRIPTION_PREFIX APPNAME ":kdf:"
+#define KDF_CACHE_HASH_BYTES 32
+#define KDF_CACHE_DESCRIPTION_SIZE                                             \
+	(sizeof(KDF_CACHE_DESCRIPTION_PREFIX) + KDF_CACHE_HASH_BYTES * 2)
+
+/**
+ * Sets description to identify the passphrase-derived key for cleartext: two
+ * keyfiles have the same description only if they have the same salt and key
+ * derivation parameters, so the same passphrase gives them the same key.
+ */
+void describe_cached_key(deserialized_cleartext *cleartext,
+                         char description[KDF_CACHE_DESCRIPTION_SIZE]);
+
+/**
+ * Returns the passphrase-derived key for cleartext cached in the kernel
+ * keyring (which must be freed with free_key()), or NULL if there is none.
+ */
+unsigned char *get_cached_key_for_cleartext(deserialized_cleartext *cleartext);
+
+/**
+ * Caches key_bytes as the passphrase-derived key for cleartext in the kernel
+ * keyring, where it expires after ttl_seconds. Failure to cache the key is
+ * only a warning.
+ */
+void cache_key_for_cleartext(deserialized_cleartext *cleartext,
+                             unsigned char *key_bytes,
+                             unsigned int ttl_seconds);
+
+/**
+ * Removes every key cached by cache_key_for_cleartext() from the session and
+ * user session keyrings, returning the number removed.
+ */
+unsigned int flush_kdf_cache(void);
+
+#endif
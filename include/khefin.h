@@ -0,0 +1,193 @@
+#ifndef KHEFIN_H
+#define KHEFIN_H
+
+/*
+ * libkhefin: the enumerate, enrol and generate subcommands, as a library.
+ *
+ * Call khefin_init() once before anything else. Each function takes a context,
+ * which holds the message for the last error; a context must only be used by
+ * one thread at a time, but threads may each use their own. Every function
+ * returns KHEFIN_OK or one of the KHEFIN_ERR_* codes below, which are the
+ * command line tool's exit statuses, where the command line tool would exit.
+ * Warnings, such as about authenticators which are skipped, are printed to
+ * standard error as the command line tool prints them, unless a warning
+ * callback is set on the context (see khefin_set_warning_callback()).
+ *
+ * Unlike the command line tool, the library does not lock the calling
+ * process's memory, disable core dumps or drop privileges; it keeps its own
+ * copies of secrets in a small locked region, but secrets returned to the
+ * caller are only as safe as the buffer they are returned in. A malformed
+ * keyfile, a wrong passphrase and missing devices or PINs are returned as
+ * errors without leaking anything; something which fails part way through for
+ * another reason (such as running out of memory) returns the locked memory it
+ * used, but may leak other memory.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KHEFIN_EXPORT __attribute__((visibility("default")))
+
+#define KHEFIN_OK 0
+#define KHEFIN_ERR_BAD_INVOCATION 32
+#define KHEFIN_ERR_BAD_PASSPHRASE 33
+#define KHEFIN_ERR_NO_DEVICES 34
+#define KHEFIN_ERR_NO_VALID_AUTHENTICATOR 35
+#define KHEFIN_ERR_DESERIALIZATION 36
+#define KHEFIN_ERR_BAD_PIN 37
+#define KHEFIN_ERR_OUT_OF_MEMORY 64
+#define KHEFIN_ERR_AUTHENTICATOR 65
+#define KHEFIN_ERR_CRYPTOGRAPHY 66
+#define KHEFIN_ERR_UNABLE_TO_GET_USER_SECRET 68
+#define KHEFIN_ERR_PROGRAMMER 96
+
+// Big enough for any secret khefin_generate() returns: two halves with
+// second_mixin, and otherwise the whole hmac-secret output
+#define KHEFIN_SECRET_MAX_SIZE 64
+// The size of each subkey from khefin_derive_subkey()
+#define KHEFIN_SUBKEY_SIZE 64
+// Longer strings in khefin_device_t are truncated
+#define KHEFIN_DEVICE_STRING_SIZE 256
+#define KHEFIN_AAGUID_MAX_SIZE 16
+
+typedef struct khefin_context_t khefin_context_t;
+
+typedef enum khefin_kdf_hardness_t {
+	// As enrol chooses when --kdf-hardness is not given, by physical memory
+	khefin_kdf_hardness_default,
+	khefin_kdf_hardness_low,
+	khefin_kdf_hardness_medium,
+	khefin_kdf_hardness_high,
+} khefin_kdf_hardness_t;
+
+/**
+ * Asked for a PIN for the authenticator described in prompt, which should be
+ * written (NUL-terminated) into pin, which has room for pin_size bytes
+ * including the NUL. Returns false if there is no PIN, giving up.
+ */
+typedef bool (*khefin_pin_callback_t)(const char *prompt, char *pin,
+                                      size_t pin_size, void *data);
+
+/**
+ * Given each warning (with no trailing newline) from a function called with
+ * the context it was set on.
+ */
+typedef void (*khefin_warning_callback_t)(const char *message, void *data);
+
+typedef struct khefin_device_t {
+	char path[KHEFIN_DEVICE_STRING_SIZE];
+	char manufacturer[KHEFIN_DEVICE_STRING_SIZE];
+	char product[KHEFIN_DEVICE_STRING_SIZE];
+	uint16_t vendor_id;
+	uint16_t product_id;
+	// Whether the device could be probed; if not, only the above are set
+	bool probed;
+	// Whether it can be enrolled, as marked by enumerate
+	bool supported;
+	size_t aaguid_size;
+	unsigned char aaguid[KHEFIN_AAGUID_MAX_SIZE];
+} khefin_device_t;
+
+/**
+ * The options for khefin_enrol(), which correspond to those of the enrol
+ * subcommand. Zero it before setting any, so that options added later are
+ * off.
+ */
+typedef struct khefin_enrol_options_t {
+	const char *device;
+	// Where to write the keyfile
+	const char *file;
+	const char *passphrase;
+	// Required if the authenticator has a PIN
+	const char *pin;
+	khefin_kdf_hardness_t kdf_hardness;
+	bool obfuscate_device_info;
+	bool derive_subkeys;
+	bool unattended;
+	bool record_device_ids;
+} khefin_enrol_options_t;
+
+/**
+ * The options for khefin_generate(), which correspond to those of the
+ * generate subcommand. Zero it before setting any, so that options added
+ * later are off.
+ */
+typedef struct khefin_generate_options_t {
+	const char *passphrase;
+	// Used for every authenticator with a PIN; if NULL, get_pin is called
+	// for the first that needs one, and failing that, it is an error
+	const char *pin;
+	khefin_pin_callback_t get_pin;
+	void *get_pin_data;
+	const char *mixin;
+	// If set, the secret is the first half of the secret for mixin followed
+	// by the first half of the secret for second_mixin
+	const char *second_mixin;
+	bool race_authenticators;
+} khefin_generate_options_t;
+
+/**
+ * Initializes libsodium and libfido2. This may be called more than once, from
+ * any thread.
+ */
+KHEFIN_EXPORT int khefin_init(void);
+/**
+ * Returns a new context, or NULL if out of memory.
+ */
+KHEFIN_EXPORT khefin_context_t *khefin_context_new(void);
+KHEFIN_EXPORT void khefin_context_free(khefin_context_t *context);
+/**
+ * Returns a description of the last error returned with context, or an empty
+ * string if there has been none. It is valid until context is next used.
+ */
+KHEFIN_EXPORT const char *khefin_last_error(const khefin_context_t *context);
+/**
+ * Passes warnings from functions called with context to callback, with data,
+ * rather than printing them to standard error. A NULL callback prints them
+ * again. A warning from one of the threads which open devices in parallel is
+ * still printed.
+ */
+KHEFIN_EXPORT void
+khefin_set_warning_callback(khefin_context_t *context,
+                            khefin_warning_callback_t callback, void *data);
+
+/**
+ * Lists the connected devices, as enumerate does, into devices, which has room
+ * for capacity of them, setting *count to the number connected (which may be
+ * more than capacity, in which case the rest are left out). Returns
+ * KHEFIN_ERR_NO_DEVICES if there are none.
+ */
+KHEFIN_EXPORT int khefin_enumerate(khefin_context_t *context,
+                                   khefin_device_t *devices, size_t capacity,
+                                   size_t *count);
+/**
+ * Creates a credential on options->device and writes its keyfile to
+ * options->file, as enrol does.
+ */
+KHEFIN_EXPORT int khefin_enrol(khefin_context_t *context,
+                               const khefin_enrol_options_t *options);
+/**
+ * Gets the secret for the keyfile in the keyfile_size bytes at keyfile, as
+ * generate does, writing it into secret, which has room for secret_capacity
+ * bytes, and setting *secret_size to its size. For a keyfile enrolled with
+ * derive_subkeys, *derive_subkeys is set and the secret is the root secret,
+ * which should only be used through khefin_derive_subkey().
+ */
+KHEFIN_EXPORT int khefin_generate(khefin_context_t *context,
+                                  const unsigned char *keyfile,
+                                  size_t keyfile_size,
+                                  const khefin_generate_options_t *options,
+                                  unsigned char *secret,
+                                  size_t secret_capacity, size_t *secret_size,
+                                  bool *derive_subkeys);
+/**
+ * Derives the KHEFIN_SUBKEY_SIZE byte subkey for label from a root secret from
+ * khefin_generate(), as generate --derive does.
+ */
+KHEFIN_EXPORT int khefin_derive_subkey(khefin_context_t *context,
+                                       const unsigned char *root,
+                                       size_t root_size, const char *label,
+                                       unsigned char *subkey);
+
+#endif
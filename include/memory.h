@@ -6,14 +6,75 @@
 #endif
 
 #include <sodium.h>
+#include <stddef.h>
 
-// This is a limit, not an allocation, so it's ok for it to be too big.
-// Set it to twice the largest amount of memory we could use (see
-// cryptography.c).
-#define MEMLOCK_LIMIT_BYTES (crypto_pwhash_MEMLIMIT_SENSITIVE * 2)
+// Size of the first locked region from which secure_malloc() allocates. This
+// must fit within RLIMIT_MEMLOCK, which is as low as 64 KiB on some
+// systems, for the memory to be locked without privileges.
+#ifndef SECURE_ARENA_SIZE
+#define SECURE_ARENA_SIZE (64 * 1024)
+#endif
+
+// Allocations from the secure arena are rounded up to a multiple of this.
+#define SECURE_ARENA_ALIGNMENT 16
 
 void lock_memory_and_drop_privileges(void);
 
+/**
+ * Registers a handler to run when the process exits, before the secure arena
+ * is zeroed, so that threads still using it can be stopped first. Handlers run
+ * in the reverse of the order they were registered in. After the arena is
+ * zeroed, secure_free() does nothing and secure_malloc() never returns on any
+ * thread but the exiting one.
+ */
+void before_zeroing_secure_arena_at_exit(void (*handler)(void));
+
+/**
+ * Allocates n bytes from the secure arena: memory which is locked (so it will
+ * not be swapped to disk), excluded from core dumps, and surrounded by
+ * inaccessible guard pages. Memory allocated this way MUST be freed with
+ * secure_free(), which zeroes it. The whole arena is zeroed when the process
+ * exits.
+ *
+ * This is intended for secrets (passphrases, PINs, keys, decrypted data). The
+ * arena starts at SECURE_ARENA_SIZE and grows by mapping more regions when it
+ * is full; if those cannot be locked (because RLIMIT_MEMLOCK is exhausted,
+ * say) they are used anyway, with a warning. Returns NULL if no memory can be
+ * mapped at all.
+ */
+void *secure_malloc(size_t n);
+void *secure_malloc_or_exit(size_t n, const char *what);
+char *secure_strdup_or_exit(const char *str, const char *what);
+char *secure_strndup_or_exit(const char *str, size_t n, const char *what);
+void secure_free(void *ptr);
+
+// Identifies the secure allocations made during one call into the library
+// (see start_secure_allocation_scope())
+typedef size_t secure_allocation_scope_t;
+#define NO_SECURE_ALLOCATION_SCOPE 0
+
+/**
+ * Starts a new scope for the secure allocations made on this thread, and
+ * returns it, so that if what follows fails part way (see catch_failures()),
+ * free_secure_allocation_scope() can return whichever of them are still held
+ * to the arena. This is for the library (see khefin.h), whose host may carry
+ * on after any number of failures; allocations which outlive a call that
+ * succeeds keep their scope, which is never freed. A worker thread can be
+ * put in its starter's scope with set_secure_allocation_scope().
+ */
+secure_allocation_scope_t start_secure_allocation_scope(void);
+secure_allocation_scope_t get_secure_allocation_scope(void);
+/**
+ * Tags later secure allocations on this thread with scope, which may be
+ * NO_SECURE_ALLOCATION_SCOPE to stop tagging them.
+ */
+void set_secure_allocation_scope(secure_allocation_scope_t scope);
+/**
+ * Zeroes and frees every secure allocation still tagged with scope. Nothing
+ * may use them afterwards, so no thread may still be running in the scope.
+ */
+void free_secure_allocation_scope(secure_allocation_scope_t scope);
+
 void *malloc_or_exit(size_t n, const char *what);
 char *strdup_or_exit(const char *str, const char *what);
 char *strndup_or_exit(const char *str, size_t n, const char *what);
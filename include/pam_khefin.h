@@ -0,0 +1,16 @@
+#ifndef PAM_KHEFIN_H
+#define PAM_KHEFIN_H
+
+// Where the PAM module finds each user's keyfile and verifier, unless given
+// keyfile= or verifier=; %h is replaced with the user's home directory, %u
+// with their user name and %% with %
+#define PAM_KHEFIN_DEFAULT_KEYFILE "%h/.config/" APPNAME "/pam.key"
+#define PAM_KHEFIN_DEFAULT_VERIFIER "%h/.config/" APPNAME "/pam.verifier"
+
+// Keyfiles are a few hundred bytes, so anything much bigger is not one
+#define PAM_KHEFIN_MAX_KEYFILE_SIZE (64 * 1024)
+
+// Expanded paths longer than this are refused
+#define PAM_KHEFIN_PATH_SIZE 4096
+
+#endif
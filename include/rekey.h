@@ -0,0 +1,18 @@
+#ifndef REKEY_H
+#define REKEY_H
+
+#include "invocation.h"
+
+/**
+ * Re-encrypts the secrets in each of invocation->files under the new
+ * passphrase (and the KDF parameters given in invocation, or otherwise those
+ * of each keyfile), writing them in the latest format. Keyfiles are rekeyed in
+ * parallel by as many jobs as there are processors and memory for.
+ *
+ * Exits without changing any keyfile if one of them cannot be read. Otherwise
+ * returns EXIT_SUCCESS if every keyfile was rekeyed, or an exit code saying
+ * why some were not (each of which will have had a warning printed).
+ */
+unsigned short int rekey_keyfiles(invocation_state_t *invocation);
+
+#endif
@@ -7,7 +7,8 @@
 #include "cryptography.h"
 #include "serialization_types.h"
 
-#define SERIALIZATION_MAX_VERSION 1
+#define SERIALIZATION_MAX_VERSION 3
+#define SECRETS_SERIALIZATION_MAX_VERSION 2
 
 #define OBFUSCATED_DEVICE_SENTINEL 0
 
@@ -24,19 +25,70 @@
 #define FIELD_COUNTER_ASSERT(function, expected, line)
 #endif
 
+/**
+ * Returns whether key_bytes decrypts the secrets in cleartext. Unlike building
+ * authenticator parameters from the cleartext, this does not exit if not.
+ */
+bool key_decrypts_cleartext(deserialized_cleartext *cleartext,
+                            unsigned char *key_bytes);
 authenticator_parameters_t *
 build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
     deserialized_cleartext *cleartext, unsigned char *key_bytes, char *mixin);
+/**
+ * As above, but rather than failing, returns EXIT_BAD_PASSPHRASE if key_bytes
+ * does not decrypt the secrets, or EXIT_DESERIALIZATION_ERROR if they cannot
+ * be deserialized, having written why into error (which has room for
+ * error_size bytes) and freed what it allocated. Otherwise sets *params and
+ * returns EXIT_SUCCESS. Only running out of memory still fails.
+ */
+int try_build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+    deserialized_cleartext *cleartext, unsigned char *key_bytes, char *mixin,
+    authenticator_parameters_t **params, char *error, size_t error_size);
 deserialized_cleartext *
-build_deserialized_cleartext_from_authenticator_parameters_and_key_spec(
-    authenticator_parameters_t *authenticator_params, key_spec_t *key_spec);
+build_deserialized_cleartext_from_authenticator_parameters_and_key_spec_and_key(
+    authenticator_parameters_t *authenticator_params, key_spec_t *key_spec,
+    unsigned char *key_bytes);
 void free_cleartext(deserialized_cleartext *clear);
 void free_secrets(deserialized_secrets *secret);
+/**
+ * Zeroes the strings and byte strings in an array of secrets, then releases
+ * our reference to it and sets *cbor_secrets to NULL.
+ */
+void zero_and_decref_cbor_secrets(cbor_item_t **cbor_secrets);
 encoded_file *write_cleartext(deserialized_cleartext *cleartext,
                               const char *path);
+/**
+ * For the versioned deserializers, which return NULL if a field is in the
+ * wrong format, having released everything they hold (cbor_root included):
+ * writes the message into error, which has room for error_size bytes, releases
+ * the references to *cbor_field (unless cbor_field is NULL) and *cbor_root,
+ * frees clear or secrets (which may be partly filled in, or NULL), and returns
+ * NULL.
+ */
+deserialized_cleartext *
+fail_to_deserialize_cleartext(deserialized_cleartext *clear,
+                              cbor_item_t **cbor_root, cbor_item_t **cbor_field,
+                              char *error, size_t error_size,
+                              const char *format, ...)
+    __attribute__((format(printf, 6, 7)));
+deserialized_secrets *
+fail_to_deserialize_secrets(deserialized_secrets *secrets,
+                            cbor_item_t **cbor_root, cbor_item_t **cbor_field,
+                            char *error, size_t error_size, const char *format,
+                            ...) __attribute__((format(printf, 6, 7)));
 deserialized_cleartext *load_cleartext(encoded_file *file);
-deserialized_secrets *load_secrets_from_bytes(unsigned char *decrypted,
-                                              size_t decrypted_size);
+/**
+ * As load_cleartext(), and likewise for the decrypted secrets, but rather than
+ * failing if the data cannot be deserialized, return NULL, having written why
+ * into error (which has room for error_size bytes) and freed what they
+ * allocated. Only running out of memory still fails.
+ */
+deserialized_cleartext *try_load_cleartext(encoded_file *file, char *error,
+                                           size_t error_size);
+deserialized_secrets *try_load_secrets_from_bytes(unsigned char *decrypted,
+                                                  size_t decrypted_size,
+                                                  char *error,
+                                                  size_t error_size);
 const char *get_cbor_error_string(cbor_error_code code);
 
 #endif
@@ -6,10 +6,13 @@
 #include "../serialization.h"
 
 deserialized_cleartext *
-deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root);
+deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root, char *error,
+                                   size_t error_size);
 cbor_item_t *serialize_cleartext_to_cbor_v1(deserialized_cleartext *clear);
 
-deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root);
+deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root,
+                                                       char *error,
+                                                       size_t error_size);
 cbor_item_t *serialize_secrets_to_cbor_v1(deserialized_secrets *secrets);
 
 #define SERIALIZATION_VERSION 1
@@ -0,0 +1,43 @@
+#ifndef SERIALIZATION_V2_H
+#define SERIALIZATION_V2_H
+
+#include <cbor.h>
+
+#include "../serialization.h"
+
+// Version 2 adds the number of Argon2 lanes to the cleartext. Version 2 of the
+// encrypted secrets adds whether they are for deriving subkeys; secrets which
+// are not are still serialized as version 1, so older versions can read them.
+deserialized_cleartext *
+deserialize_cleartext_from_cbor_v2(cbor_item_t *cbor_root, char *error,
+                                   size_t error_size);
+cbor_item_t *serialize_cleartext_to_cbor_v2(deserialized_cleartext *clear);
+
+deserialized_secrets *deserialize_secrets_from_cbor_v2(cbor_item_t *cbor_root,
+                                                       char *error,
+                                                       size_t error_size);
+cbor_item_t *serialize_secrets_to_cbor_v2(deserialized_secrets *secrets);
+
+#define SERIALIZATION_V2_VERSION 2
+
+#define V2_CLEAR_FIELD_VERSION 0
+#define V2_CLEAR_FIELD_DEVICE_AAGUID 1
+#define V2_CLEAR_FIELD_KDF_SALT 2
+#define V2_CLEAR_FIELD_OPSLIMIT 3
+#define V2_CLEAR_FIELD_MEMLIMIT 4
+#define V2_CLEAR_FIELD_ALGORITHM 5
+#define V2_CLEAR_FIELD_NONCE 6
+#define V2_CLEAR_FIELD_ENCRYPTED_DATA 7
+#define V2_CLEAR_FIELD_LANES 8
+
+#define V2_CLEAR_COUNT_OF_FIELDS 9
+
+#define V2_ENCRYPTED_FIELD_VERSION 0
+#define V2_ENCRYPTED_FIELD_RP_ID 1
+#define V2_ENCRYPTED_FIELD_CREDENTIAL_ID 2
+#define V2_ENCRYPTED_FIELD_HMAC_SALT 3
+#define V2_ENCRYPTED_FIELD_DERIVE_SUBKEYS 4
+
+#define V2_ENCRYPTED_COUNT_OF_FIELDS 5
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef SERIALIZATION_V3_H
+#define SERIALIZATION_V3_H
+
+#include <cbor.h>
+
+#include "../serialization.h"
+
+// Version 3 adds whether the secret is got without user presence, and the
+// authenticator's USB vendor and product IDs, to the cleartext, so that
+// generate knows them before the secrets are decrypted (and before opening
+// devices or asking for PINs). Keyfiles which need neither are still
+// serialized as version 2, so older versions can read them. The encrypted
+// secrets are unchanged.
+deserialized_cleartext *
+deserialize_cleartext_from_cbor_v3(cbor_item_t *cbor_root, char *error,
+                                   size_t error_size);
+cbor_item_t *serialize_cleartext_to_cbor_v3(deserialized_cleartext *clear);
+
+#define SERIALIZATION_V3_VERSION 3
+
+#define V3_CLEAR_FIELD_VERSION 0
+#define V3_CLEAR_FIELD_DEVICE_AAGUID 1
+#define V3_CLEAR_FIELD_KDF_SALT 2
+#define V3_CLEAR_FIELD_OPSLIMIT 3
+#define V3_CLEAR_FIELD_MEMLIMIT 4
+#define V3_CLEAR_FIELD_ALGORITHM 5
+#define V3_CLEAR_FIELD_NONCE 6
+#define V3_CLEAR_FIELD_ENCRYPTED_DATA 7
+#define V3_CLEAR_FIELD_LANES 8
+#define V3_CLEAR_FIELD_UNATTENDED 9
+#define V3_CLEAR_FIELD_DEVICE_VENDOR 10
+#define V3_CLEAR_FIELD_DEVICE_PRODUCT 11
+
+#define V3_CLEAR_COUNT_OF_FIELDS 12
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef SERIALIZATION_TYPES_H
 #define SERIALIZATION_TYPES_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -21,6 +22,14 @@ typedef struct deserialized_cleartext {
 	unsigned long long opslimit;
 	size_t memlimit;
 	int algorithm;
+	uint8_t lanes;
+	// Version 3 only: the secret is got without user presence, and without
+	// the authenticator's PIN
+	bool unattended;
+	// Version 3 only: the USB vendor and product IDs of the authenticator, so
+	// that generate need not open others; both are 0 if not recorded
+	int16_t device_vendor;
+	int16_t device_product;
 
 	unsigned char *nonce;
 	size_t nonce_size;
@@ -40,6 +49,9 @@ typedef struct deserialized_secrets {
 	unsigned char *salt;
 	size_t salt_size;
 
+	// Version 2 only: the authenticator's output is a root secret, from which
+	// generate derives labelled subkeys rather than printing it
+	bool derive_subkeys;
 } deserialized_secrets;
 
 #endif
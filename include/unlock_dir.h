@@ -0,0 +1,25 @@
+#ifndef UNLOCK_DIR_H
+#define UNLOCK_DIR_H
+
+#include "invocation.h"
+
+// How many times unlock-dir asks for a passphrase which turns out to be wrong
+// before moving on, when --attempts is not given
+#ifndef DEFAULT_UNLOCK_DIR_PASSPHRASE_ATTEMPTS
+#define DEFAULT_UNLOCK_DIR_PASSPHRASE_ATTEMPTS 3
+#endif
+
+/**
+ * Tries each regular file in the directory given as invocation->file as a
+ * keyfile, in alphabetical order, and prints the secret for the first which
+ * gives one, as generate does. This is for an initramfs, where the keyfiles
+ * are alternatives for the same volume (one for each authenticator, say): the
+ * devices are opened only once, keyfiles which no connected authenticator
+ * could hold the credential for are passed over without deriving their keys,
+ * and each key is derived while the PIN is asked for, as generate does.
+ * Returns EXIT_SUCCESS or the exit code for why no keyfile gave a secret,
+ * having said why on STDERR.
+ */
+unsigned short int unlock_dir(invocation_state_t *invocation);
+
+#endif
@@ -8,9 +8,15 @@ m4_APPNAME-ssh-askpass  an ssh-askpass implementation using m4_APPNAME to secure
 .B get-passphrase
 .IR ssh-keyfile
 
+.B m4_APPNAME ssh-askpass
+.B get-passphrase
+.IR ssh-keyfile
+
 .SH DESCRIPTION
-This is a Bash script that can be used as a drop-in replacement for \fBssh-askpass\fR.
-It works by having a passphrase for each SSH key derived using \fB`'m4_APPNAME generate\fR and based on the SSH key's fingerprint.
+This is a drop-in replacement for \fBssh-askpass\fR, built into \fB`'m4_APPNAME\fR(1), which acts as it when run as \fB`'m4_APPNAME-ssh-askpass\fR or with the \fBssh-askpass\fR subcommand.
+It works by having a passphrase for each SSH key derived as \fB`'m4_APPNAME generate\fR would derive it, with the SSH key's SHA256 fingerprint (as \fBssh-keygen -l\fR prints it) as the mixin.
+The fingerprint is computed from the public key, which is read from \fIssh-keyfile\fR itself if it is a public key, from \fIssh-keyfile\fB.pub\fR, or from \fIssh-keyfile\fR if it is a private key in the OpenSSH format.
+For a private key in another format, such as PEM, without its \fB.pub\fR file alongside it, \fBssh-keygen -l\fR is run to get the fingerprint, which only works if the private key is not encrypted.
 
 For this to work, you will need to set \fIssh-keyfile\fR's password to the output of \fB`'m4_APPNAME-ssh-askpass get-passphrase\fI ssh-keyfile\fR.
 You may use \fBssh-keygen -p -f \fIssh-keyfile\fB -N "$(m4_APPNAME-ssh-askpass get-passphrase \fIssh-keyfile\fB)"\fR to do this, however be aware that this will make the passphrase (briefly) available to other users on the system, who can inspect the command line for \fBssh-keygen\fR.
@@ -18,12 +24,15 @@ You may use \fBssh-keygen -p -f \fIssh-keyfile\fB -N "$(m4_APPNAME-ssh-askpass g
 Once that is done, you will need to set the \fBSSH_ASKPASS\fR environment variable to the path to \fB`'m4_APPNAME-ssh-askpass\fR so that \fBssh-agent\fR(1) knows to call it.
 
 .SH NOTES
-Because of the way this script works, it is not possible to use it with an authenticator that has a PIN.
+Because of the way this program works, it is not possible to use it with an authenticator that has a PIN.
+
+If the \fBagent\fR subcommand of \fB`'m4_APPNAME\fR(1) is running (a socket left behind by one which is not is ignored), secrets are asked of it, so that adding several keys in a row does not open the authenticator and derive the keyfile's key for each.
+Otherwise, this waits up to m4_DEFAULT_AUTHENTICATOR_WAIT_SECONDS seconds for an authenticator to be connected.
 
 You should also make a backup of your encrypted keyfile (see \fBFILES\fR below), because without this file you will be unable to decrypt your SSH keys.
 
-This script accepts parameters which are not documented here, in accordance with the way ssh-agent calls it.
-In particular, the following ways of calling this script are supported:
+This program accepts parameters which are not documented here, in accordance with the way ssh-agent calls it.
+In particular, the following ways of calling it are supported:
 
 .TP
 \(bu \fB`'m4_APPNAME-ssh-askpass\fR "Enter passphrase for $keyfile_path:"
@@ -31,6 +40,9 @@ In particular, the following ways of calling this script are supported:
 .TP
 \(bu \fB`'m4_APPNAME-ssh-askpass\fR "Enter passphrase for $keyfile_path (will confirm each use):"
 
+.TP
+\(bu \fB`'m4_APPNAME-ssh-askpass\fR "Enter passphrase for key '$keyfile_path':"
+
 .TP
 \(bu \fB`'m4_APPNAME-ssh-askpass\fR "Allow use of key $key_name?\\nKey fingerprint $key_fingerprint."
 
@@ -43,7 +55,7 @@ Defaults to \fB`'m4_SSH_ASKPASS_DEFAULT_ENCRYPTED_KEYFILE\fR.
 
 .TP
 .BR m4_SSH_ASKPASS_NOTIFY_ENV
-The command to use to send notifications.
+The command to use to send notifications, which is run by \fBsh\fR(1) with the notification's title and body as arguments.
 Defaults to \fB`'m4_SSH_ASKPASS_DEFAULT_NOTIFY_COMMAND\fR or to printing to stderr if \fBget-passphrase\fR is used.
 
 .SH FILES
@@ -52,7 +64,7 @@ Defaults to \fB`'m4_SSH_ASKPASS_DEFAULT_NOTIFY_COMMAND\fR or to printing to stde
 .BR m4_SSH_ASKPASS_DEFAULT_ENCRYPTED_KEYFILE
 The encrypted keyfile to use to protect SSH keys.
 Must be created with \fB`'m4_APPNAME`' enrol -p ""\fR.
-Can be changed by setting the \fB`'m4_SSH_ASKPASS_NOTIFY_ENV\fR environment variable.
+Can be changed by setting the \fB`'m4_SSH_ASKPASS_ENCRYPTED_KEYFILE_ENV\fR environment variable.
 This file should by readable only by its owner, however that is not checked by this application.
 
 .SH BUGS
@@ -20,12 +20,31 @@ print version and exit.
 .B enumerate
 show a list of authenticator devices currently connected.
 
+.B kdf\-calibrate
+measure the key derivation function on this system with a range of parameters, and print a table of how long each took.
+
+.B kdf\-cache flush
+remove any passphrase\-derived keys cached by \fBgenerate\fR with \fB\-\-kdf\-cache\-ttl\fR from the kernel keyring, and print how many were removed.
+
 .B enrol
 create or overwrite \fIfile\fR with randomly\-generated data required to produce a secret for the given \fIpassphrase\fR, using \fIdevice\fR.
 
 .B generate
 generate an HMAC across the data contained in \fIfile\fR, once it has been decrypted with the given \fIpassphrase\fR.
 
+.B rekey
+re\-encrypt the data in each \fIfile\fR given after the options (decrypting it with \fIpassphrase\fR) with \fInew\-passphrase\fR and new key derivation parameters, writing it in the latest key file format.
+No authenticator is needed.
+
+.B agent
+run in the foreground until interrupted, answering \fBgenerate \-\-agent\fR over a socket, and keeping passphrase\-derived keys in locked memory in between; see \fBAGENT\fR below.
+
+.B ssh\-askpass
+answer OpenSSH's prompt for an SSH key's passphrase, as \fB`'m4_APPNAME`'\-ssh\-askpass\fR does; see \fB`'m4_APPNAME`'\-ssh\-askpass\fR(1).
+
+.B unlock\-dir
+try each key file in \fIdirectory\fR, given after the options, and print the secret for the first which gives one, as \fBgenerate\fR would; see \fBUNLOCK\-DIR\fR below.
+
 .SH OPTIONS
 
 .TP
@@ -41,22 +60,34 @@ The path to write to (for \fBenrol\fR; this file will be overwritten) or read fr
 
 .TP
 .BR \-p ", " \-\-passphrase =\fIpassphrase\fR
-Optional for the \fBenrol\fR and \fBgenerate\fR subcommands, otherwise prohibited.
-The passphrase to use to encrypt (for \fBenrol\fR) or decrypt (for \fBgenerate\fR) \fIfile\fR.
+Optional for the \fBenrol\fR, \fBgenerate\fR, \fBrekey\fR and \fBunlock\-dir\fR subcommands, otherwise prohibited.
+The passphrase to use to encrypt (for \fBenrol\fR) or decrypt (for \fBgenerate\fR and \fBrekey\fR) \fIfile\fR, or for \fBunlock\-dir\fR, every key file.
 If neither this nor \fIpassphrase-file\fR are specified, you will be prompted to enter a passphrase.
 Note that either way, passphrases must \fBnot\fR contain a null (0x00) byte.
 
 .TP
 .BR \-r ", " \-\-passphrase\-file =\fIpassphrase-file\fR
-Optional for the \fBenrol\fR and \fBgenerate\fR subcommands, otherwise prohibited.
-A file containing the passphrase to use to encrypt (for \fBenrol\fR) or decrypt (for \fBgenerate\fR) \fIfile\fR.
+Optional for the \fBenrol\fR, \fBgenerate\fR, \fBrekey\fR and \fBunlock\-dir\fR subcommands, otherwise prohibited.
+A file containing the passphrase to use to encrypt (for \fBenrol\fR) or decrypt (for \fBgenerate\fR and \fBrekey\fR) \fIfile\fR, or for \fBunlock\-dir\fR, every key file.
 Note that the entire file contents will be used, including any trailing newline.
 If neither this nor \fIpassphrase\fR are specified, you will be prompted to enter a passphrase.
 Note that either way, passphrases must \fBnot\fR contain a null (0x00) byte.
 
+.TP
+.BR \-w ", " \-\-new\-passphrase =\fInew\-passphrase\fR
+Optional for the \fBrekey\fR subcommand, otherwise prohibited.
+The passphrase to encrypt each \fIfile\fR with, which may be the same as \fIpassphrase\fR (to change only the key derivation parameters or key file format).
+If neither this nor \fInew\-passphrase\-file\fR are specified, you will be prompted to enter a new passphrase after \fIpassphrase\fR.
+
+.TP
+.BR \-e ", " \-\-new\-passphrase\-file =\fInew\-passphrase\-file\fR
+Optional for the \fBrekey\fR subcommand, otherwise prohibited.
+A file containing the passphrase to encrypt each \fIfile\fR with.
+As with \fB\-\-passphrase\-file\fR, the entire file contents will be used, including any trailing newline.
+
 .TP
 .BR \-n ", " \-\-pin =\fIPIN\fR
-Optional for the \fBenrol\fR and \fBgenerate\fR subcommands, otherwise prohibited.
+Optional for the \fBenrol\fR, \fBgenerate\fR and \fBunlock\-dir\fR subcommands, otherwise prohibited.
 The PIN for your authenticator \fIdevice\fR.
 If not specified, and required by your authenticator, you will be prompted to enter a PIN.
 Note that either way, PINs must \fBnot\fR contain a null (0x00) byte.
@@ -67,19 +98,135 @@ Optional for the \fBenrol\fR subcommand, otherwise prohibited.
 If specified, do not store the \fIdevice\fR AAGUID (identifier of device make and model) in \fIfile\fR.
 
 .TP
-.BR \-k ", " \-\-kdf\-hardness =\fIhardness\fR
+.BR \-b ", " \-\-derive\-subkeys
+Optional for the \fBenrol\fR subcommand, otherwise prohibited.
+If specified, record in \fIfile\fR that the authenticator's output is a root secret, which \fBgenerate\fR never prints; instead it derives a subkey for each \fIlabel\fR given with \fB\-\-derive\fR.
+This is recorded in the encrypted part of \fIfile\fR, which older versions of m4_APPNAME cannot read.
+
+.TP
+.BR \-u ", " \-\-unattended
 Optional for the \fBenrol\fR subcommand, otherwise prohibited.
+If specified, record in \fIfile\fR that \fBgenerate\fR should ask the authenticator for the secret without user presence and without its \fIPIN\fR, so it needs nobody to touch the authenticator or enter a PIN (though still needs \fIpassphrase\fR).
+This is intended for servers which must start unattended.
+Not every authenticator supports this, so \fBenrol\fR checks that \fIdevice\fR does (after it has been touched to create the credential), and fails if not; \fBgenerate\fR likewise fails straight away, rather than waiting for a touch, if an authenticator cannot.
+The secret is not the same as it would be without this option, and anyone with \fIfile\fR, \fIpassphrase\fR and access to the authenticator can get it without touching it.
+Older versions of m4_APPNAME cannot read \fIfile\fR.
+
+.TP
+.BR \-y ", " \-\-record\-device\-ids
+Optional for the \fBenrol\fR subcommand, prohibited with \fB\-\-obfuscate\-device\-info\fR, otherwise prohibited.
+If specified, store the USB vendor and product IDs of \fIdevice\fR in \fIfile\fR, as listed by \fBenumerate\fR.
+\fBgenerate\fR then passes over devices with other IDs without opening them, which saves time when many other security devices are connected.
+Like the AAGUID, these IDs identify the make and model of \fIdevice\fR to anyone who can read \fIfile\fR.
+Older versions of m4_APPNAME cannot read \fIfile\fR.
+
+.TP
+.BR \-k ", " \-\-kdf\-hardness =\fIhardness\fR
+Optional for the \fBenrol\fR and \fBrekey\fR subcommands, otherwise prohibited.
 Specify the complexity of the key derivation function used to derive a cryptographic key from \fIpassphrase\fR.
 Valid values for \fIhardness\fR are \fBhigh\fR, \fBmedium\fR or \fBlow\fR.
-If not specified, a value will be chosen automatically based on total system RAM.
+If not specified, a value will be chosen automatically based on total system RAM, except that \fBrekey\fR keeps the parameters of each \fIfile\fR unless this or \fB\-\-kdf\-target\-ms\fR is given.
 While greater hardness provides better security (at the cost of CPU time and RAM), more important is that \fIpassphrase\fR is long and difficult to guess.
 
+.TP
+.BR \-l ", " \-\-kdf\-lanes =\fIlanes\fR
+Optional for the \fBenrol\fR, \fBrekey\fR and \fBkdf\-calibrate\fR subcommands, otherwise prohibited.
+Specify the number of lanes (between 1 and 255) used by the key derivation function.
+Each lane is computed on its own thread, so a key file with more lanes can use more memory without taking more time to decrypt, provided there are enough processors.
+This should be no more than the number of processors on the systems where \fIfile\fR will be used with \fBgenerate\fR.
+If not specified, the number of online processors will be used, up to a maximum of 16; or, for \fBrekey\fR when keeping the parameters of each \fIfile\fR, its existing number of lanes.
+
+.TP
+.BR \-t ", " \-\-kdf\-target\-ms =\fImilliseconds\fR
+Optional for the \fBenrol\fR, \fBrekey\fR and \fBkdf\-calibrate\fR subcommands, otherwise prohibited.
+For \fBenrol\fR and \fBrekey\fR, this may not be used with \fB\-\-kdf\-hardness\fR.
+Instead of using a fixed preset, measure the key derivation function on this system and choose parameters which make it take about \fImilliseconds\fR, using as much memory as possible (see \fB\-\-kdf\-max\-memory\fR) before increasing the number of passes.
+For \fBkdf\-calibrate\fR, print the parameters that would be chosen.
+
+.TP
+.BR \-x ", " \-\-kdf\-max\-memory =\fImemory\fR
+Optional for the \fBenrol\fR subcommand with \fB\-\-kdf\-target\-ms\fR, or for the \fBrekey\fR and \fBkdf\-calibrate\fR subcommands, otherwise prohibited.
+The most memory to use for key derivation, in MiB, or in KiB, MiB or GiB if followed by \fBK\fR, \fBM\fR or \fBG\fR respectively.
+If not specified, half of the memory available to m4_APPNAME is used as the limit, taking into account free system memory and any cgroup memory limit.
+Note that \fIfile\fR can only be used with \fBgenerate\fR on systems with at least this much memory available.
+For \fBrekey\fR, this also limits the memory used by all the key files being rekeyed at once.
+
+.TP
+.BR \-j ", " \-\-jobs =\fIjobs\fR
+Optional for the \fBrekey\fR subcommand, otherwise prohibited.
+Rekey up to \fIjobs\fR (at most 256) key files at once.
+If not specified, as many key files are rekeyed at once as there are online processors for the lanes of their key derivation.
+Either way, no more key files are rekeyed at once than fit within \fB\-\-kdf\-max\-memory\fR.
+
 .TP
 .BR \-m ", " \-\-mixin =\fIdata\fR
-Optional for the \fBgenerate\fR subcommand, otherwise prohibited.
+Optional for the \fBgenerate\fR and \fBunlock\-dir\fR subcommands, otherwise prohibited.
 Combine \fIdata\fR with the encrypted salt, so that the returned value depends on it.
 Note that setting \fIdata\fR to an empty string behaves differently to not using this argument at all.
 
+.TP
+.BR \-s ", " \-\-second\-mixin =\fIsecond\-data\fR
+Optional for the \fBgenerate\fR subcommand, otherwise prohibited.
+Get two secrets from a single use of the authenticator: one for \fIdata\fR (or for no mixin, if \fB\-\-mixin\fR is not given) and one for \fIsecond\-data\fR, which is combined with the encrypted salt in the same way.
+This uses the two salts the hmac\-secret extension accepts for each assertion, one for each secret, so each secret is half as long as usual: it is the first half of the secret \fBgenerate\fR prints with that mixin alone.
+The two secrets are independent, in that neither can be worked out from the other.
+This can be used, for example, to unlock two encrypted volumes with only one touch of the authenticator.
+
+.TP
+.BR \-a ", " \-\-second\-output =\fIsecond\-output\fR
+Optional for the \fBgenerate\fR subcommand with \fB\-\-second\-mixin\fR, otherwise prohibited.
+Write the second secret to the file \fIsecond\-output\fR, created with mode 0600 if it does not exist, rather than on STDOUT after the first.
+It is written before the first secret is printed.
+
+.TP
+.BR \-i ", " \-\-derive =\fIlabel\fR[,\fIlabel\fR...]
+REQUIRED for the \fBgenerate\fR subcommand if \fIfile\fR was enrolled with \fB\-\-derive\-subkeys\fR, otherwise prohibited.
+May not be used with \fB\-\-second\-mixin\fR.
+Print the subkey for each \fIlabel\fR (up to 64, separated by commas), one per line in the order given.
+Every subkey comes from the same use of the authenticator, and is derived from the root secret with keyed BLAKE2b, so knowing some subkeys does not reveal the others or the root secret.
+Each subkey is as long as the secret \fBgenerate\fR otherwise prints; \fB\-\-mixin\fR changes every subkey.
+
+.TP
+.BR \-c ", " \-\-kdf\-cache\-ttl =\fIseconds\fR
+Optional for the \fBgenerate\fR subcommand (except with \fB\-\-agent\fR) and the \fBagent\fR subcommand, otherwise prohibited.
+For \fBagent\fR, this is how long it keeps each passphrase\-derived key (600 seconds if not given); see \fBAGENT\fR below.
+After decrypting \fIfile\fR, keep the key derived from \fIpassphrase\fR in the kernel keyring for \fIseconds\fR (at most 86400, one day).
+Until then, \fBgenerate\fR with this option and the same \fIfile\fR (or any key file with the same salt and key derivation parameters) uses the cached key instead of running the key derivation function, and does \fBnot\fR ask for or check a passphrase.
+The key is kept in the session keyring, or the user session keyring if there is no session keyring, so it is available to every process of the same user which can search that keyring.
+Use \fBkdf\-cache flush\fR to remove cached keys early.
+
+.TP
+.BR \-g ", " \-\-race
+Optional for the \fBgenerate\fR and \fBunlock\-dir\fR subcommands, otherwise prohibited.
+When more than one connected authenticator might hold the credential in \fIfile\fR, ask all of them at once and use the secret from whichever is touched first, cancelling the others, rather than asking each in turn until one is touched or times out.
+Every such authenticator asks to be touched at the same time.
+
+.TP
+.BR \-z ", " \-\-wait [=\fIseconds\fR]
+Optional for the \fBgenerate\fR and \fBunlock\-dir\fR subcommands, otherwise prohibited.
+If no compatible authenticator is connected, wait for one to be connected rather than exiting, for up to \fIseconds\fR (at most 86400) if given, or otherwise indefinitely.
+An authenticator is compatible if it supports the hmac\-secret extension and matches the AAGUID (and any vendor and product IDs) in \fIfile\fR; \fBgenerate\fR notices it as soon as its device node appears in \fI/dev\fR, and meanwhile derives the key from \fIpassphrase\fR.
+If none is connected in time, \fBgenerate\fR exits as it would have without this option.
+Note that \fIseconds\fR must be attached to the option, as in \fB\-\-wait=30\fR or \fB\-z30\fR.
+
+.TP
+.BR \-q ", " \-\-agent
+Optional for the \fBgenerate\fR subcommand, otherwise prohibited.
+May not be used with \fB\-\-kdf\-cache\-ttl\fR or \fB\-\-wait\fR.
+Ask the running \fBagent\fR for the secret instead of talking to authenticators directly.
+The passphrase is only asked for (and sent to the agent) if the agent has no key for \fIfile\fR, and a PIN only if an authenticator needs one.
+Exits with status 70 if no agent is running.
+
+.TP
+.B \-\-same\-passphrase
+Optional for the \fBunlock\-dir\fR subcommand without \fB\-\-passphrase\fR or \fB\-\-passphrase\-file\fR, otherwise prohibited.
+Prompt for one passphrase for every key file in \fIdirectory\fR, rather than for a passphrase for each key file as it is tried.
+
+.TP
+.BR \-\-attempts =\fIattempts\fR
+Optional for the \fBunlock\-dir\fR subcommand without \fB\-\-passphrase\fR or \fB\-\-passphrase\-file\fR, otherwise prohibited.
+When a passphrase does not decrypt a key file, prompt for it again, up to \fIattempts\fR (at most 100) times in all for that key file, before going on to the next; 3 if not given.
+
 .SH DESCRIPTION
 
 m4_APPNAME produces deterministic output which can only be reproduced without \fIfile\fR, the \fIpassphrase\fR and the same authenticator \fIdevice\fR that was used during the \fBenrol\fR step.
@@ -98,6 +245,22 @@ The \fBenumerate\fR subcommand produces a list of connected authenticators, one
 4. the authenticator AAGUID, e.g. f8a011f3-8c0a-4d15-8006-17111f9edc7d
 .RE
 
+All authenticators are opened at once, by both \fBenumerate\fR and \fBgenerate\fR.
+An authenticator which cannot be opened, or which does not respond within three seconds, is skipped with a warning; \fBenumerate\fR lists it with a \fB!\fR and no AAGUID.
+What each authenticator reported about itself is remembered (see \fBFILES\fR) until it is unplugged, so later runs do not open authenticators which \fBgenerate\fR would not use.
+Once \fIfile\fR has been decrypted, if more than one authenticator might hold the credential, \fBgenerate\fR first asks each of them, without user presence, whether it holds the credential in \fIfile\fR; only those which do (or cannot say) are then asked for the secret, so other authenticators of the same model do not ask to be touched.
+
+The \fBkdf\-calibrate\fR subcommand prints a table of how long the key derivation function takes with a given amount of memory (rows) and number of passes (columns), as used by \fBenrol\fR.
+Measurements which would take too long are shown as \fB\-\fR.
+This can be used to choose a \fB\-\-kdf\-target\-ms\fR and \fB\-\-kdf\-max\-memory\fR suitable for every system on which \fIfile\fR will be used.
+If a key file needs more memory than is available when it is used with \fBgenerate\fR, a warning is printed.
+
+The \fBrekey\fR subcommand reads every \fIfile\fR before asking for any passphrase, and exits without changing anything if one cannot be read.
+Each \fIfile\fR is then decrypted with \fIpassphrase\fR and encrypted with \fInew\-passphrase\fR and a new salt, keeping the authenticator credential, so its \fBgenerate\fR output is unchanged.
+Version 1 key files are written in the latest format.
+Each \fIfile\fR is replaced atomically, keeping its permissions, so a \fIfile\fR which cannot be rekeyed (for example because \fIpassphrase\fR is wrong for it) is left as it was; a warning is printed, and the remaining files are still rekeyed.
+When it is done, \fBrekey\fR prints how many key files were rekeyed and how many per second.
+
 If \fIpassphrase\fR and \fIPIN\fR are not provided as command line arguments, then behavior depends on whether m4_APPNAME is running at a TTY (interactively) or not.
 
 If m4_APPNAME has a TTY, you will be prompted to enter a passphrase and, if necessary, a PIN.
@@ -113,6 +276,34 @@ As such providing an authenticator PIN on non-interactive STDIN is discouraged.
 
 In every case, only the first m4_LONGEST_VALID_PASSPHRASE bytes of a passphrase will be used.
 
+.SH AGENT
+
+Every \fBgenerate\fR otherwise starts from scratch: it reads \fIfile\fR and runs the key derivation function, which can take seconds.
+When many secrets are asked for in a short time, run the \fBagent\fR subcommand (for example as a user service) and use \fBgenerate \-\-agent\fR instead; after the first request for a given \fIfile\fR, each one costs only a use of the authenticator.
+
+The agent listens on \fI$XDG_RUNTIME_DIR/m4_APPNAME\-agent.socket\fR, and only answers processes of the user it runs as.
+It keeps the key derived from each passphrase it is sent in locked memory for \fB\-\-kdf\-cache\-ttl\fR seconds (600 if not given), during which any process of that user can get secrets for a key file with the same salt and key derivation parameters without the passphrase, though the authenticator must still be touched unless the key file is unattended.
+Authenticators are opened for each request and closed again afterwards, so other programs can use them in between.
+PINs are never kept; each request is sent the PIN again if an authenticator needs one.
+Requests are answered concurrently, so one waiting for an authenticator to be touched does not hold up others while they ask for a passphrase or derive a key, though only one at a time uses the authenticators.
+A request with a malformed key file, or with key derivation parameters needing more memory than is available, fails without affecting the agent.
+
+On SIGHUP the agent forgets every key and carries on.
+It exits, removing its socket and forgetting every key, on SIGINT or SIGTERM.
+
+.SH UNLOCK\-DIR
+
+The \fBunlock\-dir\fR subcommand is for initramfs hooks, such as the m4_APPNAME \fBmkinitcpio\fR(8) hook, where each key file in \fIdirectory\fR is an alternative way to get the key for the same encrypted volume (for example, one for each of several authenticators).
+Every regular file in \fIdirectory\fR (but not its subdirectories) is tried as a key file, in alphabetical order but with hidden files last; files which are not key files are skipped with a warning.
+
+Unlike running \fBgenerate\fR for each key file in turn, the authenticators are listed and opened only once, and a \fIPIN\fR is asked for only once.
+Key files which no connected authenticator could hold the credential for (going by its AAGUID, and any vendor and product IDs) are skipped without asking for their passphrases or running the key derivation function.
+As with \fBgenerate\fR, the key derivation function runs while the \fIPIN\fR is asked for (an empty \fIPIN\fR skips the authenticators which need one), and with \fB\-\-wait\fR, while waiting for an authenticator, if the first key file's passphrase was given, or is shared by every key file with \fB\-\-same\-passphrase\fR, or it is the only key file.
+
+The secret for the first key file which gives one is printed as \fBgenerate\fR prints it, and \fBunlock\-dir\fR exits with status 0.
+Otherwise it exits with the status \fBgenerate\fR would have for the last key file tried (33 if its passphrase was wrong every time), or with 34 or 35 if there was no authenticator for any key file, or 36 if \fIdirectory\fR held no key files.
+Key files enrolled with \fB\-\-derive\-subkeys\fR are skipped.
+
 .SH EXIT STATUS
 
 .TP
@@ -125,7 +316,7 @@ Bad invocation (invalid \fIsubcommand\fR or \fIoptions\fR)
 
 .TP
 .BR 33
-Bad passphrase
+Bad passphrase (for \fBrekey\fR, for at least one \fIfile\fR)
 
 .TP
 .BR 34
@@ -137,7 +328,7 @@ Of the authenticator(s) connected, none could be used (e.g. the connected device
 
 .TP
 .BR 36
-\fIfile\fR is corrupt or cannot be decoded
+\fIfile\fR is corrupt or cannot be decoded (or, for \fBrekey\fR, could not be written)
 
 .TP
 .BR 64
@@ -159,6 +350,18 @@ Unable to drop privileges
 .BR 68
 Unable to get passphrase or PIN safely (no TTY or STDIN, or not enough lines on STDIN)
 
+.TP
+.BR 69
+Unable to access the kernel keyring (for \fBkdf\-cache flush\fR)
+
+.TP
+.BR 70
+Unable to reach the agent, or it did not understand the request (for \fBagent\fR and \fBgenerate \-\-agent\fR)
+
+.TP
+.BR 71
+\fIsecond\-output\fR could not be opened or written (for \fBgenerate\fR)
+
 .TP
 .BR 96
 This is evidence of a bug; please report it (see \fBBUGS\fR below)
@@ -171,6 +374,9 @@ Parts of the file are unencrypted, including the authenticator \fIdevice\fR AAGU
 Each key file can be used to produce exactly one secret, given exactly one passphrase and exactly one device.
 There is no support for having a backup authenticator for a given file, for example; instead you should create two key files.
 
+Whether each connected authenticator supports FIDO2 and the hmac\-secret extension, and its AAGUID, are cached in \fI$XDG_RUNTIME_DIR/m4_APPNAME\-devices.cbor\fR, keyed by the device path and the identity of its device node.
+Nothing secret is kept in this file, and it is safe to delete; if \fBXDG_RUNTIME_DIR\fR is not set, nothing is cached.
+
 If you are using the output of m4_APPNAME for anything, you should keep a backup of \fIfile\fR.
 The sensitive components of this file are encrypted with a key derived solely from your \fIpassphrase\fR.
 As such, you should \fBnever\fR store your passphrase with the key file.
@@ -180,7 +386,7 @@ You can store a backup of the key file in public unencrypted storage without com
 If you run m4_APPNAME under \fBsudo\fR(8), it will drop privileges to the invoking user (specified by the \fBSUDO_UID\fR environment variable) after locking memory.
 
 m4_divert(m4_MEMLOCK_WARNINGS_DIVERT_DESTINATION)m4_dnl
-If you are seeing errors like \fBUnable to lock memory, which means secrets may be swapped to disk\fR, this means that RLIMIT_MEMLOCK is too low for m4_APPNAME to lock all its memory.
+If you are seeing errors like \fBUnable to lock memory, which means secrets may be swapped to disk\fR, this means that RLIMIT_MEMLOCK is too low for m4_APPNAME to lock the memory it keeps secrets in.
 The risk from this is that memory could be swapped to disk, resulting in secrets being written to swap space.
 You can fix this by raising RLIMIT_MEMLOCK, running m4_APPNAME as root, or by giving the binary the CAP_IPC_LOCK capability (so it can bypass RLIMIT_MEMLOCK) by running the following command as root:
 
@@ -211,6 +417,7 @@ has an up\-to\-date list of known issues. Bugs can also be reported there.
 
 .SH SEE ALSO
 
+.BR keyrings (7)
 .BR pam_u2f (8)
 m4_divert(m4_MEMLOCK_WARNINGS_DIVERT_DESTINATION)m4_dnl
 .BR setcap (8)
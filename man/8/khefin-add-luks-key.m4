@@ -5,6 +5,7 @@ m4_APPNAME-add-luks-key  add a LUKS key to an encrypted disk derived from a keyf
 
 .SH SYNOPSIS
 .B m4_APPNAME-add-luks-key
+[\fB\-\-token\fR]
 .IR encrypted-keyfile
 .IR disk
 [\fIcryptsetup-options\fR]
@@ -17,6 +18,16 @@ It is designed for use with the m4_APPNAME \fBmkinitcpio\fR(8) or \fBinitramfs-t
 
 This script must be run as root.
 
+.SH OPTIONS
+
+.TP
+.B \-\-token
+Also store \fIencrypted-keyfile\fR in a LUKS2 token on \fIdisk\fR for the new keyslot, using \fBcryptsetup token import\fR.
+With the m4_APPNAME token plugin, \fIlibcryptsetup-token-`'m4_APPNAME`'.so\fR, installed, \fBcryptsetup open\fR and \fBsystemd-cryptsetup\fR(8) can then unlock \fIdisk\fR themselves, without running \fB`'m4_APPNAME\fR(1) or needing \fIencrypted-keyfile\fR, asking for the keyfile's passphrase as the token PIN.
+\fIdisk\fR must use LUKS2, and the authenticator must not have a PIN, because cryptsetup asks for only one.
+If it has one, opening with the token fails, saying so, rather than asking for the passphrase again; use the m4_APPNAME \fBmkinitcpio\fR(8) or \fBinitramfs-tools\fR(8) hooks instead.
+Keyfiles enrolled with \fB\-\-derive\-subkeys\fR cannot be used in a token.
+
 .SH NOTES
 \fBMake an off-system backup of your LUKS header for \f(BIdisk\fB before running this command.\fR
 
@@ -6,6 +6,7 @@ m4_APPNAME-cryptsetup-keyscript  a Debian-style keyscript for unlocking a LUKS-e
 .SH DESCRIPTION
 This script, installed to \fI`'m4_INSTALL_PREFIX/lib/m4_APPNAME/cryptsetup-keyscript\fR by default, is designed to be specified as a \fIkeyscript\fR in \fBcrypttab\fR(5).
 The \fIkey\fR field in the \fBcrypttab\fR(5) will be used as the keyfile passed to \fB`'m4_APPNAME generate\fR.
+If the authenticator is not connected, the script waits up to m4_DEFAULT_AUTHENTICATOR_WAIT_SECONDS seconds for it to be plugged in (see \fB\-\-wait\fR in \fBm4_APPNAME\fR(1)).
 
 In general, to set up disk encryption protected by \fB`'m4_APPNAME\fR(1) you would go through the following steps:
 
@@ -0,0 +1,115 @@
+.TH "pam_`'m4_APPNAME" 8 "m4_APPDATE" "m4_APPVERSION" "pam_`'m4_APPNAME man page"
+
+.SH NAME
+pam_`'m4_APPNAME  a PAM module which authenticates users with a secret derived from a keyfile created with m4_APPNAME
+
+.SH SYNOPSIS
+.B pam_`'m4_APPNAME`'.so
+[\fBkeyfile=\fIpath\fR]
+[\fBverifier=\fIpath\fR]
+[\fBmixin=\fImixin\fR]
+[\fBsubkey=\fIlabel\fR]
+[\fBrace\fR]
+[\fBuse_first_pass\fR|\fBtry_first_pass\fR]
+[\fBdebug\fR]
+
+.SH DESCRIPTION
+This module provides the \fBauth\fR management group.
+It asks for the passphrase of the user's keyfile, gets the secret for it from a connected authenticator as \fB`'m4_APPNAME generate\fR does, and succeeds if that secret matches the user's verifier.
+It runs within the program asking for authentication, rather than running \fB`'m4_APPNAME\fR(1), and asks for the passphrase and any authenticator PIN through that program's PAM conversation.
+
+The verifier holds the SHA-256 hash of the output of \fB`'m4_APPNAME generate\fR, in hex, as printed by \fBsha256sum\fR(1); anything after the first 64 characters is ignored.
+To set up a user, run as that user:
+
+.RS
+.nf
+mkdir -p ~/.config/m4_APPNAME
+m4_APPNAME enrol -d /dev/hidraw0 -f ~/.config/m4_APPNAME/pam.key
+m4_APPNAME generate -f ~/.config/m4_APPNAME/pam.key | sha256sum > ~/.config/m4_APPNAME/pam.verifier
+.fi
+.RE
+
+giving \fB`'m4_APPNAME generate\fR the same \fB\-\-mixin\fR or \fB\-\-derive\fR as the \fBmixin=\fR or \fBsubkey=\fR options given to this module, if any.
+An example entry for \fI/etc/pam.d/sshd\fR might be:
+
+.RS
+auth required pam_`'m4_APPNAME`'.so
+.RE
+
+.SH OPTIONS
+
+.TP
+.BI keyfile= path
+The user's keyfile.
+In \fIpath\fR, \fB%u\fR is replaced with the user name, \fB%h\fR with the user's home directory, and \fB%%\fR with \fB%\fR.
+Defaults to \fB%h/.config/`'m4_APPNAME`'/pam.key\fR.
+
+.TP
+.BI verifier= path
+The user's verifier, in which \fB%u\fR, \fB%h\fR and \fB%%\fR are replaced as in \fBkeyfile=\fR.
+Defaults to \fB%h/.config/`'m4_APPNAME`'/pam.verifier\fR.
+
+.TP
+.BI mixin= mixin
+As \fB\-\-mixin\fR for \fB`'m4_APPNAME generate\fR.
+
+.TP
+.BI subkey= label
+For keyfiles enrolled with \fB\-\-derive\-subkeys\fR, which this is required for: the subkey to check against the verifier, as \fB`'m4_APPNAME generate \-\-derive\fR \fIlabel\fR gives it.
+
+.TP
+.B race
+As \fB\-\-race\fR for \fB`'m4_APPNAME generate\fR.
+
+.TP
+.B use_first_pass
+Use the password given to an earlier module as the passphrase, and fail if there was none.
+
+.TP
+.B try_first_pass
+Use the password given to an earlier module as the passphrase, and ask for one if there was none.
+
+.TP
+.B debug
+Log the paths used, and successful authentications, to \fBsyslog\fR(3).
+Warnings, such as about authenticators which are skipped, and failures are always logged there.
+
+.SH RETURN VALUES
+
+.TP
+.B PAM_SUCCESS
+The secret matched the verifier.
+
+.TP
+.B PAM_AUTH_ERR
+The passphrase or PIN was wrong, no connected authenticator gave the secret, or the secret did not match the verifier.
+
+.TP
+.B PAM_AUTHINFO_UNAVAIL
+The keyfile or verifier could not be read, or no authenticator was connected.
+
+.TP
+.B PAM_USER_UNKNOWN
+The user is not known to the system.
+
+.TP
+.B PAM_SERVICE_ERR
+The options do not suit the keyfile, or a path is too long.
+
+.SH NOTES
+Anyone who can write to a user's keyfile and verifier can authenticate as that user, so if users should not be able to change how they authenticate, give \fBkeyfile=\fR and \fBverifier=\fR paths outside their home directories.
+
+Unlike \fB`'m4_APPNAME\fR(1), this module does not lock the memory of the program it runs in.
+The secret and passphrase-derived key are kept in locked memory, but the passphrase passes through the program's PAM conversation.
+
+.SH BUGS
+.UR https://github.com/mjec/khefin/issues
+The GitHub issues page
+.UE
+has an up\-to\-date list of known issues. Bugs can also be reported there.
+
+.SH SEE ALSO
+
+.BR m4_APPNAME (1)
+.BR pam.conf (5)
+.BR pam (8)
@@ -7,12 +7,14 @@ ramfs_mount_point="$(mktemp -d)"
 disk_encryption_key_file="$ramfs_mount_point/keyfile"
 
 help() {
-	printf "Usage: %s <encrypted-keyfile> <disk> [cryptsetup-options]\n\n" "$0"
+	printf "Usage: %s [--token] <encrypted-keyfile> <disk> [cryptsetup-options]\n\n" "$0"
 	fold -w 80 -s <<HELPEOF
 This is a Bash script that runs cryptsetup's luksAddKey, passing in a keyfile generated with m4_APPNAME.  It is designed for use with the m4_APPNAME mkinitcpio or initramfs-tools hooks.
 
 <encrypted-keyfile> must have been generated by m4_APPNAME enrol.
 
+With --token, <encrypted-keyfile> is also stored in a LUKS2 token on <disk> for the new keyslot, so that cryptsetup can open it with the m4_APPNAME token plugin, asking for the keyfile's passphrase as the token PIN. The authenticator must not have a PIN, since cryptsetup asks for only one.
+
 This script must be run as root.
 
 !!! Make an off-system backup of your LUKS header for <disk> before running this command. !!!
@@ -31,6 +33,12 @@ cleanup() {
 
 trap cleanup EXIT TERM INT
 
+add_token=0
+if [ "${1:-}" = "--token" ]; then
+	add_token=1
+	shift
+fi
+
 if [ "$#" -lt 2 ] || [ "$(id -u)" -ne 0 ]; then
 	help
 	exit 1
@@ -39,4 +47,13 @@ fi
 mount -t ramfs -o size=64k "$ramfs_mount_point" "$ramfs_mount_point"
 m4_APPNAME generate -f "$1" > "$disk_encryption_key_file"
 cryptsetup luksAddKey "$2" "${@:3}" "$disk_encryption_key_file"
+
+if [ "$add_token" -eq 1 ]; then
+	keyslot="$(cryptsetup open --test-passphrase --verbose --key-file "$disk_encryption_key_file" "$2" | sed -n 's/^Key slot \([0-9]*\) unlocked\.$/\1/p')"
+	if [ -z "$keyslot" ]; then
+		echo "Unable to find the new keyslot, so no token was added" >&2
+		exit 1
+	fi
+	printf '{"type":"m4_APPNAME","keyslots":["%s"],"keyfile":"%s"}' "$keyslot" "$(base64 -w 0 "$1")" | cryptsetup token import --json-file - "$2"
+fi
 : < /dev/null > "$disk_encryption_key_file"
@@ -7,15 +7,15 @@ m4_dnl
 
 m4_COMPLETION_FUNCTION_NAME`'() {
 	local cur prev words
-	local subcommands="help version enumerate enrol generate"
+	local subcommands="help version enumerate kdf-calibrate kdf-cache enrol generate rekey agent ssh-askpass unlock-dir"
 	local opts
 	_init_completion -s || return
 
 	case "$prev" in
-		help|version|enumerate|--help|--passphrase|-p|--mixin|-m|--pin|-n)
+		help|version|enumerate|--help|--passphrase|-p|--mixin|-m|--second-mixin|-s|--derive|-i|--pin|-n|--kdf-lanes|-l|--kdf-target-ms|-t|--kdf-max-memory|-x|--kdf-cache-ttl|-c|--new-passphrase|-w|--jobs|-j|--attempts)
 			return
 			;;
-		--file|-!(-*)f)
+		--file|-!(-*)f|--second-output|-!(-*)a)
 			_filedir
 			return
 			;;
@@ -31,10 +31,40 @@ m4_COMPLETION_FUNCTION_NAME`'() {
 
 	case "${words[1]}" in
 		generate)
-			opts="-f -p -r -n -m --file --passphrase --passphrase-file --pin --mixin"
+			opts="-f -p -r -n -m -s -a -i -c -g -z -q --file --passphrase --passphrase-file --pin --mixin --second-mixin --second-output --derive --kdf-cache-ttl --race --wait --agent"
+			;;
+		kdf-cache)
+			opts="flush"
 			;;
 		enrol)
-			opts="-f -d -p -r -n -o -k --file --device --passphrase --passphrase-file --pin --obfuscate-device-info --kdf-hardness"
+			opts="-f -d -p -r -n -o -b -u -y -k -l -t -x --file --device --passphrase --passphrase-file --pin --obfuscate-device-info --derive-subkeys --unattended --record-device-ids --kdf-hardness --kdf-lanes --kdf-target-ms --kdf-max-memory"
+			;;
+		rekey)
+			if [[ "$cur" != -* ]]; then
+				_filedir
+				return
+			fi
+			opts="-p -r -w -e -j -k -l -t -x --passphrase --passphrase-file --new-passphrase --new-passphrase-file --jobs --kdf-hardness --kdf-lanes --kdf-target-ms --kdf-max-memory"
+			;;
+		kdf-calibrate)
+			opts="-t -x -l --kdf-target-ms --kdf-max-memory --kdf-lanes"
+			;;
+		agent)
+			opts="-c --kdf-cache-ttl"
+			;;
+		unlock-dir)
+			if [[ "$cur" != -* ]]; then
+				_filedir -d
+				return
+			fi
+			opts="-p -r -n -m -g -z --passphrase --passphrase-file --pin --mixin --race --wait --same-passphrase --attempts"
+			;;
+		ssh-askpass)
+			if [[ "$prev" == "get-passphrase" ]]; then
+				_filedir
+				return
+			fi
+			opts="get-passphrase"
 			;;
 	esac
 
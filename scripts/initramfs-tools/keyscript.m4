@@ -1,13 +1,21 @@
 #!/bin/sh
 
+`#' By default, fail at once if no authenticator is connected, so that
+`#' cryptsetup can fall back to asking for a passphrase. To wait for one to be
+`#' plugged in instead, set this to how many seconds to wait. E.g.:
+`#' authenticator_wait_seconds=m4_DEFAULT_AUTHENTICATOR_WAIT_SECONDS
+authenticator_wait_seconds=""
+
 decrypt_`'m4_APPNAME () {
-	m4_APPNAME enumerate >/dev/null
-	if [ $? -eq 34 ]; then
+	>&2 printf "Using key %s\n" "$1"
+	m4_APPNAME generate ${authenticator_wait_seconds:+"--wait=$authenticator_wait_seconds"} -f "$1"
+	result=$?
+	`#' From m4_APPNAME man page, EXIT CODES section:
+	`#'   34     No authenticator device connected
+	if [ $result -eq 34 ]; then
 		>&2 printf "Authenticator device not found!\n"
-		return 1
 	fi
-	>&2 printf "Using key %s\n" "$1"
-	if ! m4_APPNAME generate -f "$1"; then
+	if [ $result -ne 0 ]; then
 		return 1
 	fi
 	return 0
@@ -15,7 +15,6 @@ build() {
 	fi
 
 	add_binary m4_APPNAME
-	add_binary stty
 
 	find "$keyfiles_source_dir" -maxdepth 1 ! -name "$(printf "*\n*")" -type f -print \
 	| while IFS= read -r keyfile; do
@@ -41,6 +40,6 @@ You will also need to add these keys to a key slot for your disk. You can do thi
 
 If an authenticator is not plugged in, or you get the passphrase wrong too many times, this hook will not write your cryptsetup keyfile and the encrypt hook will fall back to prompting you for a passphrase.
 
-By default if the authenticator is not plugged in before the boot hook runs, you will be prompted to insert it and press a key. You can disable this behavior (meaning that the hook will be skipped if the authenticator is not plugged in) by setting the do_not_prompt_for_authenticator kernel parameter.
+By default if the authenticator is not plugged in before the boot hook runs, you will be prompted to insert it, and the hook will wait for it for up to m4_DEFAULT_AUTHENTICATOR_WAIT_SECONDS seconds (or the number of seconds in the authenticator_wait_seconds kernel parameter). You can disable this behavior (meaning that the hook will be skipped if the authenticator is not plugged in) by setting the do_not_prompt_for_authenticator kernel parameter.
 HELPEOF
 }
@@ -1,6 +1,3 @@
-m4_define(`m4_PROMPT_NEVER', 0)m4_dnl
-m4_define(`m4_PROMPT_ONCE', 1)m4_dnl
-m4_define(`m4_PROMPT_ALWAYS', 2)m4_dnl
 #!/usr/bin/ash
 # shellcheck shell=dash
 
@@ -14,25 +11,14 @@ run_hook() {
 	umask 077
 	encrypted_keyfile_dir=${encrypted_keyfile_dir-m4_INITCPIO_DEFAULT_ENCRYPTED_KEYFILE_DIR}
 
-	`#' From m4_APPNAME man page, EXIT CODES section:
-	`#'   34     No authenticator device connected
-	m4_APPNAME enumerate > /dev/null
-	if [ "$?" -eq 34 ]; then
-		if [ "${do_not_prompt_for_authenticator:-$undefined}" != "$undefined" ]; then
-			printf "No authenticator device found; skipping m4_APPNAME.\n"
-			return
-		else
-			printf "Insert your authenticator device and press any key to continue.\n"
-			printf "If you press a key without inserting your authenticator, the m4_APPNAME hook will be skipped.\n"
-			stty -icanon -echo
-			dd bs=1 count=1 2>/dev/null
-			stty icanon echo
-			m4_APPNAME enumerate > /dev/null
-			if [ "$?" -eq 34 ]; then
-				printf "No authenticator device found; skipping m4_APPNAME hook.\n"
-				return
-			fi
+	# unlock-dir waits for an authenticator only if none is connected, and
+	# says so itself, so there is no need to look for one here first
+	wait_option=""
+	if [ "${do_not_prompt_for_authenticator:-$undefined}" = "$undefined" ]; then
+		if ! [ "${authenticator_wait_seconds-NaN}" -gt 0 ] > /dev/null 2>&1; then
+			authenticator_wait_seconds=m4_DEFAULT_AUTHENTICATOR_WAIT_SECONDS
 		fi
+		wait_option="--wait=$authenticator_wait_seconds"
 	fi
 
 	if [ -d "$ramfs_mount_point" ] && [ -n "$(ls -A "$ramfs_mount_point")" ]; then
@@ -44,80 +30,40 @@ run_hook() {
 	mkdir -p "$ramfs_mount_point"
 	mount -t ramfs -o size=64k "$ramfs_mount_point" "$ramfs_mount_point"
 
+	passphrase_option=""
+	attempts_option=""
 	if [ "${encrypted_keyfile_passphrase-$undefined}" != "$undefined" ]; then
 		# Never prompt
-		passphrase_prompt_option=m4_PROMPT_NEVER
 		printf "Using hardcoded passphrase for m4_APPNAME.\n"
-	elif [ "${same_passphrase_every_keyfile:-$undefined}" != "$undefined" ]; then
-		# Prompt first time only
-		passphrase_prompt_option=m4_PROMPT_ONCE
+		printf "%s" "$encrypted_keyfile_passphrase" > "$encrypted_keyfile_passphrase_file"
+		passphrase_option="--passphrase-file=$encrypted_keyfile_passphrase_file"
 	else
-		# Always prompt
-		passphrase_prompt_option=m4_PROMPT_ALWAYS
-	fi
-
-	# This ! [ $x -gt 0 ] construction means that we do the body even if $x is not a number
-	if ! [ "${encrypted_keyfile_passphrase_attempts-NaN}" -gt 0 ] > /dev/null 2>&1; then
-		encrypted_keyfile_passphrase_attempts=m4_INITCPIO_DEFAULT_MAX_PASSPHRASE_ATTEMPTS
-	fi
-
-	for encrypted_keyfile in "$encrypted_keyfile_dir"/* "$encrypted_keyfile_dir"/.*; do
-		if [ ! -f "$encrypted_keyfile" ]; then
-			continue
+		if [ "${same_passphrase_every_keyfile:-$undefined}" != "$undefined" ]; then
+			# Prompt first time only
+			passphrase_option="--same-passphrase"
 		fi
 
-		passphrase_tries=0
-		exit_loop=0
-
-		if [ "$passphrase_prompt_option" -eq m4_PROMPT_ALWAYS ]; then
-			# Prompt for a new passphrase for this keyfile
-			unset encrypted_keyfile_passphrase
+		# This ! [ $x -gt 0 ] construction means that we do the body even if $x is not a number
+		if ! [ "${encrypted_keyfile_passphrase_attempts-NaN}" -gt 0 ] > /dev/null 2>&1; then
+			encrypted_keyfile_passphrase_attempts=m4_INITCPIO_DEFAULT_MAX_PASSPHRASE_ATTEMPTS
 		fi
+		attempts_option="--attempts=$encrypted_keyfile_passphrase_attempts"
+	fi
 
-		while
-			passphrase_tries=$((passphrase_tries + 1))
-			if [ "${encrypted_keyfile_passphrase-$undefined}" = "$undefined" ]; then
-				stty -echo
-				case $passphrase_prompt_option in
-					m4_PROMPT_ONCE) printf "Enter your passphrase for all keyfiles in %s: " "$encrypted_keyfile_dir" ;;
-					m4_PROMPT_ALWAYS) printf "Enter your passphrase for %s: " "$encrypted_keyfile" ;;
-				esac
-				read -r encrypted_keyfile_passphrase
-				stty echo
-				printf "\n"
-			fi
-
-			if [ $passphrase_prompt_option -ne m4_PROMPT_ALWAYS ]; then
-				printf "Trying to decrypt %s.\n" "$encrypted_keyfile"
-			fi
-
-			printf "%s" "$encrypted_keyfile_passphrase" > "$encrypted_keyfile_passphrase_file"
-			m4_APPNAME generate -f "$encrypted_keyfile" -r "$encrypted_keyfile_passphrase_file" > $disk_encryption_key_file
-			result=$?
-			: < /dev/null > $encrypted_keyfile_passphrase_file
-
-			if [ $result -eq 0 ]; then
-				export cryptkey="rootfs:$disk_encryption_key_file"
-				return
-			elif [ $result -eq 33 ] && [ $passphrase_prompt_option -ne m4_PROMPT_NEVER ]; then
-				`#' From m4_APPNAME man page, EXIT CODES section:
-				`#'   33     Bad passphrase
-				unset encrypted_keyfile_passphrase
-			else
-				# Failure but not due to a bad passphrase, so move on to the next keyfile
-				exit_loop=1
-			fi
-
-			if [ $passphrase_tries -ge "$encrypted_keyfile_passphrase_attempts" ]; then
-				printf "Too many failed passphrase attempts (maximum of %s).\n" $encrypted_keyfile_passphrase_attempts
-				exit_loop=1
-			fi
-
-			[ $exit_loop -eq 0 ]
-		do :; done
-	done
-
+	# A single process tries every keyfile in turn, prompting for passphrases
+	# itself, and opens the authenticators only once
+	m4_APPNAME unlock-dir ${wait_option:+"$wait_option"} ${passphrase_option:+"$passphrase_option"} ${attempts_option:+"$attempts_option"} "$encrypted_keyfile_dir" > "$disk_encryption_key_file"
+	result=$?
+	: < /dev/null > "$encrypted_keyfile_passphrase_file"
 	unset encrypted_keyfile_passphrase
+
+	if [ $result -eq 0 ]; then
+		export cryptkey="rootfs:$disk_encryption_key_file"
+	elif [ $result -eq 34 ]; then
+		`#' From m4_APPNAME man page, EXIT CODES section:
+		`#'   34     No authenticator device connected
+		printf "No authenticator device found; skipping m4_APPNAME hook.\n"
+	fi
 }
 
 run_cleanuphook() {
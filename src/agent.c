@@ -0,0 +1,1140 @@
+// For struct ucred, accept4() and ppoll()
+#define _GNU_SOURCE
+
+#include "agent.h"
+
+#include <errno.h>
+#include <fido.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "authenticator.h"
+#include "cryptography.h"
+#include "exit.h"
+#include "generate.h"
+#include "kdf_cache.h"
+#include "memory.h"
+#include "serialization.h"
+
+// Longer messages in failed responses are truncated
+#define AGENT_RESPONSE_MESSAGE_SIZE 256
+
+/**
+ * A message being built or read, as described in agent.h, in the secure arena.
+ */
+typedef struct agent_message_t {
+	unsigned char *bytes;
+	// Of the fields, not counting the length before them
+	size_t size;
+	// Set if a field did not fit, in which case it was left out
+	bool overflowed;
+} agent_message_t;
+
+typedef struct agent_message_field_t {
+	unsigned char tag;
+	const unsigned char *value;
+	size_t size;
+} agent_message_field_t;
+
+typedef struct agent_cached_key_t {
+	char description[KDF_CACHE_DESCRIPTION_SIZE];
+	unsigned char *key_bytes;
+	time_t expires;
+} agent_cached_key_t;
+
+typedef struct agent_t {
+	int listen_fd;
+	char *socket_path;
+	unsigned int key_ttl;
+	// Guards the cached keys and connection_count, which the threads serving
+	// requests share with the main thread
+	pthread_mutex_t lock;
+	pthread_cond_t connection_finished_condition;
+	size_t connection_count;
+	size_t cached_key_count;
+	agent_cached_key_t cached_keys[AGENT_MAX_CACHED_KEYS];
+	// Held by the request using the authenticators, which are opened for it
+	// and closed again afterwards
+	pthread_mutex_t devices_lock;
+} agent_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t forget_requested = 0;
+
+static void request_stop(int signal_number) {
+	(void)signal_number;
+	stop_requested = 1;
+}
+
+static void request_forgetting_keys(int signal_number) {
+	(void)signal_number;
+	forget_requested = 1;
+}
+
+static time_t now_in_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static void store32_be(unsigned char *dst, uint32_t value) {
+	for (size_t i = 0; i < sizeof(value); i++) {
+		dst[i] = (unsigned char)(value >> (8 * (sizeof(value) - 1 - i)));
+	}
+}
+
+static uint32_t load32_be(const unsigned char *src) {
+	uint32_t value = 0;
+	for (size_t i = 0; i < sizeof(value); i++) {
+		value = (value << 8) | src[i];
+	}
+	return value;
+}
+
+/**
+ * Returns an empty message, or NULL if there is no secure memory for it (so
+ * that the agent can turn a client away rather than exiting).
+ */
+static agent_message_t *new_agent_message(void) {
+	agent_message_t *message =
+	    malloc_or_exit(sizeof(agent_message_t), "agent message");
+	message->bytes =
+	    secure_malloc(AGENT_MESSAGE_LENGTH_SIZE + AGENT_MAX_MESSAGE_SIZE);
+	if (message->bytes == NULL) {
+		free(message);
+		return NULL;
+	}
+	message->size = 0;
+	message->overflowed = false;
+	return message;
+}
+
+static void free_agent_message(agent_message_t *message) {
+	if (message == NULL) {
+		return;
+	}
+	secure_free(message->bytes);
+	free(message);
+}
+
+static void add_field(agent_message_t *message, agent_field_t tag,
+                      const void *value, size_t size) {
+	size_t room = AGENT_MAX_MESSAGE_SIZE - message->size;
+	if (room < AGENT_FIELD_HEADER_SIZE ||
+	    room - AGENT_FIELD_HEADER_SIZE < size) {
+		message->overflowed = true;
+		return;
+	}
+	unsigned char *field =
+	    message->bytes + AGENT_MESSAGE_LENGTH_SIZE + message->size;
+	field[0] = (unsigned char)tag;
+	store32_be(field + 1, (uint32_t)size);
+	if (size > 0) {
+		memcpy(field + AGENT_FIELD_HEADER_SIZE, value, size);
+	}
+	message->size += AGENT_FIELD_HEADER_SIZE + size;
+}
+
+static void add_string_field(agent_message_t *message, agent_field_t tag,
+                             const char *value) {
+	if (value != NULL) {
+		add_field(message, tag, value, strlen(value));
+	}
+}
+
+static void add_byte_field(agent_message_t *message, agent_field_t tag,
+                           unsigned char value) {
+	add_field(message, tag, &value, 1);
+}
+
+/**
+ * Reads the field at *offset in message into field, moving *offset past it.
+ * Returns false at the end of the message, or if the field runs past the end
+ * (in which case *offset is left short of message->size).
+ */
+static bool read_field(agent_message_t *message, size_t *offset,
+                       agent_message_field_t *field) {
+	size_t remaining = message->size - *offset;
+	if (remaining < AGENT_FIELD_HEADER_SIZE) {
+		return false;
+	}
+	const unsigned char *start =
+	    message->bytes + AGENT_MESSAGE_LENGTH_SIZE + *offset;
+	uint32_t size = load32_be(start + 1);
+	if (remaining - AGENT_FIELD_HEADER_SIZE < size) {
+		return false;
+	}
+	field->tag = start[0];
+	field->value = start + AGENT_FIELD_HEADER_SIZE;
+	field->size = size;
+	*offset += AGENT_FIELD_HEADER_SIZE + size;
+	return true;
+}
+
+/**
+ * Returns the protocol version given in the first field of message, or 0 if
+ * there is none.
+ */
+static unsigned char get_message_version(agent_message_t *message) {
+	size_t offset = 0;
+	agent_message_field_t field;
+	if (!read_field(message, &offset, &field) ||
+	    field.tag != agent_field_version || field.size != 1) {
+		return 0;
+	}
+	return field.value[0];
+}
+
+static bool write_all(int fd, const unsigned char *bytes, size_t size) {
+	while (size > 0) {
+		ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return false;
+		}
+		bytes += written;
+		size -= (size_t)written;
+	}
+	return true;
+}
+
+static bool read_all(int fd, unsigned char *bytes, size_t size) {
+	while (size > 0) {
+		ssize_t got = recv(fd, bytes, size, 0);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		bytes += got;
+		size -= (size_t)got;
+	}
+	return true;
+}
+
+static bool send_agent_message(int fd, agent_message_t *message) {
+	store32_be(message->bytes, (uint32_t)message->size);
+	return write_all(fd, message->bytes,
+	                 AGENT_MESSAGE_LENGTH_SIZE + message->size);
+}
+
+/**
+ * Reads a message from fd, returning NULL if it could not be read or is too
+ * large.
+ */
+static agent_message_t *receive_agent_message(int fd) {
+	agent_message_t *message = new_agent_message();
+	if (message == NULL) {
+		return NULL;
+	}
+	if (!read_all(fd, message->bytes, AGENT_MESSAGE_LENGTH_SIZE)) {
+		free_agent_message(message);
+		return NULL;
+	}
+	uint32_t size = load32_be(message->bytes);
+	if (size > AGENT_MAX_MESSAGE_SIZE ||
+	    !read_all(fd, message->bytes + AGENT_MESSAGE_LENGTH_SIZE, size)) {
+		free_agent_message(message);
+		return NULL;
+	}
+	message->size = size;
+	return message;
+}
+
+char *get_agent_socket_path(void) {
+	const char *runtime_directory = getenv("XDG_RUNTIME_DIR");
+	if (runtime_directory == NULL || runtime_directory[0] != '/') {
+		return NULL;
+	}
+	char *path = malloc_or_exit(strlen(runtime_directory) +
+	                                strlen("/" AGENT_SOCKET_NAME) + 1,
+	                            "agent socket path");
+	sprintf(path, "%s/%s", runtime_directory, AGENT_SOCKET_NAME);
+	return path;
+}
+
+static void make_socket_address(const char *path, struct sockaddr_un *address) {
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		errx(EXIT_AGENT_ERROR, "%s is too long to be a socket path", path);
+	}
+	strcpy(address->sun_path, path);
+}
+
+/**
+ * Returns a socket connected to address, or -1 (with errno set) if nothing is
+ * listening there.
+ */
+static int connect_to_agent(const struct sockaddr_un *address) {
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *)address,
+	            sizeof(struct sockaddr_un)) != 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+bool agent_is_listening(void) {
+	char *path = get_agent_socket_path();
+	struct sockaddr_un address;
+	bool listening = false;
+	if (path != NULL && strlen(path) < sizeof(address.sun_path)) {
+		make_socket_address(path, &address);
+		int fd = connect_to_agent(&address);
+		listening = fd >= 0;
+		if (listening) {
+			close(fd);
+		}
+	}
+	free(path);
+	return listening;
+}
+
+static int listen_on_agent_socket(const char *path) {
+	struct sockaddr_un address;
+	make_socket_address(path, &address);
+
+	int existing = connect_to_agent(&address);
+	if (existing >= 0) {
+		close(existing);
+		errx(EXIT_AGENT_ERROR, "An agent is already listening on %s", path);
+	}
+	// Nothing is listening, so anything there was left behind by an agent
+	// which did not get to clean up
+	if (unlink(path) != 0 && errno != ENOENT) {
+		err(EXIT_AGENT_ERROR, "Unable to remove %s", path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err(EXIT_AGENT_ERROR, "Unable to create agent socket");
+	}
+	// Only the user can connect, though we check who has connected anyway
+	mode_t previous_umask = umask(0177);
+	int r = bind(fd, (const struct sockaddr *)&address, sizeof(address));
+	umask(previous_umask);
+	if (r != 0) {
+		err(EXIT_AGENT_ERROR, "Unable to bind %s", path);
+	}
+	if (listen(fd, SOMAXCONN) != 0) {
+		err(EXIT_AGENT_ERROR, "Unable to listen on %s", path);
+	}
+	return fd;
+}
+
+static agent_response_t *new_agent_response(agent_status_t status) {
+	agent_response_t *response =
+	    malloc_or_exit(sizeof(agent_response_t), "agent response");
+	response->status = status;
+	response->exit_code = EXIT_SUCCESS;
+	response->message = NULL;
+	response->secret = NULL;
+	response->secret_size = 0;
+	response->derive_subkeys = false;
+	return response;
+}
+
+void free_agent_response(agent_response_t *response) {
+	if (response == NULL) {
+		return;
+	}
+	free(response->message);
+	secure_free(response->secret);
+	free(response);
+}
+
+/**
+ * Returns a response with the given status and message, which is also logged
+ * if the request failed.
+ */
+static agent_response_t *
+respond_with_message(agent_status_t status, unsigned char exit_code,
+                     const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static agent_response_t *respond_with_message(agent_status_t status,
+                                              unsigned char exit_code,
+                                              const char *format, ...) {
+	char message[AGENT_RESPONSE_MESSAGE_SIZE];
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(message, sizeof(message), format, arguments);
+	va_end(arguments);
+
+	if (status == agent_status_failed) {
+		warnx("%s", message);
+	}
+	agent_response_t *response = new_agent_response(status);
+	response->exit_code = exit_code;
+	response->message = strdup_or_exit(message, "agent response message");
+	return response;
+}
+
+static void free_agent_request(agent_request_t *request) {
+	if (request == NULL) {
+		return;
+	}
+	free(request->keyfile);
+	secure_free(request->passphrase);
+	secure_free(request->pin);
+	free(request->mixin);
+	free(request->second_mixin);
+	free(request);
+}
+
+/**
+ * Reads a request from message, whose version has already been checked,
+ * returning NULL if it is malformed.
+ */
+static agent_request_t *parse_agent_request(agent_message_t *message) {
+	agent_request_t *request =
+	    malloc_or_exit(sizeof(agent_request_t), "agent request");
+	request->keyfile = NULL;
+	request->keyfile_size = 0;
+	request->passphrase = NULL;
+	request->pin = NULL;
+	request->mixin = NULL;
+	request->second_mixin = NULL;
+	request->race_authenticators = false;
+
+	bool malformed = false;
+	size_t offset = 0;
+	size_t field_offset = 0;
+	agent_message_field_t field;
+	while (!malformed && read_field(message, &offset, &field)) {
+		switch (field.tag) {
+		case agent_field_version:
+			malformed = field_offset != 0;
+			break;
+		case agent_field_keyfile:
+			malformed = request->keyfile != NULL || field.size == 0;
+			if (!malformed) {
+				request->keyfile =
+				    malloc_or_exit(field.size, "keyfile in agent request");
+				memcpy(request->keyfile, field.value, field.size);
+				request->keyfile_size = field.size;
+			}
+			break;
+		case agent_field_passphrase:
+			malformed = request->passphrase != NULL ||
+			            field.size > LONGEST_VALID_PASSPHRASE;
+			if (!malformed) {
+				request->passphrase = secure_strndup_or_exit(
+				    (const char *)field.value, field.size,
+				    "passphrase in agent request");
+			}
+			break;
+		case agent_field_pin:
+			malformed = request->pin != NULL || field.size == 0 ||
+			            field.size > LONGEST_VALID_PIN;
+			if (!malformed) {
+				request->pin = secure_strndup_or_exit(
+				    (const char *)field.value, field.size,
+				    "authenticator PIN in agent request");
+			}
+			break;
+		case agent_field_mixin:
+			malformed = request->mixin != NULL;
+			if (!malformed) {
+				request->mixin =
+				    strndup_or_exit((const char *)field.value, field.size,
+				                    "mixin in agent request");
+			}
+			break;
+		case agent_field_second_mixin:
+			malformed = request->second_mixin != NULL;
+			if (!malformed) {
+				request->second_mixin =
+				    strndup_or_exit((const char *)field.value, field.size,
+				                    "second mixin in agent request");
+			}
+			break;
+		case agent_field_race:
+			malformed = field.size != 1;
+			if (!malformed) {
+				request->race_authenticators = field.value[0] != 0;
+			}
+			break;
+		default:
+			malformed = true;
+			break;
+		}
+		field_offset = offset;
+	}
+
+	if (malformed || offset != message->size || request->keyfile == NULL) {
+		free_agent_request(request);
+		return NULL;
+	}
+	return request;
+}
+
+/**
+ * Reads a response from message, returning NULL if it is malformed or from an
+ * agent which speaks another version of the protocol.
+ */
+static agent_response_t *parse_agent_response(agent_message_t *message) {
+	if (get_message_version(message) != AGENT_PROTOCOL_VERSION) {
+		return NULL;
+	}
+
+	agent_response_t *response = new_agent_response(agent_status_failed);
+	bool seen_status = false;
+	bool malformed = false;
+	size_t offset = 0;
+	agent_message_field_t field;
+	while (!malformed && read_field(message, &offset, &field)) {
+		switch (field.tag) {
+		case agent_field_version:
+			break;
+		case agent_field_status:
+			malformed = seen_status || field.size != 1 ||
+			            field.value[0] > agent_status_failed;
+			if (!malformed) {
+				response->status = (agent_status_t)field.value[0];
+				seen_status = true;
+			}
+			break;
+		case agent_field_exit_code:
+			malformed = field.size != 1;
+			if (!malformed) {
+				response->exit_code = field.value[0];
+			}
+			break;
+		case agent_field_message:
+			malformed = response->message != NULL;
+			if (!malformed) {
+				response->message =
+				    strndup_or_exit((const char *)field.value, field.size,
+				                    "agent response message");
+			}
+			break;
+		case agent_field_secret:
+			malformed = response->secret != NULL || field.size == 0;
+			if (!malformed) {
+				response->secret = secure_malloc_or_exit(
+				    field.size, "secret in agent response");
+				memcpy(response->secret, field.value, field.size);
+				response->secret_size = field.size;
+			}
+			break;
+		case agent_field_derive_subkeys:
+			malformed = field.size != 1;
+			if (!malformed) {
+				response->derive_subkeys = field.value[0] != 0;
+			}
+			break;
+		default:
+			malformed = true;
+			break;
+		}
+	}
+
+	malformed = malformed || offset != message->size || !seen_status ||
+	            (response->status == agent_status_ok) !=
+	                (response->secret != NULL) ||
+	            ((response->status == agent_status_need_pin ||
+	              response->status == agent_status_failed) &&
+	             response->message == NULL) ||
+	            (response->status == agent_status_failed &&
+	             response->exit_code == EXIT_SUCCESS);
+	if (malformed) {
+		free_agent_response(response);
+		return NULL;
+	}
+	return response;
+}
+
+agent_response_t *request_secret_from_agent(agent_request_t *request) {
+	char *path = get_agent_socket_path();
+	if (path == NULL) {
+		errx(EXIT_AGENT_ERROR,
+		     "XDG_RUNTIME_DIR is not set, so the agent cannot be found");
+	}
+	struct sockaddr_un address;
+	make_socket_address(path, &address);
+	int fd = connect_to_agent(&address);
+	if (fd < 0) {
+		err(EXIT_AGENT_ERROR, "Unable to connect to the agent at %s", path);
+	}
+	free(path);
+	path = NULL;
+
+	agent_message_t *message = new_agent_message();
+	if (message == NULL) {
+		errx(EXIT_OUT_OF_MEMORY,
+		     "Unable to allocate secure memory for the agent request");
+	}
+	add_byte_field(message, agent_field_version, AGENT_PROTOCOL_VERSION);
+	add_field(message, agent_field_keyfile, request->keyfile,
+	          request->keyfile_size);
+	add_string_field(message, agent_field_passphrase, request->passphrase);
+	add_string_field(message, agent_field_pin, request->pin);
+	add_string_field(message, agent_field_mixin, request->mixin);
+	add_string_field(message, agent_field_second_mixin,
+	                 request->second_mixin);
+	add_byte_field(message, agent_field_race, request->race_authenticators);
+	if (message->overflowed) {
+		errx(EXIT_AGENT_ERROR, "The request is too large to send to the agent");
+	}
+	if (!send_agent_message(fd, message)) {
+		err(EXIT_AGENT_ERROR, "Unable to send the request to the agent");
+	}
+	free_agent_message(message);
+
+	message = receive_agent_message(fd);
+	close(fd);
+	agent_response_t *response =
+	    message == NULL ? NULL : parse_agent_response(message);
+	free_agent_message(message);
+	message = NULL;
+	if (response == NULL) {
+		errx(EXIT_AGENT_ERROR,
+		     "The agent did not give a response this client understands; it "
+		     "may need restarting");
+	}
+	return response;
+}
+
+static void forget_cached_key(agent_t *agent, size_t index) {
+	free_key(agent->cached_keys[index].key_bytes);
+	agent->cached_keys[index] = agent->cached_keys[--agent->cached_key_count];
+}
+
+/**
+ * Returns a copy of the cached passphrase-derived key for cleartext (which
+ * must be freed with free_key()), or NULL if there is none.
+ */
+static unsigned char *get_cached_key(agent_t *agent,
+                                     deserialized_cleartext *cleartext) {
+	char description[KDF_CACHE_DESCRIPTION_SIZE];
+	describe_cached_key(cleartext, description);
+	unsigned char *key_bytes = NULL;
+	pthread_mutex_lock(&agent->lock);
+	for (size_t i = 0; i < agent->cached_key_count; i++) {
+		if (strcmp(agent->cached_keys[i].description, description) == 0) {
+			// Without room for a copy, this is no worse than a cache miss
+			key_bytes = secure_malloc(KEY_SIZE);
+			if (key_bytes != NULL) {
+				memcpy(key_bytes, agent->cached_keys[i].key_bytes, KEY_SIZE);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&agent->lock);
+	return key_bytes;
+}
+
+static void cache_key(agent_t *agent, deserialized_cleartext *cleartext,
+                      unsigned char *key_bytes) {
+	// Not caching is only slower, so that's better than failing the request
+	unsigned char *cached_key_bytes = secure_malloc(KEY_SIZE);
+	if (cached_key_bytes == NULL) {
+		warnx("Unable to allocate secure memory to cache a key");
+		return;
+	}
+	memcpy(cached_key_bytes, key_bytes, KEY_SIZE);
+	char description[KDF_CACHE_DESCRIPTION_SIZE];
+	describe_cached_key(cleartext, description);
+
+	pthread_mutex_lock(&agent->lock);
+	// Another request for the same keyfile may have got here first
+	for (size_t i = 0; i < agent->cached_key_count; i++) {
+		if (strcmp(agent->cached_keys[i].description, description) == 0) {
+			forget_cached_key(agent, i);
+			break;
+		}
+	}
+	if (agent->cached_key_count == AGENT_MAX_CACHED_KEYS) {
+		size_t soonest = 0;
+		for (size_t i = 1; i < agent->cached_key_count; i++) {
+			if (agent->cached_keys[i].expires <
+			    agent->cached_keys[soonest].expires) {
+				soonest = i;
+			}
+		}
+		forget_cached_key(agent, soonest);
+	}
+
+	agent_cached_key_t *cached =
+	    &agent->cached_keys[agent->cached_key_count++];
+	strcpy(cached->description, description);
+	cached->key_bytes = cached_key_bytes;
+	cached->expires = now_in_seconds() + agent->key_ttl;
+	pthread_mutex_unlock(&agent->lock);
+}
+
+static bool device_supports_secrets(const fido_dev_info_t *device_info,
+                                    const device_facts_t *facts,
+                                    void *context) {
+	(void)device_info;
+	(void)context;
+	return facts == NULL || (facts->fido2 && facts->supports_hmac_secret);
+}
+
+/**
+ * Opens every connected device which supports hmac-secret, and asks those
+ * which could hold the credential in cleartext for the secret for params, as
+ * generate does (see get_secret_from_open_devices()). The devices are closed
+ * again before this returns, so that other programs can use them.
+ */
+static agent_response_t *ask_devices(agent_t *agent, agent_request_t *request,
+                                     deserialized_cleartext *cleartext,
+                                     authenticator_parameters_t *params) {
+	// Only one authenticator can be touched at a time anyway, and
+	// authenticators do not take concurrent requests from separate opens
+	pthread_mutex_lock(&agent->devices_lock);
+	devices_list_t *devices_list = list_devices();
+	probed_devices_t *probed =
+	    probe_devices(devices_list, device_supports_secrets, NULL);
+	for (size_t i = 0; i < probed->count; i++) {
+		probed_device_t *device = &probed->list[i];
+		if (device->status != device_probe_ok) {
+			warnx("Skipping device at %s: %s", device->path,
+			      describe_device_probe_failure(device));
+		}
+	}
+
+	secret_t *secret = malloc_or_exit(sizeof(secret_t), "secret");
+	secret->secret = NULL;
+	secret->secret_size = 0;
+	probed_device_t *needs_pin = NULL;
+	bool transport_error = false;
+	agent_response_t *response = NULL;
+
+	switch (get_secret_from_open_devices(
+	    devices_list, probed, cleartext, params, request->pin,
+	    request->race_authenticators, secret, &needs_pin, &transport_error)) {
+	case EXIT_SUCCESS:
+		response = new_agent_response(agent_status_ok);
+		response->secret = secret->secret;
+		response->secret_size = secret->secret_size;
+		response->derive_subkeys = params->derive_subkeys;
+		secret->secret = NULL;
+		break;
+	case EXIT_NO_DEVICES:
+		response = respond_with_message(agent_status_failed, EXIT_NO_DEVICES,
+		                                "Unable to find an appropriate "
+		                                "authenticator to generate a secret");
+		break;
+	case EXIT_BAD_PIN:
+		response =
+		    needs_pin != NULL
+		        ? respond_with_message(agent_status_need_pin, EXIT_SUCCESS,
+		                               "authenticator PIN for %s at %s",
+		                               needs_pin->product_string,
+		                               needs_pin->path)
+		        : respond_with_message(agent_status_failed, EXIT_BAD_PIN,
+		                               "Invalid PIN for authenticator");
+		break;
+	default:
+		response = respond_with_message(
+		    agent_status_failed, EXIT_NO_VALID_AUTHENTICATOR,
+		    "No connected authenticator was able to generate a valid secret");
+		break;
+	}
+
+	free_secret(secret);
+	free_probed_devices(probed);
+	free_devices_list(devices_list);
+	pthread_mutex_unlock(&agent->devices_lock);
+	return response;
+}
+
+static agent_response_t *respond_to_request(agent_t *agent,
+                                            agent_request_t *request) {
+	// The client has already loaded the keyfile, but the agent cannot rely on
+	// that: a malformed keyfile, or one whose key derivation parameters could
+	// not be used, is turned away before deriving a key
+	char keyfile_path[] = "keyfile from client";
+	encoded_file keyfile = {.path = keyfile_path,
+	                        .data = request->keyfile,
+	                        .length = request->keyfile_size};
+	char error[FAILURE_MESSAGE_SIZE];
+	deserialized_cleartext *cleartext =
+	    try_load_cleartext(&keyfile, error, sizeof(error));
+	if (cleartext == NULL) {
+		return respond_with_message(agent_status_failed,
+		                            EXIT_DESERIALIZATION_ERROR, "%s", error);
+	}
+	if (!kdf_parameters_are_usable(cleartext)) {
+		free_cleartext(cleartext);
+		return respond_with_message(
+		    agent_status_failed, EXIT_CRYPTOGRAPHY_ERROR,
+		    "The keyfile's key derivation parameters are invalid, or need more "
+		    "memory than is available");
+	}
+
+	unsigned char *key_bytes = get_cached_key(agent, cleartext);
+	if (key_bytes == NULL) {
+		if (request->passphrase == NULL) {
+			free_cleartext(cleartext);
+			return new_agent_response(agent_status_need_passphrase);
+		}
+		key_spec_t *key_spec = make_key_spec_from_passphrase_and_cleartext(
+		    request->passphrase, cleartext);
+		key_bytes = derive_key(key_spec);
+		free_key_spec(key_spec);
+		if (!key_decrypts_cleartext(cleartext, key_bytes)) {
+			free_key(key_bytes);
+			free_cleartext(cleartext);
+			return respond_with_message(
+			    agent_status_failed, EXIT_BAD_PASSPHRASE,
+			    "Could not decrypt secrets; this likely means the passphrase "
+			    "was wrong");
+		}
+		cache_key(agent, cleartext, key_bytes);
+	}
+
+	authenticator_parameters_t *params = NULL;
+	int result =
+	    try_build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+	        cleartext, key_bytes, request->mixin, &params, error,
+	        sizeof(error));
+	if (result != EXIT_SUCCESS) {
+		free_key(key_bytes);
+		free_cleartext(cleartext);
+		return respond_with_message(agent_status_failed,
+		                            (unsigned char)result, "%s", error);
+	}
+	agent_response_t *response = NULL;
+	if (request->second_mixin != NULL) {
+		if (params->salt_size != 2 * HMAC_SECRET_SALT_SIZE) {
+			response = respond_with_message(
+			    agent_status_failed, EXIT_DESERIALIZATION_ERROR,
+			    "The salt in this keyfile is %zu bytes, but --second-mixin "
+			    "needs %d bytes",
+			    params->salt_size, 2 * HMAC_SECRET_SALT_SIZE);
+		} else {
+			use_second_salt_for_second_mixin(params, cleartext, key_bytes,
+			                                 request->second_mixin);
+		}
+	}
+	free_key(key_bytes);
+	key_bytes = NULL;
+
+	if (response == NULL) {
+		response = ask_devices(agent, request, cleartext, params);
+	}
+
+	free_parameters(params);
+	params = NULL;
+	free_cleartext(cleartext);
+	cleartext = NULL;
+	return response;
+}
+
+/**
+ * Responds to message, turning any failure which would otherwise exit into a
+ * failed response, so that one request can never stop the agent. The request
+ * is freed either way, but anything else allocated for it when it failed is
+ * leaked (see catch_failures()). A malformed keyfile is turned away with a
+ * status rather than failing, so only running out of memory leaks.
+ */
+static agent_response_t *
+respond_to_message_catching_failures(agent_t *agent,
+                                     agent_message_t *message) {
+	unsigned char version = get_message_version(message);
+	if (version != AGENT_PROTOCOL_VERSION) {
+		return respond_with_message(
+		    agent_status_failed, EXIT_AGENT_ERROR,
+		    "The agent speaks version %d of its protocol, but the client "
+		    "speaks version %d; the agent may need restarting",
+		    AGENT_PROTOCOL_VERSION, version);
+	}
+
+	failure_catcher_t catcher;
+	agent_request_t *volatile request = NULL;
+	if (setjmp(catcher.jump) != 0) {
+		// devices_lock checks its owner, so this only unlocks it if the
+		// failure came while this thread held it
+		pthread_mutex_unlock(&agent->devices_lock);
+		free_agent_request(request);
+		return respond_with_message(agent_status_failed,
+		                            (unsigned char)catcher.exit_code, "%s",
+		                            catcher.message);
+	}
+	catch_failures(&catcher);
+	request = parse_agent_request(message);
+	agent_response_t *response =
+	    request == NULL ? respond_with_message(agent_status_failed,
+	                                           EXIT_AGENT_ERROR,
+	                                           "The agent could not "
+	                                           "understand the request")
+	                    : respond_to_request(agent, request);
+	stop_catching_failures();
+	free_agent_request(request);
+	return response;
+}
+
+static void send_response(int fd, pid_t pid, agent_response_t *response) {
+	agent_message_t *message = new_agent_message();
+	if (message == NULL) {
+		warnx("Unable to allocate secure memory for the response to process "
+		      "%d",
+		      pid);
+		return;
+	}
+	add_byte_field(message, agent_field_version, AGENT_PROTOCOL_VERSION);
+	add_byte_field(message, agent_field_status, response->status);
+	add_byte_field(message, agent_field_exit_code, response->exit_code);
+	add_string_field(message, agent_field_message, response->message);
+	if (response->secret != NULL) {
+		add_field(message, agent_field_secret, response->secret,
+		          response->secret_size);
+	}
+	add_byte_field(message, agent_field_derive_subkeys,
+	               response->derive_subkeys);
+	if (message->overflowed || !send_agent_message(fd, message)) {
+		warnx("Unable to send response to process %d", pid);
+	}
+	free_agent_message(message);
+}
+
+typedef struct agent_connection_t {
+	agent_t *agent;
+	int fd;
+	pid_t pid;
+} agent_connection_t;
+
+/**
+ * Reads the request on a connection, answers it and closes the connection.
+ * Each connection has its own thread, so that a request waiting for an
+ * authenticator to be touched does not hold up those which need none.
+ */
+static void *serve_connection(void *arg) {
+	agent_connection_t *connection = (agent_connection_t *)arg;
+	agent_t *agent = connection->agent;
+
+	// A connection closed before anything is sent is only a check that the
+	// agent is there (see agent_is_listening())
+	unsigned char first_byte;
+	bool request_sent = recv(connection->fd, &first_byte, 1, MSG_PEEK) != 0;
+	agent_message_t *message =
+	    request_sent ? receive_agent_message(connection->fd) : NULL;
+	if (request_sent && message == NULL) {
+		warnx("Unable to read request from process %d", connection->pid);
+	} else if (message != NULL) {
+		agent_response_t *response =
+		    respond_to_message_catching_failures(agent, message);
+		free_agent_message(message);
+		send_response(connection->fd, connection->pid, response);
+		free_agent_response(response);
+	}
+	close(connection->fd);
+	free(connection);
+
+	pthread_mutex_lock(&agent->lock);
+	agent->connection_count--;
+	pthread_cond_signal(&agent->connection_finished_condition);
+	pthread_mutex_unlock(&agent->lock);
+	return NULL;
+}
+
+static void accept_connection(agent_t *agent) {
+	int fd = accept4(agent->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			warn("Unable to accept connection");
+		}
+		return;
+	}
+
+	struct ucred credentials;
+	socklen_t credentials_size = sizeof(credentials);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials,
+	               &credentials_size) != 0 ||
+	    credentials.uid != geteuid()) {
+		warnx("Refusing connection from another user");
+		close(fd);
+		return;
+	}
+
+	struct timeval timeout = {.tv_sec = AGENT_CLIENT_TIMEOUT_SECONDS,
+	                          .tv_usec = 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	pthread_mutex_lock(&agent->lock);
+	bool busy = agent->connection_count == AGENT_MAX_CONNECTIONS;
+	if (!busy) {
+		agent->connection_count++;
+	}
+	pthread_mutex_unlock(&agent->lock);
+	if (busy) {
+		agent_response_t *response = respond_with_message(
+		    agent_status_failed, EXIT_AGENT_ERROR,
+		    "The agent is busy with %d other requests",
+		    AGENT_MAX_CONNECTIONS);
+		send_response(fd, credentials.pid, response);
+		free_agent_response(response);
+		close(fd);
+		return;
+	}
+
+	agent_connection_t *connection =
+	    malloc_or_exit(sizeof(agent_connection_t), "agent connection");
+	connection->agent = agent;
+	connection->fd = fd;
+	connection->pid = credentials.pid;
+	pthread_t thread;
+	pthread_attr_t attributes;
+	if (pthread_attr_init(&attributes) != 0 ||
+	    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED) !=
+	        0 ||
+	    pthread_create(&thread, &attributes, serve_connection, connection) !=
+	        0) {
+		errx(EXIT_OUT_OF_MEMORY, "Unable to start a thread for a request");
+	}
+	pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Forgets keys which have expired, or every key if all is set.
+ */
+static void expire_keys(agent_t *agent, bool all) {
+	time_t now = now_in_seconds();
+	pthread_mutex_lock(&agent->lock);
+	for (size_t i = agent->cached_key_count; i > 0; i--) {
+		if (all || agent->cached_keys[i - 1].expires <= now) {
+			forget_cached_key(agent, i - 1);
+		}
+	}
+	pthread_mutex_unlock(&agent->lock);
+}
+
+/**
+ * Sets timeout to how long until the next key expires, returning false if
+ * there are no keys.
+ */
+static bool get_time_until_next_expiry(agent_t *agent,
+                                       struct timespec *timeout) {
+	bool any = false;
+	time_t next = 0;
+	pthread_mutex_lock(&agent->lock);
+	for (size_t i = 0; i < agent->cached_key_count; i++) {
+		if (!any || agent->cached_keys[i].expires < next) {
+			next = agent->cached_keys[i].expires;
+			any = true;
+		}
+	}
+	pthread_mutex_unlock(&agent->lock);
+	if (!any) {
+		return false;
+	}
+
+	// Deadlines are whole seconds on the monotonic clock, so waiting this
+	// long from part way through a second never wakes us early
+	time_t now = now_in_seconds();
+	timeout->tv_sec = next > now ? next - now : 0;
+	timeout->tv_nsec = 0;
+	return true;
+}
+
+unsigned short int run_agent(invocation_state_t *invocation) {
+	agent_t agent;
+	agent.key_ttl = invocation->kdf_cache_ttl != 0
+	                    ? invocation->kdf_cache_ttl
+	                    : AGENT_DEFAULT_KEY_TTL_SECONDS;
+	free_invocation(invocation);
+	invocation = NULL;
+	agent.cached_key_count = 0;
+	agent.connection_count = 0;
+	pthread_mutexattr_t devices_lock_attributes;
+	if (pthread_mutex_init(&agent.lock, NULL) != 0 ||
+	    pthread_cond_init(&agent.connection_finished_condition, NULL) != 0 ||
+	    pthread_mutexattr_init(&devices_lock_attributes) != 0 ||
+	    pthread_mutexattr_settype(&devices_lock_attributes,
+	                              PTHREAD_MUTEX_ERRORCHECK) != 0 ||
+	    pthread_mutex_init(&agent.devices_lock, &devices_lock_attributes) !=
+	        0) {
+		errx(EXIT_OUT_OF_MEMORY, "Unable to initialize agent locks");
+	}
+	pthread_mutexattr_destroy(&devices_lock_attributes);
+
+	agent.socket_path = get_agent_socket_path();
+	if (agent.socket_path == NULL) {
+		errx(EXIT_AGENT_ERROR,
+		     "XDG_RUNTIME_DIR is not set, so there is nowhere for the agent's "
+		     "socket");
+	}
+
+	// Signals are only let through while waiting, so that one arriving just
+	// before we wait is not missed; threads serving requests never get them
+	sigset_t handled_signals;
+	sigset_t waiting_signals;
+	sigemptyset(&handled_signals);
+	sigaddset(&handled_signals, SIGINT);
+	sigaddset(&handled_signals, SIGTERM);
+	sigaddset(&handled_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &handled_signals, &waiting_signals);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = request_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	action.sa_handler = request_forgetting_keys;
+	sigaction(SIGHUP, &action, NULL);
+
+	agent.listen_fd = listen_on_agent_socket(agent.socket_path);
+	warnx("Listening on %s", agent.socket_path);
+
+	while (!stop_requested) {
+		struct pollfd descriptor = {
+		    .fd = agent.listen_fd, .events = POLLIN, .revents = 0};
+		struct timespec timeout;
+		bool has_timeout = get_time_until_next_expiry(&agent, &timeout);
+		int r = ppoll(&descriptor, 1, has_timeout ? &timeout : NULL,
+		              &waiting_signals);
+		if (r < 0 && errno != EINTR) {
+			err(EXIT_AGENT_ERROR, "Unable to wait for requests");
+		}
+		if (forget_requested) {
+			forget_requested = 0;
+			expire_keys(&agent, true);
+			warnx("Forgot every passphrase-derived key");
+		} else {
+			expire_keys(&agent, false);
+		}
+		if (r > 0 && (descriptor.revents & POLLIN) && !stop_requested) {
+			accept_connection(&agent);
+		}
+	}
+
+	unlink(agent.socket_path);
+	close(agent.listen_fd);
+	free(agent.socket_path);
+	agent.socket_path = NULL;
+
+	// Requests being served still use the cached keys and the secure arena
+	pthread_mutex_lock(&agent.lock);
+	while (agent.connection_count > 0) {
+		pthread_cond_wait(&agent.connection_finished_condition, &agent.lock);
+	}
+	pthread_mutex_unlock(&agent.lock);
+	expire_keys(&agent, true);
+	return EXIT_SUCCESS;
+}
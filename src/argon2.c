@@ -0,0 +1,1051 @@
+#include "argon2.h"
+
+#include <pthread.h>
+#include <sodium.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// ARGON2_PORTABLE leaves out the SIMD compression functions, and
+// ARGON2_NO_AVX2 just the AVX2 one, so that the tests can check each of them
+// whatever the processor they run on
+#if defined(__SSE2__) && !defined(ARGON2_PORTABLE)
+#define ARGON2_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(ARGON2_PORTABLE) &&  \
+    !defined(ARGON2_NO_AVX2)
+#define ARGON2_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+typedef struct argon2_block_t {
+	uint64_t v[ARGON2_QWORDS_IN_BLOCK];
+} argon2_block_t;
+
+typedef void (*argon2_fill_block_t)(const argon2_block_t *prev_block,
+                                    const argon2_block_t *ref_block,
+                                    argon2_block_t *next_block, bool with_xor);
+
+// The size of a huge page on the platforms we care about (x86-64 and arm64
+// with 4 KiB base pages). Transparent huge pages can only back a mapping
+// aligned to this.
+#define ARGON2_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// How often, in blocks, a segment being filled checks whether the hash has
+// been cancelled: often enough to stop within a millisecond or so
+#define ARGON2_BLOCKS_BETWEEN_CANCELLATION_CHECKS 1024
+
+#define TRANSPARENT_HUGE_PAGE_ENABLED_PATH                                     \
+	"/sys/kernel/mm/transparent_hugepage/enabled"
+
+typedef struct argon2_instance_t {
+	argon2_block_t *memory;
+	argon2_fill_block_t fill_block;
+	// If not NULL, filling stops (leaving garbage) soon after this is set
+	const atomic_bool *cancelled;
+	uint32_t passes;
+	uint32_t memory_blocks;
+	uint32_t segment_length;
+	uint32_t lane_length;
+	uint32_t lanes;
+	int type;
+} argon2_instance_t;
+
+struct argon2_memory_t {
+	argon2_block_t *blocks;
+	size_t size;
+	void *mapping;
+	size_t mapping_size;
+	argon2_memory_backing_t backing;
+};
+
+typedef struct argon2_position_t {
+	uint32_t pass;
+	uint32_t lane;
+	uint32_t slice;
+	uint32_t index;
+} argon2_position_t;
+
+typedef struct argon2_segment_job_t {
+	argon2_instance_t *instance;
+	argon2_position_t position;
+} argon2_segment_job_t;
+
+static uint64_t load64(const unsigned char *src) {
+	uint64_t w = 0;
+	for (int i = 7; i >= 0; i--) {
+		w = (w << 8) | src[i];
+	}
+	return w;
+}
+
+static void store64(unsigned char *dst, uint64_t w) {
+	for (int i = 0; i < 8; i++) {
+		dst[i] = (unsigned char)(w >> (8 * i));
+	}
+}
+
+static void store32(unsigned char *dst, uint32_t w) {
+	for (int i = 0; i < 4; i++) {
+		dst[i] = (unsigned char)(w >> (8 * i));
+	}
+}
+
+static void load_block(argon2_block_t *dst, const unsigned char *src) {
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK; i++) {
+		dst->v[i] = load64(src + (i * 8));
+	}
+}
+
+static void store_block(unsigned char *dst, const argon2_block_t *src) {
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK; i++) {
+		store64(dst + (i * 8), src->v[i]);
+	}
+}
+
+static void xor_block(argon2_block_t *dst, const argon2_block_t *src) {
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK; i++) {
+		dst->v[i] ^= src->v[i];
+	}
+}
+
+// The variable-length hash function H' from section 3.3 of RFC 9106.
+static int blake2b_long(unsigned char *output, size_t output_size,
+                        const unsigned char *input, size_t input_size) {
+	crypto_generichash_blake2b_state state;
+	unsigned char output_size_bytes[4];
+	unsigned char previous[crypto_generichash_blake2b_BYTES_MAX];
+	unsigned char next[crypto_generichash_blake2b_BYTES_MAX];
+	int r = -1;
+
+	store32(output_size_bytes, (uint32_t)output_size);
+
+	size_t first_output_size = output_size <= sizeof(previous)
+	                               ? output_size
+	                               : sizeof(previous);
+	if (crypto_generichash_blake2b_init(&state, NULL, 0, first_output_size) !=
+	        0 ||
+	    crypto_generichash_blake2b_update(&state, output_size_bytes,
+	                                      sizeof(output_size_bytes)) != 0 ||
+	    crypto_generichash_blake2b_update(&state, input, input_size) != 0 ||
+	    crypto_generichash_blake2b_final(&state, previous, first_output_size) !=
+	        0) {
+		goto cleanup;
+	}
+
+	if (output_size <= sizeof(previous)) {
+		memcpy(output, previous, output_size);
+		r = 0;
+		goto cleanup;
+	}
+
+	memcpy(output, previous, sizeof(previous) / 2);
+	output += sizeof(previous) / 2;
+	size_t remaining = output_size - (sizeof(previous) / 2);
+	while (remaining > sizeof(previous)) {
+		if (crypto_generichash_blake2b(next, sizeof(next), previous,
+		                               sizeof(previous), NULL, 0) != 0) {
+			goto cleanup;
+		}
+		memcpy(previous, next, sizeof(previous));
+		memcpy(output, previous, sizeof(previous) / 2);
+		output += sizeof(previous) / 2;
+		remaining -= sizeof(previous) / 2;
+	}
+	if (crypto_generichash_blake2b(next, remaining, previous, sizeof(previous),
+	                               NULL, 0) != 0) {
+		goto cleanup;
+	}
+	memcpy(output, next, remaining);
+	r = 0;
+
+cleanup:
+	sodium_memzero(&state, sizeof(state));
+	sodium_memzero(previous, sizeof(previous));
+	sodium_memzero(next, sizeof(next));
+	return r;
+}
+
+#ifdef ARGON2_HAVE_SSE2
+
+// With SSE2 (which every x86-64 processor has) we keep two words in each
+// register, following the optimized implementation accompanying the Argon2
+// specification. This is more than twice as fast as the portable version.
+
+static inline __m128i f_bla_mka_sse2(__m128i x, __m128i y) {
+	const __m128i z = _mm_mul_epu32(x, y);
+	return _mm_add_epi64(_mm_add_epi64(x, y), _mm_add_epi64(z, z));
+}
+
+// NOLINTBEGIN(readability-magic-numbers)
+#define ROTR32_SSE2(x) _mm_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24_SSE2(x)                                                         \
+	_mm_xor_si128(_mm_srli_epi64((x), 24), _mm_slli_epi64((x), 40))
+#define ROTR16_SSE2(x)                                                         \
+	_mm_shufflehi_epi16(_mm_shufflelo_epi16((x), _MM_SHUFFLE(0, 3, 2, 1)),     \
+	                    _MM_SHUFFLE(0, 3, 2, 1))
+#define ROTR63_SSE2(x)                                                         \
+	_mm_xor_si128(_mm_srli_epi64((x), 63), _mm_add_epi64((x), (x)))
+// NOLINTEND(readability-magic-numbers)
+
+#define G1_SSE2(A0, B0, C0, D0, A1, B1, C1, D1)                                \
+	do {                                                                       \
+		A0 = f_bla_mka_sse2(A0, B0);                                           \
+		A1 = f_bla_mka_sse2(A1, B1);                                           \
+		D0 = ROTR32_SSE2(_mm_xor_si128(D0, A0));                               \
+		D1 = ROTR32_SSE2(_mm_xor_si128(D1, A1));                               \
+		C0 = f_bla_mka_sse2(C0, D0);                                           \
+		C1 = f_bla_mka_sse2(C1, D1);                                           \
+		B0 = ROTR24_SSE2(_mm_xor_si128(B0, C0));                               \
+		B1 = ROTR24_SSE2(_mm_xor_si128(B1, C1));                               \
+	} while (0)
+
+#define G2_SSE2(A0, B0, C0, D0, A1, B1, C1, D1)                                \
+	do {                                                                       \
+		A0 = f_bla_mka_sse2(A0, B0);                                           \
+		A1 = f_bla_mka_sse2(A1, B1);                                           \
+		D0 = ROTR16_SSE2(_mm_xor_si128(D0, A0));                               \
+		D1 = ROTR16_SSE2(_mm_xor_si128(D1, A1));                               \
+		C0 = f_bla_mka_sse2(C0, D0);                                           \
+		C1 = f_bla_mka_sse2(C1, D1);                                           \
+		B0 = ROTR63_SSE2(_mm_xor_si128(B0, C0));                               \
+		B1 = ROTR63_SSE2(_mm_xor_si128(B1, C1));                               \
+	} while (0)
+
+#define DIAGONALIZE_SSE2(A0, B0, C0, D0, A1, B1, C1, D1)                       \
+	do {                                                                       \
+		__m128i t0 = D0;                                                       \
+		__m128i t1 = B0;                                                       \
+		D0 = C0;                                                               \
+		C0 = C1;                                                               \
+		C1 = D0;                                                               \
+		D0 = _mm_unpackhi_epi64(D1, _mm_unpacklo_epi64(t0, t0));               \
+		D1 = _mm_unpackhi_epi64(t0, _mm_unpacklo_epi64(D1, D1));               \
+		B0 = _mm_unpackhi_epi64(B0, _mm_unpacklo_epi64(B1, B1));               \
+		B1 = _mm_unpackhi_epi64(B1, _mm_unpacklo_epi64(t1, t1));               \
+	} while (0)
+
+#define UNDIAGONALIZE_SSE2(A0, B0, C0, D0, A1, B1, C1, D1)                     \
+	do {                                                                       \
+		__m128i t0 = C0;                                                       \
+		C0 = C1;                                                               \
+		C1 = t0;                                                               \
+		t0 = B0;                                                               \
+		__m128i t1 = D0;                                                       \
+		B0 = _mm_unpackhi_epi64(B1, _mm_unpacklo_epi64(B0, B0));               \
+		B1 = _mm_unpackhi_epi64(t0, _mm_unpacklo_epi64(B1, B1));               \
+		D0 = _mm_unpackhi_epi64(D0, _mm_unpacklo_epi64(D1, D1));               \
+		D1 = _mm_unpackhi_epi64(D1, _mm_unpacklo_epi64(t1, t1));               \
+	} while (0)
+
+// The permutation P from section 3.6 of RFC 9106, applied to the 16 words in
+// A0 to D1.
+#define PERMUTE_SSE2(A0, A1, B0, B1, C0, C1, D0, D1)                           \
+	do {                                                                       \
+		G1_SSE2(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+		G2_SSE2(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+		DIAGONALIZE_SSE2(A0, B0, C0, D0, A1, B1, C1, D1);                      \
+		G1_SSE2(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+		G2_SSE2(A0, B0, C0, D0, A1, B1, C1, D1);                               \
+		UNDIAGONALIZE_SSE2(A0, B0, C0, D0, A1, B1, C1, D1);                    \
+	} while (0)
+
+// The compression function G from section 3.5 of RFC 9106. If with_xor is set,
+// the result is XORed into next_block rather than overwriting it (as required
+// for every pass after the first).
+static void fill_block_default(const argon2_block_t *prev_block,
+                               const argon2_block_t *ref_block,
+                               argon2_block_t *next_block, bool with_xor) {
+	// NOLINTBEGIN(readability-magic-numbers)
+	__m128i state[ARGON2_QWORDS_IN_BLOCK / 2];
+	__m128i block_xy[ARGON2_QWORDS_IN_BLOCK / 2];
+
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK / 2; i++) {
+		state[i] = _mm_xor_si128(
+		    _mm_loadu_si128((const __m128i *)&prev_block->v[2 * i]),
+		    _mm_loadu_si128((const __m128i *)&ref_block->v[2 * i]));
+		block_xy[i] = state[i];
+		if (with_xor) {
+			block_xy[i] = _mm_xor_si128(
+			    block_xy[i],
+			    _mm_loadu_si128((const __m128i *)&next_block->v[2 * i]));
+		}
+	}
+
+	// Apply P to each row of the 8x8 matrix of 16 byte registers...
+	for (size_t i = 0; i < 8; i++) {
+		PERMUTE_SSE2(state[8 * i + 0], state[8 * i + 1], state[8 * i + 2],
+		             state[8 * i + 3], state[8 * i + 4], state[8 * i + 5],
+		             state[8 * i + 6], state[8 * i + 7]);
+	}
+
+	// ... and then to each column
+	for (size_t i = 0; i < 8; i++) {
+		PERMUTE_SSE2(state[8 * 0 + i], state[8 * 1 + i], state[8 * 2 + i],
+		             state[8 * 3 + i], state[8 * 4 + i], state[8 * 5 + i],
+		             state[8 * 6 + i], state[8 * 7 + i]);
+	}
+
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK / 2; i++) {
+		_mm_storeu_si128((__m128i *)&next_block->v[2 * i],
+		                 _mm_xor_si128(state[i], block_xy[i]));
+	}
+	// NOLINTEND(readability-magic-numbers)
+}
+
+#else
+
+static uint64_t rotr64(uint64_t w, unsigned int c) {
+	return (w >> c) | (w << (64 - c));
+}
+
+static uint64_t f_bla_mka(uint64_t x, uint64_t y) {
+	const uint64_t m = UINT64_C(0xFFFFFFFF);
+	return x + y + 2 * ((x & m) * (y & m));
+}
+
+static inline void g(uint64_t *a, uint64_t *b, uint64_t *c, uint64_t *d) {
+	// NOLINTBEGIN(readability-magic-numbers)
+	*a = f_bla_mka(*a, *b);
+	*d = rotr64(*d ^ *a, 32);
+	*c = f_bla_mka(*c, *d);
+	*b = rotr64(*b ^ *c, 24);
+	*a = f_bla_mka(*a, *b);
+	*d = rotr64(*d ^ *a, 16);
+	*c = f_bla_mka(*c, *d);
+	*b = rotr64(*b ^ *c, 63);
+	// NOLINTEND(readability-magic-numbers)
+}
+
+// The permutation P from section 3.6 of RFC 9106, applied to 16 words.
+static inline void permute(uint64_t w[16]) {
+	// NOLINTBEGIN(readability-magic-numbers)
+	g(&w[0], &w[4], &w[8], &w[12]);
+	g(&w[1], &w[5], &w[9], &w[13]);
+	g(&w[2], &w[6], &w[10], &w[14]);
+	g(&w[3], &w[7], &w[11], &w[15]);
+	g(&w[0], &w[5], &w[10], &w[15]);
+	g(&w[1], &w[6], &w[11], &w[12]);
+	g(&w[2], &w[7], &w[8], &w[13]);
+	g(&w[3], &w[4], &w[9], &w[14]);
+	// NOLINTEND(readability-magic-numbers)
+}
+
+// The compression function G from section 3.5 of RFC 9106. If with_xor is set,
+// the result is XORed into next_block rather than overwriting it (as required
+// for every pass after the first).
+static void fill_block_default(const argon2_block_t *prev_block,
+                               const argon2_block_t *ref_block,
+                               argon2_block_t *next_block, bool with_xor) {
+	// NOLINTBEGIN(readability-magic-numbers)
+	argon2_block_t r;
+	argon2_block_t tmp;
+
+	memcpy(&r, ref_block, sizeof(r));
+	xor_block(&r, prev_block);
+	memcpy(&tmp, &r, sizeof(tmp));
+	if (with_xor) {
+		xor_block(&tmp, next_block);
+	}
+
+	// Apply P to each row of the 8x8 matrix of 16 byte registers...
+	for (size_t i = 0; i < 8; i++) {
+		permute(&r.v[16 * i]);
+	}
+
+	// ... and then to each column, which we gather into (and scatter back
+	// from) a contiguous copy, so the word indices are all constant.
+	for (size_t i = 0; i < 8; i++) {
+		uint64_t column[16];
+		for (size_t j = 0; j < 8; j++) {
+			column[2 * j] = r.v[(2 * i) + (16 * j)];
+			column[(2 * j) + 1] = r.v[(2 * i) + (16 * j) + 1];
+		}
+		permute(column);
+		for (size_t j = 0; j < 8; j++) {
+			r.v[(2 * i) + (16 * j)] = column[2 * j];
+			r.v[(2 * i) + (16 * j) + 1] = column[(2 * j) + 1];
+		}
+	}
+
+	memcpy(next_block, &tmp, sizeof(tmp));
+	xor_block(next_block, &r);
+	// NOLINTEND(readability-magic-numbers)
+}
+
+#endif // ARGON2_HAVE_SSE2
+
+#ifdef ARGON2_HAVE_AVX2
+
+// AVX2 keeps four words in each register, so a whole row of the block fits in
+// four registers. This is chosen at runtime, because we can't assume every
+// x86-64 processor has AVX2.
+
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+static inline AVX2_FUNCTION __m256i f_bla_mka_avx2(__m256i x, __m256i y) {
+	const __m256i z = _mm256_mul_epu32(x, y);
+	return _mm256_add_epi64(_mm256_add_epi64(x, y), _mm256_add_epi64(z, z));
+}
+
+// NOLINTBEGIN(readability-magic-numbers)
+#define ROTR32_AVX2(x) _mm256_shuffle_epi32((x), _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24_AVX2(x)                                                         \
+	_mm256_shuffle_epi8((x), _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12,  \
+	                                          13, 14, 15, 8, 9, 10, 3, 4, 5,   \
+	                                          6, 7, 0, 1, 2, 11, 12, 13, 14,   \
+	                                          15, 8, 9, 10))
+#define ROTR16_AVX2(x)                                                         \
+	_mm256_shuffle_epi8((x), _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11,  \
+	                                          12, 13, 14, 15, 8, 9, 2, 3, 4,   \
+	                                          5, 6, 7, 0, 1, 10, 11, 12, 13,   \
+	                                          14, 15, 8, 9))
+#define ROTR63_AVX2(x)                                                         \
+	_mm256_xor_si256(_mm256_srli_epi64((x), 63), _mm256_add_epi64((x), (x)))
+// NOLINTEND(readability-magic-numbers)
+
+// Four applications of the function G from section 3.6 of RFC 9106, one in
+// each 64 bit lane of A, B, C and D.
+#define G_AVX2(A, B, C, D)                                                     \
+	do {                                                                       \
+		A = f_bla_mka_avx2(A, B);                                              \
+		D = ROTR32_AVX2(_mm256_xor_si256(D, A));                               \
+		C = f_bla_mka_avx2(C, D);                                              \
+		B = ROTR24_AVX2(_mm256_xor_si256(B, C));                               \
+		A = f_bla_mka_avx2(A, B);                                              \
+		D = ROTR16_AVX2(_mm256_xor_si256(D, A));                               \
+		C = f_bla_mka_avx2(C, D);                                              \
+		B = ROTR63_AVX2(_mm256_xor_si256(B, C));                               \
+	} while (0)
+
+// The permutation P applied to a row of the block (16 contiguous words), by
+// rotating the lanes of B, C and D to move the diagonals into columns.
+#define PERMUTE_ROW_AVX2(A, B, C, D)                                           \
+	do {                                                                       \
+		G_AVX2(A, B, C, D);                                                    \
+		B = _mm256_permute4x64_epi64(B, _MM_SHUFFLE(0, 3, 2, 1));              \
+		C = _mm256_permute4x64_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));              \
+		D = _mm256_permute4x64_epi64(D, _MM_SHUFFLE(2, 1, 0, 3));              \
+		G_AVX2(A, B, C, D);                                                    \
+		B = _mm256_permute4x64_epi64(B, _MM_SHUFFLE(2, 1, 0, 3));              \
+		C = _mm256_permute4x64_epi64(C, _MM_SHUFFLE(1, 0, 3, 2));              \
+		D = _mm256_permute4x64_epi64(D, _MM_SHUFFLE(0, 3, 2, 1));              \
+	} while (0)
+
+// The permutation P applied to two adjacent columns of the block at once. Xn
+// holds the two columns' words from row n, so the diagonals are made by
+// swapping words between the registers of adjacent rows.
+#define PERMUTE_COLUMNS_AVX2(X0, X1, X2, X3, X4, X5, X6, X7)                   \
+	do {                                                                       \
+		__m256i t0;                                                            \
+		__m256i t1;                                                            \
+		G_AVX2(X0, X2, X4, X6);                                                \
+		G_AVX2(X1, X3, X5, X7);                                                \
+		t0 = _mm256_blend_epi32(X2, X3, 0xCC);                                 \
+		t1 = _mm256_blend_epi32(X2, X3, 0x33);                                 \
+		X3 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+		X2 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+		t0 = X4;                                                               \
+		X4 = X5;                                                               \
+		X5 = t0;                                                               \
+		t0 = _mm256_blend_epi32(X6, X7, 0xCC);                                 \
+		t1 = _mm256_blend_epi32(X6, X7, 0x33);                                 \
+		X6 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+		X7 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+		G_AVX2(X0, X2, X4, X6);                                                \
+		G_AVX2(X1, X3, X5, X7);                                                \
+		t0 = _mm256_blend_epi32(X2, X3, 0xCC);                                 \
+		t1 = _mm256_blend_epi32(X2, X3, 0x33);                                 \
+		X2 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+		X3 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+		t0 = X4;                                                               \
+		X4 = X5;                                                               \
+		X5 = t0;                                                               \
+		t0 = _mm256_blend_epi32(X6, X7, 0x33);                                 \
+		t1 = _mm256_blend_epi32(X6, X7, 0xCC);                                 \
+		X6 = _mm256_permute4x64_epi64(t0, _MM_SHUFFLE(2, 3, 0, 1));            \
+		X7 = _mm256_permute4x64_epi64(t1, _MM_SHUFFLE(2, 3, 0, 1));            \
+	} while (0)
+
+static AVX2_FUNCTION void fill_block_avx2(const argon2_block_t *prev_block,
+                                          const argon2_block_t *ref_block,
+                                          argon2_block_t *next_block,
+                                          bool with_xor) {
+	// NOLINTBEGIN(readability-magic-numbers)
+	__m256i state[ARGON2_QWORDS_IN_BLOCK / 4];
+	__m256i block_xy[ARGON2_QWORDS_IN_BLOCK / 4];
+
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK / 4; i++) {
+		state[i] = _mm256_xor_si256(
+		    _mm256_loadu_si256((const __m256i *)&prev_block->v[4 * i]),
+		    _mm256_loadu_si256((const __m256i *)&ref_block->v[4 * i]));
+		block_xy[i] = state[i];
+		if (with_xor) {
+			block_xy[i] = _mm256_xor_si256(
+			    block_xy[i],
+			    _mm256_loadu_si256((const __m256i *)&next_block->v[4 * i]));
+		}
+	}
+
+	for (size_t i = 0; i < 8; i++) {
+		PERMUTE_ROW_AVX2(state[4 * i + 0], state[4 * i + 1], state[4 * i + 2],
+		                 state[4 * i + 3]);
+	}
+
+	for (size_t i = 0; i < 4; i++) {
+		PERMUTE_COLUMNS_AVX2(state[0 + i], state[4 + i], state[8 + i],
+		                     state[12 + i], state[16 + i], state[20 + i],
+		                     state[24 + i], state[28 + i]);
+	}
+
+	for (size_t i = 0; i < ARGON2_QWORDS_IN_BLOCK / 4; i++) {
+		_mm256_storeu_si256((__m256i *)&next_block->v[4 * i],
+		                    _mm256_xor_si256(state[i], block_xy[i]));
+	}
+	// NOLINTEND(readability-magic-numbers)
+}
+
+#endif // ARGON2_HAVE_AVX2
+
+static argon2_fill_block_t choose_fill_block(void) {
+#ifdef ARGON2_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return fill_block_avx2;
+	}
+#endif
+	return fill_block_default;
+}
+
+static void next_addresses(const argon2_instance_t *instance,
+                           argon2_block_t *address_block,
+                           argon2_block_t *input_block,
+                           const argon2_block_t *zero_block) {
+	input_block->v[6]++;
+	instance->fill_block(zero_block, input_block, address_block, false);
+	instance->fill_block(zero_block, address_block, address_block, false);
+}
+
+// Maps a pseudo-random value to the index of the reference block within its
+// lane, as described in section 3.4 of RFC 9106.
+static uint32_t index_alpha(const argon2_instance_t *instance,
+                            const argon2_position_t *position,
+                            uint32_t pseudo_rand, bool same_lane) {
+	uint32_t reference_area_size;
+
+	if (position->pass == 0) {
+		if (position->slice == 0) {
+			reference_area_size = position->index - 1;
+		} else if (same_lane) {
+			reference_area_size = (position->slice * instance->segment_length) +
+			                      position->index - 1;
+		} else {
+			reference_area_size = (position->slice * instance->segment_length) +
+			                      (position->index == 0 ? -1 : 0);
+		}
+	} else {
+		if (same_lane) {
+			reference_area_size = instance->lane_length -
+			                      instance->segment_length + position->index -
+			                      1;
+		} else {
+			reference_area_size =
+			    instance->lane_length - instance->segment_length +
+			    (position->index == 0 ? -1 : 0);
+		}
+	}
+
+	uint64_t relative_position = pseudo_rand;
+	relative_position = (relative_position * relative_position) >> 32;
+	relative_position = reference_area_size - 1 -
+	                    ((reference_area_size * relative_position) >> 32);
+
+	uint64_t start_position = 0;
+	if (position->pass != 0 && position->slice != ARGON2_SYNC_POINTS - 1) {
+		start_position =
+		    (uint64_t)(position->slice + 1) * instance->segment_length;
+	}
+
+	return (uint32_t)((start_position + relative_position) %
+	                  instance->lane_length);
+}
+
+static bool is_cancelled(const argon2_instance_t *instance) {
+	return instance->cancelled != NULL &&
+	       atomic_load_explicit(instance->cancelled, memory_order_relaxed);
+}
+
+static void fill_segment(const argon2_instance_t *instance,
+                         argon2_position_t position) {
+	argon2_block_t address_block;
+	argon2_block_t input_block;
+	argon2_block_t zero_block;
+	bool data_independent_addressing =
+	    instance->type == ARGON2_TYPE_I ||
+	    (instance->type == ARGON2_TYPE_ID && position.pass == 0 &&
+	     position.slice < ARGON2_SYNC_POINTS / 2);
+
+	if (data_independent_addressing) {
+		memset(&zero_block, 0, sizeof(zero_block));
+		memset(&input_block, 0, sizeof(input_block));
+		input_block.v[0] = position.pass;
+		input_block.v[1] = position.lane;
+		input_block.v[2] = position.slice;
+		input_block.v[3] = instance->memory_blocks;
+		input_block.v[4] = instance->passes;
+		input_block.v[5] = (uint64_t)instance->type;
+	}
+
+	uint32_t starting_index = 0;
+	if (position.pass == 0 && position.slice == 0) {
+		// The first two blocks of each lane are filled by fill_first_blocks()
+		starting_index = 2;
+		if (data_independent_addressing) {
+			next_addresses(instance, &address_block, &input_block,
+			               &zero_block);
+		}
+	}
+
+	uint32_t current_offset = (position.lane * instance->lane_length) +
+	                          (position.slice * instance->segment_length) +
+	                          starting_index;
+	uint32_t previous_offset = current_offset % instance->lane_length == 0
+	                               ? current_offset + instance->lane_length - 1
+	                               : current_offset - 1;
+
+	for (uint32_t i = starting_index; i < instance->segment_length;
+	     i++, current_offset++, previous_offset++) {
+		if (i % ARGON2_BLOCKS_BETWEEN_CANCELLATION_CHECKS == 0 &&
+		    is_cancelled(instance)) {
+			break;
+		}
+		if (current_offset % instance->lane_length == 1) {
+			previous_offset = current_offset - 1;
+		}
+
+		uint64_t pseudo_rand;
+		if (data_independent_addressing) {
+			if (i % ARGON2_ADDRESSES_IN_BLOCK == 0) {
+				next_addresses(instance, &address_block, &input_block,
+			               &zero_block);
+			}
+			pseudo_rand = address_block.v[i % ARGON2_ADDRESSES_IN_BLOCK];
+		} else {
+			pseudo_rand = instance->memory[previous_offset].v[0];
+		}
+
+		uint32_t ref_lane = (uint32_t)((pseudo_rand >> 32) % instance->lanes);
+		if (position.pass == 0 && position.slice == 0) {
+			ref_lane = position.lane;
+		}
+
+		position.index = i;
+		uint32_t ref_index =
+		    index_alpha(instance, &position, (uint32_t)pseudo_rand,
+		                ref_lane == position.lane);
+
+		const argon2_block_t *ref_block =
+		    &instance->memory[((size_t)instance->lane_length * ref_lane) +
+		                      ref_index];
+		instance->fill_block(&instance->memory[previous_offset], ref_block,
+		                     &instance->memory[current_offset],
+		                     position.pass != 0);
+	}
+
+	if (data_independent_addressing) {
+		sodium_memzero(&address_block, sizeof(address_block));
+		sodium_memzero(&input_block, sizeof(input_block));
+	}
+}
+
+static void *fill_segment_thread(void *arg) {
+	argon2_segment_job_t *job = arg;
+	fill_segment(job->instance, job->position);
+	return NULL;
+}
+
+// Each slice is a synchronization point: every lane's segment in a slice may
+// only reference blocks from other lanes in earlier slices, so the segments
+// of one slice can be filled concurrently, one thread per lane.
+static int fill_memory_blocks(argon2_instance_t *instance) {
+	if (instance->lanes == 1) {
+		for (uint32_t pass = 0; pass < instance->passes; pass++) {
+			for (uint32_t slice = 0; slice < ARGON2_SYNC_POINTS; slice++) {
+				fill_segment(instance, (argon2_position_t){pass, 0, slice, 0});
+			}
+		}
+		return is_cancelled(instance) ? -1 : 0;
+	}
+
+	pthread_t *threads = calloc(instance->lanes, sizeof(pthread_t));
+	argon2_segment_job_t *jobs =
+	    calloc(instance->lanes, sizeof(argon2_segment_job_t));
+	int r = 0;
+
+	if (threads == NULL || jobs == NULL) {
+		r = -1;
+		goto cleanup;
+	}
+
+	for (uint32_t pass = 0; pass < instance->passes && r == 0; pass++) {
+		for (uint32_t slice = 0; slice < ARGON2_SYNC_POINTS && r == 0;
+		     slice++) {
+			uint32_t started = 0;
+			for (uint32_t lane = 0; lane < instance->lanes; lane++) {
+				jobs[lane].instance = instance;
+				jobs[lane].position =
+				    (argon2_position_t){pass, lane, slice, 0};
+				if (pthread_create(&threads[lane], NULL, fill_segment_thread,
+				                   &jobs[lane]) != 0) {
+					r = -1;
+					break;
+				}
+				started++;
+			}
+			for (uint32_t lane = 0; lane < started; lane++) {
+				if (pthread_join(threads[lane], NULL) != 0) {
+					r = -1;
+				}
+			}
+			if (is_cancelled(instance)) {
+				r = -1;
+			}
+		}
+	}
+
+cleanup:
+	free(threads);
+	free(jobs);
+	return r;
+}
+
+static int initial_hash(unsigned char *prehash,
+                        const argon2_instance_t *instance, size_t output_size,
+                        uint32_t m_cost_kib, const char *passphrase,
+                        size_t passphrase_size, const unsigned char *salt,
+                        size_t salt_size, const unsigned char *secret,
+                        size_t secret_size, const unsigned char *ad,
+                        size_t ad_size) {
+	crypto_generichash_blake2b_state state;
+	unsigned char value[4];
+	int r = 0;
+
+	const uint32_t fields_before_passphrase[] = {
+	    instance->lanes,       (uint32_t)output_size, m_cost_kib,
+	    instance->passes,      ARGON2_VERSION_NUMBER, (uint32_t)instance->type,
+	    (uint32_t)passphrase_size,
+	};
+
+	r |= crypto_generichash_blake2b_init(&state, NULL, 0,
+	                                     ARGON2_PREHASH_DIGEST_LENGTH);
+	for (size_t i = 0; i < sizeof(fields_before_passphrase) /
+	                           sizeof(fields_before_passphrase[0]);
+	     i++) {
+		store32(value, fields_before_passphrase[i]);
+		r |= crypto_generichash_blake2b_update(&state, value, sizeof(value));
+	}
+	r |= crypto_generichash_blake2b_update(
+	    &state, (const unsigned char *)passphrase, passphrase_size);
+	store32(value, (uint32_t)salt_size);
+	r |= crypto_generichash_blake2b_update(&state, value, sizeof(value));
+	r |= crypto_generichash_blake2b_update(&state, salt, salt_size);
+	store32(value, (uint32_t)secret_size);
+	r |= crypto_generichash_blake2b_update(&state, value, sizeof(value));
+	r |= crypto_generichash_blake2b_update(&state, secret, secret_size);
+	store32(value, (uint32_t)ad_size);
+	r |= crypto_generichash_blake2b_update(&state, value, sizeof(value));
+	r |= crypto_generichash_blake2b_update(&state, ad, ad_size);
+	r |= crypto_generichash_blake2b_final(&state, prehash,
+	                                      ARGON2_PREHASH_DIGEST_LENGTH);
+
+	sodium_memzero(&state, sizeof(state));
+	return r == 0 ? 0 : -1;
+}
+
+static int fill_first_blocks(unsigned char *prehash_seed,
+                             const argon2_instance_t *instance) {
+	unsigned char block_bytes[ARGON2_BLOCK_SIZE];
+	int r = 0;
+
+	for (uint32_t lane = 0; lane < instance->lanes && r == 0; lane++) {
+		for (uint32_t column = 0; column < 2 && r == 0; column++) {
+			store32(prehash_seed + ARGON2_PREHASH_DIGEST_LENGTH, column);
+			store32(prehash_seed + ARGON2_PREHASH_DIGEST_LENGTH + 4, lane);
+			r = blake2b_long(block_bytes, ARGON2_BLOCK_SIZE, prehash_seed,
+			                 ARGON2_PREHASH_SEED_LENGTH);
+			load_block(&instance->memory[((size_t)lane *
+			                              instance->lane_length) +
+			                             column],
+			           block_bytes);
+		}
+	}
+
+	sodium_memzero(block_bytes, sizeof(block_bytes));
+	return r;
+}
+
+static int finalize(unsigned char *output, size_t output_size,
+                    const argon2_instance_t *instance) {
+	argon2_block_t final_block;
+	unsigned char final_block_bytes[ARGON2_BLOCK_SIZE];
+
+	memcpy(&final_block, &instance->memory[instance->lane_length - 1],
+	       sizeof(final_block));
+	for (uint32_t lane = 1; lane < instance->lanes; lane++) {
+		xor_block(&final_block,
+		          &instance->memory[((size_t)lane * instance->lane_length) +
+		                            instance->lane_length - 1]);
+	}
+
+	store_block(final_block_bytes, &final_block);
+	int r = blake2b_long(output, output_size, final_block_bytes,
+	                     ARGON2_BLOCK_SIZE);
+
+	sodium_memzero(&final_block, sizeof(final_block));
+	sodium_memzero(final_block_bytes, sizeof(final_block_bytes));
+	return r;
+}
+
+const char *argon2_memory_backing_name(argon2_memory_backing_t backing) {
+	switch (backing) {
+	case ARGON2_MEMORY_BACKING_HUGETLB:
+		return "explicit huge pages";
+	case ARGON2_MEMORY_BACKING_TRANSPARENT_HUGE_PAGES:
+		return "transparent huge pages";
+	case ARGON2_MEMORY_BACKING_NORMAL_PAGES:
+		return "normal pages";
+	}
+	return "unknown";
+}
+
+static size_t round_up_to_multiple(size_t size, size_t multiple) {
+	return ((size + multiple - 1) / multiple) * multiple;
+}
+
+/**
+ * Returns true unless transparent huge pages are disabled outright, in which
+ * case madvise(MADV_HUGEPAGE) succeeds but has no effect.
+ */
+static bool transparent_huge_pages_available(void) {
+	FILE *f = fopen(TRANSPARENT_HUGE_PAGE_ENABLED_PATH, "r");
+	if (f == NULL) {
+		return false;
+	}
+	char line[128];
+	bool result = fgets(line, sizeof(line), f) != NULL &&
+	              strstr(line, "[never]") == NULL;
+	fclose(f);
+	return result;
+}
+
+static uint32_t memory_blocks_for(uint32_t m_cost_kib, uint32_t lanes) {
+	uint32_t segment_length = m_cost_kib / (lanes * ARGON2_SYNC_POINTS);
+	return segment_length * ARGON2_SYNC_POINTS * lanes;
+}
+
+/**
+ * Maps memory for the blocks. Memory is walked at random, so with normal
+ * pages much of the time goes to TLB misses and page faults. We first try
+ * explicit huge pages (which need a pool configured in
+ * /proc/sys/vm/nr_hugepages), then a huge-page-aligned mapping which we ask
+ * the kernel to back with transparent huge pages, and finally settle for
+ * normal pages.
+ */
+argon2_memory_t *argon2_allocate_memory(uint32_t m_cost_kib, uint32_t lanes) {
+	if (lanes < 1 || lanes > ARGON2_MAX_LANES ||
+	    m_cost_kib < 2 * ARGON2_SYNC_POINTS * lanes) {
+		return NULL;
+	}
+
+	argon2_memory_t *memory = malloc(sizeof(argon2_memory_t));
+	if (memory == NULL) {
+		return NULL;
+	}
+	memory->size =
+	    (size_t)memory_blocks_for(m_cost_kib, lanes) * sizeof(argon2_block_t);
+	memory->mapping_size =
+	    round_up_to_multiple(memory->size, ARGON2_HUGE_PAGE_SIZE);
+
+	void *mapping = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	mapping = mmap(NULL, memory->mapping_size, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mapping != MAP_FAILED) {
+		memory->mapping = mapping;
+		memory->backing = ARGON2_MEMORY_BACKING_HUGETLB;
+		goto allocated;
+	}
+#endif
+
+	// Over-allocate so that we can align the blocks to a huge page boundary,
+	// then return the unaligned ends to the kernel.
+	mapping = mmap(NULL, memory->mapping_size + ARGON2_HUGE_PAGE_SIZE,
+	               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		free(memory);
+		return NULL;
+	}
+	uintptr_t start = (uintptr_t)mapping;
+	uintptr_t aligned_start =
+	    round_up_to_multiple(start, ARGON2_HUGE_PAGE_SIZE);
+	if (aligned_start > start) {
+		munmap(mapping, aligned_start - start);
+	}
+	munmap((void *)(aligned_start + memory->mapping_size),
+	       start + ARGON2_HUGE_PAGE_SIZE - aligned_start);
+
+	memory->mapping = (void *)aligned_start;
+	memory->backing = ARGON2_MEMORY_BACKING_NORMAL_PAGES;
+
+#ifdef MADV_HUGEPAGE
+	if (madvise(memory->mapping, memory->mapping_size, MADV_HUGEPAGE) == 0 &&
+	    transparent_huge_pages_available()) {
+		memory->backing = ARGON2_MEMORY_BACKING_TRANSPARENT_HUGE_PAGES;
+	}
+#endif
+
+allocated:
+#ifdef MADV_DONTDUMP
+	// The blocks are derived from the passphrase, so keep them out of core
+	// dumps like everything else secret. This is best effort.
+	madvise(memory->mapping, memory->mapping_size, MADV_DONTDUMP);
+#endif
+	memory->blocks = memory->mapping;
+	return memory;
+}
+
+void argon2_prefault_memory(argon2_memory_t *memory) {
+	long page_size = sysconf(_SC_PAGE_SIZE);
+	if (page_size <= 0) {
+		page_size = 4096; // NOLINT(readability-magic-numbers)
+	}
+	volatile unsigned char *bytes = memory->mapping;
+	for (size_t i = 0; i < memory->mapping_size; i += (size_t)page_size) {
+		bytes[i] = 0;
+	}
+}
+
+argon2_memory_backing_t argon2_memory_backing(const argon2_memory_t *memory) {
+	return memory->backing;
+}
+
+void argon2_free_memory(argon2_memory_t *memory) {
+	if (memory == NULL) {
+		return;
+	}
+	sodium_memzero(memory->mapping, memory->mapping_size);
+	munmap(memory->mapping, memory->mapping_size);
+	free(memory);
+}
+
+static bool argon2_parameters_valid(size_t output_size, size_t passphrase_size,
+                                    size_t salt_size, uint32_t t_cost,
+                                    uint32_t m_cost_kib, uint32_t lanes,
+                                    int type) {
+	return (type == ARGON2_TYPE_I || type == ARGON2_TYPE_ID) && lanes >= 1 &&
+	       lanes <= ARGON2_MAX_LANES && t_cost >= 1 &&
+	       m_cost_kib >= 2 * ARGON2_SYNC_POINTS * lanes &&
+	       output_size >= ARGON2_MIN_OUTPUT_SIZE && output_size <= UINT32_MAX &&
+	       passphrase_size <= UINT32_MAX && salt_size <= UINT32_MAX;
+}
+
+int argon2_hash_in_memory(unsigned char *output, size_t output_size,
+                          const char *passphrase, size_t passphrase_size,
+                          const unsigned char *salt, size_t salt_size,
+                          uint32_t t_cost, uint32_t m_cost_kib, uint32_t lanes,
+                          int type, argon2_memory_t *memory) {
+	return argon2_hash_in_memory_cancellable(
+	    output, output_size, passphrase, passphrase_size, salt, salt_size,
+	    t_cost, m_cost_kib, lanes, type, memory, NULL);
+}
+
+/**
+ * As argon2_hash_in_memory_cancellable(), but also with a secret key (K) and
+ * associated data (X), which khefin doesn't use: they are here so that the
+ * known-answer tests can check against the test vectors in RFC 9106, which
+ * have both.
+ */
+static int hash_in_memory_with_secret_and_ad(
+    unsigned char *output, size_t output_size, const char *passphrase,
+    size_t passphrase_size, const unsigned char *salt, size_t salt_size,
+    const unsigned char *secret, size_t secret_size, const unsigned char *ad,
+    size_t ad_size, uint32_t t_cost, uint32_t m_cost_kib, uint32_t lanes,
+    int type, argon2_memory_t *memory, const atomic_bool *cancelled) {
+	if (!argon2_parameters_valid(output_size, passphrase_size, salt_size,
+	                             t_cost, m_cost_kib, lanes, type) ||
+	    secret_size > UINT32_MAX || ad_size > UINT32_MAX ||
+	    memory->size != (size_t)memory_blocks_for(m_cost_kib, lanes) *
+	                        sizeof(argon2_block_t)) {
+		return -1;
+	}
+
+	argon2_instance_t instance;
+	instance.memory = memory->blocks;
+	instance.passes = t_cost;
+	instance.lanes = lanes;
+	instance.type = type;
+	instance.fill_block = choose_fill_block();
+	instance.cancelled = cancelled;
+	instance.segment_length = m_cost_kib / (lanes * ARGON2_SYNC_POINTS);
+	instance.lane_length = instance.segment_length * ARGON2_SYNC_POINTS;
+	instance.memory_blocks = instance.lane_length * lanes;
+
+	unsigned char prehash_seed[ARGON2_PREHASH_SEED_LENGTH];
+	int r = initial_hash(prehash_seed, &instance, output_size, m_cost_kib,
+	                     passphrase, passphrase_size, salt, salt_size, secret,
+	                     secret_size, ad, ad_size);
+	if (r == 0) {
+		r = fill_first_blocks(prehash_seed, &instance);
+	}
+	sodium_memzero(prehash_seed, sizeof(prehash_seed));
+
+	if (r == 0) {
+		r = fill_memory_blocks(&instance);
+	}
+	if (r == 0) {
+		r = finalize(output, output_size, &instance);
+	}
+
+	return r;
+}
+
+int argon2_hash_in_memory_cancellable(
+    unsigned char *output, size_t output_size, const char *passphrase,
+    size_t passphrase_size, const unsigned char *salt, size_t salt_size,
+    uint32_t t_cost, uint32_t m_cost_kib, uint32_t lanes, int type,
+    argon2_memory_t *memory, const atomic_bool *cancelled) {
+	return hash_in_memory_with_secret_and_ad(
+	    output, output_size, passphrase, passphrase_size, salt, salt_size,
+	    NULL, 0, NULL, 0, t_cost, m_cost_kib, lanes, type, memory, cancelled);
+}
+
+int argon2_hash(unsigned char *output, size_t output_size,
+                const char *passphrase, size_t passphrase_size,
+                const unsigned char *salt, size_t salt_size, uint32_t t_cost,
+                uint32_t m_cost_kib, uint32_t lanes, int type,
+                argon2_memory_backing_t *memory_backing) {
+	if (!argon2_parameters_valid(output_size, passphrase_size, salt_size,
+	                             t_cost, m_cost_kib, lanes, type)) {
+		return -1;
+	}
+
+	argon2_memory_t *memory = argon2_allocate_memory(m_cost_kib, lanes);
+	if (memory == NULL) {
+		return -1;
+	}
+	if (memory_backing != NULL) {
+		*memory_backing = memory->backing;
+	}
+
+	int r = argon2_hash_in_memory(output, output_size, passphrase,
+	                              passphrase_size, salt, salt_size, t_cost,
+	                              m_cost_kib, lanes, type, memory);
+
+	argon2_free_memory(memory);
+	return r;
+}
@@ -1,9 +1,13 @@
 #include "authenticator.h"
 
+#include <errno.h>
 #include <fido.h>
+#include <pthread.h>
 #include <sodium.h>
 #include <string.h>
+#include <time.h>
 
+#include "device_cache.h"
 #include "exit.h"
 #include "memory.h"
 #include "serialization.h"
@@ -139,13 +143,339 @@ void close_and_free_device(fido_dev_t *device) {
 	fido_dev_free(&device);
 }
 
+void get_device_facts(fido_dev_t *device, fido_cbor_info_t *device_info,
+                      device_facts_t *facts) {
+	facts->fido2 = fido_dev_is_fido2(device);
+	facts->supports_hmac_secret = false;
+	facts->aaguid_size = 0;
+	if (!facts->fido2) {
+		return;
+	}
+	facts->supports_hmac_secret = device_supports_hmac_secret(device_info);
+	facts->aaguid_size = fido_cbor_info_aaguid_len(device_info);
+	if (facts->aaguid_size > DEVICE_AAGUID_MAX_SIZE) {
+		facts->aaguid_size = DEVICE_AAGUID_MAX_SIZE;
+	}
+	memcpy(facts->aaguid, fido_cbor_info_aaguid_ptr(device_info),
+	       facts->aaguid_size);
+}
+
+typedef struct device_probes_t device_probes_t;
+
+typedef struct device_probe_t {
+	device_probes_t *probes;
+	char *path;
+	// Whether facts came from the cache, so need not be fetched
+	bool facts_cached;
+	// Whether the device was ruled out from the devices list, so never probed
+	bool not_wanted;
+	device_facts_t facts;
+	fido_dev_t *device;
+	int result;
+	// Whether a thread was started for it, which must be joined
+	bool started;
+	pthread_t thread;
+	bool finished;
+} device_probe_t;
+
+/**
+ * Shared between probe_devices() and the probe threads, which it joins before
+ * freeing this.
+ */
+struct device_probes_t {
+	pthread_mutex_t lock;
+	pthread_cond_t probe_finished_condition;
+	// When probe_devices() stops waiting, which also bounds each probe's
+	// requests to its device, so that it can be joined soon after
+	struct timespec deadline;
+	size_t finished_count;
+	size_t count;
+	device_probe_t *list;
+};
+
+static void free_device_probes(device_probes_t *probes) {
+	for (size_t i = 0; i < probes->count; i++) {
+		free(probes->list[i].path);
+	}
+	free(probes->list);
+	pthread_cond_destroy(&probes->probe_finished_condition);
+	pthread_mutex_destroy(&probes->lock);
+	free(probes);
+}
+
+/**
+ * Returns the number of milliseconds until deadline (on CLOCK_MONOTONIC), or 0
+ * if it has passed.
+ */
+static int milliseconds_until(const struct timespec *deadline) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long milliseconds =
+	    (long long)(deadline->tv_sec - now.tv_sec) * 1000 +
+	    (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return milliseconds > 0 ? (int)milliseconds : 0;
+}
+
+static void *probe_device_on_worker_thread(void *arg) {
+	device_probe_t *probe = (device_probe_t *)arg;
+	device_probes_t *probes = probe->probes;
+	fido_dev_t *device = fido_dev_new();
+	device_facts_t facts = probe->facts;
+	bool facts_cached = probe->facts_cached;
+	int r = FIDO_ERR_INTERNAL;
+
+	// libfido2 takes the timeout when each request starts, so it is set
+	// afresh before each, to what is left until the deadline
+	if (device != NULL &&
+	    ((r = fido_dev_set_timeout(
+	          device, milliseconds_until(&probes->deadline))) != FIDO_OK ||
+	     (r = fido_dev_open(device, probe->path)) != FIDO_OK)) {
+		fido_dev_free(&device);
+	}
+	// If the device is not what the cache said, find out afresh
+	if (device != NULL && facts_cached &&
+	    fido_dev_is_fido2(device) != facts.fido2) {
+		facts_cached = false;
+	}
+	if (device != NULL && !facts_cached) {
+		fido_cbor_info_t *info = NULL;
+		if (fido_dev_is_fido2(device)) {
+			if ((info = fido_cbor_info_new()) == NULL) {
+				r = FIDO_ERR_INTERNAL;
+			} else if ((r = fido_dev_set_timeout(
+			                device, milliseconds_until(&probes->deadline))) ==
+			           FIDO_OK) {
+				r = fido_dev_get_cbor_info(device, info);
+			}
+		}
+		if (r == FIDO_OK) {
+			get_device_facts(device, info, &facts);
+		} else {
+			fido_dev_close(device);
+			fido_dev_free(&device);
+		}
+		free_device_info(info);
+	}
+	// Whoever takes the device waits for a touch for as long as it takes
+	if (device != NULL) {
+		fido_dev_set_timeout(device, -1);
+	}
+
+	pthread_mutex_lock(&probes->lock);
+	probe->device = device;
+	probe->facts = facts;
+	probe->facts_cached = facts_cached;
+	probe->result = r;
+	probe->finished = true;
+	probes->finished_count++;
+	pthread_cond_signal(&probes->probe_finished_condition);
+	pthread_mutex_unlock(&probes->lock);
+	return NULL;
+}
+
+/**
+ * Starts a thread to probe each device in devices_list, other than those which
+ * are not wanted (judging by the devices list, or by their cached facts), which
+ * are marked as finished. If a thread cannot be started, that device and those
+ * after it are marked as finished and failed, rather than exiting while the
+ * threads already started need the lock.
+ */
+static device_probes_t *start_probing_devices(devices_list_t *devices_list,
+                                              device_cache_t *cache,
+                                              device_wanted_t wanted,
+                                              void *context) {
+	device_probes_t *probes =
+	    malloc_or_exit(sizeof(device_probes_t), "device probes");
+	pthread_condattr_t condition_attributes;
+	if (pthread_mutex_init(&probes->lock, NULL) != 0 ||
+	    pthread_condattr_init(&condition_attributes) != 0 ||
+	    pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC) !=
+	        0 ||
+	    pthread_cond_init(&probes->probe_finished_condition,
+	                      &condition_attributes) != 0) {
+		errx(EXIT_OUT_OF_MEMORY, "Unable to initialize device probe lock");
+	}
+	pthread_condattr_destroy(&condition_attributes);
+	probes->count = devices_list->count;
+	probes->finished_count = 0;
+	probes->list = malloc_or_exit(sizeof(device_probe_t) * probes->count,
+	                              "device probes list");
+
+	for (size_t i = 0; i < probes->count; i++) {
+		const fido_dev_info_t *di = fido_dev_info_ptr(devices_list->list, i);
+		device_probe_t *probe = &probes->list[i];
+		probe->probes = probes;
+		probe->path = strdup_or_exit(fido_dev_info_path(di), "device path");
+		probe->not_wanted = wanted != NULL && !wanted(di, NULL, context);
+		probe->facts_cached =
+		    !probe->not_wanted &&
+		    get_cached_device_facts(cache, di, &probe->facts);
+		probe->device = NULL;
+		probe->result = FIDO_ERR_INTERNAL;
+		probe->started = false;
+		probe->finished = false;
+		if (probe->not_wanted ||
+		    (probe->facts_cached &&
+		     (wanted == NULL || !wanted(di, &probe->facts, context)))) {
+			probe->result = FIDO_OK;
+			probe->finished = true;
+			probes->finished_count++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &probes->deadline);
+	probes->deadline.tv_sec += DEVICE_PROBE_TIMEOUT_MS / 1000;
+	probes->deadline.tv_nsec += (DEVICE_PROBE_TIMEOUT_MS % 1000) * 1000000L;
+	if (probes->deadline.tv_nsec >= 1000000000L) {
+		probes->deadline.tv_sec++;
+		probes->deadline.tv_nsec -= 1000000000L;
+	}
+
+	bool unable_to_start = false;
+	pthread_mutex_lock(&probes->lock);
+	for (size_t i = 0; i < probes->count; i++) {
+		device_probe_t *probe = &probes->list[i];
+		if (probe->finished) {
+			continue;
+		}
+		if (unable_to_start ||
+		    pthread_create(&probe->thread, NULL,
+		                   probe_device_on_worker_thread, probe) != 0) {
+			unable_to_start = true;
+			probe->finished = true;
+			probes->finished_count++;
+			continue;
+		}
+		probe->started = true;
+	}
+	pthread_mutex_unlock(&probes->lock);
+
+	return probes;
+}
+
+probed_devices_t *probe_devices(devices_list_t *devices_list,
+                                device_wanted_t wanted, void *context) {
+	probed_devices_t *probed =
+	    malloc_or_exit(sizeof(probed_devices_t), "probed devices");
+	probed->count = devices_list->count;
+	probed->list = malloc_or_exit(
+	    sizeof(probed_device_t) * (probed->count > 0 ? probed->count : 1),
+	    "probed devices list");
+	if (probed->count == 0) {
+		return probed;
+	}
+
+	device_cache_t *cache = load_device_cache();
+	// Which facts were fetched afresh, to be cached once the probes are
+	// unlocked (caching allocates, which may fail)
+	bool *facts_fetched = malloc_or_exit(sizeof(bool) * probed->count,
+	                                     "fetched device facts");
+	device_probes_t *probes =
+	    start_probing_devices(devices_list, cache, wanted, context);
+
+	pthread_mutex_lock(&probes->lock);
+	while (probes->finished_count < probes->count) {
+		if (pthread_cond_timedwait(&probes->probe_finished_condition,
+		                           &probes->lock,
+		                           &probes->deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < probed->count; i++) {
+		const fido_dev_info_t *di = fido_dev_info_ptr(devices_list->list, i);
+		device_probe_t *probe = &probes->list[i];
+		probed_device_t *result = &probed->list[i];
+		result->path = fido_dev_info_path(di);
+		result->manufacturer_string = fido_dev_info_manufacturer_string(di);
+		result->product_string = fido_dev_info_product_string(di);
+		result->device = NULL;
+		result->error = FIDO_OK;
+		facts_fetched[i] = false;
+		if (probe->not_wanted) {
+			result->status = device_probe_not_wanted;
+		} else if (!probe->finished) {
+			// Its device is closed once its thread has been joined
+			result->status = device_probe_timed_out;
+		} else if (probe->result != FIDO_OK) {
+			result->status = device_probe_failed;
+			result->error = probe->result;
+		} else {
+			result->status = device_probe_ok;
+			result->facts = probe->facts;
+			facts_fetched[i] = !probe->facts_cached;
+			if (wanted != NULL && wanted(di, &probe->facts, context)) {
+				result->device = probe->device;
+			} else {
+				close_and_free_device_ignoring_errors(probe->device);
+			}
+			probe->device = NULL;
+		}
+	}
+	pthread_mutex_unlock(&probes->lock);
+
+	// The probes still going have until about now for their requests, so
+	// none keeps us long, and none outlives this call (which would leave it
+	// running in unmapped code if we are in a module which is then unloaded)
+	for (size_t i = 0; i < probes->count; i++) {
+		device_probe_t *probe = &probes->list[i];
+		if (probe->started) {
+			pthread_join(probe->thread, NULL);
+		}
+		if (probed->list[i].status == device_probe_timed_out) {
+			close_and_free_device_ignoring_errors(probe->device);
+			probe->device = NULL;
+		}
+	}
+	free_device_probes(probes);
+
+	for (size_t i = 0; i < probed->count; i++) {
+		const fido_dev_info_t *di = fido_dev_info_ptr(devices_list->list, i);
+		if (probed->list[i].status == device_probe_failed) {
+			forget_device_facts(cache, di);
+		} else if (facts_fetched[i]) {
+			cache_device_facts(cache, di, &probed->list[i].facts);
+		}
+	}
+	free(facts_fetched);
+	save_and_free_device_cache(cache);
+
+	return probed;
+}
+
+void free_probed_devices(probed_devices_t *probed) {
+	if (probed == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < probed->count; i++) {
+		close_and_free_device_ignoring_errors(probed->list[i].device);
+	}
+	free(probed->list);
+	free(probed);
+}
+
+const char *describe_device_probe_failure(probed_device_t *probed) {
+	switch (probed->status) {
+	case device_probe_timed_out:
+		return "timed out";
+	case device_probe_failed:
+		return fido_strerr(probed->error);
+	case device_probe_ok:
+	case device_probe_not_wanted:
+		break;
+	}
+	errx(EXIT_PROGRAMMER_ERROR,
+	     "BUG (%s:%d): device at %s did not fail to be probed", __func__,
+	     __LINE__, probed->path);
+}
+
 authenticator_parameters_t *
 allocate_parameters_except_rpid(size_t credential_id_size, size_t salt_size) {
 	authenticator_parameters_t *params = malloc_or_exit(
 	    sizeof(authenticator_parameters_t), "authenticator parameters");
 
 	if (credential_id_size) {
-		params->credential_id = malloc_or_exit(
+		params->credential_id = secure_malloc_or_exit(
 		    credential_id_size, "credential id in authenticator parameters");
 		params->credential_id_size = credential_id_size;
 	} else {
@@ -154,14 +484,19 @@ allocate_parameters_except_rpid(size_t credential_id_size, size_t salt_size) {
 	}
 
 	if (salt_size) {
-		params->salt =
-		    malloc_or_exit(salt_size, "salt in authenticator parameters");
+		params->salt = secure_malloc_or_exit(
+		    salt_size, "salt in authenticator parameters");
 		params->salt_size = salt_size;
 	} else {
 		params->salt = NULL;
 		params->salt_size = 0;
 	}
 
+	params->derive_subkeys = false;
+	params->unattended = false;
+	params->device_vendor = 0;
+	params->device_product = 0;
+
 	// This data is required, but isn't meaninfully used, so we zero it out
 	params->user_id = calloc(1, 1);
 	params->user_id_size = 1;
@@ -189,8 +524,8 @@ allocate_parameters_except_rpid(size_t credential_id_size, size_t salt_size) {
 
 /**
  * This function assumes all pointers are to malloc()'d memory
- * except relying_party_id, credential_id and salt, which must
- * be malloc()'d.
+ * except relying_party_id, credential_id, salt and authenticator_pin, which
+ * must be secure_malloc()'d.
  */
 void free_parameters(authenticator_parameters_t *params) {
 	if (params == NULL) {
@@ -218,238 +553,351 @@ void free_parameters(authenticator_parameters_t *params) {
 	}
 
 	// The following parameters are secret
-	if (params->relying_party_id != NULL) {
-		sodium_memzero(params->relying_party_id, RELYING_PARTY_ID_SIZE);
-		free(params->relying_party_id);
-	}
-	if (params->credential_id != NULL) {
-		sodium_memzero(params->credential_id, params->credential_id_size);
-		free(params->credential_id);
-	}
-	if (params->salt != NULL) {
-		sodium_memzero(params->salt, params->salt_size);
-		free(params->salt);
-	}
-	if (params->authenticator_pin != NULL) {
-		sodium_memzero(params->authenticator_pin,
-		               strlen(params->authenticator_pin));
-		free(params->authenticator_pin);
-	}
+	secure_free(params->relying_party_id);
+	secure_free(params->credential_id);
+	secure_free(params->salt);
+	secure_free(params->authenticator_pin);
 	free(params);
 }
 
-void create_credential(fido_dev_t *device, authenticator_parameters_t *params) {
+int create_credential(fido_dev_t *device, authenticator_parameters_t *params) {
 	fido_cred_t *credential;
-	const unsigned char *cred_id;
-	size_t cred_id_size;
-	int r;
-
 	if ((credential = fido_cred_new()) == NULL) {
-		errx(EXIT_OUT_OF_MEMORY,
-		     "Unable to create credential structure (out of memory?)");
+		return FIDO_ERR_INTERNAL;
 	}
 
-	if ((r = fido_cred_set_extensions(credential, FIDO_EXT_HMAC_SECRET)) !=
-	    FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to set extension to hmac-secret: %s (0x%x)",
-		     fido_strerr(r), r);
+	int r = fido_cred_set_extensions(credential, FIDO_EXT_HMAC_SECRET);
+	if (r == FIDO_OK) {
+		r = fido_cred_set_rp(credential, params->relying_party_id,
+		                     params->relying_party_name);
 	}
-
-	if ((r = fido_cred_set_rp(credential, params->relying_party_id,
-	                          params->relying_party_name)) != FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR, "Unable to set relying party: %s (0x%x)",
-		     fido_strerr(r), r);
+	if (r == FIDO_OK) {
+		r = fido_cred_set_type(credential, COSE_ES256);
 	}
-
-	if ((r = fido_cred_set_type(credential, COSE_ES256)) != FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to set credential type: %s (0x%x)", fido_strerr(r), r);
+	if (r == FIDO_OK) {
+		r = fido_cred_set_user(credential, params->user_id,
+		                       params->user_id_size, params->user_name,
+		                       params->user_display_name, NULL);
 	}
-
-	if ((r = fido_cred_set_user(credential, params->user_id,
-	                            params->user_id_size, params->user_name,
-	                            params->user_display_name, NULL)) != FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR, "Unable to set user info: %s (0x%x)",
-		     fido_strerr(r), r);
+	if (r == FIDO_OK) {
+		r = fido_cred_set_clientdata_hash(credential, params->client_data_hash,
+		                                  params->client_data_hash_size);
 	}
-
-	if ((r = fido_cred_set_clientdata_hash(credential, params->client_data_hash,
-	                                       params->client_data_hash_size)) !=
-	    FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to set client data hash: %s (0x%x)", fido_strerr(r), r);
+	if (r == FIDO_OK) {
+		r = fido_cred_set_rk(credential, FIDO_OPT_FALSE);
 	}
-
-	if ((r = fido_cred_set_rk(credential, FIDO_OPT_FALSE)) != FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to disable use of resident key: %s (0x%x)", fido_strerr(r),
-		     r);
+	if (r == FIDO_OK) {
+		r = fido_dev_make_cred(device, credential, params->authenticator_pin);
 	}
 
-	if ((r = fido_dev_make_cred(device, credential,
-	                            params->authenticator_pin)) != FIDO_OK) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		if (r == FIDO_ERR_PIN_INVALID) {
-			errx(EXIT_BAD_PIN, "Invalid authenticator PIN");
+	const unsigned char *cred_id = NULL;
+	size_t cred_id_size = 0;
+	if (r == FIDO_OK) {
+		cred_id = fido_cred_id_ptr(credential);
+		cred_id_size = fido_cred_id_len(credential);
+		if (cred_id == NULL || cred_id_size < 1) {
+			r = FIDO_ERR_INVALID_CREDENTIAL;
 		}
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to create credential on FIDO2 device: %s (0x%x)",
-		     fido_strerr(r), r);
 	}
-
-	cred_id = fido_cred_id_ptr(credential);
-	cred_id_size = fido_cred_id_len(credential);
-
-	if (cred_id == NULL || cred_id_size < 1) {
-		fido_cred_free(&credential);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR, "Unable to read credential ID");
+	if (r == FIDO_OK) {
+		params->credential_id = secure_malloc(cred_id_size);
+		if (params->credential_id == NULL) {
+			r = FIDO_ERR_INTERNAL;
+		}
+	}
+	if (r == FIDO_OK) {
+		params->credential_id_size = cred_id_size;
+		memcpy(params->credential_id, cred_id, cred_id_size);
 	}
-
-	params->credential_id = malloc_or_exit(
-	    cred_id_size, "credential id in authenticator parameters");
-	params->credential_id_size = cred_id_size;
-	memcpy(params->credential_id, cred_id, cred_id_size);
 
 	fido_cred_free(&credential);
+	return r;
 }
 
-int get_secret_from_authenticator_params(
-    fido_dev_t *device, authenticator_parameters_t *params,
-    secret_t *secret_struct) { // cred_id_t *cred_struct, unsigned char *salt,
-	                           // size_t salt_length) {
-	int r;
-	const unsigned char *secret_pointer;
-	size_t secret_size;
-	fido_assert_t *assertion;
-
+/**
+ * Makes an assertion for the credential in params into *assertion, returning
+ * FIDO_OK or the error which stopped it (in which case *assertion is NULL).
+ * Unless probe_only, it asks for the hmac-secret over params' salt, with user
+ * presence unless params are unattended; if probe_only, it only finds out
+ * whether the device holds the credential, which needs no touch.
+ */
+static int
+make_assertion_from_authenticator_params(authenticator_parameters_t *params,
+                                         bool probe_only,
+                                         fido_assert_t **assertion) {
 	if (params->credential_id == NULL || params->credential_id_size < 1) {
-		close_and_free_device_ignoring_errors(device);
 		errx(EXIT_PROGRAMMER_ERROR, "BUG (%s:%d): No credential ID supplied",
 		     __func__, __LINE__);
 	}
 
 	if (params->salt == NULL || params->salt_size < 1) {
-		close_and_free_device_ignoring_errors(device);
 		errx(EXIT_PROGRAMMER_ERROR, "BUG (%s:%d): No salt supplied", __func__,
 		     __LINE__);
 	}
 
-	if ((assertion = fido_assert_new()) == NULL) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_OUT_OF_MEMORY,
-		     "Unable to create assertion structure (out of memory?)");
+	if ((*assertion = fido_assert_new()) == NULL) {
+		return FIDO_ERR_INTERNAL;
 	}
 
-	if ((r = fido_assert_set_hmac_salt(assertion, params->salt,
-	                                   params->salt_size)) != FIDO_OK) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to set extension to HMAC salt: %s (0x%x)", fido_strerr(r),
-		     r);
+	bool user_presence = !probe_only && !params->unattended;
+	int r = FIDO_OK;
+	if (!probe_only) {
+		r = fido_assert_set_hmac_salt(*assertion, params->salt,
+		                              params->salt_size);
 	}
-
-	if ((r = fido_assert_set_extensions(assertion, FIDO_EXT_HMAC_SECRET)) !=
-	    FIDO_OK) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to set extension to hmac-secret: %s (0x%x)",
-		     fido_strerr(r), r);
+	if (r == FIDO_OK && !probe_only) {
+		r = fido_assert_set_extensions(*assertion, FIDO_EXT_HMAC_SECRET);
+	}
+	if (r == FIDO_OK) {
+		r = fido_assert_set_rp(*assertion, params->relying_party_id);
+	}
+	if (r == FIDO_OK) {
+		r = fido_assert_set_clientdata_hash(*assertion,
+		                                    params->client_data_hash,
+		                                    params->client_data_hash_size);
+	}
+	if (r == FIDO_OK) {
+		r = fido_assert_allow_cred(*assertion, params->credential_id,
+		                           params->credential_id_size);
+	}
+	if (r == FIDO_OK) {
+		r = fido_assert_set_up(*assertion, user_presence ? FIDO_OPT_TRUE
+		                                                 : FIDO_OPT_FALSE);
 	}
+	if (r != FIDO_OK) {
+		fido_assert_free(assertion);
+	}
+	return r;
+}
 
-	if ((r = fido_assert_set_rp(assertion, params->relying_party_id)) !=
-	    FIDO_OK) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR, "Unable to set relying party: %s (0x%x)",
-		     fido_strerr(r), r);
+/**
+ * Copies the hmac-secret out of a successful assertion into secret_struct,
+ * returning FIDO_ERR_UNSUPPORTED_EXTENSION if the device did not return one,
+ * or FIDO_ERR_INTERNAL if there is no secure memory to copy it into.
+ */
+static int copy_secret_from_assertion(fido_assert_t *assertion,
+                                      secret_t *secret_struct) {
+	const unsigned char *secret_pointer =
+	    fido_assert_hmac_secret_ptr(assertion, 0);
+	size_t secret_size = fido_assert_hmac_secret_len(assertion, 0);
+	if (secret_pointer == NULL || secret_size < 1) {
+		return FIDO_ERR_UNSUPPORTED_EXTENSION;
 	}
 
-	if ((r = fido_assert_set_clientdata_hash(
-	         assertion, params->client_data_hash,
-	         params->client_data_hash_size)) != FIDO_OK) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to set client data hash: %s (0x%x)", fido_strerr(r), r);
+	unsigned char *secret = secure_malloc(secret_size);
+	if (secret == NULL) {
+		return FIDO_ERR_INTERNAL;
 	}
+	memcpy(secret, secret_pointer, secret_size);
+	secret_struct->secret = secret;
+	secret_struct->secret_size = secret_size;
+	return FIDO_OK;
+}
 
-	if ((r = fido_assert_allow_cred(assertion, params->credential_id,
-	                                params->credential_id_size)) != FIDO_OK) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR, "Unable to set credential ID: %s (0x%x)",
-		     fido_strerr(r), r);
+/**
+ * For unattended params, stops device waiting long for a touch which will
+ * never come, in case it does not honour the request for no user presence.
+ */
+static void
+limit_wait_for_unattended_assertion(fido_dev_t *device,
+                                    authenticator_parameters_t *params) {
+	int r;
+	if (params->unattended &&
+	    (r = fido_dev_set_timeout(device, UNATTENDED_ASSERTION_TIMEOUT_MS)) !=
+	        FIDO_OK) {
+		warnx("Unable to set device timeout: %s (0x%x)", fido_strerr(r), r);
 	}
+}
 
-	if ((r = fido_assert_set_up(assertion, FIDO_OPT_TRUE)) != FIDO_OK) {
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to run assert_set_up(): %s (0x%x)", fido_strerr(r), r);
+int get_secret_from_authenticator_params(fido_dev_t *device,
+                                         authenticator_parameters_t *params,
+                                         secret_t *secret_struct) {
+	fido_assert_t *assertion = NULL;
+	int r = make_assertion_from_authenticator_params(params, false, &assertion);
+	if (r != FIDO_OK) {
+		return r;
 	}
+	limit_wait_for_unattended_assertion(device, params);
 
 	r = fido_dev_get_assert(device, assertion, params->authenticator_pin);
-	if (r != FIDO_OK) {
-		fido_assert_free(&assertion);
-		if (r == FIDO_ERR_INVALID_CREDENTIAL ||
-		    r == FIDO_ERR_USER_ACTION_PENDING || r == FIDO_ERR_NO_CREDENTIALS ||
-		    r == FIDO_ERR_ACTION_TIMEOUT || r == FIDO_ERR_PIN_INVALID) {
-			return r;
+	if (r == FIDO_OK) {
+		r = copy_secret_from_assertion(assertion, secret_struct);
+	}
+	fido_assert_free(&assertion);
+	return r;
+}
+
+typedef struct assertion_race_t assertion_race_t;
+
+typedef struct assertion_race_entrant_t {
+	assertion_race_t *race;
+	size_t index;
+	assertion_attempt_t *attempt;
+	fido_assert_t *assertion;
+	pthread_t thread;
+	bool started;
+	bool finished;
+} assertion_race_entrant_t;
+
+struct assertion_race_t {
+	pthread_mutex_t lock;
+	pthread_cond_t entrant_finished_condition;
+	size_t finished_count;
+	// The index of the first entrant to succeed, or the entrant count
+	size_t winner;
+	size_t entrant_count;
+	assertion_race_entrant_t *entrants;
+};
+
+static void *get_assertion_on_worker_thread(void *arg) {
+	assertion_race_entrant_t *entrant = (assertion_race_entrant_t *)arg;
+	int r = fido_dev_get_assert(entrant->attempt->device, entrant->assertion,
+	                            entrant->attempt->pin);
+
+	assertion_race_t *race = entrant->race;
+	pthread_mutex_lock(&race->lock);
+	entrant->attempt->result = r;
+	entrant->finished = true;
+	race->finished_count++;
+	if (r == FIDO_OK && race->winner == race->entrant_count) {
+		race->winner = entrant->index;
+	}
+	pthread_cond_signal(&race->entrant_finished_condition);
+	pthread_mutex_unlock(&race->lock);
+	return NULL;
+}
+
+/**
+ * Sends an assertion for params (as made by
+ * make_assertion_from_authenticator_params()) to every device in attempts at
+ * once. If stop_at_first_success, the others are cancelled as soon as one
+ * succeeds; otherwise every attempt is left to finish. Returns the race, which
+ * must be freed with free_assertion_race().
+ */
+static assertion_race_t *
+run_assertion_race(assertion_attempt_t *attempts, size_t attempt_count,
+                   authenticator_parameters_t *params, bool probe_only,
+                   bool stop_at_first_success) {
+	assertion_race_t *race =
+	    malloc_or_exit(sizeof(assertion_race_t), "assertion race");
+	if (pthread_mutex_init(&race->lock, NULL) != 0 ||
+	    pthread_cond_init(&race->entrant_finished_condition, NULL) != 0) {
+		errx(EXIT_OUT_OF_MEMORY, "Unable to initialize assertion race lock");
+	}
+	race->finished_count = 0;
+	race->winner = attempt_count;
+	race->entrant_count = attempt_count;
+	race->entrants = malloc_or_exit(
+	    sizeof(assertion_race_entrant_t) * (attempt_count > 0 ? attempt_count
+	                                                          : 1),
+	    "assertion race entrants");
+
+	// Build every assertion before starting, so that nothing which might exit
+	// runs while other threads are talking to authenticators. An entrant
+	// whose assertion cannot be made, or whose thread cannot be started, has
+	// lost already.
+	for (size_t i = 0; i < attempt_count; i++) {
+		assertion_race_entrant_t *entrant = &race->entrants[i];
+		entrant->race = race;
+		entrant->index = i;
+		entrant->attempt = &attempts[i];
+		entrant->assertion = NULL;
+		entrant->attempt->result = make_assertion_from_authenticator_params(
+		    params, probe_only, &entrant->assertion);
+		entrant->started = false;
+		entrant->finished = entrant->attempt->result != FIDO_OK;
+		if (entrant->finished) {
+			race->finished_count++;
+		} else if (!probe_only) {
+			limit_wait_for_unattended_assertion(attempts[i].device, params);
 		}
-		free_parameters(params);
-		close_and_free_device_ignoring_errors(device);
-		errx(EXIT_AUTHENTICATOR_ERROR,
-		     "Unable to get secret from device: %s (0x%x)", fido_strerr(r), r);
 	}
 
-	secret_pointer = fido_assert_hmac_secret_ptr(assertion, 0);
-	secret_size = fido_assert_hmac_secret_len(assertion, 0);
+	pthread_mutex_lock(&race->lock);
+	for (size_t i = 0; i < attempt_count; i++) {
+		assertion_race_entrant_t *entrant = &race->entrants[i];
+		if (entrant->finished) {
+			continue;
+		}
+		entrant->started =
+		    pthread_create(&entrant->thread, NULL,
+		                   get_assertion_on_worker_thread, entrant) == 0;
+		if (!entrant->started) {
+			entrant->attempt->result = FIDO_ERR_INTERNAL;
+			entrant->finished = true;
+			race->finished_count++;
+		}
+	}
+	pthread_mutex_unlock(&race->lock);
 
-	if (secret_pointer == NULL || secret_size < 1) {
-		close_and_free_device_ignoring_errors(device);
-		fido_assert_free(&assertion);
-		errx(EXIT_AUTHENTICATOR_ERROR, "Unable to read credential ID");
+	if (stop_at_first_success) {
+		pthread_mutex_lock(&race->lock);
+		while (race->winner == attempt_count &&
+		       race->finished_count < attempt_count) {
+			pthread_cond_wait(&race->entrant_finished_condition,
+			                  &race->lock);
+		}
+		if (race->winner != attempt_count) {
+			// The user has touched one authenticator, so stop the others
+			// waiting for a touch
+			for (size_t i = 0; i < attempt_count; i++) {
+				if (!race->entrants[i].finished) {
+					fido_dev_cancel(attempts[i].device);
+				}
+			}
+		}
+		pthread_mutex_unlock(&race->lock);
 	}
 
-	secret_struct->secret_size = secret_size;
-	secret_struct->secret =
-	    malloc_or_exit(secret_struct->secret_size, "secret");
-	memcpy(secret_struct->secret, secret_pointer, secret_size);
-	fido_assert_free(&assertion);
+	for (size_t i = 0; i < attempt_count; i++) {
+		if (race->entrants[i].started) {
+			pthread_join(race->entrants[i].thread, NULL);
+		}
+	}
 
-	return FIDO_OK;
+	return race;
+}
+
+static void free_assertion_race(assertion_race_t *race) {
+	for (size_t i = 0; i < race->entrant_count; i++) {
+		fido_assert_free(&race->entrants[i].assertion);
+	}
+	free(race->entrants);
+	pthread_cond_destroy(&race->entrant_finished_condition);
+	pthread_mutex_destroy(&race->lock);
+	free(race);
+}
+
+size_t race_for_secret_from_authenticator_params(
+    assertion_attempt_t *attempts, size_t attempt_count,
+    authenticator_parameters_t *params, secret_t *secret_struct) {
+	assertion_race_t *race =
+	    run_assertion_race(attempts, attempt_count, params, false, true);
+
+	size_t winner = race->winner;
+	if (winner != attempt_count) {
+		attempts[winner].result = copy_secret_from_assertion(
+		    race->entrants[winner].assertion, secret_struct);
+		if (attempts[winner].result != FIDO_OK) {
+			winner = attempt_count;
+		}
+	}
+
+	free_assertion_race(race);
+	return winner;
+}
+
+void probe_for_credential_on_devices(assertion_attempt_t *attempts,
+                                     size_t attempt_count,
+                                     authenticator_parameters_t *params) {
+	free_assertion_race(
+	    run_assertion_race(attempts, attempt_count, params, true, false));
 }
 
 void free_secret(secret_t *secret_struct) {
 	if (secret_struct == NULL) {
 		return;
 	}
-	if (secret_struct->secret != NULL) {
-		free(secret_struct->secret);
-	}
+	secure_free(secret_struct->secret);
 	free(secret_struct);
 }
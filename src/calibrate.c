@@ -0,0 +1,354 @@
+#include "calibrate.h"
+
+#include <limits.h>
+#include <sodium.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cryptography.h"
+#include "exit.h"
+#include "memory.h"
+
+#define CALIBRATION_PASSPHRASE "kdf-calibrate"
+
+#define CGROUP_V1_MEMORY_ROOT "/sys/fs/cgroup/memory"
+#define CGROUP_V2_ROOT "/sys/fs/cgroup"
+
+/**
+ * Reads a number of bytes from a file like memory.max, returning SIZE_MAX if
+ * the file cannot be read or contains "max".
+ */
+static size_t read_bytes_from_file(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return SIZE_MAX;
+	}
+	unsigned long long value;
+	int matched = fscanf(f, "%llu", &value);
+	fclose(f);
+	if (matched != 1 || value > SIZE_MAX) {
+		return SIZE_MAX;
+	}
+	return (size_t)value;
+}
+
+static size_t get_meminfo_available_memory(void) {
+	FILE *f = fopen("/proc/meminfo", "r");
+	if (f == NULL) {
+		return SIZE_MAX;
+	}
+	char line[128];
+	unsigned long long kibibytes;
+	size_t result = SIZE_MAX;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kibibytes) == 1) {
+			if (kibibytes < SIZE_MAX / 1024) {
+				result = (size_t)(kibibytes * 1024);
+			}
+			break;
+		}
+	}
+	fclose(f);
+	return result;
+}
+
+/**
+ * Returns the smallest headroom (limit less usage) of the cgroup at path under
+ * root and each of its ancestors, or SIZE_MAX if none of them are limited.
+ */
+static size_t get_cgroup_headroom(const char *root, const char *path,
+                                  const char *limit_file,
+                                  const char *usage_file) {
+	size_t result = SIZE_MAX;
+	char *cgroup = strdup_or_exit(path, "cgroup path");
+	char file_path[PATH_MAX];
+
+	while (true) {
+		snprintf(file_path, sizeof(file_path), "%s%s/%s", root, cgroup,
+		         limit_file);
+		size_t limit = read_bytes_from_file(file_path);
+		if (limit != SIZE_MAX) {
+			snprintf(file_path, sizeof(file_path), "%s%s/%s", root, cgroup,
+			         usage_file);
+			size_t usage = read_bytes_from_file(file_path);
+			if (usage == SIZE_MAX) {
+				usage = 0;
+			}
+			size_t headroom = limit > usage ? limit - usage : 0;
+			if (headroom < result) {
+				result = headroom;
+			}
+		}
+
+		char *last_separator = strrchr(cgroup, '/');
+		if (last_separator == NULL || cgroup[0] == (char)0) {
+			break;
+		}
+		*last_separator = (char)0;
+	}
+
+	free(cgroup);
+	return result;
+}
+
+static bool controller_list_contains_memory(char *controllers) {
+	char *saveptr = NULL;
+	for (char *controller = strtok_r(controllers, ",", &saveptr);
+	     controller != NULL; controller = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(controller, "memory") == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static size_t get_cgroup_available_memory(void) {
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL) {
+		return SIZE_MAX;
+	}
+
+	size_t result = SIZE_MAX;
+	char line[PATH_MAX + 64];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		// Each line is hierarchy-ID:controller-list:cgroup-path
+		char *controllers = strchr(line, ':');
+		if (controllers == NULL) {
+			continue;
+		}
+		*controllers++ = (char)0;
+		char *path = strchr(controllers, ':');
+		if (path == NULL) {
+			continue;
+		}
+		*path++ = (char)0;
+		path[strcspn(path, "\n")] = (char)0;
+		if (strcmp(path, "/") == 0) {
+			path[0] = (char)0;
+		}
+
+		size_t headroom = SIZE_MAX;
+		if (strcmp(line, "0") == 0 && controllers[0] == (char)0) {
+			headroom = get_cgroup_headroom(CGROUP_V2_ROOT, path, "memory.max",
+			                               "memory.current");
+		} else if (controller_list_contains_memory(controllers)) {
+			headroom =
+			    get_cgroup_headroom(CGROUP_V1_MEMORY_ROOT, path,
+			                        "memory.limit_in_bytes",
+			                        "memory.usage_in_bytes");
+		}
+		if (headroom < result) {
+			result = headroom;
+		}
+	}
+
+	fclose(f);
+	return result;
+}
+
+size_t get_available_memory(void) {
+	size_t result = SIZE_MAX;
+
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGE_SIZE);
+	if (pages > 0 && page_size > 0) {
+		result = (size_t)pages * (size_t)page_size;
+	}
+
+	size_t meminfo_available = get_meminfo_available_memory();
+	if (meminfo_available < result) {
+		result = meminfo_available;
+	}
+
+	size_t cgroup_available = get_cgroup_available_memory();
+	if (cgroup_available < result) {
+		result = cgroup_available;
+	}
+
+	return result;
+}
+
+size_t get_maximum_kdf_memory(invocation_state_t *invocation) {
+	size_t available = get_available_memory();
+	size_t result = available / 2;
+
+	if (invocation->kdf_max_memory != 0) {
+		if (invocation->kdf_max_memory > available) {
+			warnx("Only %zu MiB of memory appear to be available, so using "
+			      "that instead of --kdf-max-memory",
+			      available / MEBIBYTE);
+			result = available;
+		} else {
+			result = invocation->kdf_max_memory;
+		}
+	}
+
+	if (result < CALIBRATION_MINIMUM_MEMORY_BYTES) {
+		result = CALIBRATION_MINIMUM_MEMORY_BYTES;
+	}
+
+	return result;
+}
+
+static double
+measure_kdf_milliseconds_reporting_memory_backing(
+    unsigned long long opslimit, size_t memlimit, unsigned int lanes,
+    argon2_memory_backing_t *memory_backing) {
+	key_spec_t *key_spec =
+	    malloc_or_exit(sizeof(key_spec_t), "calibration key specification");
+	key_spec->passphrase = secure_strdup_or_exit(
+	    CALIBRATION_PASSPHRASE, "calibration key specification");
+	key_spec->kdf_salt = malloc_or_exit(crypto_pwhash_SALTBYTES,
+	                                    "calibration key specification");
+	randombytes_buf(key_spec->kdf_salt, crypto_pwhash_SALTBYTES);
+	key_spec->kdf_salt_size = crypto_pwhash_SALTBYTES;
+	key_spec->opslimit = opslimit;
+	key_spec->memlimit = memlimit;
+	key_spec->algorithm = crypto_pwhash_ALG_ARGON2ID13;
+	key_spec->lanes = (uint8_t)lanes;
+	key_spec->prepared_memory = NULL;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned char *key_bytes =
+	    derive_key_reporting_memory_backing(key_spec, memory_backing);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	free_key(key_bytes);
+	free_key_spec(key_spec);
+
+	return (double)(end.tv_sec - start.tv_sec) * 1000.0 +
+	       (double)(end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+static double measure_kdf_milliseconds(unsigned long long opslimit,
+                                       size_t memlimit, unsigned int lanes) {
+	return measure_kdf_milliseconds_reporting_memory_backing(opslimit, memlimit,
+	                                                         lanes, NULL);
+}
+
+static size_t round_down_to_mebibytes(double bytes) {
+	size_t result = ((size_t)bytes / MEBIBYTE) * MEBIBYTE;
+	if (result < CALIBRATION_MINIMUM_MEMORY_BYTES) {
+		return CALIBRATION_MINIMUM_MEMORY_BYTES;
+	}
+	return result;
+}
+
+void choose_kdf_parameters_for_target_time(unsigned int target_ms,
+                                           size_t maximum_memory,
+                                           unsigned int lanes,
+                                           unsigned long long *opslimit,
+                                           size_t *memlimit) {
+	size_t memory = CALIBRATION_MINIMUM_MEMORY_BYTES;
+	double elapsed = measure_kdf_milliseconds(1, memory, lanes);
+
+	// Time is roughly proportional to memory, so grow the memory (with a
+	// single pass) towards the target, extrapolating from the last
+	// measurement. We don't extrapolate too far at once, because small
+	// amounts of memory fit in cache and so are disproportionately fast.
+	while (elapsed < target_ms && memory < maximum_memory) {
+		double scale = target_ms / (elapsed > 1.0 ? elapsed : 1.0);
+		if (scale > 8.0) {
+			scale = 8.0;
+		}
+		size_t next_memory = round_down_to_mebibytes(memory * scale);
+		if (next_memory > maximum_memory) {
+			next_memory = round_down_to_mebibytes(maximum_memory);
+		}
+		if (next_memory <= memory) {
+			break;
+		}
+
+		double next_elapsed = measure_kdf_milliseconds(1, next_memory, lanes);
+		if (next_elapsed > target_ms) {
+			// We overshot, so interpolate between the last two measurements
+			memory = round_down_to_mebibytes(
+			    memory + (double)(next_memory - memory) *
+			                 (target_ms - elapsed) / (next_elapsed - elapsed));
+			break;
+		}
+		memory = next_memory;
+		elapsed = next_elapsed;
+	}
+
+	// Each additional pass takes about as long as the first, so once we can
+	// use no more memory, spend any remaining time on more passes.
+	unsigned long long passes = 1;
+	if (memory >= maximum_memory && elapsed < target_ms && elapsed > 0) {
+		passes = (unsigned long long)(target_ms / elapsed);
+		if (passes < 1) {
+			passes = 1;
+		}
+	}
+
+	*opslimit = passes;
+	*memlimit = memory;
+}
+
+void print_kdf_calibration(invocation_state_t *invocation) {
+	size_t maximum_memory = get_maximum_kdf_memory(invocation);
+	double time_limit_ms = CALIBRATION_TABLE_TIME_LIMIT_MS;
+	if (invocation->kdf_target_ms * 2.0 > time_limit_ms) {
+		time_limit_ms = invocation->kdf_target_ms * 2.0;
+	}
+
+	printf("Available memory: %zu MiB\n", get_available_memory() / MEBIBYTE);
+	printf("Maximum memory:   %zu MiB\n", maximum_memory / MEBIBYTE);
+	printf("Lanes:            %u\n", invocation->kdf_lanes);
+	printf("\n%12s", "memory");
+	for (int opslimit = 1; opslimit <= CALIBRATION_TABLE_MAXIMUM_OPSLIMIT;
+	     opslimit++) {
+		printf("  opslimit %d", opslimit);
+	}
+	printf("\n");
+
+	size_t memory = CALIBRATION_MINIMUM_MEMORY_BYTES;
+	while (true) {
+		printf("%8zu MiB", memory / MEBIBYTE);
+		fflush(stdout);
+
+		double single_pass_ms = 0;
+		argon2_memory_backing_t memory_backing =
+		    ARGON2_MEMORY_BACKING_NORMAL_PAGES;
+		for (int opslimit = 1; opslimit <= CALIBRATION_TABLE_MAXIMUM_OPSLIMIT;
+		     opslimit++) {
+			// Skip measurements we expect to take too long
+			if (single_pass_ms * opslimit > time_limit_ms) {
+				printf("%12s", "-");
+				continue;
+			}
+			double elapsed = measure_kdf_milliseconds_reporting_memory_backing(
+			    opslimit, memory, invocation->kdf_lanes, &memory_backing);
+			if (opslimit == 1) {
+				single_pass_ms = elapsed;
+			}
+			printf("%9.0f ms", elapsed);
+			fflush(stdout);
+		}
+		printf("  (%s)\n", argon2_memory_backing_name(memory_backing));
+
+		if (memory >= maximum_memory || single_pass_ms > time_limit_ms) {
+			break;
+		}
+		memory = memory * 2 > maximum_memory ? maximum_memory : memory * 2;
+	}
+
+	if (invocation->kdf_target_ms != 0) {
+		unsigned long long opslimit;
+		size_t memlimit;
+		choose_kdf_parameters_for_target_time(invocation->kdf_target_ms,
+		                                      maximum_memory,
+		                                      invocation->kdf_lanes, &opslimit,
+		                                      &memlimit);
+		printf("\nFor a target of %u ms: opslimit %llu, memory %zu MiB "
+		       "(measured %.0f ms)\n",
+		       invocation->kdf_target_ms, opslimit, memlimit / MEBIBYTE,
+		       measure_kdf_milliseconds(opslimit, memlimit,
+		                                invocation->kdf_lanes));
+	}
+}
@@ -1,27 +1,113 @@
 #include "cryptography.h"
 
+#include "argon2.h"
+#include "calibrate.h"
 #include "exit.h"
 #include "invocation.h"
 #include "memory.h"
 #include <sodium.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-unsigned char *derive_key(key_spec_t *key_spec) {
+static uint32_t argon2_lanes(uint8_t lanes) {
+	// Version 1 keyfiles have no lanes field, and always use a single lane
+	return lanes > 1 ? lanes : 1;
+}
+
+/**
+ * Waits for the memory to be prepared and returns it (or NULL if it could not
+ * be allocated). Frees kdf_memory.
+ */
+static argon2_memory_t *finish_preparing_kdf_memory(kdf_memory_t *kdf_memory) {
+	if (pthread_join(kdf_memory->thread, NULL) != 0) {
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): unable to join key derivation memory thread",
+		     __func__, __LINE__);
+	}
+	argon2_memory_t *memory = kdf_memory->memory;
+	free(kdf_memory);
+	return memory;
+}
+
+/**
+ * Derives the key. If used_memory is not NULL, the key derivation function's
+ * work memory is stored there rather than being zeroed and freed, so that the
+ * caller can do that (with argon2_free_memory()) once the key has been used.
+ * If cancelled is not NULL and becomes true, gives up and returns NULL.
+ */
+static unsigned char *
+derive_key_leaving_memory_to_free(key_spec_t *key_spec,
+                                  argon2_memory_backing_t *memory_backing,
+                                  argon2_memory_t **used_memory,
+                                  const atomic_bool *cancelled) {
 	if (key_spec->kdf_salt_size != crypto_pwhash_SALTBYTES) {
 		err(EXIT_PROGRAMMER_ERROR,
 		    "KDF salt is of wrong size (is %zu bytes, should be %d bytes)",
 		    key_spec->kdf_salt_size, crypto_pwhash_SALTBYTES);
 	}
+	if (key_spec->opslimit > UINT32_MAX ||
+	    key_spec->memlimit / 1024 > UINT32_MAX) {
+		errx(EXIT_CRYPTOGRAPHY_ERROR,
+		     "Key derivation parameters are too large");
+	}
+	uint32_t m_cost_kib = (uint32_t)(key_spec->memlimit / 1024);
 
-	unsigned char *key_bytes =
-	    malloc_or_exit(KEY_SIZE, "passphrase-derived key");
+	argon2_memory_t *memory = NULL;
+	if (key_spec->prepared_memory != NULL) {
+		if (key_spec->prepared_memory->memlimit != key_spec->memlimit ||
+		    key_spec->prepared_memory->lanes != key_spec->lanes) {
+			errx(EXIT_PROGRAMMER_ERROR,
+			     "BUG (%s:%d): key derivation memory was prepared for "
+			     "different parameters",
+			     __func__, __LINE__);
+		}
+		memory = finish_preparing_kdf_memory(key_spec->prepared_memory);
+		key_spec->prepared_memory = NULL;
+	}
+	if (memory == NULL) {
+		memory = argon2_allocate_memory(m_cost_kib,
+		                                argon2_lanes(key_spec->lanes));
+	}
+	if (memory == NULL) {
+		err(EXIT_OUT_OF_MEMORY,
+		    "Unable to allocate memory to derive key from passphrase");
+	}
+	if (memory_backing != NULL) {
+		*memory_backing = argon2_memory_backing(memory);
+	}
 
-	if (crypto_pwhash(key_bytes, KEY_SIZE, key_spec->passphrase,
-	                  strlen(key_spec->passphrase), key_spec->kdf_salt,
-	                  key_spec->opslimit, key_spec->memlimit,
-	                  key_spec->algorithm) != 0) {
+	unsigned char *key_bytes = secure_malloc(KEY_SIZE);
+	if (key_bytes == NULL) {
+		// The work memory may be very large, so is not left to leak
+		argon2_free_memory(memory);
+		errx(EXIT_OUT_OF_MEMORY,
+		     "Unable to allocate secure memory for passphrase-derived key");
+	}
+
+	// We use our own Argon2 implementation rather than crypto_pwhash() for
+	// every keyfile, even those with a single lane (including all version 1
+	// keyfiles, which crypto_pwhash() derived before), because it can fill
+	// lanes in parallel and put its memory on huge pages. `make test` checks
+	// that it gives the same keys as crypto_pwhash() for a single lane.
+	int r = argon2_hash_in_memory_cancellable(
+	    key_bytes, KEY_SIZE, key_spec->passphrase,
+	    strlen(key_spec->passphrase), key_spec->kdf_salt,
+	    key_spec->kdf_salt_size, (uint32_t)key_spec->opslimit, m_cost_kib,
+	    argon2_lanes(key_spec->lanes), key_spec->algorithm, memory, cancelled);
+	if (used_memory != NULL) {
+		*used_memory = memory;
+	} else {
+		argon2_free_memory(memory);
+	}
+
+	if (r != 0 && cancelled != NULL &&
+	    atomic_load_explicit(cancelled, memory_order_relaxed)) {
+		free_key(key_bytes);
+		return NULL;
+	}
+	if (r != 0) {
 		err(EXIT_OUT_OF_MEMORY,
 		    "Unable to derive key from passphrase (out of memory?)");
 	}
@@ -29,12 +115,254 @@ unsigned char *derive_key(key_spec_t *key_spec) {
 	return key_bytes;
 }
 
-void free_key(unsigned char *key) {
-	if (key == NULL) {
+unsigned char *
+derive_key_reporting_memory_backing(key_spec_t *key_spec,
+                                    argon2_memory_backing_t *memory_backing) {
+	return derive_key_leaving_memory_to_free(key_spec, memory_backing, NULL,
+	                                         NULL);
+}
+
+unsigned char *derive_key(key_spec_t *key_spec) {
+	return derive_key_leaving_memory_to_free(key_spec, NULL, NULL, NULL);
+}
+
+// Every derivation whose worker has been started and not yet joined, so that
+// they can be stopped before the secure arena is zeroed if the process exits
+// (on an error, say) while they are running
+static pthread_mutex_t running_derivations_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t derivation_finished_condition = PTHREAD_COND_INITIALIZER;
+static key_derivation_t *running_derivations = NULL;
+static pthread_once_t stop_derivations_at_exit_once = PTHREAD_ONCE_INIT;
+
+static void stop_running_derivations(void) {
+	pthread_mutex_lock(&running_derivations_lock);
+	for (key_derivation_t *d = running_derivations; d != NULL;
+	     d = d->next_running) {
+		atomic_store_explicit(&d->cancelled, true, memory_order_relaxed);
+	}
+	for (key_derivation_t *d = running_derivations; d != NULL;
+	     d = d->next_running) {
+		// A worker which is itself exiting can't be waited for
+		while (!d->finished && !pthread_equal(d->thread, pthread_self())) {
+			pthread_cond_wait(&derivation_finished_condition,
+			                  &running_derivations_lock);
+		}
+	}
+	pthread_mutex_unlock(&running_derivations_lock);
+}
+
+static void stop_derivations_at_exit(void) {
+	before_zeroing_secure_arena_at_exit(stop_running_derivations);
+}
+
+static void free_key_derivation(key_derivation_t *derivation) {
+	pthread_mutex_lock(&running_derivations_lock);
+	key_derivation_t **p = &running_derivations;
+	while (*p != NULL && *p != derivation) {
+		p = &(*p)->next_running;
+	}
+	if (*p != NULL) {
+		*p = derivation->next_running;
+	}
+	pthread_mutex_unlock(&running_derivations_lock);
+
+	free_key(derivation->key_bytes);
+	free_key_spec(derivation->key_spec);
+	pthread_cond_destroy(&derivation->key_ready_condition);
+	pthread_mutex_destroy(&derivation->lock);
+	free(derivation);
+}
+
+static void *derive_key_on_worker_thread(void *arg) {
+	key_derivation_t *derivation = (key_derivation_t *)arg;
+	set_secure_allocation_scope(derivation->allocation_scope);
+
+	// A failure here is handed to whoever takes the key, so that it exits (or
+	// is caught) on their thread rather than on this one
+	failure_catcher_t catcher;
+	argon2_memory_t *volatile used_memory = NULL;
+	unsigned char *volatile key_bytes = NULL;
+	bool failed = setjmp(catcher.jump) != 0;
+	if (!failed) {
+		catch_failures(&catcher);
+		argon2_memory_t *memory = NULL;
+		key_bytes = derive_key_leaving_memory_to_free(
+		    derivation->key_spec, NULL, &memory, &derivation->cancelled);
+		used_memory = memory;
+		stop_catching_failures();
+	}
+
+	// Hand the key over before zeroing the (possibly very large) work
+	// memory, so that the key can be used while we do that.
+	pthread_mutex_lock(&derivation->lock);
+	derivation->key_bytes = key_bytes;
+	if (failed) {
+		derivation->failure_exit_code = catcher.exit_code;
+		memcpy(derivation->failure_message, catcher.message,
+		       sizeof(catcher.message));
+	}
+	derivation->key_ready = true;
+	pthread_cond_signal(&derivation->key_ready_condition);
+	pthread_mutex_unlock(&derivation->lock);
+
+	argon2_free_memory(used_memory);
+
+	pthread_mutex_lock(&running_derivations_lock);
+	derivation->finished = true;
+	pthread_cond_broadcast(&derivation_finished_condition);
+	pthread_mutex_unlock(&running_derivations_lock);
+	return NULL;
+}
+
+key_derivation_t *start_deriving_key_consuming_key_spec(key_spec_t *key_spec) {
+	key_derivation_t *derivation =
+	    malloc_or_exit(sizeof(key_derivation_t), "key derivation");
+	derivation->key_spec = key_spec;
+	derivation->key_bytes = NULL;
+	derivation->key_ready = false;
+	derivation->failure_exit_code = EXIT_SUCCESS;
+	derivation->failure_message[0] = '\0';
+	derivation->allocation_scope = get_secure_allocation_scope();
+	atomic_init(&derivation->cancelled, false);
+	derivation->finished = false;
+	if (pthread_mutex_init(&derivation->lock, NULL) != 0 ||
+	    pthread_cond_init(&derivation->key_ready_condition, NULL) != 0) {
+		errx(EXIT_OUT_OF_MEMORY, "Unable to initialize key derivation lock");
+	}
+	pthread_once(&stop_derivations_at_exit_once, stop_derivations_at_exit);
+
+	// The worker is listed before it starts, so that it is never missed at
+	// exit
+	pthread_mutex_lock(&running_derivations_lock);
+	if (pthread_create(&derivation->thread, NULL, derive_key_on_worker_thread,
+	                   derivation) != 0) {
+		pthread_mutex_unlock(&running_derivations_lock);
+		errx(EXIT_OUT_OF_MEMORY, "Unable to start key derivation thread");
+	}
+	derivation->next_running = running_derivations;
+	running_derivations = derivation;
+	pthread_mutex_unlock(&running_derivations_lock);
+	return derivation;
+}
+
+unsigned char *take_derived_key(key_derivation_t *derivation) {
+	pthread_mutex_lock(&derivation->lock);
+	while (!derivation->key_ready) {
+		pthread_cond_wait(&derivation->key_ready_condition, &derivation->lock);
+	}
+	unsigned char *key_bytes = derivation->key_bytes;
+	derivation->key_bytes = NULL;
+	int failure_exit_code = derivation->failure_exit_code;
+	pthread_mutex_unlock(&derivation->lock);
+
+	if (failure_exit_code != EXIT_SUCCESS) {
+		char message[FAILURE_MESSAGE_SIZE];
+		memcpy(message, derivation->failure_message, sizeof(message));
+		finish_scrubbing_and_free_key_derivation(derivation);
+		errx(failure_exit_code, "%s", message);
+	}
+	return key_bytes;
+}
+
+void finish_scrubbing_and_free_key_derivation(key_derivation_t *derivation) {
+	if (derivation == NULL) {
+		return;
+	}
+	if (pthread_join(derivation->thread, NULL) != 0) {
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): unable to join key derivation thread", __func__,
+		     __LINE__);
+	}
+	free_key_derivation(derivation);
+}
+
+unsigned char *finish_deriving_key(key_derivation_t *derivation) {
+	unsigned char *key_bytes = take_derived_key(derivation);
+	finish_scrubbing_and_free_key_derivation(derivation);
+	return key_bytes;
+}
+
+void cancel_key_derivation(key_derivation_t *derivation) {
+	if (derivation == NULL) {
+		return;
+	}
+	// The worker stops within a millisecond or so, and is joined rather than
+	// left to finish on its own, so that it never outlives the secure arena
+	atomic_store_explicit(&derivation->cancelled, true, memory_order_relaxed);
+	finish_scrubbing_and_free_key_derivation(derivation);
+}
+
+static void *prepare_kdf_memory_on_worker_thread(void *arg) {
+	kdf_memory_t *kdf_memory = (kdf_memory_t *)arg;
+	kdf_memory->memory =
+	    argon2_allocate_memory((uint32_t)(kdf_memory->memlimit / 1024),
+	                           argon2_lanes(kdf_memory->lanes));
+	if (kdf_memory->memory != NULL) {
+		argon2_prefault_memory(kdf_memory->memory);
+	}
+	return NULL;
+}
+
+kdf_memory_t *start_preparing_kdf_memory(size_t memlimit, uint8_t lanes) {
+	if (memlimit / 1024 > UINT32_MAX) {
+		// derive_key() will refuse these parameters anyway
+		return NULL;
+	}
+	kdf_memory_t *kdf_memory =
+	    malloc_or_exit(sizeof(kdf_memory_t), "key derivation memory");
+	kdf_memory->memlimit = memlimit;
+	kdf_memory->lanes = lanes;
+	kdf_memory->memory = NULL;
+	if (pthread_create(&kdf_memory->thread, NULL,
+	                   prepare_kdf_memory_on_worker_thread, kdf_memory) != 0) {
+		// This is only an optimization, so derive_key() can allocate the
+		// memory itself
+		free(kdf_memory);
+		return NULL;
+	}
+	return kdf_memory;
+}
+
+void free_kdf_memory(kdf_memory_t *kdf_memory) {
+	if (kdf_memory == NULL) {
 		return;
 	}
-	sodium_memzero(key, KEY_SIZE);
-	free(key);
+	argon2_free_memory(finish_preparing_kdf_memory(kdf_memory));
+}
+
+void derive_subkey(unsigned char *subkey, const unsigned char *root,
+                   size_t root_size, const char *label) {
+	// Must be exactly crypto_generichash_blake2b_PERSONALBYTES long
+	static const unsigned char personalization[] = "khefin subkey\0\0";
+
+	if (root_size < crypto_generichash_blake2b_KEYBYTES_MIN ||
+	    root_size > crypto_generichash_blake2b_KEYBYTES_MAX) {
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): root secret is %zu bytes, which cannot be used as a "
+		     "BLAKE2b key",
+		     __func__, __LINE__, root_size);
+	}
+
+	if (crypto_generichash_blake2b_salt_personal(
+	        subkey, SUBKEY_SIZE, (const unsigned char *)label, strlen(label),
+	        root, root_size, NULL, personalization) != 0) {
+		errx(EXIT_CRYPTOGRAPHY_ERROR, "Unable to derive subkey %s", label);
+	}
+}
+
+void free_key(unsigned char *key) {
+	secure_free(key);
+}
+
+bool kdf_parameters_are_usable(const deserialized_cleartext *cleartext) {
+	uint32_t lanes = argon2_lanes(cleartext->lanes);
+	return cleartext->kdf_salt_size == crypto_pwhash_SALTBYTES &&
+	       (cleartext->algorithm == ARGON2_TYPE_I ||
+	        cleartext->algorithm == ARGON2_TYPE_ID) &&
+	       cleartext->opslimit >= 1 && cleartext->opslimit <= UINT32_MAX &&
+	       cleartext->memlimit / 1024 <= UINT32_MAX &&
+	       cleartext->memlimit / 1024 >= 2 * ARGON2_SYNC_POINTS * lanes &&
+	       cleartext->memlimit <= get_available_memory();
 }
 
 key_spec_t *
@@ -42,11 +370,13 @@ make_key_spec_from_passphrase_and_cleartext(char *passphrase,
                                             deserialized_cleartext *cleartext) {
 	key_spec_t *keyspec = malloc_or_exit(
 	    sizeof(key_spec_t), "password-derived key specificications");
-	keyspec->passphrase = strdup_or_exit(
+	keyspec->passphrase = secure_strdup_or_exit(
 	    passphrase, "passphrase in password-derived key specificications");
 	keyspec->opslimit = cleartext->opslimit;
 	keyspec->memlimit = cleartext->memlimit;
 	keyspec->algorithm = cleartext->algorithm;
+	keyspec->lanes = cleartext->lanes;
+	keyspec->prepared_memory = NULL;
 	keyspec->kdf_salt =
 	    malloc_or_exit(cleartext->kdf_salt_size,
 	                   "salt in password-derived key specificications");
@@ -57,11 +387,18 @@ make_key_spec_from_passphrase_and_cleartext(char *passphrase,
 }
 
 key_spec_t *make_new_key_spec_from_invocation(invocation_state_t *invocation) {
+	return make_new_key_spec_from_invocation_and_passphrase(
+	    invocation, invocation->passphrase);
+}
+
+key_spec_t *
+make_new_key_spec_from_invocation_and_passphrase(invocation_state_t *invocation,
+                                                 const char *passphrase) {
 	key_spec_t *keyspec = malloc_or_exit(
 	    sizeof(key_spec_t), "password-derived key specificications");
-	keyspec->passphrase =
-	    strdup_or_exit(invocation->passphrase,
-	                   "passphrase in password-derived key specificications");
+	keyspec->passphrase = secure_strdup_or_exit(
+	    passphrase, "passphrase in password-derived key specificications");
+	keyspec->prepared_memory = NULL;
 
 	switch (invocation->kdf_hardness) {
 	case kdf_hardness_low:
@@ -76,6 +413,15 @@ key_spec_t *make_new_key_spec_from_invocation(invocation_state_t *invocation) {
 		keyspec->opslimit = crypto_pwhash_OPSLIMIT_SENSITIVE;
 		keyspec->memlimit = crypto_pwhash_MEMLIMIT_SENSITIVE;
 		break;
+	case kdf_hardness_calibrated:
+		fprintf(stderr, "Calibrating key derivation to take %u ms...\n",
+		        invocation->kdf_target_ms);
+		choose_kdf_parameters_for_target_time(
+		    invocation->kdf_target_ms, get_maximum_kdf_memory(invocation),
+		    invocation->kdf_lanes, &keyspec->opslimit, &keyspec->memlimit);
+		fprintf(stderr, "Using opslimit %llu and %zu MiB of memory\n",
+		        keyspec->opslimit, keyspec->memlimit / MEBIBYTE);
+		break;
 	case kdf_hardness_unspecified:
 	case kdf_hardness_invalid:
 		errx(EXIT_PROGRAMMER_ERROR,
@@ -84,13 +430,11 @@ key_spec_t *make_new_key_spec_from_invocation(invocation_state_t *invocation) {
 		break;
 	}
 
-	if (keyspec->opslimit < 3) {
-		// opslimit must be at least 3 because we're using Argon2i:
-		// https://download.libsodium.org/doc/password_hashing/default_phf#notes
-		keyspec->opslimit = 3;
-	}
-
-	keyspec->algorithm = crypto_pwhash_ALG_ARGON2I13;
+	// The presets above are intended for Argon2id. (Version 1 keyfiles used
+	// Argon2i, for which opslimit had to be raised to at least 3:
+	// https://download.libsodium.org/doc/password_hashing/default_phf#notes)
+	keyspec->algorithm = crypto_pwhash_ALG_ARGON2ID13;
+	keyspec->lanes = (uint8_t)invocation->kdf_lanes;
 	keyspec->kdf_salt =
 	    malloc_or_exit(crypto_pwhash_SALTBYTES,
 	                   "salt in password-derived key specificications");
@@ -100,14 +444,26 @@ key_spec_t *make_new_key_spec_from_invocation(invocation_state_t *invocation) {
 	return keyspec;
 }
 
+key_spec_t *copy_key_spec(key_spec_t *spec) {
+	key_spec_t *copy = malloc_or_exit(sizeof(key_spec_t),
+	                                  "password-derived key specificications");
+	memcpy(copy, spec, sizeof(key_spec_t));
+	copy->prepared_memory = NULL;
+	copy->passphrase = secure_strdup_or_exit(
+	    spec->passphrase,
+	    "passphrase in password-derived key specificications");
+	copy->kdf_salt = malloc_or_exit(
+	    spec->kdf_salt_size, "salt in password-derived key specificications");
+	memcpy(copy->kdf_salt, spec->kdf_salt, spec->kdf_salt_size);
+	return copy;
+}
+
 void free_key_spec(key_spec_t *spec) {
 	if (spec == NULL) {
 		return;
 	}
-	if (spec->passphrase != NULL) {
-		sodium_memzero(spec->passphrase, strlen(spec->passphrase));
-		free(spec->passphrase);
-	}
+	secure_free(spec->passphrase);
+	free_kdf_memory(spec->prepared_memory);
 	if (spec->kdf_salt != NULL) {
 		free(spec->kdf_salt);
 	}
@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <json-c/json.h>
+#include <libcryptsetup.h>
+#include <sodium.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cryptsetup_token_khefin.h"
+#include "khefin.h"
+
+static void log_message(struct crypt_device *cd, int level, const char *format,
+                        ...) __attribute__((format(printf, 3, 4)));
+static void log_message(struct crypt_device *cd, int level, const char *format,
+                        ...) {
+	char message[CRYPTSETUP_TOKEN_KHEFIN_MESSAGE_SIZE];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	crypt_log(cd, level, message);
+}
+
+/**
+ * Passes a warning from libkhefin, such as about a skipped authenticator, to
+ * cryptsetup's log (see khefin_warning_callback_t).
+ */
+static void log_warning(const char *message, void *data) {
+	log_message((struct crypt_device *)data, CRYPT_LOG_NORMAL, "%s\n",
+	            message);
+}
+
+/**
+ * Decodes the keyfile in the token described by json into keyfile, which must
+ * be CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE bytes. Returns 0, or a negative
+ * errno as the token functions do.
+ */
+static int read_keyfile(struct crypt_device *cd, const char *json,
+                        unsigned char *keyfile, size_t *size) {
+	json_object *token = json_tokener_parse(json);
+	json_object *encoded = NULL;
+	if (token == NULL ||
+	    !json_object_object_get_ex(
+	        token, CRYPTSETUP_TOKEN_KHEFIN_KEYFILE_FIELD, &encoded) ||
+	    !json_object_is_type(encoded, json_type_string)) {
+		log_message(cd, CRYPT_LOG_ERROR,
+		            "The " APPNAME " token has no %s string\n",
+		            CRYPTSETUP_TOKEN_KHEFIN_KEYFILE_FIELD);
+		if (token != NULL) {
+			json_object_put(token);
+		}
+		return -EINVAL;
+	}
+
+	int result = 0;
+	if (sodium_base642bin(keyfile, CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE,
+	                      json_object_get_string(encoded),
+	                      (size_t)json_object_get_string_len(encoded), NULL,
+	                      size, NULL, sodium_base64_VARIANT_ORIGINAL) != 0) {
+		log_message(cd, CRYPT_LOG_ERROR,
+		            "The %s of the " APPNAME
+		            " token is not a base64 encoded keyfile\n",
+		            CRYPTSETUP_TOKEN_KHEFIN_KEYFILE_FIELD);
+		result = -EINVAL;
+	}
+	json_object_put(token);
+	return result;
+}
+
+static int errno_for(int khefin_error) {
+	switch (khefin_error) {
+	case KHEFIN_OK:
+		return 0;
+	case KHEFIN_ERR_BAD_PASSPHRASE:
+	case KHEFIN_ERR_BAD_PIN:
+		return -EPERM;
+	case KHEFIN_ERR_NO_DEVICES:
+	case KHEFIN_ERR_NO_VALID_AUTHENTICATOR:
+		// Plugging in the right authenticator may help
+		return -EAGAIN;
+	case KHEFIN_ERR_BAD_INVOCATION:
+	case KHEFIN_ERR_DESERIALIZATION:
+		return -EINVAL;
+	case KHEFIN_ERR_OUT_OF_MEMORY:
+		return -ENOMEM;
+	default:
+		return -EIO;
+	}
+}
+
+/**
+ * Refuses to give a PIN (see khefin_pin_callback_t), noting in *data (a bool)
+ * that an authenticator needed one.
+ */
+static bool refuse_pin(const char *prompt, char *pin, size_t pin_size,
+                       void *data) {
+	(void)prompt;
+	(void)pin;
+	(void)pin_size;
+	*(bool *)data = true;
+	return false;
+}
+
+/**
+ * Gets the secret for the keyfile into secret (which must be
+ * KHEFIN_SECRET_MAX_SIZE bytes), and returns it in *buffer as generate prints
+ * it: in hex, followed by a newline. That is what add-luks-key gives
+ * cryptsetup as the key, so a keyslot added with it can be opened with the
+ * token.
+ */
+static int unlock(struct crypt_device *cd, const unsigned char *keyfile,
+                  size_t keyfile_size, const char *passphrase,
+                  unsigned char *secret, char **buffer, size_t *buffer_len) {
+	khefin_context_t *context = khefin_context_new();
+	if (context == NULL) {
+		return -ENOMEM;
+	}
+	khefin_set_warning_callback(context, log_warning, cd);
+
+	// No authenticator PIN can be asked for, because cryptsetup only asks for
+	// one "PIN", which is the passphrase
+	bool pin_wanted = false;
+	khefin_generate_options_t options;
+	memset(&options, 0, sizeof(options));
+	options.passphrase = passphrase;
+	options.get_pin = refuse_pin;
+	options.get_pin_data = &pin_wanted;
+
+	size_t secret_size = 0;
+	bool derive_subkeys = false;
+	int khefin_result =
+	    khefin_generate(context, keyfile, keyfile_size, &options, secret,
+	                    KHEFIN_SECRET_MAX_SIZE, &secret_size, &derive_subkeys);
+	if (khefin_result != KHEFIN_OK && pin_wanted) {
+		// Not -EPERM, which would have cryptsetup ask for the passphrase
+		// again, when no passphrase would do
+		log_message(cd, CRYPT_LOG_ERROR,
+		            "%s, and the " APPNAME " token cannot ask for one; "
+		            "remove the authenticator's PIN or unlock with the "
+		            APPNAME " keyscript instead\n",
+		            khefin_last_error(context));
+		khefin_context_free(context);
+		return -ENOTSUP;
+	}
+	if (khefin_result != KHEFIN_OK) {
+		log_message(cd, CRYPT_LOG_ERROR, "%s\n", khefin_last_error(context));
+		khefin_context_free(context);
+		return errno_for(khefin_result);
+	}
+	khefin_context_free(context);
+	if (derive_subkeys) {
+		log_message(cd, CRYPT_LOG_ERROR,
+		            "The keyfile in the " APPNAME " token was enrolled with "
+		            "--derive-subkeys, which the token does not support\n");
+		return -EINVAL;
+	}
+
+	*buffer_len = secret_size * 2 + 1;
+	*buffer = sodium_malloc(*buffer_len + 1);
+	if (*buffer == NULL) {
+		return -ENOMEM;
+	}
+	sodium_bin2hex(*buffer, *buffer_len, secret, secret_size);
+	(*buffer)[secret_size * 2] = '\n';
+	(*buffer)[*buffer_len] = '\0';
+	return 0;
+}
+
+KHEFIN_EXPORT const char *cryptsetup_token_version(void) {
+	return APPVERSION;
+}
+
+/**
+ * The keyfile always has a passphrase, which cryptsetup asks for as the
+ * token's PIN; this returns -ENOANO so that it does, unless the token cannot
+ * be used whatever the passphrase.
+ */
+KHEFIN_EXPORT int cryptsetup_token_open(struct crypt_device *cd, int token,
+                                        char **buffer, size_t *buffer_len,
+                                        void *usrptr) {
+	(void)buffer;
+	(void)buffer_len;
+	(void)usrptr;
+	const char *json = NULL;
+	int result = crypt_token_json_get(cd, token, &json);
+	if (result < 0) {
+		return result;
+	}
+
+	unsigned char *keyfile = malloc(CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE);
+	size_t keyfile_size = 0;
+	if (keyfile == NULL) {
+		return -ENOMEM;
+	}
+	result = read_keyfile(cd, json, keyfile, &keyfile_size);
+	free(keyfile);
+	return result == 0 ? -ENOANO : result;
+}
+
+KHEFIN_EXPORT int cryptsetup_token_open_pin(struct crypt_device *cd, int token,
+                                            const char *pin, size_t pin_size,
+                                            char **buffer, size_t *buffer_len,
+                                            void *usrptr) {
+	(void)usrptr;
+	if (pin == NULL) {
+		return -ENOANO;
+	}
+	if (khefin_init() != KHEFIN_OK) {
+		log_message(cd, CRYPT_LOG_ERROR,
+		            "Unable to initialize lib" APPNAME "\n");
+		return -EIO;
+	}
+
+	const char *json = NULL;
+	int result = crypt_token_json_get(cd, token, &json);
+	if (result < 0) {
+		return result;
+	}
+
+	unsigned char *keyfile = malloc(CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE);
+	char *passphrase = sodium_malloc(pin_size + 1);
+	unsigned char *secret = sodium_malloc(KHEFIN_SECRET_MAX_SIZE);
+	size_t keyfile_size = 0;
+	if (keyfile == NULL || passphrase == NULL || secret == NULL) {
+		result = -ENOMEM;
+	} else {
+		result = read_keyfile(cd, json, keyfile, &keyfile_size);
+	}
+	if (result == 0) {
+		memcpy(passphrase, pin, pin_size);
+		passphrase[pin_size] = '\0';
+		result = unlock(cd, keyfile, keyfile_size, passphrase, secret, buffer,
+		                buffer_len);
+	}
+
+	sodium_free(secret);
+	sodium_free(passphrase);
+	free(keyfile);
+	return result;
+}
+
+KHEFIN_EXPORT void cryptsetup_token_buffer_free(void *buffer,
+                                                size_t buffer_len) {
+	(void)buffer_len;
+	sodium_free(buffer);
+}
+
+KHEFIN_EXPORT int cryptsetup_token_validate(struct crypt_device *cd,
+                                            const char *json) {
+	unsigned char *keyfile = malloc(CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE);
+	size_t keyfile_size = 0;
+	if (keyfile == NULL) {
+		return -ENOMEM;
+	}
+	int result = read_keyfile(cd, json, keyfile, &keyfile_size);
+	free(keyfile);
+	return result;
+}
+
+KHEFIN_EXPORT void cryptsetup_token_dump(struct crypt_device *cd,
+                                         const char *json) {
+	unsigned char *keyfile = malloc(CRYPTSETUP_TOKEN_KHEFIN_MAX_KEYFILE_SIZE);
+	size_t keyfile_size = 0;
+	if (keyfile != NULL &&
+	    read_keyfile(cd, json, keyfile, &keyfile_size) == 0) {
+		log_message(cd, CRYPT_LOG_NORMAL, "\tKeyfile:    %zu bytes\n",
+		            keyfile_size);
+	}
+	free(keyfile);
+}
@@ -0,0 +1,336 @@
+#include "device_cache.h"
+
+#include <cbor.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "exit.h"
+#include "files.h"
+#include "memory.h"
+
+// Each entry is a CBOR array with these fields
+#define DEVICE_CACHE_FIELD_PATH 0
+#define DEVICE_CACHE_FIELD_VENDOR 1
+#define DEVICE_CACHE_FIELD_PRODUCT 2
+#define DEVICE_CACHE_FIELD_DEVICE_NUMBER 3
+#define DEVICE_CACHE_FIELD_INODE 4
+#define DEVICE_CACHE_FIELD_CHANGE_SECONDS 5
+#define DEVICE_CACHE_FIELD_CHANGE_NANOSECONDS 6
+#define DEVICE_CACHE_FIELD_FIDO2 7
+#define DEVICE_CACHE_FIELD_HMAC_SECRET 8
+#define DEVICE_CACHE_FIELD_AAGUID 9
+
+#define DEVICE_CACHE_COUNT_OF_FIELDS 10
+
+/**
+ * Fills in identity for the device at path, returning false if the path can't
+ * be examined (in which case identity->path is not set).
+ */
+static bool get_device_identity_for_path(const char *path, int16_t vendor,
+                                         int16_t product,
+                                         device_identity_t *identity) {
+	struct stat node;
+	if (stat(path, &node) != 0) {
+		return false;
+	}
+	identity->path = NULL;
+	identity->vendor = vendor;
+	identity->product = product;
+	identity->device_number = (uint64_t)node.st_rdev;
+	identity->inode = (uint64_t)node.st_ino;
+	identity->change_seconds = (uint64_t)node.st_ctim.tv_sec;
+	identity->change_nanoseconds = (uint64_t)node.st_ctim.tv_nsec;
+	return true;
+}
+
+static bool get_device_identity(const fido_dev_info_t *device_info,
+                                device_identity_t *identity) {
+	return get_device_identity_for_path(
+	    fido_dev_info_path(device_info), fido_dev_info_vendor(device_info),
+	    fido_dev_info_product(device_info), identity);
+}
+
+static bool device_identities_match(const device_identity_t *a,
+                                    const device_identity_t *b) {
+	return a->vendor == b->vendor && a->product == b->product &&
+	       a->device_number == b->device_number && a->inode == b->inode &&
+	       a->change_seconds == b->change_seconds &&
+	       a->change_nanoseconds == b->change_nanoseconds;
+}
+
+static device_cache_entry_t *find_entry(device_cache_t *cache,
+                                        const char *path) {
+	for (size_t i = 0; i < cache->count; i++) {
+		if (strcmp(cache->list[i].identity.path, path) == 0) {
+			return &cache->list[i];
+		}
+	}
+	return NULL;
+}
+
+static bool get_uint_field(cbor_item_t *entry, size_t field, uint64_t maximum,
+                           uint64_t *result) {
+	cbor_item_t *item = cbor_array_get(entry, field);
+	bool valid = cbor_isa_uint(item) && cbor_get_int(item) <= maximum;
+	if (valid) {
+		*result = cbor_get_int(item);
+	}
+	cbor_decref(&item);
+	return valid;
+}
+
+/**
+ * Adds the entry encoded as CBOR to cache, returning false if it is malformed.
+ */
+static bool load_entry(device_cache_t *cache, cbor_item_t *entry) {
+	if (!cbor_isa_array(entry) ||
+	    cbor_array_size(entry) != DEVICE_CACHE_COUNT_OF_FIELDS ||
+	    cache->count >= MAX_DEVICES_TO_LIST) {
+		return false;
+	}
+
+	uint64_t vendor, product, fido2, hmac_secret;
+	device_cache_entry_t loaded;
+	if (!get_uint_field(entry, DEVICE_CACHE_FIELD_VENDOR, UINT16_MAX,
+	                    &vendor) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_PRODUCT, UINT16_MAX,
+	                    &product) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_DEVICE_NUMBER, UINT64_MAX,
+	                    &loaded.identity.device_number) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_INODE, UINT64_MAX,
+	                    &loaded.identity.inode) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_CHANGE_SECONDS, UINT64_MAX,
+	                    &loaded.identity.change_seconds) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_CHANGE_NANOSECONDS,
+	                    UINT64_MAX, &loaded.identity.change_nanoseconds) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_FIDO2, 1, &fido2) ||
+	    !get_uint_field(entry, DEVICE_CACHE_FIELD_HMAC_SECRET, 1,
+	                    &hmac_secret)) {
+		return false;
+	}
+	loaded.identity.vendor = (int16_t)(uint16_t)vendor;
+	loaded.identity.product = (int16_t)(uint16_t)product;
+	loaded.facts.fido2 = fido2 == 1;
+	loaded.facts.supports_hmac_secret = hmac_secret == 1;
+
+	cbor_item_t *aaguid = cbor_array_get(entry, DEVICE_CACHE_FIELD_AAGUID);
+	bool valid = cbor_isa_bytestring(aaguid) &&
+	             cbor_bytestring_is_definite(aaguid) &&
+	             cbor_bytestring_length(aaguid) <= DEVICE_AAGUID_MAX_SIZE;
+	if (valid) {
+		loaded.facts.aaguid_size = cbor_bytestring_length(aaguid);
+		memcpy(loaded.facts.aaguid, cbor_bytestring_handle(aaguid),
+		       loaded.facts.aaguid_size);
+	}
+	cbor_decref(&aaguid);
+
+	cbor_item_t *path = cbor_array_get(entry, DEVICE_CACHE_FIELD_PATH);
+	valid = valid && cbor_isa_string(path) && cbor_string_is_definite(path);
+	if (valid) {
+		size_t path_size = cbor_string_length(path);
+		loaded.identity.path = malloc_or_exit(path_size + 1, "cached path");
+		memcpy(loaded.identity.path, cbor_string_handle(path), path_size);
+		loaded.identity.path[path_size] = (char)0;
+		cache->list[cache->count++] = loaded;
+	}
+	cbor_decref(&path);
+	return valid;
+}
+
+static void load_entries(device_cache_t *cache, unsigned char *data,
+                         size_t length) {
+	struct cbor_load_result result;
+	cbor_item_t *root = cbor_load(data, length, &result);
+	if (result.error.code != CBOR_ERR_NONE) {
+		return;
+	}
+
+	uint64_t version;
+	if (!cbor_isa_array(root) || cbor_array_size(root) != 2 ||
+	    !get_uint_field(root, 0, UINT8_MAX, &version) ||
+	    version != DEVICE_CACHE_VERSION) {
+		cbor_decref(&root);
+		return;
+	}
+
+	cbor_item_t *entries = cbor_array_get(root, 1);
+	if (cbor_isa_array(entries)) {
+		for (size_t i = 0; i < cbor_array_size(entries); i++) {
+			cbor_item_t *entry = cbor_array_get(entries, i);
+			bool loaded = load_entry(cache, entry);
+			cbor_decref(&entry);
+			if (!loaded) {
+				break;
+			}
+		}
+	}
+	cbor_decref(&entries);
+	cbor_decref(&root);
+}
+
+device_cache_t *load_device_cache(void) {
+	device_cache_t *cache =
+	    malloc_or_exit(sizeof(device_cache_t), "device cache");
+	cache->path = NULL;
+	cache->count = 0;
+	cache->list =
+	    malloc_or_exit(sizeof(device_cache_entry_t) * MAX_DEVICES_TO_LIST,
+	                   "device cache list");
+	cache->changed = false;
+
+	const char *runtime_directory = getenv("XDG_RUNTIME_DIR");
+	if (runtime_directory == NULL || runtime_directory[0] != '/') {
+		return cache;
+	}
+	cache->path =
+	    malloc_or_exit(strlen(runtime_directory) +
+	                       strlen("/" DEVICE_CACHE_FILE_NAME) + 1,
+	                   "device cache path");
+	sprintf(cache->path, "%s/%s", runtime_directory, DEVICE_CACHE_FILE_NAME);
+
+	FILE *fp = fopen(cache->path, "r");
+	if (fp == NULL) {
+		return cache;
+	}
+	unsigned char *data =
+	    malloc_or_exit(DEVICE_CACHE_MAX_FILE_SIZE, "device cache contents");
+	size_t length = fread(data, 1, DEVICE_CACHE_MAX_FILE_SIZE, fp);
+	if (ferror(fp) == 0 && feof(fp) != 0) {
+		load_entries(cache, data, length);
+	}
+	fclose(fp);
+	free(data);
+
+	return cache;
+}
+
+bool get_cached_device_facts(device_cache_t *cache,
+                             const fido_dev_info_t *device_info,
+                             device_facts_t *facts) {
+	device_cache_entry_t *entry =
+	    find_entry(cache, fido_dev_info_path(device_info));
+	device_identity_t identity;
+	if (entry == NULL || !get_device_identity(device_info, &identity) ||
+	    !device_identities_match(&entry->identity, &identity)) {
+		return false;
+	}
+	*facts = entry->facts;
+	return true;
+}
+
+void cache_device_facts(device_cache_t *cache,
+                        const fido_dev_info_t *device_info,
+                        const device_facts_t *facts) {
+	device_identity_t identity;
+	if (!get_device_identity(device_info, &identity)) {
+		forget_device_facts(cache, device_info);
+		return;
+	}
+
+	const char *path = fido_dev_info_path(device_info);
+	device_cache_entry_t *entry = find_entry(cache, path);
+	if (entry == NULL) {
+		if (cache->count >= MAX_DEVICES_TO_LIST) {
+			return;
+		}
+		entry = &cache->list[cache->count++];
+		identity.path = strdup_or_exit(path, "cached path");
+	} else {
+		identity.path = entry->identity.path;
+	}
+	entry->identity = identity;
+	entry->facts = *facts;
+	cache->changed = true;
+}
+
+void forget_device_facts(device_cache_t *cache,
+                         const fido_dev_info_t *device_info) {
+	device_cache_entry_t *entry =
+	    find_entry(cache, fido_dev_info_path(device_info));
+	if (entry == NULL) {
+		return;
+	}
+	free(entry->identity.path);
+	*entry = cache->list[--cache->count];
+	cache->changed = true;
+}
+
+static cbor_item_t *serialize_entry(device_cache_entry_t *entry) {
+	cbor_item_t *fields[DEVICE_CACHE_COUNT_OF_FIELDS];
+	fields[DEVICE_CACHE_FIELD_PATH] = cbor_build_string(entry->identity.path);
+	fields[DEVICE_CACHE_FIELD_VENDOR] =
+	    cbor_build_uint16((uint16_t)entry->identity.vendor);
+	fields[DEVICE_CACHE_FIELD_PRODUCT] =
+	    cbor_build_uint16((uint16_t)entry->identity.product);
+	fields[DEVICE_CACHE_FIELD_DEVICE_NUMBER] =
+	    cbor_build_uint64(entry->identity.device_number);
+	fields[DEVICE_CACHE_FIELD_INODE] = cbor_build_uint64(entry->identity.inode);
+	fields[DEVICE_CACHE_FIELD_CHANGE_SECONDS] =
+	    cbor_build_uint64(entry->identity.change_seconds);
+	fields[DEVICE_CACHE_FIELD_CHANGE_NANOSECONDS] =
+	    cbor_build_uint64(entry->identity.change_nanoseconds);
+	fields[DEVICE_CACHE_FIELD_FIDO2] =
+	    cbor_build_uint8(entry->facts.fido2 ? 1 : 0);
+	fields[DEVICE_CACHE_FIELD_HMAC_SECRET] =
+	    cbor_build_uint8(entry->facts.supports_hmac_secret ? 1 : 0);
+	fields[DEVICE_CACHE_FIELD_AAGUID] = cbor_build_bytestring(
+	    entry->facts.aaguid, entry->facts.aaguid_size);
+
+	cbor_item_t *serialized =
+	    cbor_new_definite_array(DEVICE_CACHE_COUNT_OF_FIELDS);
+	for (size_t i = 0; i < DEVICE_CACHE_COUNT_OF_FIELDS; i++) {
+		cbor_array_push(serialized, fields[i]);
+		cbor_decref(&fields[i]);
+	}
+	return serialized;
+}
+
+void save_and_free_device_cache(device_cache_t *cache) {
+	if (cache == NULL) {
+		return;
+	}
+
+	if (cache->changed && cache->path != NULL) {
+		cbor_item_t *entries = cbor_new_definite_array(cache->count);
+		for (size_t i = 0; i < cache->count; i++) {
+			// Leave out devices which have been unplugged
+			device_identity_t identity;
+			if (!get_device_identity_for_path(
+			        cache->list[i].identity.path,
+			        cache->list[i].identity.vendor,
+			        cache->list[i].identity.product, &identity) ||
+			    !device_identities_match(&cache->list[i].identity,
+			                             &identity)) {
+				continue;
+			}
+			cbor_item_t *entry = serialize_entry(&cache->list[i]);
+			cbor_array_push(entries, entry);
+			cbor_decref(&entry);
+		}
+
+		cbor_item_t *root = cbor_new_definite_array(2);
+		cbor_item_t *version = cbor_build_uint8(DEVICE_CACHE_VERSION);
+		cbor_array_push(root, version);
+		cbor_decref(&version);
+		cbor_array_push(root, entries);
+		cbor_decref(&entries);
+
+		encoded_file f;
+		f.path = cache->path;
+		if (cbor_serialize_alloc(root, &f.data, &f.length) == 0) {
+			errx(EXIT_OUT_OF_MEMORY, "Unable to serialize device cache");
+		}
+		cbor_decref(&root);
+		write_file_atomically(&f);
+		free(f.data);
+	}
+
+	for (size_t i = 0; i < cache->count; i++) {
+		free(cache->list[i].identity.path);
+	}
+	free(cache->list);
+	free(cache->path);
+	free(cache);
+}
@@ -5,11 +5,67 @@
 #include <sodium.h>
 #include <string.h>
 
+#include "cryptography.h"
 #include "exit.h"
 #include "files.h"
 #include "memory.h"
 #include "serialization.h"
 
+/**
+ * Checks that device returns the secret for params without user presence or a
+ * PIN, as generate will ask for it for an unattended keyfile, so that a device
+ * which cannot is found out now rather than at an unattended boot.
+ */
+static void
+check_device_gives_secret_unattended(fido_dev_t *device,
+                                     authenticator_parameters_t *params,
+                                     const char *path) {
+	char *authenticator_pin = params->authenticator_pin;
+	params->authenticator_pin = NULL;
+
+	secret_t *secret = malloc_or_exit(sizeof(secret_t), "secret");
+	secret->secret = NULL;
+	secret->secret_size = 0;
+	int r = get_secret_from_authenticator_params(device, params, secret);
+	free_secret(secret);
+	params->authenticator_pin = authenticator_pin;
+
+	if (r != FIDO_OK) {
+		free_parameters(params);
+		close_and_free_device_ignoring_errors(device);
+		errx(EXIT_AUTHENTICATOR_ERROR,
+		     "Device at %s did not return the secret without user presence: "
+		     "%s (0x%x)",
+		     path, fido_strerr(r), r);
+	}
+}
+
+/**
+ * Sets params' device IDs to the USB vendor and product IDs of the device at
+ * path, as given in the devices list.
+ */
+static void record_device_ids(authenticator_parameters_t *params,
+                              const char *path) {
+	devices_list_t *devices_list = list_devices();
+	for (size_t i = 0; i < devices_list->count; i++) {
+		const fido_dev_info_t *di = fido_dev_info_ptr(devices_list->list, i);
+		if (strcmp(fido_dev_info_path(di), path) == 0) {
+			params->device_vendor = fido_dev_info_vendor(di);
+			params->device_product = fido_dev_info_product(di);
+			break;
+		}
+	}
+	free_devices_list(devices_list);
+
+	if (params->device_vendor == 0 && params->device_product == 0) {
+		free_parameters(params);
+		errx(EXIT_AUTHENTICATOR_ERROR,
+		     "Unable to record vendor and product IDs: device at %s is not "
+		     "in the list of devices (see enumerate)",
+		     path);
+	}
+}
+
 void enrol_device(invocation_state_t *invocation) {
 	fido_dev_t *authenticator;
 	authenticator_parameters_t *authenticator_params;
@@ -26,10 +82,16 @@ void enrol_device(invocation_state_t *invocation) {
 
 	authenticator_params = allocate_parameters_except_rpid(0, SALT_SIZE_BYTES);
 	randombytes_buf(authenticator_params->salt, SALT_SIZE_BYTES);
+	authenticator_params->derive_subkeys = invocation->derive_subkeys;
+	authenticator_params->unattended = invocation->unattended;
+	if (invocation->record_device_ids) {
+		record_device_ids(authenticator_params, invocation->device);
+	}
 
 	authenticator_params->relying_party_id =
-	    malloc_or_exit(RELYING_PARTY_ID_SIZE + RELYING_PARTY_SUFFIX_SIZE + 1,
-	                   "relying party id in authenticator parameters");
+	    secure_malloc_or_exit(RELYING_PARTY_ID_SIZE +
+	                              RELYING_PARTY_SUFFIX_SIZE + 1,
+	                          "relying party id in authenticator parameters");
 	for (int i = 0; i < RELYING_PARTY_ID_SIZE; i++) {
 		authenticator_params->relying_party_id[i] =
 		    RPID_ENCODING_TABLE[randombytes_uniform(RPID_ENCODING_TABLE_SIZE)];
@@ -39,7 +101,7 @@ void enrol_device(invocation_state_t *invocation) {
 	        RELYING_PARTY_SUFFIX_SIZE + 1);
 
 	if (fido_dev_has_pin(authenticator)) {
-		authenticator_params->authenticator_pin = malloc_or_exit(
+		authenticator_params->authenticator_pin = secure_malloc_or_exit(
 		    LONGEST_VALID_PIN + 1, "authenticator PIN in enrol_device");
 		if (invocation->authenticator_pin == NULL) {
 			prompt_for_secret("authenticator PIN", LONGEST_VALID_PIN,
@@ -56,14 +118,45 @@ void enrol_device(invocation_state_t *invocation) {
 		}
 	}
 
-	create_credential(authenticator, authenticator_params);
-	close_and_free_device_ignoring_errors(authenticator);
-
+	// Derive the key while we wait for the user to touch the authenticator,
+	// so that only encryption is left to do once the credential is created.
 	key_spec_t *key_spec = make_new_key_spec_from_invocation(invocation);
+	key_derivation_t *key_derivation =
+	    start_deriving_key_consuming_key_spec(copy_key_spec(key_spec));
+
+	int r = create_credential(authenticator, authenticator_params);
+	if (r != FIDO_OK) {
+		// The derivation is stopped rather than left running, which matters
+		// in the library, where the process carries on
+		cancel_key_derivation(key_derivation);
+		free_key_spec(key_spec);
+		free_device_info(device_info);
+		free_parameters(authenticator_params);
+		close_and_free_device_ignoring_errors(authenticator);
+		if (r == FIDO_ERR_PIN_INVALID) {
+			errx(EXIT_BAD_PIN, "Invalid authenticator PIN");
+		}
+		errx(EXIT_AUTHENTICATOR_ERROR,
+		     "Unable to create credential on FIDO2 device: %s (0x%x)",
+		     fido_strerr(r), r);
+	}
+
+	unsigned char *key_bytes = finish_deriving_key(key_derivation);
+	key_derivation = NULL;
+
+	// Only once the key is derived, as this exits if the check fails
+	if (invocation->unattended) {
+		check_device_gives_secret_unattended(
+		    authenticator, authenticator_params, invocation->device);
+	}
+	close_and_free_device_ignoring_errors(authenticator);
 	cleartext =
-	    build_deserialized_cleartext_from_authenticator_parameters_and_key_spec(
-	        authenticator_params, key_spec);
+	    build_deserialized_cleartext_from_authenticator_parameters_and_key_spec_and_key(
+	        authenticator_params, key_spec, key_bytes);
+	free_key(key_bytes);
+	key_bytes = NULL;
 	free_key_spec(key_spec);
+	key_spec = NULL;
 
 	cleartext->device_aaguid_size = fido_cbor_info_aaguid_len(device_info);
 	cleartext->device_aaguid =
@@ -7,43 +7,45 @@
 #include "exit.h"
 
 void print_devices_list(devices_list_t *devices_list) {
-	for (size_t i = 0; i < devices_list->count; i++) {
-		const fido_dev_info_t *device_info =
-		    fido_dev_info_ptr(devices_list->list, i);
-		fido_dev_t *authenticator =
-		    get_device_even_if_not_fido2(fido_dev_info_path(device_info));
-
-		fido_cbor_info_t *ctap_info = get_device_info(authenticator);
+	// Nothing needs to be kept open, so devices the cache knows about are
+	// not opened at all
+	probed_devices_t *probed = probe_devices(devices_list, NULL, NULL);
+
+	for (size_t i = 0; i < probed->count; i++) {
+		probed_device_t *device = &probed->list[i];
+		if (device->status != device_probe_ok) {
+			warnx("Unable to access device at %s: %s", device->path,
+			      describe_device_probe_failure(device));
+		}
 
-		bool device_supported = fido_dev_is_fido2(authenticator) &&
-		                        device_supports_hmac_secret(ctap_info);
+		bool device_supported = device->status == device_probe_ok &&
+		                        device->facts.fido2 &&
+		                        device->facts.supports_hmac_secret;
 
 		printf("%s\t", device_supported ? " " : "!");
 
-		printf("%s\t", fido_dev_info_path(device_info));
+		printf("%s\t", device->path);
 
-		printf("%s %s\t", fido_dev_info_manufacturer_string(device_info),
-		       fido_dev_info_product_string(device_info));
+		printf("%s %s\t", device->manufacturer_string,
+		       device->product_string);
 
-		print_device_aaguid(ctap_info);
+		if (device->status == device_probe_ok) {
+			print_device_aaguid(&device->facts);
+		}
 		printf("\n");
-
-		free_device_info(ctap_info);
-		close_and_free_device_ignoring_errors(authenticator);
 	}
 
+	free_probed_devices(probed);
+
 	if (devices_list->count == 0) {
 		free_devices_list(devices_list);
 		errx(EXIT_NO_DEVICES, "No devices found");
 	}
 }
 
-void print_device_aaguid(fido_cbor_info_t *ctap_info) {
-	const unsigned char *device_aaguid = fido_cbor_info_aaguid_ptr(ctap_info);
-	size_t device_aaguid_size = fido_cbor_info_aaguid_len(ctap_info);
-
-	for (size_t i = 0; i < device_aaguid_size; i++) {
-		printf("%02x", device_aaguid[i]);
+void print_device_aaguid(const device_facts_t *facts) {
+	for (size_t i = 0; i < facts->aaguid_size; i++) {
+		printf("%02x", facts->aaguid[i]);
 		// Add separators for GUID, two characters per byte:
 		//  0                       1
 		//  0 1 2 3  4 5  6 7  8 9  0 1 2 3 4 5
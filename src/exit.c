@@ -0,0 +1,76 @@
+#include "exit.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static __thread failure_catcher_t *current_catcher = NULL;
+static __thread warning_handler_t current_warning_handler = NULL;
+static __thread void *current_warning_data = NULL;
+
+void fail(int exit_code, bool with_errno, const char *format, ...) {
+	int saved_errno = errno;
+	va_list arguments;
+	va_start(arguments, format);
+
+	failure_catcher_t *catcher = current_catcher;
+	if (catcher == NULL) {
+		errno = saved_errno;
+		if (with_errno) {
+			verr(exit_code, format, arguments);
+		}
+		verrx(exit_code, format, arguments);
+	}
+
+	current_catcher = NULL;
+	catcher->exit_code = exit_code;
+	int length = vsnprintf(catcher->message, sizeof(catcher->message),
+	                       format, arguments);
+	va_end(arguments);
+	if (with_errno && length >= 0 &&
+	    (size_t)length < sizeof(catcher->message)) {
+		snprintf(catcher->message + length,
+		         sizeof(catcher->message) - (size_t)length, ": %s",
+		         strerror(saved_errno));
+	}
+	longjmp(catcher->jump, 1);
+}
+
+void catch_failures(failure_catcher_t *catcher) { current_catcher = catcher; }
+
+void stop_catching_failures(void) { current_catcher = NULL; }
+
+void warning(bool with_errno, const char *format, ...) {
+	int saved_errno = errno;
+	va_list arguments;
+	va_start(arguments, format);
+
+	if (current_warning_handler == NULL) {
+		errno = saved_errno;
+		if (with_errno) {
+			vwarn(format, arguments);
+		} else {
+			vwarnx(format, arguments);
+		}
+		va_end(arguments);
+		return;
+	}
+
+	char message[FAILURE_MESSAGE_SIZE];
+	int length = vsnprintf(message, sizeof(message), format, arguments);
+	va_end(arguments);
+	if (with_errno && length >= 0 && (size_t)length < sizeof(message)) {
+		snprintf(message + length, sizeof(message) - (size_t)length, ": %s",
+		         strerror(saved_errno));
+	}
+	current_warning_handler(message, current_warning_data);
+	errno = saved_errno;
+}
+
+void redirect_warnings(warning_handler_t handler, void *data) {
+	current_warning_handler = handler;
+	current_warning_data = data;
+}
+
+void stop_redirecting_warnings(void) { redirect_warnings(NULL, NULL); }
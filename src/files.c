@@ -1,52 +1,67 @@
 #include "files.h"
 #include "exit.h"
 #include "memory.h"
+#include <fcntl.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-encoded_file *read_file(const char *path) {
-	encoded_file *result =
-	    malloc_or_exit(sizeof(encoded_file), "encoded file structure");
-
-	long int ftell_result;
-
+encoded_file *try_read_file(const char *path, char *error,
+                            size_t error_size) {
 	FILE *fp = fopen(path, "r");
 	if (fp == NULL) {
-		errx(EXIT_DESERIALIZATION_ERROR, "Unable to open file at %s", path);
+		snprintf(error, error_size, "Unable to open file at %s", path);
+		return NULL;
 	}
 
+	long int ftell_result;
 	if (fseek(fp, 0, SEEK_END) != 0) {
-		errx(EXIT_DESERIALIZATION_ERROR, "Unable to seek to end of file at %s",
-		     path);
+		snprintf(error, error_size, "Unable to seek to end of file at %s",
+		         path);
+		fclose(fp);
+		return NULL;
 	}
 
 	if ((ftell_result = ftell(fp)) < 0) {
-		errx(EXIT_DESERIALIZATION_ERROR, "Unable to get size of file at %s",
-		     path);
+		snprintf(error, error_size, "Unable to get size of file at %s", path);
+		fclose(fp);
+		return NULL;
 	}
 	size_t length = (size_t)ftell_result;
 
 	if (fseek(fp, 0, SEEK_SET) != 0) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Unable to seek to start of file at %s", path);
+		snprintf(error, error_size, "Unable to seek to start of file at %s",
+		         path);
+		fclose(fp);
+		return NULL;
 	}
 
 	if (length > LARGEST_VALID_PAYLOAD_SIZE_BYTES) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File at %s is too big (more than %d bytes); refusing to load it",
-		     path, LARGEST_VALID_PAYLOAD_SIZE_BYTES);
+		snprintf(error, error_size,
+		         "File at %s is too big (more than %d bytes); refusing to "
+		         "load it",
+		         path, LARGEST_VALID_PAYLOAD_SIZE_BYTES);
+		fclose(fp);
+		return NULL;
 	}
 
 	unsigned char *buffer =
 	    malloc_or_exit(length, "buffer for reading keyfile");
 
 	if (fread(buffer, length, 1, fp) != 1) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Unable to read file at %s into buffer", path);
+		snprintf(error, error_size, "Unable to read file at %s into buffer",
+		         path);
+		free(buffer);
+		fclose(fp);
+		return NULL;
 	}
 
 	fclose(fp);
 
+	encoded_file *result =
+	    malloc_or_exit(sizeof(encoded_file), "encoded file structure");
 	size_t path_size_including_null = strlen(path) + 1;
 	result->path =
 	    malloc_or_exit(path_size_including_null, "encoded file path");
@@ -57,6 +72,15 @@ encoded_file *read_file(const char *path) {
 	return result;
 }
 
+encoded_file *read_file(const char *path) {
+	char error[FAILURE_MESSAGE_SIZE];
+	encoded_file *result = try_read_file(path, error, sizeof(error));
+	if (result == NULL) {
+		errx(EXIT_DESERIALIZATION_ERROR, "%s", error);
+	}
+	return result;
+}
+
 void write_file(encoded_file *file) {
 	FILE *fp = fopen(file->path, "w");
 
@@ -78,6 +102,79 @@ void write_file(encoded_file *file) {
 	fclose(fp);
 }
 
+bool write_file_atomically(encoded_file *file) {
+	const char *suffix = ".XXXXXX";
+	char *temporary_path = malloc_or_exit(
+	    strlen(file->path) + strlen(suffix) + 1, "temporary file path");
+	strcpy(temporary_path, file->path);
+	strcat(temporary_path, suffix);
+
+	int fd = mkstemp(temporary_path);
+	if (fd < 0) {
+		warn("Unable to create temporary file for %s", file->path);
+		free(temporary_path);
+		return false;
+	}
+
+	// Keep the permissions of the file we are replacing, rather than
+	// mkstemp()'s 0600
+	struct stat existing;
+	if (stat(file->path, &existing) == 0 &&
+	    fchmod(fd, existing.st_mode & 07777) != 0) {
+		warn("Unable to set permissions on temporary file for %s",
+		     file->path);
+		goto fail;
+	}
+
+	size_t written = 0;
+	while (written < file->length) {
+		ssize_t result =
+		    write(fd, file->data + written, file->length - written);
+		if (result < 0) {
+			warn("Unable to write temporary file for %s", file->path);
+			goto fail;
+		}
+		written += (size_t)result;
+	}
+
+	if (fsync(fd) != 0) {
+		warn("Unable to sync temporary file for %s", file->path);
+		goto fail;
+	}
+	if (close(fd) != 0) {
+		fd = -1;
+		warn("Unable to close temporary file for %s", file->path);
+		goto fail;
+	}
+	fd = -1;
+
+	if (rename(temporary_path, file->path) != 0) {
+		warn("Unable to replace %s", file->path);
+		goto fail;
+	}
+	free(temporary_path);
+
+	// Make the rename itself durable; the file is in place either way, so
+	// failing here is not an error
+	char *directory_path = strdup_or_exit(file->path, "directory path");
+	int directory_fd = open(dirname(directory_path), O_RDONLY | O_DIRECTORY);
+	if (directory_fd >= 0) {
+		fsync(directory_fd);
+		close(directory_fd);
+	}
+	free(directory_path);
+
+	return true;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+	unlink(temporary_path);
+	free(temporary_path);
+	return false;
+}
+
 void free_encoded_file(encoded_file *file) {
 	if (file->path) {
 		free(file->path);
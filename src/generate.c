@@ -1,124 +1,684 @@
 #include "generate.h"
 
+#include <fcntl.h>
 #include <sodium.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "agent.h"
+#include "calibrate.h"
 #include "cryptography.h"
 #include "exit.h"
 #include "files.h"
+#include "hotplug.h"
+#include "kdf_cache.h"
 #include "memory.h"
 #include "serialization.h"
 
-unsigned short int
-print_secret_consuming_invocation(invocation_state_t *invocation,
-                                  devices_list_t *devices_list) {
+typedef struct candidate_authenticator_t {
+	fido_dev_t *device;
+	const char *path;
+	const char *product_string;
+	char *pin;
+} candidate_authenticator_t;
+
+typedef struct candidate_authenticators_t {
+	size_t count;
+	candidate_authenticator_t *list;
+} candidate_authenticators_t;
+
+static void
+free_candidate_authenticators(candidate_authenticators_t *candidates) {
+	if (candidates == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < candidates->count; i++) {
+		close_and_free_device_ignoring_errors(candidates->list[i].device);
+		secure_free(candidates->list[i].pin);
+	}
+	free(candidates->list);
+	free(candidates);
+}
+
+bool device_may_be_candidate(const fido_dev_info_t *device_info,
+                             const device_facts_t *facts, void *context) {
+	deserialized_cleartext *cleartext = (deserialized_cleartext *)context;
+	if (facts == NULL) {
+		return device_ids_match(cleartext, device_info);
+	}
+	return facts->fido2 && facts->supports_hmac_secret &&
+	       device_aaguid_matches(cleartext, facts);
+}
+
+/**
+ * Probes each device in devices_list, keeping (open) those which match the
+ * keyfile's AAGUID and support hmac-secret, and collecting a PIN for those
+ * which need one. This is intended to run while the key is being derived.
+ */
+static candidate_authenticators_t *
+find_candidate_authenticators(invocation_state_t *invocation,
+                              deserialized_cleartext *cleartext,
+                              devices_list_t *devices_list) {
+	candidate_authenticators_t *candidates = malloc_or_exit(
+	    sizeof(candidate_authenticators_t), "candidate authenticators");
+	candidates->count = 0;
+	candidates->list = malloc_or_exit(sizeof(candidate_authenticator_t) *
+	                                      (devices_list->count > 0
+	                                           ? devices_list->count
+	                                           : 1),
+	                                  "candidate authenticators list");
+
+	probed_devices_t *probed =
+	    probe_devices(devices_list, device_may_be_candidate, cleartext);
+
+	// Devices are considered (and PINs asked for) in the order they were
+	// listed, however quickly each one answered.
+	for (size_t i = 0; i < probed->count; i++) {
+		probed_device_t *device = &probed->list[i];
+		if (device->status == device_probe_not_wanted) {
+			// Not a candidate according to its vendor and product IDs
+			continue;
+		}
+		if (device->status != device_probe_ok) {
+			warnx("Skipping device at %s: %s", device->path,
+			      describe_device_probe_failure(device));
+			continue;
+		}
+		if (device->device == NULL) {
+			// Not a candidate, so never kept open
+			continue;
+		}
+		const char *authenticator_path = device->path;
+		const char *authenticator_product_string = device->product_string;
+		fido_dev_t *authenticator = device->device;
+		device->device = NULL;
+
+		// An unattended keyfile's secret is got without the PIN
+		char *authenticator_pin = NULL;
+		if (!cleartext->unattended && fido_dev_has_pin(authenticator)) {
+			authenticator_pin = secure_malloc_or_exit(
+			    LONGEST_VALID_PIN + 1, "authenticator PIN in generate");
+			const char *prompt_format_string = "authenticator PIN for %s at %s";
+			char *prompt_string =
+			    malloc_or_exit(strlen(prompt_format_string) +
+			                       strlen(authenticator_product_string) +
+			                       strlen(authenticator_path) + 1,
+			                   "PIN prompt");
+			sprintf(prompt_string, prompt_format_string,
+			        authenticator_product_string, authenticator_path);
+
+			if (invocation->authenticator_pin == NULL) {
+				prompt_for_secret(prompt_string, LONGEST_VALID_PIN,
+				                  authenticator_pin);
+			} else {
+				strncpy(authenticator_pin, invocation->authenticator_pin,
+				        LONGEST_VALID_PIN);
+				authenticator_pin[LONGEST_VALID_PIN] = '\0';
+			}
+			free(prompt_string);
+			prompt_string = NULL;
+
+			if (strlen(authenticator_pin) == 0) {
+				fprintf(stderr,
+				        "No PIN entered; skipping this authenticator.\n");
+				secure_free(authenticator_pin);
+				close_and_free_device_ignoring_errors(authenticator);
+				continue;
+			}
+		}
+
+		candidate_authenticator_t *candidate =
+		    &candidates->list[candidates->count++];
+		candidate->device = authenticator;
+		candidate->path = authenticator_path;
+		candidate->product_string = authenticator_product_string;
+		candidate->pin = authenticator_pin;
+	}
+
+	free_probed_devices(probed);
+
+	return candidates;
+}
+
+static void warn_candidate_failed(candidate_authenticator_t *candidate,
+                                  int result) {
+	switch (result) {
+	case FIDO_ERR_NO_CREDENTIALS:
+		// no warning here
+		break;
+	case FIDO_ERR_PIN_INVALID:
+		warnx("Invalid PIN for %s at %s", candidate->product_string,
+		      candidate->path);
+		break;
+	default:
+		warnx("%s at %s did not return a valid secret: %s (0x%x)",
+		      candidate->product_string, candidate->path,
+		      fido_strerr(result), result);
+		break;
+	}
+}
+
+/**
+ * Asks every candidate at once, without needing a touch, whether it holds the
+ * keyfile's credential, and drops those which do not, so that authenticators
+ * of the same model which do not hold it never ask to be touched.
+ */
+static void
+drop_candidates_without_credential(candidate_authenticators_t *candidates,
+                                   authenticator_parameters_t *params) {
+	assertion_attempt_t *attempts = malloc_or_exit(
+	    sizeof(assertion_attempt_t) * (candidates->count > 0 ? candidates->count
+	                                                         : 1),
+	    "credential probes");
+	for (size_t i = 0; i < candidates->count; i++) {
+		attempts[i].device = candidates->list[i].device;
+		attempts[i].pin = NULL;
+	}
+
+	probe_for_credential_on_devices(attempts, candidates->count, params);
+
+	// Devices which cannot say whether they hold it are kept, and asked
+	// properly later
+	size_t kept = 0;
+	for (size_t i = 0; i < candidates->count; i++) {
+		candidate_authenticator_t *candidate = &candidates->list[i];
+		if (attempts[i].result == FIDO_ERR_NO_CREDENTIALS ||
+		    attempts[i].result == FIDO_ERR_INVALID_CREDENTIAL) {
+			close_and_free_device_ignoring_errors(candidate->device);
+			secure_free(candidate->pin);
+			continue;
+		}
+		candidates->list[kept++] = *candidate;
+	}
+	candidates->count = kept;
+
+	free(attempts);
+}
+
+/**
+ * Asks each candidate for the secret in turn until one returns it, returning
+ * whether any did.
+ */
+static bool
+try_candidate_authenticators_in_turn(candidate_authenticators_t *candidates,
+                                     authenticator_parameters_t *params,
+                                     secret_t *secret) {
+	for (size_t i = 0; i < candidates->count; i++) {
+		candidate_authenticator_t *candidate = &candidates->list[i];
+
+		// The parameters only ever hold the current candidate's PIN, which
+		// remains owned by the candidate.
+		params->authenticator_pin = candidate->pin;
+		int result = get_secret_from_authenticator_params(candidate->device,
+		                                                  params, secret);
+		params->authenticator_pin = NULL;
+		if (result == FIDO_OK) {
+			return true;
+		}
+		warn_candidate_failed(candidate, result);
+	}
+	return false;
+}
+
+/**
+ * Asks every candidate for the secret at once, so that whichever the user
+ * touches first answers, returning whether any did.
+ */
+static bool race_candidate_authenticators(
+    candidate_authenticators_t *candidates, authenticator_parameters_t *params,
+    secret_t *secret) {
+	assertion_attempt_t *attempts = malloc_or_exit(
+	    sizeof(assertion_attempt_t) * candidates->count, "assertion attempts");
+	for (size_t i = 0; i < candidates->count; i++) {
+		attempts[i].device = candidates->list[i].device;
+		attempts[i].pin = candidates->list[i].pin;
+	}
+
+	size_t winner = race_for_secret_from_authenticator_params(
+	    attempts, candidates->count, params, secret);
+	if (winner == candidates->count) {
+		for (size_t i = 0; i < candidates->count; i++) {
+			warn_candidate_failed(&candidates->list[i], attempts[i].result);
+		}
+	}
+
+	free(attempts);
+	return winner != candidates->count;
+}
+
+static bool is_transport_error(int result) {
+	return result == FIDO_ERR_TX || result == FIDO_ERR_RX ||
+	       result == FIDO_ERR_RX_NOT_CBOR || result == FIDO_ERR_RX_INVALID_CBOR;
+}
+
+unsigned short int get_secret_from_open_devices(
+    devices_list_t *devices_list, probed_devices_t *probed,
+    deserialized_cleartext *cleartext, authenticator_parameters_t *params,
+    const char *pin, bool race, secret_t *secret, probed_device_t **needs_pin,
+    bool *transport_error) {
+	size_t slots = probed->count > 0 ? probed->count : 1;
+	assertion_attempt_t *attempts =
+	    malloc_or_exit(sizeof(assertion_attempt_t) * slots, "attempts");
+	candidate_authenticator_t *candidates = malloc_or_exit(
+	    sizeof(candidate_authenticator_t) * slots, "candidate authenticators");
+	size_t count = 0;
+
+	for (size_t i = 0; i < probed->count; i++) {
+		probed_device_t *device = &probed->list[i];
+		if (device->status != device_probe_ok || device->device == NULL ||
+		    !device_ids_match(cleartext,
+		                      fido_dev_info_ptr(devices_list->list, i)) ||
+		    !device_aaguid_matches(cleartext, &device->facts)) {
+			continue;
+		}
+
+		// An unattended keyfile's secret is got without the PIN
+		const char *device_pin = NULL;
+		if (!params->unattended && fido_dev_has_pin(device->device)) {
+			if (pin == NULL) {
+				*needs_pin = device;
+				free(candidates);
+				free(attempts);
+				return EXIT_BAD_PIN;
+			}
+			// As when no PIN is entered for generate
+			if (pin[0] == '\0') {
+				continue;
+			}
+			device_pin = pin;
+		}
+
+		// A shorter timeout may be left from an earlier unattended keyfile
+		fido_dev_set_timeout(device->device, -1);
+		attempts[count].device = device->device;
+		attempts[count].pin = device_pin;
+		candidates[count].device = device->device;
+		candidates[count].path = device->path;
+		candidates[count].product_string = device->product_string;
+		candidates[count].pin = NULL;
+		count++;
+	}
+
+	if (count == 0) {
+		free(candidates);
+		free(attempts);
+		return devices_list->count == 0 ? EXIT_NO_DEVICES
+		                                : EXIT_NO_VALID_AUTHENTICATOR;
+	}
+
+	// As for generate, so that authenticators which do not hold the
+	// credential never ask to be touched
+	if (!params->unattended) {
+		probe_for_credential_on_devices(attempts, count, params);
+		size_t kept = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (attempts[i].result == FIDO_ERR_NO_CREDENTIALS ||
+			    attempts[i].result == FIDO_ERR_INVALID_CREDENTIAL) {
+				continue;
+			}
+			attempts[kept] = attempts[i];
+			candidates[kept++] = candidates[i];
+		}
+		count = kept;
+	}
+
+	// Racing a single device is just asking it, but leaves any error in its
+	// attempt rather than exiting
+	size_t winner = count;
+	if (race) {
+		winner = race_for_secret_from_authenticator_params(attempts, count,
+		                                                   params, secret);
+	} else {
+		for (size_t i = 0; i < count && winner == count; i++) {
+			if (race_for_secret_from_authenticator_params(
+			        &attempts[i], 1, params, secret) == 0) {
+				winner = i;
+			}
+		}
+	}
+
+	unsigned short int result = EXIT_SUCCESS;
+	if (winner == count) {
+		result = EXIT_NO_VALID_AUTHENTICATOR;
+		for (size_t i = 0; i < count; i++) {
+			warn_candidate_failed(&candidates[i], attempts[i].result);
+			if (attempts[i].result == FIDO_ERR_PIN_INVALID) {
+				result = EXIT_BAD_PIN;
+			}
+			*transport_error =
+			    *transport_error || is_transport_error(attempts[i].result);
+		}
+	}
+
+	free(candidates);
+	free(attempts);
+	return result;
+}
+
+void use_second_salt_for_second_mixin(authenticator_parameters_t *params,
+                                      deserialized_cleartext *cleartext,
+                                      unsigned char *key_bytes,
+                                      char *second_mixin) {
+	if (params->salt_size != 2 * HMAC_SECRET_SALT_SIZE) {
+		errx(EXIT_DESERIALIZATION_ERROR,
+		     "The salt in this keyfile is %zu bytes, but --second-mixin needs "
+		     "%d bytes",
+		     params->salt_size, 2 * HMAC_SECRET_SALT_SIZE);
+	}
+	authenticator_parameters_t *second_params =
+	    build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+	        cleartext, key_bytes, second_mixin);
+	memcpy(params->salt + HMAC_SECRET_SALT_SIZE, second_params->salt,
+	       HMAC_SECRET_SALT_SIZE);
+	free_parameters(second_params);
+}
+
+/**
+ * Exits if --derive was given for a keyfile not enrolled with
+ * --derive-subkeys, or the other way around.
+ */
+static void check_subkeys_match_keyfile(invocation_state_t *invocation,
+                                        bool derive_subkeys) {
+	if (derive_subkeys && invocation->subkey_labels == NULL) {
+		errx(EXIT_BAD_INVOCATION,
+		     "%s was enrolled with --derive-subkeys, so --derive is required",
+		     invocation->file);
+	}
+	if (!derive_subkeys && invocation->subkey_labels != NULL) {
+		errx(EXIT_BAD_INVOCATION,
+		     "%s was not enrolled with --derive-subkeys, so --derive cannot be "
+		     "used",
+		     invocation->file);
+	}
+}
+
+void print_hex(FILE *stream, const unsigned char *data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		fprintf(stream, "%02x", data[i]);
+	}
+	fprintf(stream, "\n");
+}
+
+/**
+ * Prints the secret on STDOUT. With --second-mixin, the secret holds two
+ * secrets, and the second goes to --second-output (if given, and first, so
+ * that it is there as soon as whoever reads STDOUT carries on) or else on the
+ * following line. With --derive, the secret is a root secret, and the subkey
+ * for each label is printed instead, one per line.
+ */
+static void print_secret(invocation_state_t *invocation, secret_t *secret) {
+	if (invocation->subkey_labels != NULL) {
+		unsigned char *subkey =
+		    secure_malloc_or_exit(SUBKEY_SIZE, "subkey in generate");
+		for (size_t i = 0; i < invocation->subkey_label_count; i++) {
+			derive_subkey(subkey, secret->secret, secret->secret_size,
+			              invocation->subkey_labels[i]);
+			print_hex(stdout, subkey, SUBKEY_SIZE);
+		}
+		secure_free(subkey);
+		fflush(stdout);
+		return;
+	}
+
+	if (invocation->second_mixin == NULL) {
+		print_hex(stdout, secret->secret, secret->secret_size);
+		fflush(stdout);
+		return;
+	}
+
+	size_t half = secret->secret_size / 2;
+	if (invocation->second_output != NULL) {
+		int fd = open(invocation->second_output,
+		              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		FILE *second_output = fd < 0 ? NULL : fdopen(fd, "w");
+		if (second_output == NULL) {
+			err(EXIT_OUTPUT_ERROR, "Unable to open %s",
+			    invocation->second_output);
+		}
+		print_hex(second_output, secret->secret + half, half);
+		if (fclose(second_output) != 0) {
+			err(EXIT_OUTPUT_ERROR, "Unable to write %s",
+			    invocation->second_output);
+		}
+		print_hex(stdout, secret->secret, half);
+	} else {
+		print_hex(stdout, secret->secret, half);
+		print_hex(stdout, secret->secret + half, half);
+	}
+	fflush(stdout);
+}
+
+loaded_keyfile_t *
+load_keyfile_and_start_preparing_kdf_memory(invocation_state_t *invocation) {
 	encoded_file *f = read_file(invocation->file);
-	deserialized_cleartext *cleartext = load_cleartext(f);
+	loaded_keyfile_t *keyfile =
+	    malloc_or_exit(sizeof(loaded_keyfile_t), "loaded keyfile");
+	keyfile->cleartext = load_cleartext(f);
 	free_encoded_file(f);
 
-	key_spec_t *key_spec = make_key_spec_from_passphrase_and_cleartext(
-	    invocation->passphrase, cleartext);
-	unsigned char *key_bytes = derive_key(key_spec);
-	free_key_spec(key_spec);
-	key_spec = NULL;
+	size_t available_memory = get_available_memory();
+	if (keyfile->cleartext->memlimit > available_memory) {
+		warnx("Key derivation for %s needs %zu MiB of memory, but only %zu MiB "
+		      "appear to be available",
+		      invocation->file, keyfile->cleartext->memlimit / MEBIBYTE,
+		      available_memory / MEBIBYTE);
+	}
+
+	keyfile->kdf_memory = NULL;
+	keyfile->cached_key = NULL;
+	if (invocation->kdf_cache_ttl != 0) {
+		keyfile->cached_key = get_cached_key_for_cleartext(keyfile->cleartext);
+		if (keyfile->cached_key != NULL) {
+			return keyfile;
+		}
+	}
+
+	// Faulting in the memory can take hundreds of milliseconds for the higher
+	// hardness levels, so we do it while the user types their passphrase.
+	keyfile->kdf_memory = start_preparing_kdf_memory(
+	    keyfile->cleartext->memlimit, keyfile->cleartext->lanes);
+
+	return keyfile;
+}
+
+void free_loaded_keyfile(loaded_keyfile_t *keyfile) {
+	if (keyfile == NULL) {
+		return;
+	}
+	free_kdf_memory(keyfile->kdf_memory);
+	free_key(keyfile->cached_key);
+	free_cleartext(keyfile->cleartext);
+	free(keyfile);
+}
+
+/**
+ * Waits for a device to be connected or changed, then replaces devices_list and
+ * candidates with those now connected, returning false if watch timed out
+ * first.
+ */
+static bool
+wait_for_candidate_authenticators(invocation_state_t *invocation,
+                                  deserialized_cleartext *cleartext,
+                                  hotplug_watch_t *watch,
+                                  devices_list_t **devices_list,
+                                  candidate_authenticators_t **candidates) {
+	if (!wait_for_device_change(watch)) {
+		return false;
+	}
+	free_candidate_authenticators(*candidates);
+	free_devices_list(*devices_list);
+	*devices_list = list_devices();
+	*candidates =
+	    find_candidate_authenticators(invocation, cleartext, *devices_list);
+	return true;
+}
+
+unsigned short int
+print_secret_consuming_invocation_and_keyfile(invocation_state_t *invocation,
+                                              loaded_keyfile_t *keyfile) {
+	deserialized_cleartext *cleartext = keyfile->cleartext;
+	keyfile->cleartext = NULL;
+	kdf_memory_t *kdf_memory = keyfile->kdf_memory;
+	keyfile->kdf_memory = NULL;
+	unsigned char *cached_key = keyfile->cached_key;
+	keyfile->cached_key = NULL;
+	free_loaded_keyfile(keyfile);
+	keyfile = NULL;
+
+	// Watch before listing, so that no device connected in between is missed
+	hotplug_watch_t *hotplug_watch = NULL;
+	if (invocation->wait_for_device) {
+		hotplug_watch = start_watching_for_devices(invocation->wait_seconds);
+	}
+	devices_list_t *devices_list = list_devices();
+
+	if (devices_list->count == 0 && hotplug_watch == NULL) {
+		// No point deriving a key we have nothing to use with
+		free_devices_list(devices_list);
+		devices_list = NULL;
+
+		free_invocation(invocation);
+		invocation = NULL;
+
+		free_kdf_memory(kdf_memory);
+		kdf_memory = NULL;
+
+		free_key(cached_key);
+		cached_key = NULL;
+
+		free_cleartext(cleartext);
+		cleartext = NULL;
+
+		return EXIT_NO_DEVICES;
+	}
+
+	// Derive the key in the background while we talk to the authenticators
+	// and prompt for PINs (or wait for one to be connected), which can take a
+	// while.
+	key_derivation_t *key_derivation = NULL;
+	if (cached_key == NULL) {
+		key_spec_t *key_spec = make_key_spec_from_passphrase_and_cleartext(
+		    invocation->passphrase, cleartext);
+		key_spec->prepared_memory = kdf_memory;
+		kdf_memory = NULL;
+		key_derivation = start_deriving_key_consuming_key_spec(key_spec);
+		key_spec = NULL;
+	}
+
+	candidate_authenticators_t *candidates =
+	    find_candidate_authenticators(invocation, cleartext, devices_list);
+
+	if (candidates->count == 0 && hotplug_watch != NULL) {
+		warn_waiting_for_authenticator(invocation->wait_seconds);
+		while (candidates->count == 0 &&
+		       wait_for_candidate_authenticators(invocation, cleartext,
+		                                         hotplug_watch, &devices_list,
+		                                         &candidates)) {
+		}
+	}
+	stop_watching_for_devices(hotplug_watch);
+	hotplug_watch = NULL;
+
+	if (candidates->count == 0) {
+		unsigned short int result = devices_list->count == 0
+		                                ? EXIT_NO_DEVICES
+		                                : EXIT_NO_VALID_AUTHENTICATOR;
+
+		cancel_key_derivation(key_derivation);
+		key_derivation = NULL;
+
+		free_key(cached_key);
+		cached_key = NULL;
+
+		free_candidate_authenticators(candidates);
+		candidates = NULL;
+
+		free_devices_list(devices_list);
+		devices_list = NULL;
+
+		free_invocation(invocation);
+		invocation = NULL;
+
+		free_cleartext(cleartext);
+		cleartext = NULL;
+
+		return result;
+	}
+
+	// The worker zeroes the key derivation function's work memory after
+	// handing over the key; we only wait for it once the secret is out.
+	unsigned char *key_bytes = cached_key;
+	cached_key = NULL;
+	if (key_bytes == NULL) {
+		key_bytes = take_derived_key(key_derivation);
+	}
 	authenticator_parameters_t *authenticator_params =
 	    build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
 	        cleartext, key_bytes, invocation->mixin);
+	check_subkeys_match_keyfile(invocation,
+	                            authenticator_params->derive_subkeys);
+	if (invocation->second_mixin != NULL) {
+		use_second_salt_for_second_mixin(authenticator_params, cleartext,
+		                                 key_bytes, invocation->second_mixin);
+	}
+
+	// We only get here if the key decrypted the keyfile, so we never cache
+	// a key derived from the wrong passphrase.
+	if (key_derivation != NULL && invocation->kdf_cache_ttl != 0) {
+		cache_key_for_cleartext(cleartext, key_bytes,
+		                        invocation->kdf_cache_ttl);
+	}
 
 	// Clean up things we don't need anymore
 	free_key(key_bytes);
 	key_bytes = NULL;
 
-	for (size_t i = 0; i < devices_list->count; i++) {
-		const fido_dev_info_t *di = fido_dev_info_ptr(devices_list->list, i);
-		const char *authenticator_path = fido_dev_info_path(di);
-		const char *authenticator_product_string =
-		    fido_dev_info_product_string(di);
-		fido_dev_t *authenticator = get_device(authenticator_path);
-		fido_cbor_info_t *device_info = get_device_info(authenticator);
-		if (device_aaguid_matches(cleartext, device_info)) {
-			if (!device_supports_hmac_secret(device_info)) {
-				close_and_free_device_ignoring_errors(authenticator);
-				free_device_info(device_info);
-				continue;
-			}
+	free_cleartext(cleartext);
+	cleartext = NULL;
 
-			bool authenticator_has_pin = fido_dev_has_pin(authenticator);
-
-			if (authenticator_has_pin) {
-				authenticator_params->authenticator_pin = malloc_or_exit(
-				    LONGEST_VALID_PIN + 1, "authenticator PIN in enrol_device");
-				const char *prompt_format_string =
-				    "authenticator PIN for %s at %s";
-				char *prompt_string =
-				    malloc_or_exit(strlen(prompt_format_string) +
-				                       strlen(authenticator_product_string) +
-				                       strlen(authenticator_path) + 1,
-				                   "PIN prompt");
-				sprintf(prompt_string, prompt_format_string,
-				        authenticator_product_string, authenticator_path);
-
-				if (invocation->authenticator_pin == NULL) {
-					prompt_for_secret(prompt_string, LONGEST_VALID_PIN,
-					                  authenticator_params->authenticator_pin);
-				} else {
-					strncpy(authenticator_params->authenticator_pin,
-					        invocation->authenticator_pin, LONGEST_VALID_PIN);
-				}
-				free(prompt_string);
-				prompt_string = NULL;
-
-				if (strlen(authenticator_params->authenticator_pin) == 0) {
-					fprintf(stderr,
-					        "No PIN entered; skipping this authenticator.\n");
-					close_and_free_device_ignoring_errors(authenticator);
-					free_device_info(device_info);
-					continue;
-				}
-			}
+	// Asking for an unattended keyfile's secret needs no touch anyway, and a
+	// lone candidate is asked for it whatever the answer would be, so the
+	// extra round trip is only worth it when there is a choice to make
+	if (!authenticator_params->unattended && candidates->count > 1) {
+		drop_candidates_without_credential(candidates, authenticator_params);
+	}
 
-			secret_t *secret = malloc_or_exit(sizeof(secret_t), "secret");
-			secret->secret = NULL;
-			secret->secret_size = 0;
-			int result = get_secret_from_authenticator_params(
-			    authenticator, authenticator_params, secret);
-			close_and_free_device_ignoring_errors(authenticator);
-			free_device_info(device_info);
-			if (result == FIDO_OK) {
-				for (int j = 0; j < secret->secret_size; j++) {
-					printf("%02x", secret->secret[j]);
-				}
-				printf("\n");
-				fflush(stdout);
-				free_parameters(authenticator_params);
-				authenticator_params = NULL;
-
-				free_cleartext(cleartext);
-				cleartext = NULL;
-
-				free_secret(secret);
-				secret = NULL;
-				return EXIT_SUCCESS;
-			}
-			free_secret(secret);
-			secret = NULL;
-			switch (result) {
-			case FIDO_ERR_NO_CREDENTIALS:
-				// no warning here
-				break;
-			case FIDO_ERR_PIN_INVALID:
-				warnx("Invalid PIN for %s at %s",
-				      fido_dev_info_product_string(di), authenticator_path);
-				break;
-			default:
-				warnx("%s at %s did not return a valid secret: %s (0x%x)",
-				      fido_dev_info_product_string(di), authenticator_path,
-				      fido_strerr(result), result);
-				break;
-			}
-		}
+	secret_t *secret = malloc_or_exit(sizeof(secret_t), "secret");
+	secret->secret = NULL;
+	secret->secret_size = 0;
+	bool got_secret =
+	    invocation->race_authenticators && candidates->count > 1
+	        ? race_candidate_authenticators(candidates, authenticator_params,
+	                                        secret)
+	        : try_candidate_authenticators_in_turn(
+	              candidates, authenticator_params, secret);
+	if (got_secret) {
+		print_secret(invocation, secret);
+
+		// Small secrets are wiped straight away...
+		free_secret(secret);
+		secret = NULL;
+
+		free_parameters(authenticator_params);
+		authenticator_params = NULL;
+
+		free_invocation(invocation);
+		invocation = NULL;
+
+		// ...but the bulk of the cleanup happens after the secret has
+		// been written, so that whoever is reading it can get on.
+		finish_scrubbing_and_free_key_derivation(key_derivation);
+		key_derivation = NULL;
+
+		free_candidate_authenticators(candidates);
+		candidates = NULL;
+
+		free_devices_list(devices_list);
+		devices_list = NULL;
+		return EXIT_SUCCESS;
 	}
+	free_secret(secret);
+	secret = NULL;
 
 	free_invocation(invocation);
 	invocation = NULL;
@@ -126,40 +686,151 @@ print_secret_consuming_invocation(invocation_state_t *invocation,
 	free_parameters(authenticator_params);
 	authenticator_params = NULL;
 
-	free_cleartext(cleartext);
-	cleartext = NULL;
+	finish_scrubbing_and_free_key_derivation(key_derivation);
+	key_derivation = NULL;
+
+	free_candidate_authenticators(candidates);
+	candidates = NULL;
+
+	free_devices_list(devices_list);
+	devices_list = NULL;
+
+	return EXIT_NO_VALID_AUTHENTICATOR;
+}
+
+unsigned short int
+print_secret_from_agent_consuming_invocation(invocation_state_t *invocation) {
+	// The agent exits on a keyfile it cannot load, so check it here first
+	encoded_file *f = read_file(invocation->file);
+	free_cleartext(load_cleartext(f));
+
+	agent_request_t request = {
+	    .keyfile = f->data,
+	    .keyfile_size = f->length,
+	    .passphrase = invocation->passphrase,
+	    .pin = invocation->authenticator_pin,
+	    .mixin = invocation->mixin,
+	    .second_mixin = invocation->second_mixin,
+	    .race_authenticators = invocation->race_authenticators,
+	};
+	agent_response_t *response = request_secret_from_agent(&request);
+
+	// The agent asks for the passphrase only if it has no key cached for the
+	// keyfile, and for a PIN only if an authenticator needs one
+	while (response->status == agent_status_need_passphrase ||
+	       response->status == agent_status_need_pin) {
+		if (response->status == agent_status_need_passphrase &&
+		    request.passphrase == NULL) {
+			get_passphrase_if_not_given(invocation);
+			request.passphrase = invocation->passphrase;
+		} else if (response->status == agent_status_need_pin &&
+		           request.pin == NULL) {
+			invocation->authenticator_pin = secure_malloc_or_exit(
+			    LONGEST_VALID_PIN + 1, "authenticator PIN in generate");
+			prompt_for_secret(response->message, LONGEST_VALID_PIN,
+			                  invocation->authenticator_pin);
+			if (strlen(invocation->authenticator_pin) == 0) {
+				errx(EXIT_BAD_PIN, "No PIN entered");
+			}
+			request.pin = invocation->authenticator_pin;
+		} else {
+			errx(EXIT_AGENT_ERROR, "The agent asked again for the %s",
+			     response->status == agent_status_need_pin ? "PIN"
+			                                               : "passphrase");
+		}
+		free_agent_response(response);
+		response = request_secret_from_agent(&request);
+	}
+	free_encoded_file(f);
+	f = NULL;
+
+	if (response->status != agent_status_ok) {
+		unsigned short int result = response->exit_code;
+		if (result != EXIT_NO_DEVICES &&
+		    result != EXIT_NO_VALID_AUTHENTICATOR) {
+			errx(result, "%s", response->message);
+		}
+		free_agent_response(response);
+		response = NULL;
 
-	if (devices_list->count > 0) {
-		return EXIT_NO_VALID_AUTHENTICATOR;
+		free_invocation(invocation);
+		invocation = NULL;
+
+		return result;
 	}
 
-	return EXIT_NO_DEVICES;
+	check_subkeys_match_keyfile(invocation, response->derive_subkeys);
+	secret_t secret = {.secret = response->secret,
+	                   .secret_size = response->secret_size};
+	print_secret(invocation, &secret);
+
+	free_agent_response(response);
+	response = NULL;
+
+	free_invocation(invocation);
+	invocation = NULL;
+
+	return EXIT_SUCCESS;
+}
+
+unsigned short int
+print_secret_consuming_invocation(invocation_state_t *invocation) {
+	if (invocation->use_agent) {
+		return print_secret_from_agent_consuming_invocation(invocation);
+	}
+	loaded_keyfile_t *keyfile =
+	    load_keyfile_and_start_preparing_kdf_memory(invocation);
+	if (keyfile->cached_key == NULL) {
+		get_passphrase_if_not_given(invocation);
+	}
+	return print_secret_consuming_invocation_and_keyfile(invocation, keyfile);
+}
+
+void exit_unless_secret_printed(unsigned short int result) {
+	switch (result) {
+	case EXIT_NO_DEVICES:
+		errx(EXIT_NO_DEVICES,
+		     "Unable to find an appropriate authenticator to generate a "
+		     "secret");
+	case EXIT_NO_VALID_AUTHENTICATOR:
+		errx(EXIT_NO_VALID_AUTHENTICATOR,
+		     "No connected authenticator was able to generate a valid "
+		     "secret");
+	case EXIT_SUCCESS:
+		return;
+	default:
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): unhandled return value from "
+		     "print_secret_consuming_invocation() (%d)",
+		     __func__, __LINE__, result);
+	}
 }
 
 bool device_aaguid_matches(deserialized_cleartext *cleartext,
-                           fido_cbor_info_t *device_info) {
+                           const device_facts_t *facts) {
 	if (cleartext->device_aaguid_size == 0) {
 		return true;
 	}
 
-	size_t this_device_aaguid_size = fido_cbor_info_aaguid_len(device_info);
-
-	if (this_device_aaguid_size != cleartext->device_aaguid_size) {
+	if (facts->aaguid_size != cleartext->device_aaguid_size) {
 		return false;
 	}
 
-	unsigned char *this_device_aaguid =
-	    malloc_or_exit(cleartext->device_aaguid_size, "device AAGUID");
-	memcpy(this_device_aaguid, fido_cbor_info_aaguid_ptr(device_info),
-	       this_device_aaguid_size);
-
 	for (size_t i = 0; i < cleartext->device_aaguid_size; i++) {
-		if (cleartext->device_aaguid[i] != this_device_aaguid[i]) {
-			free(this_device_aaguid);
+		if (cleartext->device_aaguid[i] != facts->aaguid[i]) {
 			return false;
 		}
 	}
 
-	free(this_device_aaguid);
 	return true;
 }
+
+bool device_ids_match(deserialized_cleartext *cleartext,
+                      const fido_dev_info_t *device_info) {
+	if (cleartext->device_vendor == 0 && cleartext->device_product == 0) {
+		return true;
+	}
+
+	return fido_dev_info_vendor(device_info) == cleartext->device_vendor &&
+	       fido_dev_info_product(device_info) == cleartext->device_product;
+}
@@ -14,14 +14,32 @@ void print_usage(char *program_name) {
 		   "Usage: %s help\n"
 	       "       %s version\n"
 	       "       %s enumerate\n"
+	       "       %s kdf-calibrate [-t <milliseconds>] [-x <memory>] [-l <lanes>]\n"
+	       "       %s kdf-cache flush\n"
 	       "       %s generate -f <file> [-p <passphrase> | -r <passphrase-file>]\n"
-		   "       %*s          [-n <pin>] [-m <data>]\n"
+		   "       %*s          [-n <pin>] [-m <data>] [-c <seconds>] [-g] [-z[<seconds>]]\n"
+		   "       %*s          [-s <data> [-a <file>] | -i <label>[,<label>...]] [-q]\n"
 	       "       %s enrol -d <device> -f <file> [-p <passphrase> | -r <passphrase-file>]\n"
-	       "       %*s       [-n <pin>] [-o] [-k <hardness>]\n",
+	       "       %*s       [-n <pin>] [-o | -y] [-b] [-u] [-l <lanes>]\n"
+	       "       %*s       [-k <hardness> | -t <milliseconds> [-x <memory>]]\n"
+	       "       %s rekey [-p <passphrase> | -r <passphrase-file>]\n"
+	       "       %*s       [-w <passphrase> | -e <passphrase-file>] [-j <jobs>]\n"
+	       "       %*s       [-l <lanes>] [-k <hardness> | -t <milliseconds>]\n"
+	       "       %*s       [-x <memory>] <file>...\n"
+	       "       %s agent [-c <seconds>]\n"
+	       "       %s ssh-askpass <prompt> | get-passphrase <ssh-key>\n"
+	       "       %s unlock-dir [-p <passphrase> | -r <passphrase-file> |\n"
+	       "       %*s            [--same-passphrase] [--attempts <attempts>]]\n"
+	       "       %*s            [-n <pin>] [-m <data>] [-g] [-z[<seconds>]] <directory>\n",
 	    // clang-format on
-	    program_name, program_name, program_name, program_name,
-	    (int)strlen(program_name), " ", program_name, (int)strlen(program_name),
-	    " ");
+	    program_name, program_name, program_name, program_name, program_name,
+	    program_name, (int)strlen(program_name), " ",
+	    (int)strlen(program_name), " ", program_name,
+	    (int)strlen(program_name), " ", (int)strlen(program_name), " ",
+	    program_name, (int)strlen(program_name), " ",
+	    (int)strlen(program_name), " ", (int)strlen(program_name), " ",
+	    program_name, program_name, program_name, (int)strlen(program_name),
+	    " ", (int)strlen(program_name), " ");
 }
 
 void print_help(char *program_name) {
@@ -38,12 +56,45 @@ void print_help(char *program_name) {
 	    "\n"
 	    "enumerate  show a list of authenticator devices currently connected.\n"
 	    "\n"
+	    "kdf-calibrate\n"
+	    "           measure the key derivation function on this system with a range\n"
+	    "           of parameters, and print a table of how long each took.\n"
+	    "\n"
+	    "kdf-cache flush\n"
+	    "           remove any passphrase-derived keys cached with --kdf-cache-ttl\n"
+	    "           from the kernel keyring.\n"
+	    "\n"
 	    "enrol       create or overwrite <file> with randomly-generated data required\n"
 	    "            to produce a secret for the given passphrase.\n"
 	    "\n"
 	    "generate   generate an HMAC across the data contained in <file>, once it has\n"
 	    "           been decrypted with the given passphrase.\n"
 	    "\n"
+	    "rekey      re-encrypt each <file> with a new passphrase or key derivation\n"
+	    "           parameters, in the latest keyfile format. No authenticator is\n"
+	    "           needed, and several files are rekeyed at once.\n"
+	    "\n"
+	    "agent      serve generate --agent until interrupted, keeping\n"
+	    "           passphrase-derived keys in locked memory in between. SIGHUP\n"
+	    "           forgets the keys.\n"
+	    "\n"
+	    "ssh-askpass\n"
+	    "           answer OpenSSH's <prompt> for an SSH key's passphrase with the\n"
+	    "           secret for its fingerprint, or print the passphrase to set for\n"
+	    "           <ssh-key>; also run as " APPNAME "-ssh-askpass.\n"
+	    "\n"
+	    "unlock-dir print the secret for the first keyfile in <directory> that gives\n"
+	    "           one, as generate would, opening authenticators and asking for a\n"
+	    "           PIN only once, and skipping keyfiles whose authenticator is not\n"
+	    "           connected. For initramfs hooks.\n"
+	    "\n"
+	    // clang-format on
+	);
+	printf(
+	    "%s",
+	    // clang-format off
+	    // This is split from the above to keep each string within the length
+	    // ISO C99 compilers are required to support.
 	    "   -d, --device <device>           REQUIRED for enrol. The path to the\n"
 	    "                                   authenticator to enrol, e.g. /dev/hidraw0.\n"
 	    "                                   This device MUST support the FIDO2\n"
@@ -65,6 +116,17 @@ void print_help(char *program_name) {
 	    "                                   neither this nor --passphrase are\n"
 		"                                   specified, you will be prompted for a\n"
 		"                                   passphrase.\n"
+	    "\n"
+	    "   -w, --new-passphrase <passphrase>\n"
+	    "                                   For rekey, the passphrase to encrypt each\n"
+	    "                                   <file> with (which may be the same as the\n"
+	    "                                   old one).\n"
+	    "\n"
+	    "   -e, --new-passphrase-file <file>\n"
+	    "                                   A file containing the new passphrase for\n"
+	    "                                   rekey. If neither this nor\n"
+	    "                                   --new-passphrase are specified, you will\n"
+	    "                                   be prompted for a new passphrase.\n"
 	    "\n"
 		"   -n, --pin <pin>                 The authenticator PIN to use. If not\n"
 		"                                   specified, and your device requires it,\n"
@@ -73,19 +135,124 @@ void print_help(char *program_name) {
 	    "   -o, --obfuscate-device-info     If specified for enrol, do not store the.\n"
 	    "                                   device vendor and product ID in <file>.\n"
 	    "\n"
+	    "   -b, --derive-subkeys            If specified for enrol, treat the secret as\n"
+	    "                                   a root secret, from which generate derives\n"
+	    "                                   the subkeys given with --derive.\n"
+	    "\n"
+	    "   -u, --unattended                If specified for enrol, generate gets the\n"
+	    "                                   secret without a touch or PIN. Enrol fails\n"
+	    "                                   if <device> does not support this.\n"
+	    "\n"
+	    "   -y, --record-device-ids         If specified for enrol, store the USB vendor\n"
+	    "                                   and product IDs of <device> in <file>, so\n"
+	    "                                   generate need not open other devices.\n"
+	    "\n"
+	    // clang-format on
+	);
+	printf(
+	    "%s",
+	    // clang-format off
 	    "   -k, --kdf-hardness <hardness>   Specify the complexity of the key derivation\n"
 	    "                                   function used to derive a cryptographic key\n"
 	    "                                   from <passphrase>. Valid options are high,\n"
 	    "                                   medium or low. If not specified, a value\n"
 	    "                                   will be chosen automatically based on\n"
-	    "                                   total system RAM.\n"
-		"\n"
+	    "                                   total system RAM (or, for rekey, each\n"
+	    "                                   <file>'s parameters will be kept).\n"
+	    "\n"
+	    "   -l, --kdf-lanes <lanes>         Specify the number of lanes (between 1 and\n"
+	    "                                   255) of the key derivation function. Each\n"
+	    "                                   lane is computed on its own thread, so this\n"
+	    "                                   should be no more than the number of\n"
+	    "                                   processors where you will use <file>. If\n"
+	    "                                   not specified, the number of processors on\n"
+	    "                                   this system will be used, up to 16 (unless\n"
+	    "                                   rekey is keeping each <file>'s parameters).\n"
+	    "\n"
+	    "   -t, --kdf-target-ms <ms>        Instead of --kdf-hardness, measure the key\n"
+	    "                                   derivation function on this system and\n"
+	    "                                   choose parameters that make it take about\n"
+	    "                                   <ms> milliseconds. For kdf-calibrate, print\n"
+	    "                                   the parameters that would be chosen.\n"
+	    "\n"
+	    "   -x, --kdf-max-memory <memory>   With --kdf-target-ms, use no more than\n"
+	    "                                   <memory> MiB (or KiB, MiB or GiB if followed\n"
+	    "                                   by K, M or G) for key derivation. If not\n"
+	    "                                   specified, half the memory available to this\n"
+	    "                                   process is used as the limit. For rekey,\n"
+	    "                                   this limits all files being rekeyed at once.\n"
+	    "\n"
+	    // clang-format on
+	);
+	printf(
+	    "%s",
+	    // clang-format off
 		"   -m, --mixin <data>              Combine <data> with the encrypted salt,\n"
 		"                                   so that the returned value depends on it.\n"
 		"                                   Note that setting <data> to an empty\n"
 		"                                   string behaves differently to not using\n"
 		"                                   this argument at all.\n"
 	    "\n"
+	    "   -s, --second-mixin <data>       For generate, get a second secret from the\n"
+	    "                                   same authenticator touch, using <data> in\n"
+	    "                                   place of --mixin. Each secret is then half\n"
+	    "                                   as long: the first half of the secret that\n"
+	    "                                   would be printed for its mixin alone.\n"
+	    "\n"
+	    "   -a, --second-output <file>      With --second-mixin, write the second\n"
+	    "                                   secret to <file> (with mode 0600) rather\n"
+	    "                                   than on the line after the first. Exits\n"
+	    "                                   with status 71 if <file> cannot be\n"
+	    "                                   written.\n"
+	    "\n"
+	    "   -i, --derive <label>[,<label>...]\n"
+	    "                                   REQUIRED for generate if <file> was\n"
+	    "                                   enrolled with --derive-subkeys, otherwise\n"
+	    "                                   prohibited. Print the subkey for each\n"
+	    "                                   <label>, one per line, all from a single\n"
+	    "                                   authenticator touch.\n"
+	    "\n"
+	    "   -c, --kdf-cache-ttl <seconds>   For generate, keep the passphrase-derived\n"
+	    "                                   key in the kernel keyring for <seconds>\n"
+	    "                                   (at most a day). Later uses of generate\n"
+	    "                                   with this option and the same <file> skip\n"
+	    "                                   key derivation and do not ask for the\n"
+	    "                                   passphrase until then.\n"
+	    "\n"
+	    "   -g, --race                      For generate or unlock-dir, ask every\n"
+	    "                                   matching authenticator at once, and use\n"
+	    "                                   whichever is touched first, rather than\n"
+	    "                                   asking one at a time.\n"
+	    "\n"
+	    "   -z, --wait[=<seconds>]          For generate or unlock-dir, if no\n"
+	    "                                   compatible authenticator is connected, wait\n"
+	    "                                   for one (for up to <seconds>, if given)\n"
+	    "                                   rather than exiting.\n"
+	    "\n"
+	    // clang-format on
+	);
+	printf(
+	    "%s",
+	    // clang-format off
+	    "   -j, --jobs <jobs>               For rekey, rekey up to <jobs> files at once.\n"
+	    "                                   If not specified, as many files are rekeyed\n"
+	    "                                   at once as there are processors for their\n"
+	    "                                   key derivation lanes. Either way, no more\n"
+	    "                                   than fit within --kdf-max-memory.\n"
+	    "\n"
+	    "   -q, --agent                     For generate, ask the running agent for\n"
+	    "                                   the secret, which asks for the passphrase\n"
+	    "                                   only if it has no key for <file>. For the\n"
+	    "                                   agent, --kdf-cache-ttl is how long it keeps\n"
+	    "                                   each key (10 minutes if not specified).\n"
+	    "\n"
+	    "   --same-passphrase               For unlock-dir, prompt for one passphrase\n"
+	    "                                   for every keyfile, rather than one each.\n"
+	    "\n"
+	    "   --attempts <attempts>           For unlock-dir, prompt again for a wrong\n"
+	    "                                   passphrase, up to <attempts> times in all\n"
+	    "                                   (3 if not specified).\n"
+	    "\n"
 	    "The output of this program on STDOUT (in either enrol or generate mode) will be\n"
 	    "a sequence of printable, URL-safe ASCII characters, that depend on the\n"
 	    "randomly generated parameters placed in the file, the authenticator device and\n"
@@ -0,0 +1,131 @@
+#include "hotplug.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "exit.h"
+#include "memory.h"
+
+// Room for at least this many events per read
+#define HOTPLUG_EVENTS_PER_READ 16
+
+hotplug_watch_t *start_watching_for_devices(unsigned int timeout_seconds) {
+	hotplug_watch_t *watch =
+	    malloc_or_exit(sizeof(hotplug_watch_t), "hotplug watch");
+
+	watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->inotify_fd < 0) {
+		err(EXIT_AUTHENTICATOR_ERROR, "Unable to watch for authenticators");
+	}
+	if (inotify_add_watch(watch->inotify_fd, HOTPLUG_DEVICE_DIRECTORY,
+	                      IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+		err(EXIT_AUTHENTICATOR_ERROR,
+		    "Unable to watch " HOTPLUG_DEVICE_DIRECTORY " for authenticators");
+	}
+
+	watch->has_deadline = timeout_seconds != 0;
+	clock_gettime(CLOCK_MONOTONIC, &watch->deadline);
+	watch->deadline.tv_sec += timeout_seconds;
+
+	return watch;
+}
+
+bool read_device_changes(hotplug_watch_t *watch) {
+	char buffer[HOTPLUG_EVENTS_PER_READ * (sizeof(struct inotify_event) +
+	                                       NAME_MAX + 1)]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool device_changed = false;
+
+	while (true) {
+		ssize_t length = read(watch->inotify_fd, buffer, sizeof(buffer));
+		if (length < 0 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			// EAGAIN once there are no more events
+			return device_changed;
+		}
+		for (char *next = buffer; next < buffer + length;) {
+			struct inotify_event *event = (struct inotify_event *)next;
+			if (event->len > 0 &&
+			    strncmp(event->name, HOTPLUG_DEVICE_PREFIX,
+			            strlen(HOTPLUG_DEVICE_PREFIX)) == 0) {
+				device_changed = true;
+			}
+			next += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+/**
+ * Returns the milliseconds from now until the deadline of watch (or -1 if it
+ * has none, which poll() takes to mean forever).
+ */
+static int milliseconds_until_deadline(hotplug_watch_t *watch) {
+	if (!watch->has_deadline) {
+		return -1;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long milliseconds =
+	    (watch->deadline.tv_sec - now.tv_sec) * 1000LL +
+	    (watch->deadline.tv_nsec - now.tv_nsec) / 1000000LL;
+	if (milliseconds < 0) {
+		return 0;
+	}
+	return milliseconds > INT_MAX ? INT_MAX : (int)milliseconds;
+}
+
+/**
+ * Waits up to timeout milliseconds (or forever, if it is negative) for events
+ * on watch, returning false if there were none.
+ */
+static bool poll_for_events(hotplug_watch_t *watch, int timeout) {
+	struct pollfd descriptor = {
+	    .fd = watch->inotify_fd, .events = POLLIN, .revents = 0};
+	int r = poll(&descriptor, 1, timeout);
+	if (r < 0 && errno != EINTR) {
+		err(EXIT_AUTHENTICATOR_ERROR, "Unable to wait for authenticators");
+	}
+	return r > 0;
+}
+
+bool wait_for_device_change(hotplug_watch_t *watch) {
+	while (!read_device_changes(watch)) {
+		int timeout = milliseconds_until_deadline(watch);
+		if (timeout == 0) {
+			return false;
+		}
+		poll_for_events(watch, timeout);
+	}
+
+	// A new node is created, then has its permissions set by udev, so let
+	// that settle rather than probing the device for each step
+	while (poll_for_events(watch, HOTPLUG_SETTLE_MS)) {
+		read_device_changes(watch);
+	}
+	return true;
+}
+
+void stop_watching_for_devices(hotplug_watch_t *watch) {
+	if (watch == NULL) {
+		return;
+	}
+	close(watch->inotify_fd);
+	free(watch);
+}
+
+void warn_waiting_for_authenticator(unsigned int timeout_seconds) {
+	if (timeout_seconds > 0) {
+		warnx("Waiting up to %u seconds for a compatible authenticator to be "
+		      "connected",
+		      timeout_seconds);
+	} else {
+		warnx("Waiting for a compatible authenticator to be connected");
+	}
+}
@@ -4,32 +4,146 @@
 #include <getopt.h>
 #include <sodium.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "argon2.h"
 #include "exit.h"
 #include "files.h"
 #include "help.h"
 #include "memory.h"
+#include "ssh_askpass.h"
+
+static char *read_passphrase_file(const char *path, const char *what) {
+	encoded_file *f = read_file(path);
+	char *result = secure_strndup_or_exit(
+	    (const char *)f->data,
+	    f->length > LONGEST_VALID_PASSPHRASE ? LONGEST_VALID_PASSPHRASE
+	                                         : f->length,
+	    what);
+	sodium_memzero(f->data, f->length);
+	free_encoded_file(f);
+	return result;
+}
 
-invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
-	if (argc < 2) {
-		print_usage(argv[0]);
-		exit(EXIT_BAD_INVOCATION);
+/**
+ * Splits the comma-separated labels into invocation->subkey_labels, returning
+ * false if any label is empty or there are too many.
+ */
+static bool parse_subkey_labels(invocation_state_t *invocation,
+                                const char *labels) {
+	size_t count = 1;
+	for (const char *c = labels; *c != (char)0; c++) {
+		if (*c == ',') {
+			count++;
+		}
+	}
+	if (invocation->subkey_labels != NULL || count > MAXIMUM_SUBKEYS) {
+		return false;
+	}
+
+	invocation->subkey_labels = malloc_or_exit(
+	    sizeof(char *) * count, "subkey labels in invocation state");
+	const char *start = labels;
+	for (size_t i = 0; i < count; i++) {
+		const char *end = strchr(start, ',');
+		size_t length = end == NULL ? strlen(start) : (size_t)(end - start);
+		invocation->subkey_labels[i] = strndup_or_exit(
+		    start, length, "subkey label in invocation state");
+		invocation->subkey_label_count++;
+		if (length == 0) {
+			return false;
+		}
+		start += length + 1;
 	}
+	return true;
+}
 
+invocation_state_t *new_invocation_state(subcommand_t subcommand) {
 	invocation_state_t *result =
 	    malloc_or_exit(sizeof(invocation_state_t), "invocation state");
+	result->subcommand = subcommand;
 	result->device = NULL;
 	result->file = NULL;
+	result->files = NULL;
+	result->file_count = 0;
 	result->passphrase = NULL;
+	result->new_passphrase = NULL;
 	result->authenticator_pin = NULL;
 	result->obfuscate_device_info = false;
+	result->derive_subkeys = false;
+	result->race_authenticators = false;
+	result->unattended = false;
+	result->record_device_ids = false;
+	result->wait_for_device = false;
+	result->wait_seconds = 0;
+	result->use_agent = false;
+	result->subkey_labels = NULL;
+	result->subkey_label_count = 0;
 	result->kdf_hardness = kdf_hardness_unspecified;
+	result->kdf_lanes = 0;
+	result->kdf_target_ms = 0;
+	result->kdf_max_memory = 0;
+	result->kdf_cache_ttl = 0;
+	result->jobs = 0;
+	result->same_passphrase = false;
+	result->passphrase_attempts = 0;
 	result->mixin = NULL;
+	result->second_mixin = NULL;
+	result->second_output = NULL;
+	result->prompt = NULL;
+	result->ssh_key = NULL;
+
+	return result;
+}
+
+/**
+ * Parses the arguments ssh-askpass was given, from argv[first] on. These are
+ * not options, since OpenSSH passes its prompt as the only argument, whatever
+ * it looks like.
+ */
+static invocation_state_t *parse_ssh_askpass_arguments(int argc, char **argv,
+                                                      int first) {
+	invocation_state_t *result = new_invocation_state(subcommand_ssh_askpass);
+	if (argc - first == 2 &&
+	    strcmp(argv[first], SSH_ASKPASS_GET_PASSPHRASE) == 0) {
+		result->ssh_key =
+		    strdup_or_exit(argv[first + 1], "SSH key path in invocation state");
+	} else if (argc - first == 1 &&
+	           strcmp(argv[first], SSH_ASKPASS_GET_PASSPHRASE) != 0) {
+		result->prompt =
+		    strdup_or_exit(argv[first], "prompt in invocation state");
+	} else {
+		free_invocation(result);
+		print_usage(argv[0]);
+		exit(EXIT_BAD_INVOCATION);
+	}
+	return result;
+}
+
+invocation_state_t *parse_arguments(int argc, char **argv) {
+	// OpenSSH runs $SSH_ASKPASS with no subcommand, so the binary is also
+	// installed as APPNAME-ssh-askpass
+	const char *invoked_as = strrchr(argv[0], '/');
+	invoked_as = invoked_as == NULL ? argv[0] : invoked_as + 1;
+	if (strcmp(invoked_as, SSH_ASKPASS_PROGRAM_NAME) == 0) {
+		return parse_ssh_askpass_arguments(argc, argv, 1);
+	}
+
+	if (argc < 2) {
+		print_usage(argv[0]);
+		exit(EXIT_BAD_INVOCATION);
+	}
+
+	if (strcmp(argv[1], "ssh-askpass") == 0) {
+		return parse_ssh_askpass_arguments(argc, argv, 2);
+	}
+
+	invocation_state_t *result = new_invocation_state(subcommand_unknown);
 
 	if (strcmp(argv[1], "help") == 0) {
 		result->subcommand = subcommand_help;
@@ -41,6 +155,17 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 		result->subcommand = subcommand_generate;
 	} else if (strcmp(argv[1], "enumerate") == 0) {
 		result->subcommand = subcommand_enumerate;
+	} else if (strcmp(argv[1], "kdf-calibrate") == 0) {
+		result->subcommand = subcommand_kdf_calibrate;
+	} else if (strcmp(argv[1], "kdf-cache") == 0) {
+		// flush is the only action, and is checked for below
+		result->subcommand = subcommand_kdf_cache_flush;
+	} else if (strcmp(argv[1], "rekey") == 0) {
+		result->subcommand = subcommand_rekey;
+	} else if (strcmp(argv[1], "agent") == 0) {
+		result->subcommand = subcommand_agent;
+	} else if (strcmp(argv[1], "unlock-dir") == 0) {
+		result->subcommand = subcommand_unlock_dir;
 	} else {
 		print_usage(argv[0]);
 		exit(EXIT_BAD_INVOCATION);
@@ -54,10 +179,28 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 		    {"file", required_argument, 0, 'f'},
 		    {"passphrase", required_argument, 0, 'p'},
 		    {"passphrase-file", required_argument, 0, 'r'},
+		    {"new-passphrase", required_argument, 0, 'w'},
+		    {"new-passphrase-file", required_argument, 0, 'e'},
 		    {"pin", required_argument, 0, 'n'},
 		    {"mixin", required_argument, 0, 'm'},
+		    {"second-mixin", required_argument, 0, 's'},
+		    {"second-output", required_argument, 0, 'a'},
 		    {"kdf-hardness", required_argument, 0, 'k'},
+		    {"kdf-lanes", required_argument, 0, 'l'},
+		    {"kdf-target-ms", required_argument, 0, 't'},
+		    {"kdf-max-memory", required_argument, 0, 'x'},
+		    {"kdf-cache-ttl", required_argument, 0, 'c'},
+		    {"jobs", required_argument, 0, 'j'},
 		    {"obfuscate-device", no_argument, 0, 'o'},
+		    {"derive-subkeys", no_argument, 0, 'b'},
+		    {"derive", required_argument, 0, 'i'},
+		    {"race", no_argument, 0, 'g'},
+		    {"unattended", no_argument, 0, 'u'},
+		    {"record-device-ids", no_argument, 0, 'y'},
+		    {"wait", optional_argument, 0, 'z'},
+		    {"agent", no_argument, 0, 'q'},
+		    {"same-passphrase", no_argument, 0, OPTION_SAME_PASSPHRASE},
+		    {"attempts", required_argument, 0, OPTION_ATTEMPTS},
 		    {"help", no_argument, 0, 'h'},
 		    {NULL, 0, NULL, 0},
 		};
@@ -65,8 +208,9 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "d:f:p:r:m:k:n:oh", long_options,
-		                &option_index);
+		c = getopt_long(argc, argv,
+		                "d:f:p:r:w:e:m:s:a:i:k:l:t:x:c:j:n:z::obguyqh",
+		                long_options, &option_index);
 
 		if (c == -1) {
 			break;
@@ -85,24 +229,30 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 
 		case 'p':
 			result->passphrase =
-			    strndup_or_exit(optarg, LONGEST_VALID_PASSPHRASE,
-			                    "passphrase in invocation state");
+			    secure_strndup_or_exit(optarg, LONGEST_VALID_PASSPHRASE,
+			                           "passphrase in invocation state");
 			break;
 
-		case 'r': {
-			encoded_file *f = read_file(optarg);
-			result->passphrase = strndup_or_exit(
-			    (const char *)f->data,
-			    f->length > LONGEST_VALID_PASSPHRASE ? LONGEST_VALID_PASSPHRASE
-			                                         : f->length,
-			    "passphrase in invocation state");
-			free_encoded_file(f);
-		} break;
+		case 'r':
+			result->passphrase = read_passphrase_file(
+			    optarg, "passphrase in invocation state");
+			break;
+
+		case 'w':
+			result->new_passphrase =
+			    secure_strndup_or_exit(optarg, LONGEST_VALID_PASSPHRASE,
+			                           "new passphrase in invocation state");
+			break;
+
+		case 'e':
+			result->new_passphrase = read_passphrase_file(
+			    optarg, "new passphrase in invocation state");
+			break;
 
 		case 'n':
 			result->authenticator_pin =
-			    strndup_or_exit(optarg, LONGEST_VALID_PIN,
-			                    "authenticator PIN in invocation state");
+			    secure_strndup_or_exit(optarg, LONGEST_VALID_PIN,
+			                           "authenticator PIN in invocation state");
 			break;
 
 		case 'm':
@@ -110,6 +260,16 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 			    strdup_or_exit(optarg, "mixin data in invocation state");
 			break;
 
+		case 's':
+			result->second_mixin = strdup_or_exit(
+			    optarg, "second mixin data in invocation state");
+			break;
+
+		case 'a':
+			result->second_output = strdup_or_exit(
+			    optarg, "second output path in invocation state");
+			break;
+
 		case 'k':
 			switch (LOWERCASE(optarg[0])) {
 			case 'l':
@@ -127,10 +287,148 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 			}
 			break;
 
+		case 'l': {
+			char *end = NULL;
+			errno = 0;
+			unsigned long lanes = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != (char)0 || lanes < 1 ||
+			    lanes > ARGON2_MAX_LANES) {
+				invalid_invocation = true;
+			} else {
+				result->kdf_lanes = (unsigned int)lanes;
+			}
+		} break;
+
+		case 't': {
+			char *end = NULL;
+			errno = 0;
+			unsigned long target_ms = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != (char)0 ||
+			    target_ms < 1 || target_ms > MAXIMUM_KDF_TARGET_MS) {
+				invalid_invocation = true;
+			} else {
+				result->kdf_target_ms = (unsigned int)target_ms;
+			}
+		} break;
+
+		case 'x': {
+			// A number of mebibytes, or of kibi-, mebi- or gibibytes if
+			// followed by K, M or G respectively
+			char *end = NULL;
+			errno = 0;
+			unsigned long long size = strtoull(optarg, &end, 10);
+			unsigned long long multiplier = 1024 * 1024;
+			if (end != optarg && *end != (char)0 && end[1] == (char)0) {
+				switch (LOWERCASE(*end)) {
+				case 'k':
+					multiplier = 1024;
+					end++;
+					break;
+				case 'm':
+					end++;
+					break;
+				case 'g':
+					multiplier = 1024 * 1024 * 1024;
+					end++;
+					break;
+				default:
+					break;
+				}
+			}
+			if (errno != 0 || end == optarg || *end != (char)0 || size < 1 ||
+			    size > SIZE_MAX / multiplier) {
+				invalid_invocation = true;
+			} else {
+				result->kdf_max_memory = (size_t)(size * multiplier);
+			}
+		} break;
+
+		case 'c': {
+			char *end = NULL;
+			errno = 0;
+			unsigned long ttl = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != (char)0 || ttl < 1 ||
+			    ttl > MAXIMUM_KDF_CACHE_TTL_SECONDS) {
+				invalid_invocation = true;
+			} else {
+				result->kdf_cache_ttl = (unsigned int)ttl;
+			}
+		} break;
+
+		case 'j': {
+			char *end = NULL;
+			errno = 0;
+			unsigned long jobs = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != (char)0 || jobs < 1 ||
+			    jobs > MAXIMUM_REKEY_JOBS) {
+				invalid_invocation = true;
+			} else {
+				result->jobs = (unsigned int)jobs;
+			}
+		} break;
+
 		case 'o':
 			result->obfuscate_device_info = true;
 			break;
 
+		case 'b':
+			result->derive_subkeys = true;
+			break;
+
+		case 'i':
+			if (!parse_subkey_labels(result, optarg)) {
+				invalid_invocation = true;
+			}
+			break;
+
+		case 'g':
+			result->race_authenticators = true;
+			break;
+
+		case 'u':
+			result->unattended = true;
+			break;
+
+		case 'y':
+			result->record_device_ids = true;
+			break;
+
+		case 'z': {
+			result->wait_for_device = true;
+			if (optarg == NULL) {
+				break;
+			}
+			char *end = NULL;
+			errno = 0;
+			unsigned long seconds = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != (char)0 ||
+			    seconds < 1 || seconds > MAXIMUM_WAIT_SECONDS) {
+				invalid_invocation = true;
+			} else {
+				result->wait_seconds = (unsigned int)seconds;
+			}
+		} break;
+
+		case 'q':
+			result->use_agent = true;
+			break;
+
+		case OPTION_SAME_PASSPHRASE:
+			result->same_passphrase = true;
+			break;
+
+		case OPTION_ATTEMPTS: {
+			char *end = NULL;
+			errno = 0;
+			unsigned long attempts = strtoul(optarg, &end, 10);
+			if (errno != 0 || end == optarg || *end != (char)0 ||
+			    attempts < 1 || attempts > MAXIMUM_PASSPHRASE_ATTEMPTS) {
+				invalid_invocation = true;
+			} else {
+				result->passphrase_attempts = (unsigned int)attempts;
+			}
+		} break;
+
 		case 'h':
 			result->subcommand = subcommand_help;
 			break;
@@ -154,6 +452,27 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 	// Add 1 to optind to take account of the subcommand, if we've already seen
 	// it
 	optind += (result->subcommand == subcommand_unknown) ? 0 : 1;
+	if (result->subcommand == subcommand_kdf_cache_flush) {
+		if (optind < argc && strcmp(argv[optind], "flush") == 0) {
+			optind++;
+		} else {
+			invalid_invocation = true;
+		}
+	}
+	if (result->subcommand == subcommand_rekey && optind < argc) {
+		result->file_count = (size_t)(argc - optind);
+		result->files = malloc_or_exit(sizeof(char *) * result->file_count,
+		                               "file paths in invocation state");
+		for (size_t i = 0; i < result->file_count; i++) {
+			result->files[i] = strdup_or_exit(argv[optind++],
+			                                  "file path in invocation state");
+		}
+	}
+	if (result->subcommand == subcommand_unlock_dir && optind < argc &&
+	    result->file == NULL) {
+		result->file = strdup_or_exit(argv[optind++],
+		                              "directory path in invocation state");
+	}
 	int extra_args = argc - optind;
 
 	if (extra_args > 0) {
@@ -176,25 +495,141 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 	// Required arguments
 	switch (result->subcommand) {
 	case subcommand_enrol:
-		invalid_invocation = invalid_invocation || result->device == NULL ||
-		                     result->file == NULL || result->mixin != NULL ||
-		                     result->kdf_hardness == kdf_hardness_invalid;
+		invalid_invocation =
+		    invalid_invocation || result->device == NULL ||
+		    result->file == NULL || result->mixin != NULL ||
+		    result->second_mixin != NULL || result->second_output != NULL ||
+		    result->subkey_labels != NULL ||
+		    result->kdf_hardness == kdf_hardness_invalid ||
+		    (result->kdf_target_ms != 0 &&
+		     result->kdf_hardness != kdf_hardness_unspecified) ||
+		    (result->kdf_max_memory != 0 && result->kdf_target_ms == 0) ||
+		    result->kdf_cache_ttl != 0 || result->new_passphrase != NULL ||
+		    result->jobs != 0 || result->race_authenticators ||
+		    (result->record_device_ids && result->obfuscate_device_info) ||
+		    result->wait_for_device || result->use_agent ||
+		    result->same_passphrase || result->passphrase_attempts != 0;
 		break;
 	case subcommand_generate:
 		invalid_invocation = invalid_invocation || result->device != NULL ||
 		                     result->file == NULL ||
+		                     (result->second_output != NULL &&
+		                      result->second_mixin == NULL) ||
+		                     (result->subkey_labels != NULL &&
+		                      result->second_mixin != NULL) ||
+		                     result->derive_subkeys || result->unattended ||
+		                     result->record_device_ids ||
+		                     result->new_passphrase != NULL ||
+		                     result->jobs != 0 ||
 		                     result->obfuscate_device_info ||
-		                     result->kdf_hardness != kdf_hardness_unspecified;
+		                     result->kdf_hardness != kdf_hardness_unspecified ||
+		                     result->kdf_lanes != 0 ||
+		                     result->kdf_target_ms != 0 ||
+		                     result->kdf_max_memory != 0 ||
+		                     result->same_passphrase ||
+		                     result->passphrase_attempts != 0 ||
+		                     (result->use_agent &&
+		                      (result->kdf_cache_ttl != 0 ||
+		                       result->wait_for_device));
+		break;
+	case subcommand_kdf_calibrate:
+		invalid_invocation = invalid_invocation || result->device != NULL ||
+		                     result->file != NULL || result->mixin != NULL ||
+		                     result->second_mixin != NULL ||
+		                     result->second_output != NULL ||
+		                     result->derive_subkeys ||
+		                     result->subkey_labels != NULL ||
+		                     result->passphrase != NULL ||
+		                     result->authenticator_pin != NULL ||
+		                     result->obfuscate_device_info ||
+		                     result->kdf_hardness != kdf_hardness_unspecified ||
+		                     result->kdf_cache_ttl != 0 ||
+		                     result->new_passphrase != NULL ||
+		                     result->jobs != 0 ||
+		                     result->race_authenticators ||
+		                     result->unattended || result->record_device_ids ||
+		                     result->wait_for_device || result->use_agent ||
+		                     result->same_passphrase ||
+		                     result->passphrase_attempts != 0;
+		break;
+	case subcommand_rekey:
+		// --kdf-max-memory bounds the memory used by all jobs together, so
+		// is allowed without --kdf-target-ms here
+		invalid_invocation =
+		    invalid_invocation || result->device != NULL ||
+		    result->file != NULL || result->file_count == 0 ||
+		    result->mixin != NULL || result->second_mixin != NULL ||
+		    result->second_output != NULL || result->derive_subkeys ||
+		    result->subkey_labels != NULL ||
+		    result->authenticator_pin != NULL ||
+		    result->obfuscate_device_info ||
+		    result->kdf_hardness == kdf_hardness_invalid ||
+		    (result->kdf_target_ms != 0 &&
+		     result->kdf_hardness != kdf_hardness_unspecified) ||
+		    result->kdf_cache_ttl != 0 || result->race_authenticators ||
+		    result->unattended || result->record_device_ids ||
+		    result->wait_for_device || result->use_agent ||
+		    result->same_passphrase || result->passphrase_attempts != 0;
+		break;
+	case subcommand_agent:
+		// --kdf-cache-ttl is how long the agent keeps passphrase-derived keys
+		invalid_invocation =
+		    invalid_invocation || result->device != NULL ||
+		    result->file != NULL || result->mixin != NULL ||
+		    result->second_mixin != NULL || result->second_output != NULL ||
+		    result->derive_subkeys || result->subkey_labels != NULL ||
+		    result->passphrase != NULL || result->authenticator_pin != NULL ||
+		    result->obfuscate_device_info ||
+		    result->kdf_hardness != kdf_hardness_unspecified ||
+		    result->kdf_lanes != 0 || result->kdf_target_ms != 0 ||
+		    result->kdf_max_memory != 0 || result->new_passphrase != NULL ||
+		    result->jobs != 0 || result->race_authenticators ||
+		    result->unattended || result->record_device_ids ||
+		    result->wait_for_device || result->use_agent ||
+		    result->same_passphrase || result->passphrase_attempts != 0;
+		break;
+	case subcommand_unlock_dir:
+		// --passphrase and --passphrase-file give the passphrase for every
+		// keyfile, so --same-passphrase would be redundant
+		invalid_invocation =
+		    invalid_invocation || result->device != NULL ||
+		    result->file == NULL || result->second_mixin != NULL ||
+		    result->second_output != NULL || result->derive_subkeys ||
+		    result->subkey_labels != NULL || result->obfuscate_device_info ||
+		    result->kdf_hardness != kdf_hardness_unspecified ||
+		    result->kdf_lanes != 0 || result->kdf_target_ms != 0 ||
+		    result->kdf_max_memory != 0 || result->kdf_cache_ttl != 0 ||
+		    result->new_passphrase != NULL || result->jobs != 0 ||
+		    result->unattended || result->record_device_ids ||
+		    result->use_agent ||
+		    (result->passphrase != NULL &&
+		     (result->same_passphrase || result->passphrase_attempts != 0));
 		break;
 	case subcommand_enumerate:
+	case subcommand_kdf_cache_flush:
 	case subcommand_help:
 	case subcommand_version:
 	default:
 		invalid_invocation = invalid_invocation || result->device != NULL ||
 		                     result->file != NULL || result->mixin != NULL ||
+		                     result->second_mixin != NULL ||
+		                     result->second_output != NULL ||
+		                     result->derive_subkeys ||
+		                     result->subkey_labels != NULL ||
 		                     result->passphrase != NULL ||
 		                     result->obfuscate_device_info ||
-		                     result->kdf_hardness != kdf_hardness_unspecified;
+		                     result->kdf_hardness != kdf_hardness_unspecified ||
+		                     result->kdf_lanes != 0 ||
+		                     result->kdf_target_ms != 0 ||
+		                     result->kdf_max_memory != 0 ||
+		                     result->kdf_cache_ttl != 0 ||
+		                     result->new_passphrase != NULL ||
+		                     result->jobs != 0 ||
+		                     result->race_authenticators ||
+		                     result->unattended || result->record_device_ids ||
+		                     result->wait_for_device || result->use_agent ||
+		                     result->same_passphrase ||
+		                     result->passphrase_attempts != 0;
 		break;
 	}
 
@@ -204,31 +639,65 @@ invocation_state_t *parse_arguments_and_get_passphrase(int argc, char **argv) {
 		exit(EXIT_BAD_INVOCATION);
 	}
 
-	if (result->subcommand == subcommand_enrol &&
-	    result->kdf_hardness == kdf_hardness_unspecified) {
+	choose_default_kdf_parameters(result);
+
+	return result;
+}
+
+void choose_default_kdf_parameters(invocation_state_t *invocation) {
+	if ((invocation->subcommand == subcommand_enrol ||
+	     invocation->subcommand == subcommand_rekey) &&
+	    invocation->kdf_target_ms != 0) {
+		invocation->kdf_hardness = kdf_hardness_calibrated;
+	}
+
+	if (invocation->subcommand == subcommand_enrol &&
+	    invocation->kdf_hardness == kdf_hardness_unspecified) {
 		long pages = sysconf(_SC_PHYS_PAGES);
 		long page_size = sysconf(_SC_PAGE_SIZE);
 		size_t available_memory = pages * page_size;
 		if (available_memory > (crypto_pwhash_MEMLIMIT_SENSITIVE * 2)) {
-			result->kdf_hardness = kdf_hardness_high;
+			invocation->kdf_hardness = kdf_hardness_high;
 		} else if (available_memory > (crypto_pwhash_MEMLIMIT_MODERATE * 2)) {
-			result->kdf_hardness = kdf_hardness_medium;
+			invocation->kdf_hardness = kdf_hardness_medium;
 		} else {
-			result->kdf_hardness = kdf_hardness_low;
+			invocation->kdf_hardness = kdf_hardness_low;
 		}
 	}
 
-	if (result->subcommand == subcommand_enrol ||
-	    result->subcommand == subcommand_generate) {
-		if (result->passphrase == NULL) {
-			result->passphrase =
-			    malloc_or_exit(LONGEST_VALID_PASSPHRASE + 1, "passphrase");
-			prompt_for_secret("passphrase", LONGEST_VALID_PASSPHRASE,
-			                  result->passphrase);
+	// rekey keeps each keyfile's lanes unless it is choosing new parameters
+	if ((invocation->subcommand == subcommand_enrol ||
+	     invocation->subcommand == subcommand_kdf_calibrate ||
+	     (invocation->subcommand == subcommand_rekey &&
+	      invocation->kdf_hardness != kdf_hardness_unspecified)) &&
+	    invocation->kdf_lanes == 0) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		if (processors < 1) {
+			invocation->kdf_lanes = 1;
+		} else if (processors > DEFAULT_MAXIMUM_KDF_LANES) {
+			invocation->kdf_lanes = DEFAULT_MAXIMUM_KDF_LANES;
+		} else {
+			invocation->kdf_lanes = (unsigned int)processors;
 		}
 	}
+}
 
-	return result;
+void get_passphrase_if_not_given(invocation_state_t *invocation) {
+	if (invocation->passphrase == NULL) {
+		invocation->passphrase =
+		    secure_malloc_or_exit(LONGEST_VALID_PASSPHRASE + 1, "passphrase");
+		prompt_for_secret("passphrase", LONGEST_VALID_PASSPHRASE,
+		                  invocation->passphrase);
+	}
+}
+
+void get_new_passphrase_if_not_given(invocation_state_t *invocation) {
+	if (invocation->new_passphrase == NULL) {
+		invocation->new_passphrase = secure_malloc_or_exit(
+		    LONGEST_VALID_PASSPHRASE + 1, "new passphrase");
+		prompt_for_secret("new passphrase", LONGEST_VALID_PASSPHRASE,
+		                  invocation->new_passphrase);
+	}
 }
 
 void prompt_for_secret(const char *description, size_t maximum_size,
@@ -288,22 +757,51 @@ void free_invocation(invocation_state_t *invocation) {
 		return;
 	}
 
-	if (invocation->passphrase != NULL) {
-		sodium_memzero(invocation->passphrase, strlen(invocation->passphrase));
-		free(invocation->passphrase);
-	}
+	secure_free(invocation->passphrase);
+	secure_free(invocation->new_passphrase);
+	secure_free(invocation->authenticator_pin);
 
 	if (invocation->mixin != NULL) {
 		free(invocation->mixin);
 	}
 
+	if (invocation->second_mixin != NULL) {
+		free(invocation->second_mixin);
+	}
+
+	for (size_t i = 0; i < invocation->subkey_label_count; i++) {
+		free(invocation->subkey_labels[i]);
+	}
+	if (invocation->subkey_labels != NULL) {
+		free(invocation->subkey_labels);
+	}
+
+	if (invocation->second_output != NULL) {
+		free(invocation->second_output);
+	}
+
 	if (invocation->device != NULL) {
 		free(invocation->device);
 	}
 
+	if (invocation->prompt != NULL) {
+		free(invocation->prompt);
+	}
+
+	if (invocation->ssh_key != NULL) {
+		free(invocation->ssh_key);
+	}
+
 	if (invocation->file != NULL) {
 		free(invocation->file);
 	}
 
+	for (size_t i = 0; i < invocation->file_count; i++) {
+		free(invocation->files[i]);
+	}
+	if (invocation->files != NULL) {
+		free(invocation->files);
+	}
+
 	free(invocation);
 }
@@ -0,0 +1,231 @@
+#include "kdf_cache.h"
+
+#include <linux/keyctl.h>
+#include <sodium.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cryptography.h"
+#include "exit.h"
+#include "memory.h"
+
+#define KDF_CACHE_KEY_TYPE "user"
+
+// Hashed ahead of the keyfile parameters, so that the description can't be
+// confused with a hash of anything else.
+#define KDF_CACHE_HASH_CONTEXT APPNAME " kdf-cache v1"
+
+// Enough for KEYCTL_DESCRIBE to give us the type, uid, gid and permissions
+// of one of our keys followed by its description. Longer descriptions are
+// truncated, which is fine as we only look at their start.
+#define KEY_DESCRIPTION_BUFFER_SIZE 256
+
+// glibc has no wrappers for the keyring system calls, and we don't want to
+// depend on libkeyutils for these few.
+static long keyctl_syscall(int operation, unsigned long arg2,
+                           unsigned long arg3, unsigned long arg4,
+                           unsigned long arg5) {
+	return syscall(SYS_keyctl, operation, arg2, arg3, arg4, arg5);
+}
+
+static int32_t add_key_syscall(const char *type, const char *description,
+                               const void *payload, size_t payload_size,
+                               int32_t keyring) {
+	return (int32_t)syscall(SYS_add_key, type, description, payload,
+	                        payload_size, keyring);
+}
+
+/**
+ * Returns the ID of the keyring special_keyring refers to, without creating
+ * it, or -1 if there is none.
+ */
+static int32_t get_keyring_id(int32_t special_keyring) {
+	return (int32_t)keyctl_syscall(KEYCTL_GET_KEYRING_ID,
+	                               (unsigned long)special_keyring, 0, 0, 0);
+}
+
+/**
+ * We keep cached keys in the session keyring, so they go away when the login
+ * session does. If this process has no session keyring, asking for it
+ * without creating it gives us the user session keyring, which outlives any
+ * one process; asking add_key() to use KEY_SPEC_SESSION_KEYRING directly
+ * would instead create a session keyring that dies with this process.
+ */
+static int32_t get_cache_keyring(void) {
+	return get_keyring_id(KEY_SPEC_SESSION_KEYRING);
+}
+
+static void store64_le(unsigned char *dst, uint64_t value) {
+	for (size_t i = 0; i < sizeof(value); i++) {
+		dst[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+void describe_cached_key(deserialized_cleartext *cleartext,
+                         char description[KDF_CACHE_DESCRIPTION_SIZE]) {
+	crypto_generichash_state state;
+	unsigned char value[sizeof(uint64_t)];
+	unsigned char hash[KDF_CACHE_HASH_BYTES];
+
+	crypto_generichash_init(&state, NULL, 0, sizeof(hash));
+	crypto_generichash_update(&state,
+	                          (const unsigned char *)KDF_CACHE_HASH_CONTEXT,
+	                          sizeof(KDF_CACHE_HASH_CONTEXT));
+	store64_le(value, cleartext->kdf_salt_size);
+	crypto_generichash_update(&state, value, sizeof(value));
+	crypto_generichash_update(&state, cleartext->kdf_salt,
+	                          cleartext->kdf_salt_size);
+	const uint64_t parameters[] = {
+	    cleartext->opslimit,
+	    cleartext->memlimit,
+	    (uint64_t)cleartext->algorithm,
+	    cleartext->lanes > 1 ? cleartext->lanes : 1,
+	};
+	for (size_t i = 0; i < sizeof(parameters) / sizeof(parameters[0]); i++) {
+		store64_le(value, parameters[i]);
+		crypto_generichash_update(&state, value, sizeof(value));
+	}
+	crypto_generichash_final(&state, hash, sizeof(hash));
+
+	memcpy(description, KDF_CACHE_DESCRIPTION_PREFIX,
+	       sizeof(KDF_CACHE_DESCRIPTION_PREFIX) - 1);
+	sodium_bin2hex(description + sizeof(KDF_CACHE_DESCRIPTION_PREFIX) - 1,
+	               KDF_CACHE_HASH_BYTES * 2 + 1, hash, sizeof(hash));
+}
+
+unsigned char *get_cached_key_for_cleartext(deserialized_cleartext *cleartext) {
+	char description[KDF_CACHE_DESCRIPTION_SIZE];
+	describe_cached_key(cleartext, description);
+
+	int32_t keyring = get_cache_keyring();
+	if (keyring < 0) {
+		return NULL;
+	}
+	long key = keyctl_syscall(KEYCTL_SEARCH, (unsigned long)keyring,
+	                          (unsigned long)KDF_CACHE_KEY_TYPE,
+	                          (unsigned long)description, 0);
+	if (key < 0) {
+		return NULL;
+	}
+
+	unsigned char *key_bytes =
+	    secure_malloc_or_exit(KEY_SIZE, "cached passphrase-derived key");
+	long size = keyctl_syscall(KEYCTL_READ, (unsigned long)key,
+	                           (unsigned long)key_bytes, KEY_SIZE, 0);
+	if (size != KEY_SIZE) {
+		free_key(key_bytes);
+		return NULL;
+	}
+	return key_bytes;
+}
+
+void cache_key_for_cleartext(deserialized_cleartext *cleartext,
+                             unsigned char *key_bytes,
+                             unsigned int ttl_seconds) {
+	char description[KDF_CACHE_DESCRIPTION_SIZE];
+	describe_cached_key(cleartext, description);
+
+	int32_t keyring = get_cache_keyring();
+	if (keyring < 0) {
+		warn("Unable to find a keyring to cache the passphrase-derived key in");
+		return;
+	}
+	int32_t key = add_key_syscall(KDF_CACHE_KEY_TYPE, description, key_bytes,
+	                              KEY_SIZE, keyring);
+	if (key < 0) {
+		warn("Unable to cache the passphrase-derived key");
+		return;
+	}
+	if (keyctl_syscall(KEYCTL_SET_TIMEOUT, (unsigned long)key, ttl_seconds, 0,
+	                   0) != 0) {
+		// A cached key which never expires is worse than no cached key
+		warn("Unable to set an expiry time on the cached passphrase-derived "
+		     "key, so not caching it");
+		keyctl_syscall(KEYCTL_INVALIDATE, (unsigned long)key, 0, 0, 0);
+		keyctl_syscall(KEYCTL_UNLINK, (unsigned long)key,
+		               (unsigned long)keyring, 0, 0);
+	}
+}
+
+/**
+ * Returns true if key is one of ours, going by its type and description.
+ */
+static bool is_kdf_cache_key(int32_t key) {
+	char buffer[KEY_DESCRIPTION_BUFFER_SIZE];
+	long size = keyctl_syscall(KEYCTL_DESCRIBE, (unsigned long)key,
+	                           (unsigned long)buffer, sizeof(buffer), 0);
+	if (size < 0 || (size_t)size > sizeof(buffer)) {
+		return false;
+	}
+	buffer[sizeof(buffer) - 1] = (char)0;
+
+	// The description is "type;uid;gid;perm;description"
+	char *description = buffer;
+	for (int i = 0; i < 4; i++) {
+		description = strchr(description, ';');
+		if (description == NULL) {
+			return false;
+		}
+		description++;
+	}
+	return strncmp(buffer, KDF_CACHE_KEY_TYPE ";",
+	               sizeof(KDF_CACHE_KEY_TYPE)) == 0 &&
+	       strncmp(description, KDF_CACHE_DESCRIPTION_PREFIX,
+	               sizeof(KDF_CACHE_DESCRIPTION_PREFIX) - 1) == 0;
+}
+
+static unsigned int flush_kdf_cache_from_keyring(int32_t keyring) {
+	long size = keyctl_syscall(KEYCTL_READ, (unsigned long)keyring, 0, 0, 0);
+	if (size <= 0) {
+		return 0;
+	}
+	int32_t *keys = malloc_or_exit((size_t)size, "list of keys in keyring");
+	long read_size =
+	    keyctl_syscall(KEYCTL_READ, (unsigned long)keyring,
+	                   (unsigned long)keys, (unsigned long)size, 0);
+	if (read_size > size) {
+		// The keyring grew between our two calls; just use what we got
+		read_size = size;
+	}
+
+	unsigned int removed = 0;
+	for (long i = 0; read_size > 0 && i < read_size / (long)sizeof(int32_t);
+	     i++) {
+		if (!is_kdf_cache_key(keys[i])) {
+			continue;
+		}
+		if (keyctl_syscall(KEYCTL_INVALIDATE, (unsigned long)keys[i], 0, 0,
+		                   0) == 0 ||
+		    keyctl_syscall(KEYCTL_UNLINK, (unsigned long)keys[i],
+		                   (unsigned long)keyring, 0, 0) == 0) {
+			removed++;
+		} else {
+			warn("Unable to remove cached key %d", keys[i]);
+		}
+	}
+
+	free(keys);
+	return removed;
+}
+
+unsigned int flush_kdf_cache(void) {
+	int32_t session_keyring = get_keyring_id(KEY_SPEC_SESSION_KEYRING);
+	int32_t user_session_keyring =
+	    get_keyring_id(KEY_SPEC_USER_SESSION_KEYRING);
+	if (session_keyring < 0 && user_session_keyring < 0) {
+		err(EXIT_KEYRING_ERROR, "Unable to access the kernel keyring");
+	}
+
+	unsigned int removed = 0;
+	if (session_keyring >= 0) {
+		removed += flush_kdf_cache_from_keyring(session_keyring);
+	}
+	if (user_session_keyring >= 0 && user_session_keyring != session_keyring) {
+		removed += flush_kdf_cache_from_keyring(user_session_keyring);
+	}
+	return removed;
+}
@@ -0,0 +1,458 @@
+#include "khefin.h"
+
+#include <fido.h>
+#include <pthread.h>
+#include <sodium.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "authenticator.h"
+#include "cryptography.h"
+#include "enrol.h"
+#include "exit.h"
+#include "generate.h"
+#include "invocation.h"
+#include "memory.h"
+#include "serialization.h"
+
+_Static_assert(KHEFIN_ERR_BAD_INVOCATION == EXIT_BAD_INVOCATION,
+               "KHEFIN_ERR_BAD_INVOCATION must match the exit code");
+_Static_assert(KHEFIN_ERR_BAD_PASSPHRASE == EXIT_BAD_PASSPHRASE,
+               "KHEFIN_ERR_BAD_PASSPHRASE must match the exit code");
+_Static_assert(KHEFIN_ERR_NO_DEVICES == EXIT_NO_DEVICES,
+               "KHEFIN_ERR_NO_DEVICES must match the exit code");
+_Static_assert(KHEFIN_ERR_NO_VALID_AUTHENTICATOR ==
+                   EXIT_NO_VALID_AUTHENTICATOR,
+               "KHEFIN_ERR_NO_VALID_AUTHENTICATOR must match the exit code");
+_Static_assert(KHEFIN_ERR_DESERIALIZATION == EXIT_DESERIALIZATION_ERROR,
+               "KHEFIN_ERR_DESERIALIZATION must match the exit code");
+_Static_assert(KHEFIN_ERR_BAD_PIN == EXIT_BAD_PIN,
+               "KHEFIN_ERR_BAD_PIN must match the exit code");
+_Static_assert(KHEFIN_ERR_OUT_OF_MEMORY == EXIT_OUT_OF_MEMORY,
+               "KHEFIN_ERR_OUT_OF_MEMORY must match the exit code");
+_Static_assert(KHEFIN_ERR_AUTHENTICATOR == EXIT_AUTHENTICATOR_ERROR,
+               "KHEFIN_ERR_AUTHENTICATOR must match the exit code");
+_Static_assert(KHEFIN_ERR_CRYPTOGRAPHY == EXIT_CRYPTOGRAPHY_ERROR,
+               "KHEFIN_ERR_CRYPTOGRAPHY must match the exit code");
+_Static_assert(KHEFIN_ERR_UNABLE_TO_GET_USER_SECRET ==
+                   EXIT_UNABLE_TO_GET_USER_SECRET,
+               "KHEFIN_ERR_UNABLE_TO_GET_USER_SECRET must match the exit code");
+_Static_assert(KHEFIN_ERR_PROGRAMMER == EXIT_PROGRAMMER_ERROR,
+               "KHEFIN_ERR_PROGRAMMER must match the exit code");
+_Static_assert(KHEFIN_AAGUID_MAX_SIZE == DEVICE_AAGUID_MAX_SIZE,
+               "KHEFIN_AAGUID_MAX_SIZE must match DEVICE_AAGUID_MAX_SIZE");
+_Static_assert(KHEFIN_SECRET_MAX_SIZE == 2 * HMAC_SECRET_SALT_SIZE,
+               "KHEFIN_SECRET_MAX_SIZE must fit the whole hmac-secret output");
+_Static_assert(KHEFIN_SUBKEY_SIZE == SUBKEY_SIZE,
+               "KHEFIN_SUBKEY_SIZE must match SUBKEY_SIZE");
+
+struct khefin_context_t {
+	char last_error[FAILURE_MESSAGE_SIZE];
+	khefin_warning_callback_t warning_callback;
+	void *warning_data;
+};
+
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+static int initialize_result = KHEFIN_OK;
+
+static void initialize(void) {
+	if (sodium_init() < 0) {
+		initialize_result = KHEFIN_ERR_CRYPTOGRAPHY;
+		return;
+	}
+	fido_init(0);
+}
+
+int khefin_init(void) {
+	pthread_once(&initialized, initialize);
+	return initialize_result;
+}
+
+khefin_context_t *khefin_context_new(void) {
+	khefin_context_t *context = malloc(sizeof(khefin_context_t));
+	if (context != NULL) {
+		context->last_error[0] = '\0';
+		context->warning_callback = NULL;
+		context->warning_data = NULL;
+	}
+	return context;
+}
+
+void khefin_context_free(khefin_context_t *context) { free(context); }
+
+const char *khefin_last_error(const khefin_context_t *context) {
+	return context->last_error;
+}
+
+void khefin_set_warning_callback(khefin_context_t *context,
+                                 khefin_warning_callback_t callback,
+                                 void *data) {
+	context->warning_callback = callback;
+	context->warning_data = data;
+}
+
+static int set_error(khefin_context_t *context, int error, const char *format,
+                     ...) __attribute__((format(printf, 3, 4)));
+
+static int set_error(khefin_context_t *context, int error, const char *format,
+                     ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(context->last_error, sizeof(context->last_error), format,
+	          arguments);
+	va_end(arguments);
+	return error;
+}
+
+/**
+ * Returns the error for a failure caught while calling into the rest of
+ * khefin, which would have made the command line tool exit, having returned
+ * the secure memory left allocated in scope to the arena and stopped
+ * redirecting warnings. Other memory is leaked.
+ */
+static int caught_failure(khefin_context_t *context, failure_catcher_t *catcher,
+                          secure_allocation_scope_t scope) {
+	stop_redirecting_warnings();
+	set_secure_allocation_scope(NO_SECURE_ALLOCATION_SCOPE);
+	free_secure_allocation_scope(scope);
+	return set_error(context, catcher->exit_code, "%s", catcher->message);
+}
+
+static void copy_string(char *destination, const char *source) {
+	snprintf(destination, KHEFIN_DEVICE_STRING_SIZE, "%s",
+	         source != NULL ? source : "");
+}
+
+static int enumerate_devices(khefin_context_t *context,
+                             khefin_device_t *devices, size_t capacity,
+                             size_t *count) {
+	devices_list_t *devices_list = list_devices();
+	probed_devices_t *probed = probe_devices(devices_list, NULL, NULL);
+
+	*count = probed->count;
+	for (size_t i = 0; i < probed->count && i < capacity; i++) {
+		const probed_device_t *device = &probed->list[i];
+		const fido_dev_info_t *device_info =
+		    fido_dev_info_ptr(devices_list->list, i);
+		khefin_device_t *result = &devices[i];
+		memset(result, 0, sizeof(khefin_device_t));
+		copy_string(result->path, device->path);
+		copy_string(result->manufacturer, device->manufacturer_string);
+		copy_string(result->product, device->product_string);
+		result->vendor_id = (uint16_t)fido_dev_info_vendor(device_info);
+		result->product_id = (uint16_t)fido_dev_info_product(device_info);
+		result->probed = device->status == device_probe_ok;
+		if (result->probed) {
+			result->supported =
+			    device->facts.fido2 && device->facts.supports_hmac_secret;
+			result->aaguid_size = device->facts.aaguid_size;
+			memcpy(result->aaguid, device->facts.aaguid,
+			       device->facts.aaguid_size);
+		}
+	}
+
+	bool none = devices_list->count == 0;
+	free_probed_devices(probed);
+	free_devices_list(devices_list);
+	if (none) {
+		return set_error(context, KHEFIN_ERR_NO_DEVICES, "No devices found");
+	}
+	return KHEFIN_OK;
+}
+
+int khefin_enumerate(khefin_context_t *context, khefin_device_t *devices,
+                     size_t capacity, size_t *count) {
+	failure_catcher_t catcher;
+	context->last_error[0] = '\0';
+	secure_allocation_scope_t scope = start_secure_allocation_scope();
+	if (setjmp(catcher.jump) != 0) {
+		return caught_failure(context, &catcher, scope);
+	}
+	catch_failures(&catcher);
+	redirect_warnings(context->warning_callback, context->warning_data);
+	int result = enumerate_devices(context, devices, capacity, count);
+	stop_redirecting_warnings();
+	stop_catching_failures();
+	set_secure_allocation_scope(NO_SECURE_ALLOCATION_SCOPE);
+	return result;
+}
+
+static int enrol(khefin_context_t *context,
+                 const khefin_enrol_options_t *options) {
+	if (options->device == NULL || options->file == NULL ||
+	    options->passphrase == NULL) {
+		return set_error(context, KHEFIN_ERR_BAD_INVOCATION,
+		                 "A device, file and passphrase are required");
+	}
+	if (options->record_device_ids && options->obfuscate_device_info) {
+		return set_error(context, KHEFIN_ERR_BAD_INVOCATION,
+		                 "Device IDs cannot be recorded when obfuscating "
+		                 "device info");
+	}
+
+	invocation_state_t *invocation = new_invocation_state(subcommand_enrol);
+	invocation->device = strdup_or_exit(options->device, "device");
+	invocation->file = strdup_or_exit(options->file, "file");
+	invocation->passphrase =
+	    secure_strndup_or_exit(options->passphrase, LONGEST_VALID_PASSPHRASE,
+	                           "passphrase in invocation state");
+	// enrol_device() prompts on the terminal for a PIN it needs which was not
+	// given, but refuses an empty one
+	invocation->authenticator_pin = secure_strndup_or_exit(
+	    options->pin != NULL ? options->pin : "", LONGEST_VALID_PIN,
+	    "authenticator PIN in invocation state");
+	invocation->obfuscate_device_info = options->obfuscate_device_info;
+	invocation->derive_subkeys = options->derive_subkeys;
+	invocation->unattended = options->unattended;
+	invocation->record_device_ids = options->record_device_ids;
+	switch (options->kdf_hardness) {
+	case khefin_kdf_hardness_low:
+		invocation->kdf_hardness = kdf_hardness_low;
+		break;
+	case khefin_kdf_hardness_medium:
+		invocation->kdf_hardness = kdf_hardness_medium;
+		break;
+	case khefin_kdf_hardness_high:
+		invocation->kdf_hardness = kdf_hardness_high;
+		break;
+	default:
+		invocation->kdf_hardness = kdf_hardness_unspecified;
+		break;
+	}
+	choose_default_kdf_parameters(invocation);
+
+	enrol_device(invocation);
+	free_invocation(invocation);
+	return KHEFIN_OK;
+}
+
+int khefin_enrol(khefin_context_t *context,
+                 const khefin_enrol_options_t *options) {
+	failure_catcher_t catcher;
+	context->last_error[0] = '\0';
+	secure_allocation_scope_t scope = start_secure_allocation_scope();
+	if (setjmp(catcher.jump) != 0) {
+		return caught_failure(context, &catcher, scope);
+	}
+	catch_failures(&catcher);
+	redirect_warnings(context->warning_callback, context->warning_data);
+	int result = enrol(context, options);
+	stop_redirecting_warnings();
+	stop_catching_failures();
+	set_secure_allocation_scope(NO_SECURE_ALLOCATION_SCOPE);
+	return result;
+}
+
+/**
+ * Asks the devices for the secret, as get_secret_from_open_devices() does,
+ * asking options->get_pin for a PIN if a device needs one and none was given.
+ */
+static int ask_devices(khefin_context_t *context,
+                       const khefin_generate_options_t *options,
+                       deserialized_cleartext *cleartext,
+                       authenticator_parameters_t *params, secret_t *secret) {
+	devices_list_t *devices_list = list_devices();
+	probed_devices_t *probed =
+	    probe_devices(devices_list, device_may_be_candidate, cleartext);
+	for (size_t i = 0; i < probed->count; i++) {
+		probed_device_t *device = &probed->list[i];
+		if (device->status != device_probe_ok &&
+		    device->status != device_probe_not_wanted) {
+			warnx("Skipping device at %s: %s", device->path,
+			      describe_device_probe_failure(device));
+		}
+	}
+
+	probed_device_t *needs_pin = NULL;
+	bool transport_error = false;
+	char *pin = NULL;
+	int result = get_secret_from_open_devices(
+	    devices_list, probed, cleartext, params, options->pin,
+	    options->race_authenticators, secret, &needs_pin, &transport_error);
+	if (result == EXIT_BAD_PIN && needs_pin != NULL &&
+	    options->get_pin != NULL) {
+		char prompt[FAILURE_MESSAGE_SIZE];
+		snprintf(prompt, sizeof(prompt), "authenticator PIN for %s at %s",
+		         needs_pin->product_string, needs_pin->path);
+		pin = secure_malloc_or_exit(LONGEST_VALID_PIN + 1,
+		                            "authenticator PIN");
+		if (options->get_pin(prompt, pin, LONGEST_VALID_PIN + 1,
+		                     options->get_pin_data) &&
+		    strnlen(pin, LONGEST_VALID_PIN + 1) <= LONGEST_VALID_PIN &&
+		    pin[0] != '\0') {
+			needs_pin = NULL;
+			result = get_secret_from_open_devices(
+			    devices_list, probed, cleartext, params, pin,
+			    options->race_authenticators, secret, &needs_pin,
+			    &transport_error);
+		}
+	}
+
+	switch (result) {
+	case EXIT_SUCCESS:
+		break;
+	case EXIT_NO_DEVICES:
+		set_error(context, result,
+		          "Unable to find an appropriate authenticator to generate a "
+		          "secret");
+		break;
+	case EXIT_BAD_PIN:
+		if (needs_pin != NULL) {
+			set_error(context, result,
+			          "No PIN given for the authenticator %s at %s",
+			          needs_pin->product_string, needs_pin->path);
+		} else {
+			set_error(context, result, "Invalid PIN for authenticator");
+		}
+		break;
+	default:
+		set_error(context, result,
+		          "No connected authenticator was able to generate a valid "
+		          "secret");
+		break;
+	}
+
+	secure_free(pin);
+	free_probed_devices(probed);
+	free_devices_list(devices_list);
+	return result;
+}
+
+static int generate(khefin_context_t *context, const unsigned char *keyfile,
+                    size_t keyfile_size,
+                    const khefin_generate_options_t *options,
+                    unsigned char *secret, size_t secret_capacity,
+                    size_t *secret_size, bool *derive_subkeys) {
+	if (options->passphrase == NULL) {
+		return set_error(context, KHEFIN_ERR_BAD_INVOCATION,
+		                 "A passphrase is required");
+	}
+
+	// try_load_cleartext() only reads the data
+	char keyfile_path[] = "keyfile";
+	encoded_file file = {.path = keyfile_path,
+	                     .data = (unsigned char *)keyfile,
+	                     .length = keyfile_size};
+	char error[FAILURE_MESSAGE_SIZE];
+	deserialized_cleartext *cleartext =
+	    try_load_cleartext(&file, error, sizeof(error));
+	if (cleartext == NULL) {
+		return set_error(context, KHEFIN_ERR_DESERIALIZATION, "%s", error);
+	}
+	// The keyfile may have come from anywhere, so its parameters are checked
+	// as the agent checks them, rather than failing to derive the key
+	if (!kdf_parameters_are_usable(cleartext)) {
+		free_cleartext(cleartext);
+		return set_error(context, KHEFIN_ERR_CRYPTOGRAPHY,
+		                 "The keyfile's key derivation parameters are "
+		                 "invalid, or need more memory than is available");
+	}
+
+	key_spec_t *key_spec = make_key_spec_from_passphrase_and_cleartext(
+	    (char *)options->passphrase, cleartext);
+	unsigned char *key_bytes = derive_key(key_spec);
+	free_key_spec(key_spec);
+	if (!key_decrypts_cleartext(cleartext, key_bytes)) {
+		free_key(key_bytes);
+		free_cleartext(cleartext);
+		return set_error(context, KHEFIN_ERR_BAD_PASSPHRASE,
+		                 "Could not decrypt secrets; this likely means the "
+		                 "passphrase was wrong");
+	}
+
+	authenticator_parameters_t *params = NULL;
+	int result =
+	    try_build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+	        cleartext, key_bytes, (char *)options->mixin, &params, error,
+	        sizeof(error));
+	if (result != KHEFIN_OK) {
+		free_key(key_bytes);
+		free_cleartext(cleartext);
+		return set_error(context, result, "%s", error);
+	}
+	if (options->second_mixin != NULL) {
+		if (params->salt_size != 2 * HMAC_SECRET_SALT_SIZE) {
+			result = set_error(context, KHEFIN_ERR_DESERIALIZATION,
+			                   "The salt in this keyfile is %zu bytes, but a "
+			                   "second mixin needs %d bytes",
+			                   params->salt_size, 2 * HMAC_SECRET_SALT_SIZE);
+		} else {
+			use_second_salt_for_second_mixin(params, cleartext, key_bytes,
+			                                 (char *)options->second_mixin);
+		}
+	}
+	free_key(key_bytes);
+	key_bytes = NULL;
+
+	secret_t *secret_struct = malloc_or_exit(sizeof(secret_t), "secret");
+	secret_struct->secret = NULL;
+	secret_struct->secret_size = 0;
+	if (result == KHEFIN_OK) {
+		result = ask_devices(context, options, cleartext, params,
+		                     secret_struct);
+	}
+
+	if (result == KHEFIN_OK) {
+		*secret_size = secret_struct->secret_size;
+		if (derive_subkeys != NULL) {
+			*derive_subkeys = params->derive_subkeys;
+		}
+		if (secret_struct->secret_size > secret_capacity) {
+			result = set_error(context, KHEFIN_ERR_BAD_INVOCATION,
+			                   "The secret is %zu bytes, which does not fit "
+			                   "in %zu",
+			                   secret_struct->secret_size, secret_capacity);
+		} else {
+			memcpy(secret, secret_struct->secret, secret_struct->secret_size);
+		}
+	}
+
+	free_secret(secret_struct);
+	free_parameters(params);
+	free_cleartext(cleartext);
+	return result;
+}
+
+int khefin_generate(khefin_context_t *context, const unsigned char *keyfile,
+                    size_t keyfile_size,
+                    const khefin_generate_options_t *options,
+                    unsigned char *secret, size_t secret_capacity,
+                    size_t *secret_size, bool *derive_subkeys) {
+	failure_catcher_t catcher;
+	context->last_error[0] = '\0';
+	secure_allocation_scope_t scope = start_secure_allocation_scope();
+	if (setjmp(catcher.jump) != 0) {
+		return caught_failure(context, &catcher, scope);
+	}
+	catch_failures(&catcher);
+	redirect_warnings(context->warning_callback, context->warning_data);
+	int result = generate(context, keyfile, keyfile_size, options, secret,
+	                      secret_capacity, secret_size, derive_subkeys);
+	stop_redirecting_warnings();
+	stop_catching_failures();
+	set_secure_allocation_scope(NO_SECURE_ALLOCATION_SCOPE);
+	return result;
+}
+
+int khefin_derive_subkey(khefin_context_t *context, const unsigned char *root,
+                         size_t root_size, const char *label,
+                         unsigned char *subkey) {
+	context->last_error[0] = '\0';
+	if (root_size < crypto_generichash_blake2b_KEYBYTES_MIN ||
+	    root_size > crypto_generichash_blake2b_KEYBYTES_MAX) {
+		return set_error(context, KHEFIN_ERR_BAD_INVOCATION,
+		                 "A root secret of %zu bytes cannot be used to derive "
+		                 "subkeys",
+		                 root_size);
+	}
+
+	failure_catcher_t catcher;
+	if (setjmp(catcher.jump) != 0) {
+		return caught_failure(context, &catcher, NO_SECURE_ALLOCATION_SCOPE);
+	}
+	catch_failures(&catcher);
+	derive_subkey(subkey, root, root_size, label);
+	stop_catching_failures();
+	return KHEFIN_OK;
+}
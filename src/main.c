@@ -1,19 +1,26 @@
 #include <fido.h>
 #include <sodium.h>
+#include <stdio.h>
 
+#include "agent.h"
 #include "authenticator.h"
+#include "calibrate.h"
 #include "enrol.h"
 #include "enumerate.h"
 #include "exit.h"
 #include "generate.h"
 #include "help.h"
 #include "invocation.h"
+#include "kdf_cache.h"
 #include "memory.h"
+#include "rekey.h"
+#include "ssh_askpass.h"
+#include "unlock_dir.h"
 
 int main(int argc, char **argv) {
 	lock_memory_and_drop_privileges();
 
-	unsigned short int print_secret_result;
+	unsigned short int rekey_result;
 
 	if (sodium_init() != 0) {
 		errx(EXIT_CRYPTOGRAPHY_ERROR, "Unable to initialize libsodium");
@@ -21,8 +28,7 @@ int main(int argc, char **argv) {
 
 	fido_init(0);
 
-	invocation_state_t *invocation =
-	    parse_arguments_and_get_passphrase(argc, argv);
+	invocation_state_t *invocation = parse_arguments(argc, argv);
 
 	devices_list_t *devices_list;
 
@@ -44,34 +50,43 @@ int main(int argc, char **argv) {
 		free_invocation(invocation);
 		return EXIT_SUCCESS;
 
+	case subcommand_kdf_calibrate:
+		print_kdf_calibration(invocation);
+		free_invocation(invocation);
+		return EXIT_SUCCESS;
+
+	case subcommand_kdf_cache_flush: {
+		unsigned int removed = flush_kdf_cache();
+		printf("Removed %u cached key%s\n", removed, removed == 1 ? "" : "s");
+		free_invocation(invocation);
+		return EXIT_SUCCESS;
+	}
+
 	case subcommand_enrol:
+		get_passphrase_if_not_given(invocation);
 		enrol_device(invocation);
 		free_invocation(invocation);
 		return EXIT_SUCCESS;
 
+	case subcommand_rekey:
+		rekey_result = rekey_keyfiles(invocation);
+		free_invocation(invocation);
+		return rekey_result;
+
+	case subcommand_agent:
+		return run_agent(invocation);
+
 	case subcommand_generate:
-		devices_list = list_devices();
-		print_secret_result =
-		    print_secret_consuming_invocation(invocation, devices_list);
-		free_devices_list(devices_list);
-		switch (print_secret_result) {
-		case EXIT_NO_DEVICES:
-			errx(EXIT_NO_DEVICES,
-			     "Unable to find an appropriate authenticator to generate a "
-			     "secret");
-		case EXIT_NO_VALID_AUTHENTICATOR:
-			errx(EXIT_NO_VALID_AUTHENTICATOR,
-			     "No connected authenticator was able to generate a valid "
-			     "secret");
-		case EXIT_SUCCESS:
-			return EXIT_SUCCESS;
-		default:
-			errx(EXIT_PROGRAMMER_ERROR,
-			     "BUG (%s:%d): unhandled return value from "
-			     "print_secret_consuming_invocation() (%d)",
-			     __func__, __LINE__, print_secret_result);
-		}
-		break;
+		exit_unless_secret_printed(
+		    print_secret_consuming_invocation(invocation));
+		return EXIT_SUCCESS;
+
+	case subcommand_ssh_askpass:
+		exit_unless_secret_printed(run_ssh_askpass(invocation));
+		return EXIT_SUCCESS;
+
+	case subcommand_unlock_dir:
+		return unlock_dir(invocation);
 
 	default:
 		errx(EXIT_PROGRAMMER_ERROR,
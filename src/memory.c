@@ -1,7 +1,10 @@
 #include "memory.h"
 
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -11,19 +14,236 @@
 
 #include "exit.h"
 
-void lock_memory_and_drop_privileges(void) {
+// Each allocation in the secure arena is preceded by one of these. Blocks are
+// contiguous, so the next block starts size bytes after this header ends.
+typedef struct secure_block_t {
+	size_t size;
+	size_t in_use;
+	secure_allocation_scope_t scope;
+} secure_block_t;
+
+#define SECURE_BLOCK_HEADER_SIZE                                               \
+	(((sizeof(secure_block_t) + SECURE_ARENA_ALIGNMENT - 1) /                  \
+	  SECURE_ARENA_ALIGNMENT) *                                                \
+	 SECURE_ARENA_ALIGNMENT)
+
+// Each region of locked memory from which secure allocations are made. The
+// first is SECURE_ARENA_SIZE; more are mapped as they are needed.
+typedef struct secure_arena_t {
+	unsigned char *memory;
+	size_t size;
+	struct secure_arena_t *next;
+} secure_arena_t;
+
+// At most this many functions can be registered to run before the arenas are
+// zeroed at exit
+#define MAXIMUM_HANDLERS_BEFORE_ZEROING 4
+
+// The key derivation runs on a worker thread, so the arenas must be locked
+// (in the mutex sense) before they are used.
+static pthread_mutex_t secure_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static secure_arena_t *secure_arenas = NULL;
+static bool secure_arena_released = false;
+static pthread_t secure_arena_releasing_thread;
+static void (*handlers_before_zeroing[MAXIMUM_HANDLERS_BEFORE_ZEROING])(void);
+static size_t handler_before_zeroing_count = 0;
+// The last scope started, guarded by secure_arena_mutex
+static secure_allocation_scope_t last_allocation_scope =
+    NO_SECURE_ALLOCATION_SCOPE;
+static __thread secure_allocation_scope_t current_allocation_scope =
+    NO_SECURE_ALLOCATION_SCOPE;
+
+static void zero_secure_arena_at_exit(void) {
+	// Worker threads which might still allocate secure memory are stopped
+	// first, while it can still be allocated
+	pthread_mutex_lock(&secure_arena_mutex);
+	size_t handler_count = handler_before_zeroing_count;
+	pthread_mutex_unlock(&secure_arena_mutex);
+	for (size_t i = handler_count; i > 0; i--) {
+		handlers_before_zeroing[i - 1]();
+	}
+
+	pthread_mutex_lock(&secure_arena_mutex);
+	for (secure_arena_t *arena = secure_arenas; arena != NULL;
+	     arena = arena->next) {
+		sodium_memzero(arena->memory, arena->size);
+	}
+	// Any later secure_free() would find zeroed block headers, so from here
+	// on freeing does nothing.
+	secure_arena_released = true;
+	secure_arena_releasing_thread = pthread_self();
+	pthread_mutex_unlock(&secure_arena_mutex);
+}
+
+void before_zeroing_secure_arena_at_exit(void (*handler)(void)) {
+	pthread_mutex_lock(&secure_arena_mutex);
+	if (handler_before_zeroing_count == MAXIMUM_HANDLERS_BEFORE_ZEROING) {
+		pthread_mutex_unlock(&secure_arena_mutex);
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): too many handlers to run before zeroing secure "
+		     "memory",
+		     __func__, __LINE__);
+	}
+	handlers_before_zeroing[handler_before_zeroing_count++] = handler;
+	pthread_mutex_unlock(&secure_arena_mutex);
+}
+
+/**
+ * Maps an arena of at least minimum_size bytes, returning NULL (with errno
+ * set) if that fails. If the memory cannot be locked, this warns (only once)
+ * and carries on. Must be called with secure_arena_mutex held.
+ */
+static secure_arena_t *map_secure_arena(size_t minimum_size) {
+#if WARN_ON_MEMORY_LOCK_ERRORS
+	static bool warned_about_locking = false;
+#endif
+
+	size_t page_size = (size_t)sysconf(_SC_PAGE_SIZE);
+	if (minimum_size > SIZE_MAX - (3 * page_size)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t arena_size = ((minimum_size + page_size - 1) / page_size) * page_size;
+
+	secure_arena_t *arena = malloc(sizeof(secure_arena_t));
+	if (arena == NULL) {
+		return NULL;
+	}
+
+	// One guard page either side of the arena, which will fault if accessed
+	unsigned char *region =
+	    mmap(NULL, arena_size + 2 * page_size, PROT_NONE,
+	         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		free(arena);
+		return NULL;
+	}
+	if (mprotect(region + page_size, arena_size, PROT_READ | PROT_WRITE) !=
+	    0) {
+		int mprotect_errno = errno;
+		munmap(region, arena_size + 2 * page_size);
+		free(arena);
+		errno = mprotect_errno;
+		return NULL;
+	}
+
 	int r;
 
-	// Prevent our memory from being swapped out
-	r = mlockall(MCL_CURRENT | MCL_FUTURE);
+	// Prevent secrets from being swapped out
+	r = mlock(region + page_size, arena_size);
 #if WARN_ON_MEMORY_LOCK_ERRORS
-	if (r != 0) {
+	if (r != 0 && !warned_about_locking) {
 		warn("Unable to lock memory, which means secrets may be swapped to "
 		     "disk");
+		warned_about_locking = true;
+	}
+#endif
+
+#ifdef MADV_DONTDUMP
+	// Belt and braces: outside of DEBUG builds we disable core dumps entirely
+	r = madvise(region + page_size, arena_size, MADV_DONTDUMP);
+#if WARN_ON_MEMORY_LOCK_ERRORS
+	if (r != 0) {
+		warn("Unable to exclude secure memory from core dumps");
 	}
 #endif
+#endif
+	(void)r;
+
+	arena->memory = region + page_size;
+	arena->size = arena_size;
+	arena->next = NULL;
+
+	secure_block_t *first_block = (secure_block_t *)arena->memory;
+	first_block->size = arena->size - SECURE_BLOCK_HEADER_SIZE;
+	first_block->in_use = false;
+	first_block->scope = NO_SECURE_ALLOCATION_SCOPE;
+
+	return arena;
+}
+
+/**
+ * Maps the first secure arena, if that hasn't already been done, returning
+ * false if it cannot be. Must be called with secure_arena_mutex held.
+ */
+static bool initialize_secure_arena(void) {
+	if (secure_arenas != NULL) {
+		return true;
+	}
+	secure_arenas = map_secure_arena(SECURE_ARENA_SIZE);
+	if (secure_arenas == NULL) {
+		return false;
+	}
+	atexit(zero_secure_arena_at_exit);
+	return true;
+}
+
+/**
+ * Returns the first free block in arena of at least size bytes, marked in use,
+ * or NULL if there is none. Must be called with secure_arena_mutex held.
+ */
+static void *allocate_from_secure_arena(secure_arena_t *arena, size_t size) {
+	unsigned char *arena_end = arena->memory + arena->size;
+	// First fit
+	for (unsigned char *p = arena->memory; p < arena_end;
+	     p += SECURE_BLOCK_HEADER_SIZE + ((secure_block_t *)p)->size) {
+		secure_block_t *block = (secure_block_t *)p;
+		if (block->in_use || block->size < size) {
+			continue;
+		}
+
+		// Split off the remainder, if it is big enough to be useful
+		if (block->size >=
+		    size + SECURE_BLOCK_HEADER_SIZE + SECURE_ARENA_ALIGNMENT) {
+			secure_block_t *remainder =
+			    (secure_block_t *)(p + SECURE_BLOCK_HEADER_SIZE + size);
+			remainder->size = block->size - size - SECURE_BLOCK_HEADER_SIZE;
+			remainder->in_use = false;
+			remainder->scope = NO_SECURE_ALLOCATION_SCOPE;
+			block->size = size;
+		}
+
+		block->in_use = true;
+		block->scope = current_allocation_scope;
+		return p + SECURE_BLOCK_HEADER_SIZE;
+	}
+	return NULL;
+}
+
+/**
+ * Merges runs of free blocks in arena, so that it doesn't fragment. Must be
+ * called with secure_arena_mutex held.
+ */
+static void merge_free_blocks(secure_arena_t *arena) {
+	unsigned char *arena_end = arena->memory + arena->size;
+	for (unsigned char *q = arena->memory; q < arena_end;
+	     q += SECURE_BLOCK_HEADER_SIZE + ((secure_block_t *)q)->size) {
+		secure_block_t *current = (secure_block_t *)q;
+		if (current->in_use) {
+			continue;
+		}
+		unsigned char *next = q + SECURE_BLOCK_HEADER_SIZE + current->size;
+		while (next < arena_end && !((secure_block_t *)next)->in_use) {
+			current->size +=
+			    SECURE_BLOCK_HEADER_SIZE + ((secure_block_t *)next)->size;
+			sodium_memzero(next, SECURE_BLOCK_HEADER_SIZE);
+			next = q + SECURE_BLOCK_HEADER_SIZE + current->size;
+		}
+	}
+}
+
+void lock_memory_and_drop_privileges(void) {
+	// Set up the locked memory we keep secrets in now, so that any warnings
+	// are shown before we prompt for anything.
+	pthread_mutex_lock(&secure_arena_mutex);
+	bool initialized = initialize_secure_arena();
+	pthread_mutex_unlock(&secure_arena_mutex);
+	if (!initialized) {
+		err(EXIT_OUT_OF_MEMORY, "Unable to map secure memory");
+	}
 
 #ifndef DEBUG
+	int r;
 
 	// Set memory to not-dumpable
 	r = prctl(PR_SET_DUMPABLE, 0);
@@ -71,3 +291,156 @@ char *strndup_or_exit(const char *str, size_t n, const char *what) {
 	}
 	return result;
 }
+
+void *secure_malloc(size_t n) {
+	if (n > SIZE_MAX - SECURE_BLOCK_HEADER_SIZE - SECURE_ARENA_ALIGNMENT) {
+		return NULL;
+	}
+	size_t size = n == 0 ? SECURE_ARENA_ALIGNMENT
+	                     : ((n + SECURE_ARENA_ALIGNMENT - 1) /
+	                        SECURE_ARENA_ALIGNMENT) *
+	                           SECURE_ARENA_ALIGNMENT;
+
+	pthread_mutex_lock(&secure_arena_mutex);
+	if (secure_arena_released) {
+		bool releasing_thread =
+		    pthread_equal(pthread_self(), secure_arena_releasing_thread);
+		pthread_mutex_unlock(&secure_arena_mutex);
+		if (releasing_thread) {
+			return NULL;
+		}
+		// The process is exiting on another thread, and exiting again from
+		// this one (as the caller would on failure) is undefined, so wait
+		// for it to finish instead.
+		while (true) {
+			pause();
+		}
+	}
+	if (!initialize_secure_arena()) {
+		pthread_mutex_unlock(&secure_arena_mutex);
+		return NULL;
+	}
+
+	secure_arena_t *last = NULL;
+	for (secure_arena_t *arena = secure_arenas; arena != NULL;
+	     arena = arena->next) {
+		void *result = allocate_from_secure_arena(arena, size);
+		if (result != NULL) {
+			pthread_mutex_unlock(&secure_arena_mutex);
+			return result;
+		}
+		last = arena;
+	}
+
+	// Every arena is full, so map another at least big enough for this
+	size_t arena_size = size + SECURE_BLOCK_HEADER_SIZE > SECURE_ARENA_SIZE
+	                        ? size + SECURE_BLOCK_HEADER_SIZE
+	                        : SECURE_ARENA_SIZE;
+	secure_arena_t *arena = map_secure_arena(arena_size);
+	if (arena == NULL) {
+		pthread_mutex_unlock(&secure_arena_mutex);
+		return NULL;
+	}
+	last->next = arena;
+	void *result = allocate_from_secure_arena(arena, size);
+	pthread_mutex_unlock(&secure_arena_mutex);
+	return result;
+}
+
+void *secure_malloc_or_exit(size_t n, const char *what) {
+	void *result = secure_malloc(n);
+	if (result == NULL) {
+		errx(EXIT_OUT_OF_MEMORY, "Unable to allocate secure memory for %s",
+		     what);
+	}
+	return result;
+}
+
+char *secure_strdup_or_exit(const char *str, const char *what) {
+	size_t size = strlen(str) + 1;
+	char *result = secure_malloc_or_exit(size, what);
+	memcpy(result, str, size);
+	return result;
+}
+
+char *secure_strndup_or_exit(const char *str, size_t n, const char *what) {
+	size_t length = strnlen(str, n);
+	char *result = secure_malloc_or_exit(length + 1, what);
+	memcpy(result, str, length);
+	result[length] = (char)0;
+	return result;
+}
+
+void secure_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&secure_arena_mutex);
+	if (secure_arena_released) {
+		pthread_mutex_unlock(&secure_arena_mutex);
+		return;
+	}
+
+	unsigned char *p = (unsigned char *)ptr - SECURE_BLOCK_HEADER_SIZE;
+	secure_arena_t *arena = secure_arenas;
+	while (arena != NULL &&
+	       (p < arena->memory || p >= arena->memory + arena->size)) {
+		arena = arena->next;
+	}
+	if (arena == NULL || !((secure_block_t *)p)->in_use) {
+		pthread_mutex_unlock(&secure_arena_mutex);
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): pointer was not allocated from secure memory",
+		     __func__, __LINE__);
+	}
+
+	secure_block_t *block = (secure_block_t *)p;
+	sodium_memzero(ptr, block->size);
+	block->in_use = false;
+	merge_free_blocks(arena);
+
+	pthread_mutex_unlock(&secure_arena_mutex);
+}
+
+secure_allocation_scope_t start_secure_allocation_scope(void) {
+	pthread_mutex_lock(&secure_arena_mutex);
+	current_allocation_scope = ++last_allocation_scope;
+	pthread_mutex_unlock(&secure_arena_mutex);
+	return current_allocation_scope;
+}
+
+secure_allocation_scope_t get_secure_allocation_scope(void) {
+	return current_allocation_scope;
+}
+
+void set_secure_allocation_scope(secure_allocation_scope_t scope) {
+	current_allocation_scope = scope;
+}
+
+void free_secure_allocation_scope(secure_allocation_scope_t scope) {
+	if (scope == NO_SECURE_ALLOCATION_SCOPE) {
+		return;
+	}
+
+	pthread_mutex_lock(&secure_arena_mutex);
+	if (secure_arena_released) {
+		pthread_mutex_unlock(&secure_arena_mutex);
+		return;
+	}
+	for (secure_arena_t *arena = secure_arenas; arena != NULL;
+	     arena = arena->next) {
+		unsigned char *arena_end = arena->memory + arena->size;
+		for (unsigned char *p = arena->memory; p < arena_end;
+		     p += SECURE_BLOCK_HEADER_SIZE + ((secure_block_t *)p)->size) {
+			secure_block_t *block = (secure_block_t *)p;
+			if (block->in_use && block->scope == scope) {
+				sodium_memzero(p + SECURE_BLOCK_HEADER_SIZE, block->size);
+				block->in_use = false;
+			}
+		}
+		merge_free_blocks(arena);
+	}
+	pthread_mutex_unlock(&secure_arena_mutex);
+}
+
@@ -0,0 +1,366 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pwd.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "khefin.h"
+#include "pam_khefin.h"
+
+typedef struct pam_khefin_options_t {
+	const char *keyfile;
+	const char *verifier;
+	const char *mixin;
+	const char *subkey;
+	bool race_authenticators;
+	bool debug;
+} pam_khefin_options_t;
+
+static void parse_options(pam_handle_t *pamh, int argc, const char **argv,
+                          pam_khefin_options_t *options) {
+	options->keyfile = PAM_KHEFIN_DEFAULT_KEYFILE;
+	options->verifier = PAM_KHEFIN_DEFAULT_VERIFIER;
+	options->mixin = NULL;
+	options->subkey = NULL;
+	options->race_authenticators = false;
+	options->debug = false;
+
+	for (int i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "keyfile=", strlen("keyfile=")) == 0) {
+			options->keyfile = argv[i] + strlen("keyfile=");
+		} else if (strncmp(argv[i], "verifier=", strlen("verifier=")) == 0) {
+			options->verifier = argv[i] + strlen("verifier=");
+		} else if (strncmp(argv[i], "mixin=", strlen("mixin=")) == 0) {
+			options->mixin = argv[i] + strlen("mixin=");
+		} else if (strncmp(argv[i], "subkey=", strlen("subkey=")) == 0) {
+			options->subkey = argv[i] + strlen("subkey=");
+		} else if (strcmp(argv[i], "race") == 0) {
+			options->race_authenticators = true;
+		} else if (strcmp(argv[i], "debug") == 0) {
+			options->debug = true;
+		} else if (strcmp(argv[i], "use_first_pass") != 0 &&
+		           strcmp(argv[i], "try_first_pass") != 0) {
+			// pam_get_authtok() reads those two itself
+			pam_syslog(pamh, LOG_ERR, "Unknown option: %s", argv[i]);
+		}
+	}
+}
+
+/**
+ * Writes template into path (which must be PAM_KHEFIN_PATH_SIZE bytes) with %u
+ * replaced by user, %h by home and %% by %, returning false if it does not fit.
+ */
+static bool expand_path(const char *template, const char *user,
+                        const char *home, char *path) {
+	size_t length = 0;
+	for (const char *next = template; *next != '\0'; next++) {
+		char literal[2] = {*next, '\0'};
+		const char *insert = literal;
+		if (next[0] == '%' && next[1] == 'u') {
+			insert = user;
+			next++;
+		} else if (next[0] == '%' && next[1] == 'h') {
+			insert = home;
+			next++;
+		} else if (next[0] == '%' && next[1] == '%') {
+			next++;
+		}
+
+		size_t insert_length = strlen(insert);
+		if (length + insert_length >= PAM_KHEFIN_PATH_SIZE) {
+			return false;
+		}
+		memcpy(path + length, insert, insert_length);
+		length += insert_length;
+	}
+	path[length] = '\0';
+	return true;
+}
+
+/**
+ * Reads the keyfile at path into keyfile, which must be
+ * PAM_KHEFIN_MAX_KEYFILE_SIZE bytes, returning a PAM error if it cannot.
+ */
+static int read_keyfile(pam_handle_t *pamh, const char *path,
+                        unsigned char *keyfile, size_t *size) {
+	FILE *file = fopen(path, "rbe");
+	if (file == NULL) {
+		pam_syslog(pamh, LOG_ERR, "Unable to open keyfile %s: %s", path,
+		           strerror(errno));
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	*size = fread(keyfile, 1, PAM_KHEFIN_MAX_KEYFILE_SIZE, file);
+	bool failed = ferror(file) != 0;
+	bool too_big = !failed && fgetc(file) != EOF;
+	fclose(file);
+
+	if (failed) {
+		pam_syslog(pamh, LOG_ERR, "Unable to read keyfile %s", path);
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	if (too_big) {
+		pam_syslog(pamh, LOG_ERR, "%s is too big to be a keyfile", path);
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	return PAM_SUCCESS;
+}
+
+/**
+ * Whether the verifier file at path holds the hex SHA-256 of secret as
+ * generate prints it (as hex, followed by a newline), as sha256sum prints it.
+ */
+static int check_verifier(pam_handle_t *pamh, const char *path,
+                          const unsigned char *secret, size_t secret_size) {
+	char hex[crypto_hash_sha256_BYTES * 2 + 1];
+	unsigned char expected[crypto_hash_sha256_BYTES];
+	size_t expected_size = 0;
+
+	FILE *file = fopen(path, "re");
+	if (file == NULL) {
+		pam_syslog(pamh, LOG_ERR, "Unable to open verifier %s: %s", path,
+		           strerror(errno));
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+	size_t length = fread(hex, 1, sizeof(hex) - 1, file);
+	fclose(file);
+	hex[length] = '\0';
+	if (sodium_hex2bin(expected, sizeof(expected), hex, length, NULL,
+	                   &expected_size, NULL) != 0 ||
+	    expected_size != sizeof(expected)) {
+		pam_syslog(pamh, LOG_ERR, "%s does not start with a SHA-256 hash",
+		           path);
+		return PAM_AUTHINFO_UNAVAIL;
+	}
+
+	char *line = sodium_malloc(KHEFIN_SECRET_MAX_SIZE * 2 + 2);
+	unsigned char actual[crypto_hash_sha256_BYTES];
+	if (line == NULL) {
+		return PAM_BUF_ERR;
+	}
+	sodium_bin2hex(line, KHEFIN_SECRET_MAX_SIZE * 2 + 1, secret, secret_size);
+	strcat(line, "\n");
+	crypto_hash_sha256(actual, (const unsigned char *)line, strlen(line));
+	sodium_free(line);
+
+	int result = sodium_memcmp(actual, expected, sizeof(actual)) == 0
+	                 ? PAM_SUCCESS
+	                 : PAM_AUTH_ERR;
+	sodium_memzero(actual, sizeof(actual));
+	return result;
+}
+
+/**
+ * Asks for a PIN through the PAM conversation (see khefin_pin_callback_t).
+ */
+static bool get_pin_by_conversation(const char *prompt, char *pin,
+                                    size_t pin_size, void *data) {
+	pam_handle_t *pamh = (pam_handle_t *)data;
+	char *response = NULL;
+	if (pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &response, "%c%s: ",
+	               toupper((unsigned char)prompt[0]),
+	               prompt + 1) != PAM_SUCCESS ||
+	    response == NULL) {
+		return false;
+	}
+
+	size_t length = strlen(response);
+	bool fits = length < pin_size;
+	if (fits) {
+		memcpy(pin, response, length + 1);
+	}
+	sodium_memzero(response, length);
+	free(response);
+	return fits;
+}
+
+/**
+ * Logs a warning from libkhefin, such as about a skipped authenticator (see
+ * khefin_warning_callback_t), rather than letting it reach the application's
+ * standard error.
+ */
+static void log_warning(const char *message, void *data) {
+	pam_syslog((pam_handle_t *)data, LOG_WARNING, "%s", message);
+}
+
+static int pam_error_for(int khefin_error) {
+	switch (khefin_error) {
+	case KHEFIN_OK:
+		return PAM_SUCCESS;
+	case KHEFIN_ERR_BAD_PASSPHRASE:
+	case KHEFIN_ERR_BAD_PIN:
+	case KHEFIN_ERR_NO_VALID_AUTHENTICATOR:
+		return PAM_AUTH_ERR;
+	case KHEFIN_ERR_NO_DEVICES:
+	case KHEFIN_ERR_DESERIALIZATION:
+		return PAM_AUTHINFO_UNAVAIL;
+	case KHEFIN_ERR_OUT_OF_MEMORY:
+		return PAM_BUF_ERR;
+	default:
+		return PAM_SYSTEM_ERR;
+	}
+}
+
+/**
+ * Gets the secret for the keyfile, or the subkey of it named in options,
+ * into secret (which must be KHEFIN_SECRET_MAX_SIZE bytes) and checks it
+ * against the verifier.
+ */
+static int authenticate(pam_handle_t *pamh, int flags,
+                        pam_khefin_options_t *options, const char *user,
+                        const unsigned char *keyfile, size_t keyfile_size,
+                        const char *verifier_path, unsigned char *secret) {
+	const char *passphrase = NULL;
+	int result = pam_get_authtok(pamh, PAM_AUTHTOK, &passphrase,
+	                             APPNAME " passphrase: ");
+	if (result != PAM_SUCCESS) {
+		return result;
+	}
+
+	khefin_context_t *context = khefin_context_new();
+	if (context == NULL) {
+		return PAM_BUF_ERR;
+	}
+	khefin_set_warning_callback(context, log_warning, pamh);
+
+	khefin_generate_options_t generate_options;
+	memset(&generate_options, 0, sizeof(generate_options));
+	generate_options.passphrase = passphrase;
+	generate_options.get_pin = get_pin_by_conversation;
+	generate_options.get_pin_data = pamh;
+	generate_options.mixin = options->mixin;
+	generate_options.race_authenticators = options->race_authenticators;
+
+	size_t secret_size = 0;
+	bool derive_subkeys = false;
+	int khefin_result = khefin_generate(
+	    context, keyfile, keyfile_size, &generate_options, secret,
+	    KHEFIN_SECRET_MAX_SIZE, &secret_size, &derive_subkeys);
+	if (khefin_result == KHEFIN_OK &&
+	    derive_subkeys != (options->subkey != NULL)) {
+		pam_syslog(pamh, LOG_ERR,
+		           derive_subkeys ? "The keyfile for %s was enrolled with "
+		                            "--derive-subkeys, so subkey= is required"
+		                          : "The keyfile for %s was not enrolled with "
+		                            "--derive-subkeys, so subkey= cannot be "
+		                            "used",
+		           user);
+		khefin_context_free(context);
+		return PAM_SERVICE_ERR;
+	}
+	if (khefin_result == KHEFIN_OK && derive_subkeys) {
+		unsigned char *root = sodium_malloc(secret_size);
+		if (root == NULL) {
+			khefin_context_free(context);
+			return PAM_BUF_ERR;
+		}
+		memcpy(root, secret, secret_size);
+		khefin_result = khefin_derive_subkey(context, root, secret_size,
+		                                     options->subkey, secret);
+		secret_size = KHEFIN_SUBKEY_SIZE;
+		sodium_free(root);
+	}
+
+	if (khefin_result != KHEFIN_OK) {
+		pam_syslog(pamh, LOG_NOTICE, "Authentication failure for %s: %s",
+		           user, khefin_last_error(context));
+		if (!(flags & PAM_SILENT)) {
+			pam_error(pamh, "%s", khefin_last_error(context));
+		}
+		khefin_context_free(context);
+		return pam_error_for(khefin_result);
+	}
+	khefin_context_free(context);
+
+	result = check_verifier(pamh, verifier_path, secret, secret_size);
+	if (result == PAM_AUTH_ERR) {
+		pam_syslog(pamh, LOG_NOTICE,
+		           "Authentication failure for %s: the secret does not match "
+		           "%s",
+		           user, verifier_path);
+	} else if (result == PAM_SUCCESS && options->debug) {
+		pam_syslog(pamh, LOG_DEBUG, "Authenticated %s", user);
+	}
+	return result;
+}
+
+KHEFIN_EXPORT int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
+                                      const char **argv) {
+	pam_khefin_options_t options;
+	parse_options(pamh, argc, argv, &options);
+
+	if (khefin_init() != KHEFIN_OK) {
+		pam_syslog(pamh, LOG_ERR, "Unable to initialize lib" APPNAME);
+		return PAM_SERVICE_ERR;
+	}
+
+	const char *user = NULL;
+	int result = pam_get_user(pamh, &user, NULL);
+	if (result != PAM_SUCCESS) {
+		return result;
+	}
+
+	struct passwd entry;
+	struct passwd *found = NULL;
+	long buffer_size = sysconf(_SC_GETPW_R_SIZE_MAX);
+	char *buffer = malloc(buffer_size > 0 ? (size_t)buffer_size : 16384);
+	if (buffer == NULL) {
+		return PAM_BUF_ERR;
+	}
+	if (getpwnam_r(user, &entry, buffer,
+	               buffer_size > 0 ? (size_t)buffer_size : 16384,
+	               &found) != 0 ||
+	    found == NULL) {
+		free(buffer);
+		return PAM_USER_UNKNOWN;
+	}
+
+	char keyfile_path[PAM_KHEFIN_PATH_SIZE];
+	char verifier_path[PAM_KHEFIN_PATH_SIZE];
+	if (!expand_path(options.keyfile, found->pw_name, found->pw_dir,
+	                 keyfile_path) ||
+	    !expand_path(options.verifier, found->pw_name, found->pw_dir,
+	                 verifier_path)) {
+		pam_syslog(pamh, LOG_ERR, "The keyfile or verifier path for %s is "
+		                          "too long",
+		           user);
+		free(buffer);
+		return PAM_SERVICE_ERR;
+	}
+	free(buffer);
+	if (options.debug) {
+		pam_syslog(pamh, LOG_DEBUG, "Using keyfile %s and verifier %s",
+		           keyfile_path, verifier_path);
+	}
+
+	unsigned char *keyfile = malloc(PAM_KHEFIN_MAX_KEYFILE_SIZE);
+	unsigned char *secret = sodium_malloc(KHEFIN_SECRET_MAX_SIZE);
+	size_t keyfile_size = 0;
+	if (keyfile == NULL || secret == NULL) {
+		result = PAM_BUF_ERR;
+	} else {
+		result = read_keyfile(pamh, keyfile_path, keyfile, &keyfile_size);
+	}
+	if (result == PAM_SUCCESS) {
+		result = authenticate(pamh, flags, &options, user, keyfile,
+		                      keyfile_size, verifier_path, secret);
+	}
+
+	sodium_free(secret);
+	free(keyfile);
+	return result;
+}
+
+KHEFIN_EXPORT int pam_sm_setcred(pam_handle_t *pamh, int flags, int argc,
+                                 const char **argv) {
+	(void)pamh;
+	(void)flags;
+	(void)argc;
+	(void)argv;
+	return PAM_SUCCESS;
+}
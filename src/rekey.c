@@ -0,0 +1,278 @@
+#include "rekey.h"
+
+#include <pthread.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "calibrate.h"
+#include "cryptography.h"
+#include "exit.h"
+#include "files.h"
+#include "memory.h"
+#include "serialization.h"
+
+typedef enum rekey_outcome_t {
+	rekey_outcome_pending,
+	rekey_outcome_succeeded,
+	rekey_outcome_bad_passphrase,
+	rekey_outcome_write_failed,
+} rekey_outcome_t;
+
+typedef struct rekey_job_t {
+	const char *path;
+	deserialized_cleartext *cleartext;
+	rekey_outcome_t outcome;
+} rekey_job_t;
+
+/**
+ * The keyfiles to rekey, which worker threads take one at a time (under lock)
+ * until there are none left.
+ */
+typedef struct rekey_pool_t {
+	pthread_mutex_t lock;
+	size_t next_job;
+	size_t job_count;
+	rekey_job_t *jobs;
+	char *old_passphrase;
+	char *new_passphrase;
+	// The KDF parameters for every keyfile, or NULL to keep each keyfile's own
+	key_spec_t *new_parameters;
+	// When keeping each keyfile's parameters, the lanes to use instead of the
+	// keyfile's, or 0
+	uint8_t new_lanes;
+} rekey_pool_t;
+
+/**
+ * Returns a key spec for the new passphrase with a fresh salt and either the
+ * pool's new parameters or those of cleartext.
+ */
+static key_spec_t *
+make_new_key_spec_for_keyfile(rekey_pool_t *pool,
+                              deserialized_cleartext *clear) {
+	key_spec_t *key_spec;
+	if (pool->new_parameters != NULL) {
+		key_spec = copy_key_spec(pool->new_parameters);
+	} else {
+		key_spec = make_key_spec_from_passphrase_and_cleartext(
+		    pool->new_passphrase, clear);
+		if (pool->new_lanes != 0) {
+			key_spec->lanes = pool->new_lanes;
+		}
+	}
+	randombytes_buf(key_spec->kdf_salt, key_spec->kdf_salt_size);
+	return key_spec;
+}
+
+static rekey_outcome_t rekey_keyfile(rekey_pool_t *pool, rekey_job_t *job) {
+	key_spec_t *key_spec = make_key_spec_from_passphrase_and_cleartext(
+	    pool->old_passphrase, job->cleartext);
+	unsigned char *key_bytes = derive_key(key_spec);
+	free_key_spec(key_spec);
+
+	if (!key_decrypts_cleartext(job->cleartext, key_bytes)) {
+		free_key(key_bytes);
+		warnx("Could not decrypt secrets in %s; this likely means the "
+		      "passphrase was wrong",
+		      job->path);
+		return rekey_outcome_bad_passphrase;
+	}
+	authenticator_parameters_t *authenticator_params =
+	    build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+	        job->cleartext, key_bytes, NULL);
+	free_key(key_bytes);
+
+	key_spec = make_new_key_spec_for_keyfile(pool, job->cleartext);
+	key_bytes = derive_key(key_spec);
+	deserialized_cleartext *rekeyed =
+	    build_deserialized_cleartext_from_authenticator_parameters_and_key_spec_and_key(
+	        authenticator_params, key_spec, key_bytes);
+	free_key(key_bytes);
+	free_key_spec(key_spec);
+	free_parameters(authenticator_params);
+
+	rekeyed->device_aaguid_size = job->cleartext->device_aaguid_size;
+	if (rekeyed->device_aaguid_size > 0) {
+		rekeyed->device_aaguid =
+		    malloc_or_exit(rekeyed->device_aaguid_size, "device AAGUID");
+		memcpy(rekeyed->device_aaguid, job->cleartext->device_aaguid,
+		       rekeyed->device_aaguid_size);
+	} else {
+		rekeyed->device_aaguid = NULL;
+	}
+
+	encoded_file *f = write_cleartext(rekeyed, job->path);
+	free_cleartext(rekeyed);
+	bool written = write_file_atomically(f);
+	free_encoded_file(f);
+
+	return written ? rekey_outcome_succeeded : rekey_outcome_write_failed;
+}
+
+static void *rekey_worker(void *arg) {
+	rekey_pool_t *pool = (rekey_pool_t *)arg;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		size_t next = pool->next_job;
+		if (next < pool->job_count) {
+			pool->next_job++;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		if (next >= pool->job_count) {
+			return NULL;
+		}
+		pool->jobs[next].outcome = rekey_keyfile(pool, &pool->jobs[next]);
+	}
+}
+
+/**
+ * Chooses how many keyfiles to rekey at once: one per processor divided
+ * between the lanes each key derivation uses (or --jobs, if given), but no
+ * more than can derive keys at once within the memory budget.
+ */
+static unsigned int choose_worker_count(invocation_state_t *invocation,
+                                        rekey_pool_t *pool) {
+	size_t largest_memlimit = 0;
+	unsigned int most_lanes = 1;
+	for (size_t i = 0; i < pool->job_count; i++) {
+		deserialized_cleartext *clear = pool->jobs[i].cleartext;
+		size_t new_memlimit = clear->memlimit;
+		unsigned int new_lanes = pool->new_lanes != 0 ? pool->new_lanes
+		                                              : clear->lanes;
+		if (pool->new_parameters != NULL) {
+			new_memlimit = pool->new_parameters->memlimit;
+			new_lanes = pool->new_parameters->lanes;
+		}
+		// The old and new keys are derived one after the other
+		largest_memlimit = clear->memlimit > largest_memlimit
+		                       ? clear->memlimit
+		                       : largest_memlimit;
+		largest_memlimit =
+		    new_memlimit > largest_memlimit ? new_memlimit : largest_memlimit;
+		most_lanes = clear->lanes > most_lanes ? clear->lanes : most_lanes;
+		most_lanes = new_lanes > most_lanes ? new_lanes : most_lanes;
+	}
+
+	unsigned int workers = invocation->jobs;
+	if (workers == 0) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = processors > (long)most_lanes
+		              ? (unsigned int)(processors / most_lanes)
+		              : 1;
+	}
+
+	size_t memory_budget = get_maximum_kdf_memory(invocation);
+	size_t workers_within_budget = memory_budget / largest_memlimit;
+	if (workers_within_budget < 1) {
+		workers_within_budget = 1;
+	}
+	if (workers > workers_within_budget) {
+		if (invocation->jobs != 0) {
+			warnx("Only running %zu job%s at once to keep key derivation "
+			      "within %zu MiB of memory",
+			      workers_within_budget,
+			      workers_within_budget == 1 ? "" : "s",
+			      memory_budget / MEBIBYTE);
+		}
+		workers = (unsigned int)workers_within_budget;
+	}
+
+	if (workers > pool->job_count) {
+		workers = (unsigned int)pool->job_count;
+	}
+	if (workers > MAXIMUM_REKEY_JOBS) {
+		workers = MAXIMUM_REKEY_JOBS;
+	}
+	return workers;
+}
+
+unsigned short int rekey_keyfiles(invocation_state_t *invocation) {
+	rekey_pool_t pool;
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.next_job = 0;
+	pool.job_count = invocation->file_count;
+	pool.jobs = malloc_or_exit(sizeof(rekey_job_t) * pool.job_count,
+	                           "keyfiles to rekey");
+
+	// Read every keyfile first, so that we exit before asking for passphrases
+	// (or changing anything) if any of them is missing or malformed
+	for (size_t i = 0; i < pool.job_count; i++) {
+		encoded_file *f = read_file(invocation->files[i]);
+		pool.jobs[i].path = invocation->files[i];
+		pool.jobs[i].cleartext = load_cleartext(f);
+		pool.jobs[i].outcome = rekey_outcome_pending;
+		free_encoded_file(f);
+	}
+
+	get_passphrase_if_not_given(invocation);
+	get_new_passphrase_if_not_given(invocation);
+	pool.old_passphrase = invocation->passphrase;
+	pool.new_passphrase = invocation->new_passphrase;
+
+	pool.new_parameters = NULL;
+	pool.new_lanes = 0;
+	if (invocation->kdf_hardness != kdf_hardness_unspecified) {
+		pool.new_parameters = make_new_key_spec_from_invocation_and_passphrase(
+		    invocation, invocation->new_passphrase);
+	} else {
+		pool.new_lanes = (uint8_t)invocation->kdf_lanes;
+	}
+
+	unsigned int worker_count = choose_worker_count(invocation, &pool);
+	pthread_t *workers =
+	    malloc_or_exit(sizeof(pthread_t) * worker_count, "rekey workers");
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned int i = 0; i < worker_count; i++) {
+		if (pthread_create(&workers[i], NULL, rekey_worker, &pool) != 0) {
+			errx(EXIT_OUT_OF_MEMORY, "Unable to start rekey worker thread");
+		}
+	}
+	for (unsigned int i = 0; i < worker_count; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(workers);
+
+	size_t succeeded = 0;
+	unsigned short int result = EXIT_SUCCESS;
+	for (size_t i = 0; i < pool.job_count; i++) {
+		switch (pool.jobs[i].outcome) {
+		case rekey_outcome_succeeded:
+			succeeded++;
+			break;
+		case rekey_outcome_bad_passphrase:
+			result = EXIT_BAD_PASSPHRASE;
+			break;
+		case rekey_outcome_write_failed:
+			if (result == EXIT_SUCCESS) {
+				result = EXIT_DESERIALIZATION_ERROR;
+			}
+			break;
+		case rekey_outcome_pending:
+			errx(EXIT_PROGRAMMER_ERROR,
+			     "BUG (%s:%d): %s was never rekeyed", __func__, __LINE__,
+			     pool.jobs[i].path);
+		}
+		free_cleartext(pool.jobs[i].cleartext);
+	}
+
+	double seconds = (end.tv_sec - start.tv_sec) +
+	                 (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	printf("Rekeyed %zu of %zu keyfile%s in %.1f s (%.2f keyfiles/s, %u "
+	       "job%s at once)\n",
+	       succeeded, pool.job_count, pool.job_count == 1 ? "" : "s", seconds,
+	       seconds > 0 ? succeeded / seconds : 0.0, worker_count,
+	       worker_count == 1 ? "" : "s");
+
+	free_key_spec(pool.new_parameters);
+	free(pool.jobs);
+	pthread_mutex_destroy(&pool.lock);
+
+	return result;
+}
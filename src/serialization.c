@@ -1,5 +1,6 @@
 #include <cbor.h>
 #include <sodium.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,61 +11,146 @@
 #include "memory.h"
 #include "serialization.h"
 #include "serialization/v1.h"
+#include "serialization/v2.h"
+#include "serialization/v3.h"
+
+bool key_decrypts_cleartext(deserialized_cleartext *cleartext,
+                            unsigned char *key_bytes) {
+	unsigned char *decrypted = secure_malloc_or_exit(
+	    cleartext->encrypted_data_size - crypto_secretbox_MACBYTES,
+	    "decrypted data");
+	bool result = crypto_secretbox_open_easy(
+	                  decrypted, cleartext->encrypted_data,
+	                  cleartext->encrypted_data_size, cleartext->nonce,
+	                  key_bytes) == 0;
+	secure_free(decrypted);
+	return result;
+}
 
-authenticator_parameters_t *
-build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
-    deserialized_cleartext *cleartext, unsigned char *key_bytes, char *mixin) {
-	unsigned char *decrypted = malloc_or_exit(cleartext->encrypted_data_size -
-	                                              crypto_secretbox_MACBYTES,
-	                                          "encrypted data");
+deserialized_cleartext *
+fail_to_deserialize_cleartext(deserialized_cleartext *clear,
+                              cbor_item_t **cbor_root, cbor_item_t **cbor_field,
+                              char *error, size_t error_size,
+                              const char *format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(error, error_size, format, arguments);
+	va_end(arguments);
+	if (cbor_field != NULL) {
+		cbor_decref(cbor_field);
+	}
+	cbor_decref(cbor_root);
+	free_cleartext(clear);
+	return NULL;
+}
+
+deserialized_secrets *
+fail_to_deserialize_secrets(deserialized_secrets *secrets,
+                            cbor_item_t **cbor_root, cbor_item_t **cbor_field,
+                            char *error, size_t error_size, const char *format,
+                            ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(error, error_size, format, arguments);
+	va_end(arguments);
+	if (cbor_field != NULL) {
+		cbor_decref(cbor_field);
+	}
+	zero_and_decref_cbor_secrets(cbor_root);
+	free_secrets(secrets);
+	return NULL;
+}
+
+int try_build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+    deserialized_cleartext *cleartext, unsigned char *key_bytes, char *mixin,
+    authenticator_parameters_t **params, char *error, size_t error_size) {
+	unsigned char *decrypted = secure_malloc_or_exit(
+	    cleartext->encrypted_data_size - crypto_secretbox_MACBYTES,
+	    "decrypted data");
 	if (crypto_secretbox_open_easy(decrypted, cleartext->encrypted_data,
 	                               cleartext->encrypted_data_size,
 	                               cleartext->nonce, key_bytes) != 0) {
-		errx(EXIT_BAD_PASSPHRASE,
-		     "Could not decrypt secrets; this likely means "
-		     "the passphrase was wrong");
+		secure_free(decrypted);
+		snprintf(error, error_size,
+		         "Could not decrypt secrets; this likely means the passphrase "
+		         "was wrong");
+		return EXIT_BAD_PASSPHRASE;
+	}
+	deserialized_secrets *secrets = try_load_secrets_from_bytes(
+	    decrypted, cleartext->encrypted_data_size - crypto_secretbox_MACBYTES,
+	    error, error_size);
+	secure_free(decrypted);
+	if (secrets == NULL) {
+		return EXIT_DESERIALIZATION_ERROR;
 	}
-	deserialized_secrets *secrets = load_secrets_from_bytes(
-	    decrypted, cleartext->encrypted_data_size - crypto_secretbox_MACBYTES);
-	free(decrypted);
 
-	authenticator_parameters_t *params = allocate_parameters_except_rpid(
-	    secrets->credential_id_size, secrets->salt_size);
-	memcpy(params->credential_id, secrets->credential_id,
+	*params = allocate_parameters_except_rpid(secrets->credential_id_size,
+	                                          secrets->salt_size);
+	memcpy((*params)->credential_id, secrets->credential_id,
 	       secrets->credential_id_size);
-	params->relying_party_id =
-	    strdup_or_exit(secrets->relying_party_id,
-	                   "relying party id in authenticator parameters");
-	memcpy(params->salt, secrets->salt, secrets->salt_size);
+	(*params)->relying_party_id =
+	    secure_strdup_or_exit(secrets->relying_party_id,
+	                          "relying party id in authenticator parameters");
+	memcpy((*params)->salt, secrets->salt, secrets->salt_size);
+	(*params)->derive_subkeys = secrets->derive_subkeys;
+	(*params)->unattended = cleartext->unattended;
+	(*params)->device_vendor = cleartext->device_vendor;
+	(*params)->device_product = cleartext->device_product;
 	free_secrets(secrets);
 	secrets = NULL;
 
 	if (mixin != NULL) {
 		unsigned char *hashed_mixin =
-		    malloc_or_exit(params->salt_size, "mixin salt");
-		if (crypto_generichash(hashed_mixin, params->salt_size,
+		    malloc_or_exit((*params)->salt_size, "mixin salt");
+		if (crypto_generichash(hashed_mixin, (*params)->salt_size,
 		                       (unsigned char *)mixin, strlen(mixin), NULL,
 		                       0) != 0) {
 			errx(EXIT_CRYPTOGRAPHY_ERROR, "Unable to hash mixin data");
 		}
-		for (size_t i = 0; i < params->salt_size; i++) {
-			params->salt[i] ^= hashed_mixin[i];
+		for (size_t i = 0; i < (*params)->salt_size; i++) {
+			(*params)->salt[i] ^= hashed_mixin[i];
 		}
 		free(hashed_mixin);
 	}
 
+	return EXIT_SUCCESS;
+}
+
+authenticator_parameters_t *
+build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+    deserialized_cleartext *cleartext, unsigned char *key_bytes, char *mixin) {
+	authenticator_parameters_t *params = NULL;
+	char error[FAILURE_MESSAGE_SIZE];
+	int result =
+	    try_build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+	        cleartext, key_bytes, mixin, &params, error, sizeof(error));
+	if (result != EXIT_SUCCESS) {
+		errx(result, "%s", error);
+	}
 	return params;
 }
 
 deserialized_cleartext *
-build_deserialized_cleartext_from_authenticator_parameters_and_key_spec(
-    authenticator_parameters_t *authenticator_params, key_spec_t *key_spec) {
+build_deserialized_cleartext_from_authenticator_parameters_and_key_spec_and_key(
+    authenticator_parameters_t *authenticator_params, key_spec_t *key_spec,
+    unsigned char *key_bytes) {
 	deserialized_cleartext *cleartext =
 	    malloc_or_exit(sizeof(deserialized_cleartext), "encrypted keyfile");
-	cleartext->version = SERIALIZATION_MAX_VERSION;
+	// Version 3 is only needed for unattended keyfiles and recorded device
+	// IDs; otherwise stick to version 2, which older versions of this program
+	// can read
+	cleartext->version = authenticator_params->unattended ||
+	                             authenticator_params->device_vendor != 0 ||
+	                             authenticator_params->device_product != 0
+	                         ? SERIALIZATION_V3_VERSION
+	                         : SERIALIZATION_V2_VERSION;
+	cleartext->unattended = authenticator_params->unattended;
+	cleartext->device_vendor = authenticator_params->device_vendor;
+	cleartext->device_product = authenticator_params->device_product;
 	cleartext->opslimit = key_spec->opslimit;
 	cleartext->memlimit = key_spec->memlimit;
 	cleartext->algorithm = key_spec->algorithm;
+	cleartext->lanes = key_spec->lanes;
 	cleartext->kdf_salt =
 	    malloc_or_exit(key_spec->kdf_salt_size, "salt in encrypted keyfile");
 	memcpy(cleartext->kdf_salt, key_spec->kdf_salt, key_spec->kdf_salt_size);
@@ -76,23 +162,32 @@ build_deserialized_cleartext_from_authenticator_parameters_and_key_spec(
 
 	deserialized_secrets *secrets =
 	    malloc_or_exit(sizeof(deserialized_secrets), "secrets");
-	secrets->version = cleartext->version;
+	// Version 2 is only needed for deriving subkeys; otherwise stick to
+	// version 1, which older versions of this program can read
+	secrets->version = authenticator_params->derive_subkeys ? 2 : 1;
+	secrets->derive_subkeys = authenticator_params->derive_subkeys;
 	secrets->relying_party_id =
-	    strdup_or_exit(authenticator_params->relying_party_id,
-	                   "relying party id in encrypted keyfile");
+	    secure_strdup_or_exit(authenticator_params->relying_party_id,
+	                          "relying party id in encrypted keyfile");
 	secrets->credential_id =
-	    malloc_or_exit(authenticator_params->credential_id_size,
-	                   "credential id in encrypted keyfile");
+	    secure_malloc_or_exit(authenticator_params->credential_id_size,
+	                          "credential id in encrypted keyfile");
 	memcpy(secrets->credential_id, authenticator_params->credential_id,
 	       authenticator_params->credential_id_size);
 	secrets->credential_id_size = authenticator_params->credential_id_size;
-	secrets->salt = malloc_or_exit(authenticator_params->salt_size,
-	                               "encrypted secret in encrypted keyfile");
+	secrets->salt =
+	    secure_malloc_or_exit(authenticator_params->salt_size,
+	                          "encrypted secret in encrypted keyfile");
 	memcpy(secrets->salt, authenticator_params->salt,
 	       authenticator_params->salt_size);
 	secrets->salt_size = authenticator_params->salt_size;
 
-	cbor_item_t *cbor_encoded_secrets = serialize_secrets_to_cbor_v1(secrets);
+	cbor_item_t *cbor_encoded_secrets;
+	if (secrets->version == 2) {
+		cbor_encoded_secrets = serialize_secrets_to_cbor_v2(secrets);
+	} else {
+		cbor_encoded_secrets = serialize_secrets_to_cbor_v1(secrets);
+	}
 	free_secrets(secrets);
 	secrets = NULL;
 
@@ -109,19 +204,17 @@ build_deserialized_cleartext_from_authenticator_parameters_and_key_spec(
 	    "encrypted data blob in encrypted keyfile");
 	cleartext->encrypted_data_size =
 	    serialized_unencrypted_secrets_size + crypto_secretbox_MACBYTES;
-	unsigned char *key_bytes = derive_key(key_spec);
 	if (crypto_secretbox_easy(cleartext->encrypted_data,
 	                          serialized_unencrypted_secrets,
 	                          serialized_unencrypted_secrets_size,
 	                          cleartext->nonce, key_bytes) != 0) {
 		errx(EXIT_CRYPTOGRAPHY_ERROR, "Could not encrypt secrets");
 	}
-	free(key_bytes);
 
 	sodium_memzero(serialized_unencrypted_secrets,
 	               serialized_unencrypted_secrets_size);
 	free(serialized_unencrypted_secrets);
-	cbor_decref(&cbor_encoded_secrets);
+	zero_and_decref_cbor_secrets(&cbor_encoded_secrets);
 
 	return cleartext;
 }
@@ -155,39 +248,63 @@ void free_secrets(deserialized_secrets *secret) {
 		return;
 	}
 
-	sodium_memzero(secret->relying_party_id, strlen(secret->relying_party_id));
-	free(secret->relying_party_id);
-	sodium_memzero(secret->credential_id, secret->credential_id_size);
-	free(secret->credential_id);
-	sodium_memzero(secret->salt, secret->salt_size);
-	free(secret->salt);
+	secure_free(secret->relying_party_id);
+	secure_free(secret->credential_id);
+	secure_free(secret->salt);
 	free(secret);
 }
 
-deserialized_secrets *load_secrets_from_bytes(unsigned char *decrypted,
-                                              size_t decrypted_size) {
+// libcbor copies the secrets it builds or parses into ordinary heap memory,
+// which is not locked, so they may be swapped to disk while it holds them; we
+// cannot give libcbor an allocator for just these items. All we can do is
+// zero those copies before they are freed, so that they don't linger in freed
+// memory. The serialized bytes are zeroed by our callers likewise.
+void zero_and_decref_cbor_secrets(cbor_item_t **cbor_secrets) {
+	for (size_t i = 0; i < cbor_array_size(*cbor_secrets); i++) {
+		cbor_item_t *item = cbor_array_get(*cbor_secrets, i);
+		if (cbor_isa_string(item) && cbor_string_is_definite(item)) {
+			sodium_memzero(cbor_string_handle(item), cbor_string_length(item));
+		} else if (cbor_isa_bytestring(item) &&
+		           cbor_bytestring_is_definite(item)) {
+			sodium_memzero(cbor_bytestring_handle(item),
+			               cbor_bytestring_length(item));
+		}
+		cbor_decref(&item);
+	}
+	cbor_decref(cbor_secrets);
+}
+
+deserialized_secrets *try_load_secrets_from_bytes(unsigned char *decrypted,
+                                                  size_t decrypted_size,
+                                                  char *error,
+                                                  size_t error_size) {
 	struct cbor_load_result result;
 	cbor_item_t *cbor_root = cbor_load(decrypted, decrypted_size, &result);
 
 	if (result.error.code != CBOR_ERR_NONE) {
-		errx(
-		    EXIT_DESERIALIZATION_ERROR,
+		snprintf(
+		    error, error_size,
 		    "Unable to deserialize secrets; is the data not CBOR-encoded? CBOR "
 		    "error code %d: %s",
 		    result.error.code, get_cbor_error_string(result.error.code));
+		return NULL;
 	}
 
 	if (!cbor_isa_array(cbor_root)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Secrets have the wrong format (should be a CBOR array at root)");
+		snprintf(
+		    error, error_size,
+		    "Secrets have the wrong format (should be a CBOR array at root)");
+		cbor_decref(&cbor_root);
+		return NULL;
 	}
 
 	cbor_item_t *cbor_version = cbor_array_get(cbor_root, 0);
 	if (!cbor_isa_uint(cbor_version) ||
 	    cbor_int_get_width(cbor_version) != CBOR_INT_8) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Secrets have the wrong format (first field should be a version "
-		     "number stored as an 8-bit unsigned integer)");
+		return fail_to_deserialize_secrets(
+		    NULL, &cbor_root, &cbor_version, error, error_size,
+		    "Secrets have the wrong format (first field should be a version "
+		    "number stored as an 8-bit unsigned integer)");
 	}
 
 	uint8_t version = cbor_get_uint8(cbor_version);
@@ -195,13 +312,15 @@ deserialized_secrets *load_secrets_from_bytes(unsigned char *decrypted,
 
 	switch (version) {
 	case 1:
-		return deserialize_secrets_from_cbor_v1(cbor_root);
+		return deserialize_secrets_from_cbor_v1(cbor_root, error, error_size);
+	case 2:
+		return deserialize_secrets_from_cbor_v2(cbor_root, error, error_size);
 	default:
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Unrecognized secrets version (we only support up to %d, got "
-		     "version %d)",
-		     SERIALIZATION_MAX_VERSION, version);
-		break;
+		return fail_to_deserialize_secrets(
+		    NULL, &cbor_root, NULL, error, error_size,
+		    "Unrecognized secrets version (we only support up to %d, got "
+		    "version %d)",
+		    SECRETS_SERIALIZATION_MAX_VERSION, version);
 	}
 }
 
@@ -211,7 +330,22 @@ encoded_file *write_cleartext(deserialized_cleartext *cleartext,
 	    malloc_or_exit(sizeof(encoded_file), "encoded file structure");
 	result->path = strdup_or_exit(path, "encoded file path");
 
-	cbor_item_t *cbor_cleartext = serialize_cleartext_to_cbor_v1(cleartext);
+	cbor_item_t *cbor_cleartext;
+	switch (cleartext->version) {
+	case 1:
+		cbor_cleartext = serialize_cleartext_to_cbor_v1(cleartext);
+		break;
+	case 2:
+		cbor_cleartext = serialize_cleartext_to_cbor_v2(cleartext);
+		break;
+	case 3:
+		cbor_cleartext = serialize_cleartext_to_cbor_v3(cleartext);
+		break;
+	default:
+		errx(EXIT_PROGRAMMER_ERROR,
+		     "BUG (%s:%d): unable to serialize cleartext with version %d",
+		     __func__, __LINE__, cleartext->version);
+	}
 
 	if (cbor_serialize_alloc(cbor_cleartext, &result->data, &result->length) ==
 	    0) {
@@ -223,31 +357,36 @@ encoded_file *write_cleartext(deserialized_cleartext *cleartext,
 	return result;
 }
 
-deserialized_cleartext *load_cleartext(encoded_file *file) {
+deserialized_cleartext *try_load_cleartext(encoded_file *file, char *error,
+                                           size_t error_size) {
 	struct cbor_load_result result;
 	cbor_item_t *cbor_root = cbor_load(file->data, file->length, &result);
 
 	if (result.error.code != CBOR_ERR_NONE) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Unable to deserialize %s; is it not CBOR-encoded? CBOR error "
-		     "code %d: %s",
-		     file->path, result.error.code,
-		     get_cbor_error_string(result.error.code));
+		snprintf(error, error_size,
+		         "Unable to deserialize %s; is it not CBOR-encoded? CBOR error "
+		         "code %d: %s",
+		         file->path, result.error.code,
+		         get_cbor_error_string(result.error.code));
+		return NULL;
 	}
 
 	if (!cbor_isa_array(cbor_root)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "%s has the wrong format (should be a CBOR array at root)",
-		     file->path);
+		snprintf(error, error_size,
+		         "%s has the wrong format (should be a CBOR array at root)",
+		         file->path);
+		cbor_decref(&cbor_root);
+		return NULL;
 	}
 
 	cbor_item_t *cbor_version = cbor_array_get(cbor_root, 0);
 	if (!cbor_isa_uint(cbor_version) ||
 	    cbor_int_get_width(cbor_version) != CBOR_INT_8) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "%s has the wrong format (first field should be a version number "
-		     "stored as an 8-bit unsigned integer)",
-		     file->path);
+		return fail_to_deserialize_cleartext(
+		    NULL, &cbor_root, &cbor_version, error, error_size,
+		    "%s has the wrong format (first field should be a version number "
+		    "stored as an 8-bit unsigned integer)",
+		    file->path);
 	}
 
 	uint8_t version = cbor_get_uint8(cbor_version);
@@ -255,14 +394,28 @@ deserialized_cleartext *load_cleartext(encoded_file *file) {
 
 	switch (version) {
 	case 1:
-		return deserialize_cleartext_from_cbor_v1(cbor_root);
+		return deserialize_cleartext_from_cbor_v1(cbor_root, error, error_size);
+	case 2:
+		return deserialize_cleartext_from_cbor_v2(cbor_root, error, error_size);
+	case 3:
+		return deserialize_cleartext_from_cbor_v3(cbor_root, error, error_size);
 	default:
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Unrecognized data version (we only support up to %d, got version "
-		     "%d)",
-		     SERIALIZATION_MAX_VERSION, version);
-		break;
+		return fail_to_deserialize_cleartext(
+		    NULL, &cbor_root, NULL, error, error_size,
+		    "Unrecognized data version (we only support up to %d, got version "
+		    "%d)",
+		    SERIALIZATION_MAX_VERSION, version);
+	}
+}
+
+deserialized_cleartext *load_cleartext(encoded_file *file) {
+	char error[FAILURE_MESSAGE_SIZE];
+	deserialized_cleartext *cleartext =
+	    try_load_cleartext(file, error, sizeof(error));
+	if (cleartext == NULL) {
+		errx(EXIT_DESERIALIZATION_ERROR, "%s", error);
 	}
+	return cleartext;
 }
 
 const char *get_cbor_error_string(cbor_error_code code) {
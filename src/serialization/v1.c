@@ -9,24 +9,28 @@
 #include "memory.h"
 
 deserialized_cleartext *
-deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
+deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root, char *error,
+                                   size_t error_size) {
 	deserialized_cleartext *clear =
 	    malloc_or_exit(sizeof(deserialized_cleartext), "keyfile");
+	memset(clear, 0, sizeof(deserialized_cleartext));
 
 	if (cbor_array_size(cbor_root) != CLEAR_COUNT_OF_FIELDS) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format for v1 (should be a CBOR array with %d "
-		     "elements at root)",
-		     CLEAR_COUNT_OF_FIELDS);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, NULL, error, error_size,
+		    "File has the wrong format for v1 (should be a CBOR array with %d "
+		    "elements at root)",
+		    CLEAR_COUNT_OF_FIELDS);
 	}
 
 	cbor_item_t *cbor_version = cbor_array_get(cbor_root, CLEAR_FIELD_VERSION);
 	if (!cbor_isa_uint(cbor_version) ||
 	    cbor_int_get_width(cbor_version) != CBOR_INT_8) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a version number "
-		     "stored as an 8-bit unsigned integer)",
-		     CLEAR_FIELD_VERSION);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_version, error, error_size,
+		    "File has the wrong format (field %d should be a version number "
+		    "stored as an 8-bit unsigned integer)",
+		    CLEAR_FIELD_VERSION);
 	}
 	clear->version = cbor_get_uint8(cbor_version);
 	if (clear->version != SERIALIZATION_VERSION) {
@@ -42,10 +46,11 @@ deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, CLEAR_FIELD_DEVICE_AAGUID);
 	if (!cbor_isa_bytestring(cbor_device_aaguid) ||
 	    !cbor_bytestring_is_definite(cbor_device_aaguid)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a AAGUID as a "
-		     "definite bytestring)",
-		     CLEAR_FIELD_DEVICE_AAGUID);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_device_aaguid, error, error_size,
+		    "File has the wrong format (field %d should be a AAGUID as a "
+		    "definite bytestring)",
+		    CLEAR_FIELD_DEVICE_AAGUID);
 	}
 	clear->device_aaguid_size = cbor_bytestring_length(cbor_device_aaguid);
 	if (clear->device_aaguid_size > 0) {
@@ -63,10 +68,11 @@ deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, CLEAR_FIELD_KDF_SALT);
 	if (!cbor_isa_bytestring(cbor_kdf_salt) ||
 	    !cbor_bytestring_is_definite(cbor_kdf_salt)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a salt as a "
-		     "definite bytestring)",
-		     CLEAR_FIELD_KDF_SALT);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_kdf_salt, error, error_size,
+		    "File has the wrong format (field %d should be a salt as a "
+		    "definite bytestring)",
+		    CLEAR_FIELD_KDF_SALT);
 	}
 	clear->kdf_salt_size = cbor_bytestring_length(cbor_kdf_salt);
 	if (clear->kdf_salt_size > 0) {
@@ -84,10 +90,11 @@ deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, CLEAR_FIELD_OPSLIMIT);
 	if (!cbor_isa_uint(cbor_opslimit) ||
 	    cbor_int_get_width(cbor_opslimit) != CBOR_INT_64) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a 64-bit unsigned "
-		     "integer)",
-		     CLEAR_FIELD_OPSLIMIT);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_opslimit, error, error_size,
+		    "File has the wrong format (field %d should be a 64-bit unsigned "
+		    "integer)",
+		    CLEAR_FIELD_OPSLIMIT);
 	}
 	clear->opslimit = (unsigned long long)cbor_get_uint64(cbor_opslimit);
 	cbor_decref(&cbor_opslimit);
@@ -97,10 +104,11 @@ deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, CLEAR_FIELD_MEMLIMIT);
 	if (!cbor_isa_uint(cbor_memlimit) ||
 	    cbor_int_get_width(cbor_memlimit) != CBOR_INT_64) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a 64-bit unsigned "
-		     "integer)",
-		     CLEAR_FIELD_MEMLIMIT);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_memlimit, error, error_size,
+		    "File has the wrong format (field %d should be a 64-bit unsigned "
+		    "integer)",
+		    CLEAR_FIELD_MEMLIMIT);
 	}
 	clear->memlimit = (size_t)cbor_get_uint64(cbor_memlimit);
 	cbor_decref(&cbor_memlimit);
@@ -110,22 +118,31 @@ deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, CLEAR_FIELD_ALGORITHM);
 	if (!cbor_isa_uint(cbor_algorithm) ||
 	    cbor_int_get_width(cbor_algorithm) != CBOR_INT_16) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a 16-bit unsigned "
-		     "integer)",
-		     CLEAR_FIELD_ALGORITHM);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_algorithm, error, error_size,
+		    "File has the wrong format (field %d should be a 16-bit unsigned "
+		    "integer)",
+		    CLEAR_FIELD_ALGORITHM);
 	}
 	clear->algorithm = (int)cbor_get_uint16(cbor_algorithm);
 	cbor_decref(&cbor_algorithm);
 	cbor_algorithm = NULL;
 
+	// Version 1 predates multi-lane key derivation, unattended keyfiles and
+	// recorded device IDs
+	clear->lanes = 1;
+	clear->unattended = false;
+	clear->device_vendor = 0;
+	clear->device_product = 0;
+
 	cbor_item_t *cbor_nonce = cbor_array_get(cbor_root, CLEAR_FIELD_NONCE);
 	if (!cbor_isa_bytestring(cbor_nonce) ||
 	    !cbor_bytestring_is_definite(cbor_nonce)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "File has the wrong format (field %d should be a nonce as a "
-		     "definite bytestring)",
-		     CLEAR_FIELD_NONCE);
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_nonce, error, error_size,
+		    "File has the wrong format (field %d should be a nonce as a "
+		    "definite bytestring)",
+		    CLEAR_FIELD_NONCE);
 	}
 	clear->nonce_size = cbor_bytestring_length(cbor_nonce);
 	if (clear->nonce_size > 0) {
@@ -142,8 +159,8 @@ deserialize_cleartext_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, CLEAR_FIELD_ENCRYPTED_DATA);
 	if (!cbor_isa_bytestring(cbor_encrypted_data) ||
 	    !cbor_bytestring_is_definite(cbor_encrypted_data)) {
-		errx(
-		    EXIT_DESERIALIZATION_ERROR,
+		return fail_to_deserialize_cleartext(
+		    clear, &cbor_root, &cbor_encrypted_data, error, error_size,
 		    "File has the wrong format (field %d should be encrypted data as a "
 		    "definite bytestring)",
 		    CLEAR_FIELD_ENCRYPTED_DATA);
@@ -216,23 +233,27 @@ cbor_item_t *serialize_cleartext_to_cbor_v1(deserialized_cleartext *clear) {
 	return root;
 }
 
-deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root) {
+deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root,
+                                                       char *error,
+                                                       size_t error_size) {
 	deserialized_secrets *secrets =
 	    malloc_or_exit(sizeof(deserialized_secrets), "decrypted secret blob");
+	memset(secrets, 0, sizeof(deserialized_secrets));
 
 	if (cbor_array_size(cbor_root) != ENCRYPTED_COUNT_OF_FIELDS) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Decrypted blob has the wrong format for v1 (should be a CBOR "
-		     "array with %d elements at root)",
-		     ENCRYPTED_COUNT_OF_FIELDS);
+		return fail_to_deserialize_secrets(
+		    secrets, &cbor_root, NULL, error, error_size,
+		    "Decrypted blob has the wrong format for v1 (should be a CBOR "
+		    "array with %d elements at root)",
+		    ENCRYPTED_COUNT_OF_FIELDS);
 	}
 
 	cbor_item_t *cbor_version =
 	    cbor_array_get(cbor_root, ENCRYPTED_FIELD_VERSION);
 	if (!cbor_isa_uint(cbor_version) ||
 	    cbor_int_get_width(cbor_version) != CBOR_INT_8) {
-		errx(
-		    EXIT_DESERIALIZATION_ERROR,
+		return fail_to_deserialize_secrets(
+		    secrets, &cbor_root, &cbor_version, error, error_size,
 		    "Decrypted blob has the wrong format (field %d should be a version "
 		    "number stored as an 8-bit unsigned integer)",
 		    ENCRYPTED_FIELD_VERSION);
@@ -251,8 +272,8 @@ deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, ENCRYPTED_FIELD_RP_ID);
 	if (!cbor_isa_string(cbor_relying_party_id) ||
 	    !cbor_string_is_definite(cbor_relying_party_id)) {
-		errx(
-		    EXIT_DESERIALIZATION_ERROR,
+		return fail_to_deserialize_secrets(
+		    secrets, &cbor_root, &cbor_relying_party_id, error, error_size,
 		    "Decrypted blob has the wrong format (field %d should be a relying "
 		    "party ID as a definite UTF-8 string)",
 		    ENCRYPTED_FIELD_RP_ID);
@@ -260,8 +281,8 @@ deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root) {
 	size_t relying_party_size = cbor_string_length(cbor_relying_party_id);
 	if (relying_party_size > 0) {
 		secrets->relying_party_id =
-		    malloc_or_exit(relying_party_size + 1,
-		                   "relying party id in decrypted secret blob");
+		    secure_malloc_or_exit(relying_party_size + 1,
+		                          "relying party id in decrypted secret blob");
 		strncpy(secrets->relying_party_id,
 		        (const char *restrict)cbor_string_handle(cbor_relying_party_id),
 		        relying_party_size); // We explicitly add the null terminator in
@@ -277,16 +298,17 @@ deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, ENCRYPTED_FIELD_CREDENTIAL_ID);
 	if (!cbor_isa_bytestring(cbor_credential_id) ||
 	    !cbor_bytestring_is_definite(cbor_credential_id)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Decrypted blob has the wrong format (field %d should be a "
-		     "credential ID as a definite bytestring)",
-		     ENCRYPTED_FIELD_CREDENTIAL_ID);
+		return fail_to_deserialize_secrets(
+		    secrets, &cbor_root, &cbor_credential_id, error, error_size,
+		    "Decrypted blob has the wrong format (field %d should be a "
+		    "credential ID as a definite bytestring)",
+		    ENCRYPTED_FIELD_CREDENTIAL_ID);
 	}
 	secrets->credential_id_size = cbor_bytestring_length(cbor_credential_id);
 	if (secrets->credential_id_size > 0) {
 		secrets->credential_id =
-		    malloc_or_exit(secrets->credential_id_size,
-		                   "credential id in decrypted secret blob");
+		    secure_malloc_or_exit(secrets->credential_id_size,
+		                          "credential id in decrypted secret blob");
 		memcpy(secrets->credential_id,
 		       cbor_bytestring_handle(cbor_credential_id),
 		       secrets->credential_id_size);
@@ -300,15 +322,16 @@ deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root) {
 	    cbor_array_get(cbor_root, ENCRYPTED_FIELD_HMAC_SALT);
 	if (!cbor_isa_bytestring(cbor_salt) ||
 	    !cbor_bytestring_is_definite(cbor_salt)) {
-		errx(EXIT_DESERIALIZATION_ERROR,
-		     "Decrypted blob has the wrong format (field %d should be a HMAC "
-		     "salt as a definite bytestring)",
-		     ENCRYPTED_FIELD_HMAC_SALT);
+		return fail_to_deserialize_secrets(
+		    secrets, &cbor_root, &cbor_salt, error, error_size,
+		    "Decrypted blob has the wrong format (field %d should be a HMAC "
+		    "salt as a definite bytestring)",
+		    ENCRYPTED_FIELD_HMAC_SALT);
 	}
 	secrets->salt_size = cbor_bytestring_length(cbor_salt);
 	if (secrets->salt_size > 0) {
-		secrets->salt =
-		    malloc_or_exit(secrets->salt_size, "salt in decrypted secret blob");
+		secrets->salt = secure_malloc_or_exit(secrets->salt_size,
+		                                      "salt in decrypted secret blob");
 		memcpy(secrets->salt, cbor_bytestring_handle(cbor_salt),
 		       secrets->salt_size);
 	} else {
@@ -317,7 +340,9 @@ deserialized_secrets *deserialize_secrets_from_cbor_v1(cbor_item_t *cbor_root) {
 	cbor_decref(&cbor_salt);
 	cbor_salt = NULL;
 
-	cbor_decref(&cbor_root);
+	secrets->derive_subkeys = false;
+
+	zero_and_decref_cbor_secrets(&cbor_root);
 
 	return secrets;
 }
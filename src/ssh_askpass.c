@@ -0,0 +1,470 @@
+// For pipe2()
+#define _GNU_SOURCE
+
+#include "ssh_askpass.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sodium.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "agent.h"
+#include "exit.h"
+#include "files.h"
+#include "generate.h"
+#include "memory.h"
+
+extern char **environ;
+
+/**
+ * Shows title and body with command, which the shell runs with them as its
+ * arguments, or prints them to stderr if command is NULL.
+ */
+static void notify(const char *command, const char *title, const char *body) {
+	if (command == NULL) {
+		fprintf(stderr, "%s\n%s\n", title, body);
+		return;
+	}
+
+	size_t script_size = strlen(command) + sizeof(" \"$@\"");
+	char *script = malloc_or_exit(script_size, "notification command");
+	snprintf(script, script_size, "%s \"$@\"", command);
+	char *const argv[] = {(char *)"sh", (char *)"-c", script, (char *)"sh",
+	                      (char *)title, (char *)body, NULL};
+
+	// Standard output is for the secret
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+	pid_t pid;
+	if (posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, environ) == 0) {
+		waitpid(pid, NULL, 0);
+	} else {
+		warnx("Unable to run %s", command);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	free(script);
+}
+
+static void notify_about_key(const char *command, const char *title,
+                             const char *path, const char *fingerprint) {
+	const char *format = fingerprint == NULL ? "No such keyfile: %s%s"
+	                                         : "Keyfile %s (fingerprint %s).";
+	if (fingerprint == NULL) {
+		fingerprint = "";
+	}
+	size_t body_size = strlen(format) + strlen(path) + strlen(fingerprint) + 1;
+	char *body = malloc_or_exit(body_size, "notification body");
+	snprintf(body, body_size, format, path, fingerprint);
+	notify(command, title, body);
+	free(body);
+}
+
+static char *get_keyfile_path(void) {
+	const char *path = getenv(SSH_ASKPASS_KEYFILE_ENV);
+	if (path != NULL && path[0] != (char)0) {
+		return strdup_or_exit(path, "file path in invocation state");
+	}
+
+	const char *home = getenv("HOME");
+	if (home == NULL) {
+		errx(EXIT_BAD_INVOCATION,
+		     "Neither %s nor HOME is set, so there is no keyfile to use",
+		     SSH_ASKPASS_KEYFILE_ENV);
+	}
+	size_t size =
+	    strlen(home) + sizeof("/" SSH_ASKPASS_DEFAULT_KEYFILE_IN_HOME);
+	char *result = malloc_or_exit(size, "file path in invocation state");
+	snprintf(result, size, "%s/%s", home, SSH_ASKPASS_DEFAULT_KEYFILE_IN_HOME);
+	return result;
+}
+
+/**
+ * Returns the path of the SSH key in an OpenSSH passphrase prompt (which must
+ * be freed), or NULL if prompt is not one.
+ */
+static char *ssh_key_path_from_prompt(const char *prompt) {
+	if (strncmp(prompt, SSH_ASKPASS_PASSPHRASE_PROMPT,
+	            strlen(SSH_ASKPASS_PASSPHRASE_PROMPT)) != 0) {
+		return NULL;
+	}
+	const char *start = prompt + strlen(SSH_ASKPASS_PASSPHRASE_PROMPT);
+	const char *end = strrchr(start, ':');
+	if (end == NULL) {
+		return NULL;
+	}
+
+	size_t suffix_length = strlen(SSH_ASKPASS_CONFIRM_EACH_USE_SUFFIX);
+	if ((size_t)(end - start) > suffix_length &&
+	    strncmp(end - suffix_length, SSH_ASKPASS_CONFIRM_EACH_USE_SUFFIX,
+	            suffix_length) == 0) {
+		end -= suffix_length;
+	}
+	size_t prefix_length = strlen(SSH_ASKPASS_QUOTED_KEY_PREFIX);
+	if ((size_t)(end - start) > prefix_length &&
+	    strncmp(start, SSH_ASKPASS_QUOTED_KEY_PREFIX, prefix_length) == 0 &&
+	    end[-1] == '\'') {
+		start += prefix_length;
+		end--;
+	}
+
+	if (end == start) {
+		return NULL;
+	}
+	return strndup_or_exit(start, (size_t)(end - start), "SSH key path");
+}
+
+static bool read_ssh_uint32(const unsigned char **cursor,
+                            const unsigned char *end, uint32_t *value) {
+	if (end - *cursor < 4) {
+		return false;
+	}
+	*value = ((uint32_t)(*cursor)[0] << 24) | ((uint32_t)(*cursor)[1] << 16) |
+	         ((uint32_t)(*cursor)[2] << 8) | (uint32_t)(*cursor)[3];
+	*cursor += 4;
+	return true;
+}
+
+/**
+ * Reads a string in SSH's wire format (a 4-byte big-endian length followed by
+ * that many bytes) from *cursor, advancing it past the string.
+ */
+static bool read_ssh_string(const unsigned char **cursor,
+                            const unsigned char *end,
+                            const unsigned char **value, size_t *length) {
+	uint32_t size;
+	if (!read_ssh_uint32(cursor, end, &size) ||
+	    (size_t)(end - *cursor) < size) {
+		return false;
+	}
+	*value = *cursor;
+	*length = size;
+	*cursor += size;
+	return true;
+}
+
+/**
+ * Finds the first line of text which is a public key ("<type> <base64>
+ * [comment]", as in a .pub file) and decodes it into blob, which must be at
+ * least as big as text.
+ */
+static bool public_key_from_text(const char *text, unsigned char *blob,
+                                 size_t *blob_size) {
+	size_t capacity = strlen(text);
+	for (const char *line = text; *line != (char)0;) {
+		const char *type = line;
+		while (*type == ' ' || *type == '\t') {
+			type++;
+		}
+		const char *type_end = type;
+		while (*type_end != (char)0 && !isspace((unsigned char)*type_end)) {
+			type_end++;
+		}
+		const char *encoded = type_end;
+		while (*encoded == ' ' || *encoded == '\t') {
+			encoded++;
+		}
+		const char *encoded_end = encoded;
+		while (*encoded_end != (char)0 &&
+		       !isspace((unsigned char)*encoded_end)) {
+			encoded_end++;
+		}
+
+		// The key's own type must match the one it is listed with
+		const unsigned char *blob_type;
+		size_t blob_type_length;
+		const unsigned char *cursor = blob;
+		if (type != type_end && *type != '#' && encoded != encoded_end &&
+		    sodium_base642bin(blob, capacity, encoded,
+		                      (size_t)(encoded_end - encoded), NULL,
+		                      blob_size, NULL,
+		                      sodium_base64_VARIANT_ORIGINAL) == 0 &&
+		    read_ssh_string(&cursor, blob + *blob_size, &blob_type,
+		                    &blob_type_length) &&
+		    blob_type_length == (size_t)(type_end - type) &&
+		    memcmp(blob_type, type, blob_type_length) == 0) {
+			return true;
+		}
+
+		line = strchr(encoded_end, '\n');
+		if (line == NULL) {
+			break;
+		}
+		line++;
+	}
+	return false;
+}
+
+/**
+ * Decodes the public key in an OpenSSH private key into blob, which must be at
+ * least as big as text. The public key is not encrypted, even if the private
+ * key is.
+ */
+static bool public_key_from_private_key(const char *text, unsigned char *blob,
+                                        size_t *blob_size) {
+	const char *begin = strstr(text, SSH_PRIVATE_KEY_BEGIN);
+	if (begin == NULL) {
+		return false;
+	}
+	begin += strlen(SSH_PRIVATE_KEY_BEGIN);
+	const char *end = strstr(begin, SSH_PRIVATE_KEY_END);
+	if (end == NULL) {
+		return false;
+	}
+
+	size_t capacity = (size_t)(end - begin);
+	unsigned char *decoded = malloc_or_exit(capacity, "SSH private key");
+	size_t decoded_size = 0;
+	bool found = false;
+	if (sodium_base642bin(decoded, capacity, begin, capacity, " \t\r\n",
+	                      &decoded_size, NULL,
+	                      sodium_base64_VARIANT_ORIGINAL) == 0 &&
+	    decoded_size >= sizeof(SSH_PRIVATE_KEY_MAGIC) &&
+	    memcmp(decoded, SSH_PRIVATE_KEY_MAGIC,
+	           sizeof(SSH_PRIVATE_KEY_MAGIC)) == 0) {
+		const unsigned char *cursor = decoded + sizeof(SSH_PRIVATE_KEY_MAGIC);
+		const unsigned char *decoded_end = decoded + decoded_size;
+		const unsigned char *value;
+		size_t length;
+		uint32_t key_count;
+		// The cipher, KDF and KDF options come before the public keys
+		found = read_ssh_string(&cursor, decoded_end, &value, &length) &&
+		        read_ssh_string(&cursor, decoded_end, &value, &length) &&
+		        read_ssh_string(&cursor, decoded_end, &value, &length) &&
+		        read_ssh_uint32(&cursor, decoded_end, &key_count) &&
+		        key_count > 0 &&
+		        read_ssh_string(&cursor, decoded_end, &value, &length);
+		if (found) {
+			memcpy(blob, value, length);
+			*blob_size = length;
+		}
+	}
+
+	sodium_memzero(decoded, capacity);
+	free(decoded);
+	return found;
+}
+
+/**
+ * Returns the NUL-terminated contents of the file at path (which must be
+ * freed with free_text()), or NULL if it cannot be read.
+ */
+static char *read_text(const char *path) {
+	if (access(path, R_OK) != 0) {
+		return NULL;
+	}
+	encoded_file *f = read_file(path);
+	char *result = strndup_or_exit((const char *)f->data, f->length,
+	                               "contents of SSH key file");
+	sodium_memzero(f->data, f->length);
+	free_encoded_file(f);
+	return result;
+}
+
+static void free_text(char *text) {
+	if (text != NULL) {
+		sodium_memzero(text, strlen(text));
+		free(text);
+	}
+}
+
+/**
+ * Returns the SHA256 fingerprint ssh-keygen -l prints for the SSH key at path
+ * (which must be freed), or NULL if it prints none. This is only for keys
+ * whose public key cannot be found without deriving it from the private key.
+ */
+static char *get_fingerprint_from_ssh_keygen(const char *path) {
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+		return NULL;
+	}
+	char *const argv[] = {(char *)"ssh-keygen", (char *)"-l", (char *)"-E",
+	                      (char *)"sha256",     (char *)"-f", (char *)path,
+	                      NULL};
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+	// Nothing for it to ask a passphrase with
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+	                                 O_RDONLY, 0);
+	pid_t pid;
+	int spawn_result =
+	    posix_spawnp(&pid, "ssh-keygen", &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipe_fds[1]);
+
+	// Read to the end, so that ssh-keygen is not left blocked on a full pipe,
+	// keeping only the start
+	char output[SSH_KEYGEN_OUTPUT_SIZE];
+	char chunk[SSH_KEYGEN_OUTPUT_SIZE];
+	size_t output_length = 0;
+	ssize_t r;
+	while ((r = read(pipe_fds[0], chunk, sizeof(chunk))) != 0) {
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r < 0) {
+			break;
+		}
+		size_t kept = sizeof(output) - 1 - output_length;
+		if ((size_t)r < kept) {
+			kept = (size_t)r;
+		}
+		memcpy(output + output_length, chunk, kept);
+		output_length += kept;
+	}
+	close(pipe_fds[0]);
+	output[output_length] = (char)0;
+
+	int status;
+	if (spawn_result != 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return NULL;
+	}
+
+	// It prints the size, the fingerprint, the comment and the type
+	const char *fingerprint = strstr(output, " " SSH_FINGERPRINT_PREFIX);
+	if (fingerprint == NULL) {
+		return NULL;
+	}
+	fingerprint++;
+	size_t length = strcspn(fingerprint, " \t\n");
+	return strndup_or_exit(fingerprint, length, "SSH key fingerprint");
+}
+
+/**
+ * Returns the SHA256 fingerprint of the SSH key at path (which must be
+ * freed), as ssh-keygen -l prints it, or NULL if it has no public key. As for
+ * ssh-keygen, the public key is looked for in the file, then in the file with
+ * .pub appended, then in the OpenSSH private key in the file; failing those,
+ * ssh-keygen itself is asked, since it can derive the public key from other
+ * private keys.
+ */
+static char *get_fingerprint(const char *path) {
+	size_t public_path_size = strlen(path) + sizeof(".pub");
+	char *public_path = malloc_or_exit(public_path_size, "SSH public key path");
+	snprintf(public_path, public_path_size, "%s.pub", path);
+
+	char *text = read_text(path);
+	char *public_text = read_text(public_path);
+	free(public_path);
+	size_t blob_capacity = 1;
+	blob_capacity += text == NULL ? 0 : strlen(text);
+	blob_capacity += public_text == NULL ? 0 : strlen(public_text);
+	unsigned char *blob = malloc_or_exit(blob_capacity, "SSH public key");
+	size_t blob_size = 0;
+	bool found =
+	    (text != NULL && public_key_from_text(text, blob, &blob_size)) ||
+	    (public_text != NULL &&
+	     public_key_from_text(public_text, blob, &blob_size)) ||
+	    (text != NULL && public_key_from_private_key(text, blob, &blob_size));
+	bool readable = text != NULL;
+	free_text(text);
+	free_text(public_text);
+	if (!found) {
+		free(blob);
+		return readable ? get_fingerprint_from_ssh_keygen(path) : NULL;
+	}
+
+	unsigned char hash[crypto_hash_sha256_BYTES];
+	crypto_hash_sha256(hash, blob, blob_size);
+	free(blob);
+
+	size_t encoded_size = sodium_base64_ENCODED_LEN(
+	    sizeof(hash), sodium_base64_VARIANT_ORIGINAL_NO_PADDING);
+	char *result = malloc_or_exit(
+	    strlen(SSH_FINGERPRINT_PREFIX) + encoded_size, "SSH key fingerprint");
+	strcpy(result, SSH_FINGERPRINT_PREFIX);
+	sodium_bin2base64(result + strlen(SSH_FINGERPRINT_PREFIX), encoded_size,
+	                  hash, sizeof(hash),
+	                  sodium_base64_VARIANT_ORIGINAL_NO_PADDING);
+	return result;
+}
+
+unsigned short int run_ssh_askpass(invocation_state_t *invocation) {
+	const char *notify_command = getenv(SSH_ASKPASS_NOTIFY_ENV);
+	if (notify_command == NULL || notify_command[0] == (char)0) {
+		// get-passphrase is run from a terminal
+		notify_command = invocation->ssh_key != NULL
+		                     ? NULL
+		                     : SSH_ASKPASS_DEFAULT_NOTIFY_COMMAND;
+	}
+
+	invocation_state_t *generate = new_invocation_state(subcommand_generate);
+	generate->file = get_keyfile_path();
+	if (access(generate->file, R_OK) != 0) {
+		errx(EXIT_BAD_INVOCATION,
+		     "%s encrypted keyfile does not exist at %s; you can create it "
+		     "with %s enrol",
+		     APPNAME, generate->file, APPNAME);
+	}
+	// The keyfile is enrolled with an empty passphrase, since the point is
+	// not to ask for one
+	generate->passphrase =
+	    secure_strdup_or_exit("", "passphrase in invocation state");
+
+	// ssh asks for several secrets in a row, which a running agent answers
+	// without opening authenticators and deriving the key again each time;
+	// a socket left behind by an agent which is no longer running is ignored
+	if (agent_is_listening()) {
+		generate->use_agent = true;
+	} else {
+		generate->wait_for_device = true;
+		generate->wait_seconds = SSH_ASKPASS_WAIT_SECONDS;
+	}
+
+	if (invocation->prompt != NULL &&
+	    strncmp(invocation->prompt, SSH_ASKPASS_CONFIRM_PROMPT,
+	            strlen(SSH_ASKPASS_CONFIRM_PROMPT)) == 0) {
+		notify(notify_command, "Trigger authenticator to allow use of key",
+		       invocation->prompt);
+		// Touching the authenticator is the confirmation, so the secret is
+		// thrown away
+		generate->mixin = strdup_or_exit("", "mixin data in invocation state");
+		if (freopen("/dev/null", "w", stdout) == NULL) {
+			err(EXIT_FAILURE, "Unable to open /dev/null");
+		}
+	} else {
+		char *ssh_key =
+		    invocation->ssh_key != NULL
+		        ? strdup_or_exit(invocation->ssh_key, "SSH key path")
+		        : ssh_key_path_from_prompt(invocation->prompt);
+		if (ssh_key == NULL) {
+			errx(EXIT_BAD_INVOCATION, "Unrecognized prompt: %s",
+			     invocation->prompt);
+		}
+		if (access(ssh_key, F_OK) != 0) {
+			notify_about_key(notify_command, APPNAME " ssh-askpass failure",
+			                 ssh_key, NULL);
+			errx(EXIT_BAD_INVOCATION, "No such SSH key: %s", ssh_key);
+		}
+		generate->mixin = get_fingerprint(ssh_key);
+		if (generate->mixin == NULL) {
+			errx(EXIT_BAD_INVOCATION,
+			     "Unable to find the public key for %s; ssh-keygen -y can "
+			     "write it to %s.pub",
+			     ssh_key, ssh_key);
+		}
+		notify_about_key(notify_command,
+		                 invocation->ssh_key != NULL
+		                     ? "Trigger authenticator to get passphrase"
+		                     : "Trigger authenticator to add key to ssh agent",
+		                 ssh_key, generate->mixin);
+		free(ssh_key);
+	}
+	free_invocation(invocation);
+
+	unsigned short int result = print_secret_consuming_invocation(generate);
+	if (result == EXIT_NO_DEVICES) {
+		notify(notify_command, APPNAME " ssh-askpass failure",
+		       "No compatible FIDO2 authenticator device was connected.");
+	}
+	return result;
+}
@@ -0,0 +1,498 @@
+#include "unlock_dir.h"
+
+#include <dirent.h>
+#include <fido.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "authenticator.h"
+#include "cryptography.h"
+#include "exit.h"
+#include "files.h"
+#include "generate.h"
+#include "hotplug.h"
+#include "memory.h"
+#include "serialization.h"
+
+typedef struct unlock_keyfile_t {
+	char *path;
+	deserialized_cleartext *cleartext;
+} unlock_keyfile_t;
+
+typedef struct unlock_state_t {
+	invocation_state_t *invocation;
+	size_t keyfile_count;
+	unlock_keyfile_t *keyfiles;
+	// Whether the passphrase and PIN were given as options, rather than asked
+	// for; once asked for, the shared passphrase (with --same-passphrase) and
+	// the PIN are kept in the invocation too
+	bool passphrase_given;
+	bool pin_given;
+	// Opened once for every keyfile, and again only if a device goes away
+	devices_list_t *devices_list;
+	probed_devices_t *probed;
+} unlock_state_t;
+
+/**
+ * Sorts files as the mkinitcpio hook used to try them, with the shell's "*"
+ * followed by ".*": alphabetically, but hidden files last.
+ */
+static int hidden_files_last(const struct dirent **a, const struct dirent **b) {
+	bool a_hidden = (*a)->d_name[0] == '.';
+	bool b_hidden = (*b)->d_name[0] == '.';
+	if (a_hidden != b_hidden) {
+		return a_hidden ? 1 : -1;
+	}
+	return alphasort(a, b);
+}
+
+/**
+ * Loads the keyfile at path, or warns and returns NULL if it cannot be, so
+ * that one bad keyfile does not stop the others being tried.
+ */
+static deserialized_cleartext *load_keyfile(const char *path) {
+	char error[FAILURE_MESSAGE_SIZE];
+	deserialized_cleartext *cleartext = NULL;
+	encoded_file *f = try_read_file(path, error, sizeof(error));
+	if (f != NULL) {
+		cleartext = try_load_cleartext(f, error, sizeof(error));
+		free_encoded_file(f);
+	}
+	if (cleartext == NULL) {
+		warnx("Skipping %s: %s", path, error);
+	}
+	return cleartext;
+}
+
+static void load_keyfiles(unlock_state_t *state, const char *directory) {
+	struct dirent **entries = NULL;
+	int entry_count = scandir(directory, &entries, NULL, hidden_files_last);
+	if (entry_count < 0) {
+		err(EXIT_DESERIALIZATION_ERROR, "Unable to read directory %s",
+		    directory);
+	}
+
+	state->keyfile_count = 0;
+	state->keyfiles =
+	    malloc_or_exit(sizeof(unlock_keyfile_t) *
+	                       (entry_count > 0 ? (size_t)entry_count : 1),
+	                   "keyfiles in directory");
+	for (int i = 0; i < entry_count; i++) {
+		size_t path_size =
+		    strlen(directory) + strlen(entries[i]->d_name) + 2;
+		char *path = malloc_or_exit(path_size, "keyfile path");
+		snprintf(path, path_size, "%s/%s", directory, entries[i]->d_name);
+		free(entries[i]);
+
+		// Like the shell's test -f, this follows symbolic links
+		struct stat file_stat;
+		if (stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+			free(path);
+			continue;
+		}
+		deserialized_cleartext *cleartext = load_keyfile(path);
+		if (cleartext == NULL) {
+			free(path);
+			continue;
+		}
+
+		unlock_keyfile_t *keyfile = &state->keyfiles[state->keyfile_count++];
+		keyfile->path = path;
+		keyfile->cleartext = cleartext;
+	}
+	free(entries);
+}
+
+static void free_state(unlock_state_t *state) {
+	for (size_t i = 0; i < state->keyfile_count; i++) {
+		free_cleartext(state->keyfiles[i].cleartext);
+		free(state->keyfiles[i].path);
+	}
+	free(state->keyfiles);
+	free_probed_devices(state->probed);
+	free_devices_list(state->devices_list);
+	free_invocation(state->invocation);
+}
+
+static bool device_may_be_candidate_for_any(const fido_dev_info_t *device_info,
+                                            const device_facts_t *facts,
+                                            void *context) {
+	unlock_state_t *state = (unlock_state_t *)context;
+	for (size_t i = 0; i < state->keyfile_count; i++) {
+		if (device_may_be_candidate(device_info, facts,
+		                            state->keyfiles[i].cleartext)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void close_devices(unlock_state_t *state) {
+	free_probed_devices(state->probed);
+	state->probed = NULL;
+	free_devices_list(state->devices_list);
+	state->devices_list = NULL;
+}
+
+/**
+ * Opens every connected device which could hold the credential in any of the
+ * keyfiles.
+ */
+static void open_devices(unlock_state_t *state) {
+	state->devices_list = list_devices();
+	state->probed = probe_devices(state->devices_list,
+	                              device_may_be_candidate_for_any, state);
+	for (size_t i = 0; i < state->probed->count; i++) {
+		probed_device_t *device = &state->probed->list[i];
+		if (device->status != device_probe_ok &&
+		    device->status != device_probe_not_wanted) {
+			warnx("Skipping device at %s: %s", device->path,
+			      describe_device_probe_failure(device));
+		}
+	}
+}
+
+/**
+ * Whether any open device could hold the credential in cleartext, going by
+ * its USB IDs and AAGUID; if none could, there is no point deriving its key.
+ */
+static bool has_open_candidate(unlock_state_t *state,
+                               deserialized_cleartext *cleartext) {
+	for (size_t i = 0; i < state->probed->count; i++) {
+		probed_device_t *device = &state->probed->list[i];
+		if (device->status == device_probe_ok && device->device != NULL &&
+		    device_ids_match(cleartext,
+		                     fido_dev_info_ptr(state->devices_list->list, i)) &&
+		    device_aaguid_matches(cleartext, &device->facts)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool any_keyfile_has_open_candidate(unlock_state_t *state) {
+	for (size_t i = 0; i < state->keyfile_count; i++) {
+		if (has_open_candidate(state, state->keyfiles[i].cleartext)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static char *prompt_for_passphrase(unlock_state_t *state,
+                                   unlock_keyfile_t *keyfile) {
+	const char *format = state->invocation->same_passphrase
+	                         ? "passphrase for all keyfiles in %s"
+	                         : "passphrase for %s";
+	const char *path = state->invocation->same_passphrase
+	                       ? state->invocation->file
+	                       : keyfile->path;
+	size_t description_size = strlen(format) + strlen(path);
+	char *description =
+	    malloc_or_exit(description_size, "passphrase description");
+	snprintf(description, description_size, format, path);
+
+	char *passphrase =
+	    secure_malloc_or_exit(LONGEST_VALID_PASSPHRASE + 1, "passphrase");
+	prompt_for_secret(description, LONGEST_VALID_PASSPHRASE, passphrase);
+	free(description);
+	return passphrase;
+}
+
+/**
+ * Starts deriving the key for keyfile on a worker thread, from the passphrase
+ * given or asked for with --same-passphrase, or else from one asked for now,
+ * so that the devices can be waited for or a PIN asked for meanwhile.
+ */
+static key_derivation_t *start_deriving_key(unlock_state_t *state,
+                                            unlock_keyfile_t *keyfile) {
+	invocation_state_t *invocation = state->invocation;
+	char *passphrase = invocation->passphrase;
+	if (passphrase == NULL) {
+		passphrase = prompt_for_passphrase(state, keyfile);
+		if (invocation->same_passphrase) {
+			invocation->passphrase = passphrase;
+		}
+	} else if (!state->passphrase_given) {
+		warnx("Trying %s", keyfile->path);
+	}
+
+	key_spec_t *key_spec = make_key_spec_from_passphrase_and_cleartext(
+	    passphrase, keyfile->cleartext);
+	if (passphrase != invocation->passphrase) {
+		secure_free(passphrase);
+	}
+	return start_deriving_key_consuming_key_spec(key_spec);
+}
+
+/**
+ * Opens the devices, waiting for a compatible one to be connected with
+ * --wait, and returns whether any could hold the credential in a keyfile.
+ * Like generate, this derives a key while it waits, but only for the first
+ * keyfile, and only if that needs no passphrase to be asked for which might
+ * turn out to be for a keyfile with no authenticator; *derivation is set to
+ * that derivation, or to NULL.
+ */
+static bool open_devices_waiting_if_asked(unlock_state_t *state,
+                                          key_derivation_t **derivation) {
+	*derivation = NULL;
+	// Watch before listing, so that no device connected in between is missed
+	hotplug_watch_t *hotplug_watch = NULL;
+	if (state->invocation->wait_for_device) {
+		hotplug_watch =
+		    start_watching_for_devices(state->invocation->wait_seconds);
+	}
+	open_devices(state);
+
+	bool found = any_keyfile_has_open_candidate(state);
+	if (!found && hotplug_watch != NULL) {
+		if (state->keyfile_count == 1 ||
+		    state->invocation->passphrase != NULL ||
+		    state->invocation->same_passphrase) {
+			*derivation = start_deriving_key(state, &state->keyfiles[0]);
+		}
+		warn_waiting_for_authenticator(state->invocation->wait_seconds);
+		while (!found && wait_for_device_change(hotplug_watch)) {
+			close_devices(state);
+			open_devices(state);
+			found = any_keyfile_has_open_candidate(state);
+		}
+	}
+	stop_watching_for_devices(hotplug_watch);
+	return found;
+}
+
+/**
+ * Asks for the PIN for device, which needs one, keeping it for every later
+ * device and keyfile. As for generate, an empty PIN skips the devices which
+ * need one.
+ */
+static void ask_for_pin(unlock_state_t *state, probed_device_t *device) {
+	char description[FAILURE_MESSAGE_SIZE];
+	snprintf(description, sizeof(description),
+	         "authenticator PIN for %s at %s", device->product_string,
+	         device->path);
+	state->invocation->authenticator_pin =
+	    secure_malloc_or_exit(LONGEST_VALID_PIN + 1, "authenticator PIN");
+	prompt_for_secret(description, LONGEST_VALID_PIN,
+	                  state->invocation->authenticator_pin);
+	if (state->invocation->authenticator_pin[0] == '\0') {
+		warnx("No PIN entered; skipping authenticators which need one");
+	}
+}
+
+/**
+ * Asks for the PIN now, if none has been, when an open device which could
+ * hold the credential in keyfile needs one to give its secret, so that it is
+ * asked for while the key is being derived rather than after.
+ */
+static void ask_for_pin_if_needed(unlock_state_t *state,
+                                  unlock_keyfile_t *keyfile) {
+	if (state->invocation->authenticator_pin != NULL ||
+	    keyfile->cleartext->unattended) {
+		return;
+	}
+	for (size_t i = 0; i < state->probed->count; i++) {
+		probed_device_t *device = &state->probed->list[i];
+		if (device->status == device_probe_ok && device->device != NULL &&
+		    device_ids_match(keyfile->cleartext,
+		                     fido_dev_info_ptr(state->devices_list->list, i)) &&
+		    device_aaguid_matches(keyfile->cleartext, &device->facts) &&
+		    fido_dev_has_pin(device->device)) {
+			ask_for_pin(state, device);
+			return;
+		}
+	}
+}
+
+/**
+ * Returns the key which decrypts keyfile, derived from its passphrase, asking
+ * again for a passphrase which is wrong up to --attempts times in all. If
+ * derivation is not NULL, it is the first attempt, already started (see
+ * start_deriving_key()). Returns NULL if the passphrase was wrong every time.
+ */
+static unsigned char *get_key(unlock_state_t *state, unlock_keyfile_t *keyfile,
+                              key_derivation_t *derivation) {
+	invocation_state_t *invocation = state->invocation;
+	for (unsigned int attempt = 1;; attempt++) {
+		if (derivation == NULL) {
+			derivation = start_deriving_key(state, keyfile);
+		}
+		ask_for_pin_if_needed(state, keyfile);
+		unsigned char *key_bytes = finish_deriving_key(derivation);
+		derivation = NULL;
+
+		if (key_decrypts_cleartext(keyfile->cleartext, key_bytes)) {
+			return key_bytes;
+		}
+		free_key(key_bytes);
+		key_bytes = NULL;
+
+		warnx("Could not decrypt secrets in %s; this likely means the "
+		      "passphrase was wrong",
+		      keyfile->path);
+		if (state->passphrase_given) {
+			return NULL;
+		}
+		if (invocation->same_passphrase) {
+			secure_free(invocation->passphrase);
+			invocation->passphrase = NULL;
+		}
+		if (attempt >= invocation->passphrase_attempts) {
+			warnx("Too many failed passphrase attempts (maximum of %u)",
+			      invocation->passphrase_attempts);
+			return NULL;
+		}
+	}
+}
+
+/**
+ * Asks the open devices for the secret for params, as the agent does: asking
+ * for a PIN the first time a device needs one, and reopening the devices once
+ * if one has gone away since they were opened.
+ */
+static unsigned short int ask_devices(unlock_state_t *state,
+                                      unlock_keyfile_t *keyfile,
+                                      authenticator_parameters_t *params,
+                                      secret_t *secret) {
+	invocation_state_t *invocation = state->invocation;
+	bool reopened = false;
+	while (true) {
+		probed_device_t *needs_pin = NULL;
+		bool transport_error = false;
+		unsigned short int result = get_secret_from_open_devices(
+		    state->devices_list, state->probed, keyfile->cleartext, params,
+		    invocation->authenticator_pin, invocation->race_authenticators,
+		    secret, &needs_pin, &transport_error);
+
+		if (result == EXIT_BAD_PIN && needs_pin != NULL) {
+			ask_for_pin(state, needs_pin);
+			continue;
+		}
+		if (result == EXIT_BAD_PIN && !state->pin_given) {
+			// Ask again for the next keyfile
+			secure_free(invocation->authenticator_pin);
+			invocation->authenticator_pin = NULL;
+		}
+		if (transport_error && !reopened) {
+			close_devices(state);
+			open_devices(state);
+			reopened = true;
+			continue;
+		}
+		return result;
+	}
+}
+
+/**
+ * Gets the secret for keyfile, returning EXIT_SUCCESS, or the exit code
+ * generate would fail with (having warned why). As for get_key(), derivation
+ * is the derivation of the key already started for keyfile, or NULL.
+ */
+static unsigned short int unlock_keyfile(unlock_state_t *state,
+                                         unlock_keyfile_t *keyfile,
+                                         key_derivation_t *derivation,
+                                         secret_t *secret) {
+	unsigned char *key_bytes = get_key(state, keyfile, derivation);
+	if (key_bytes == NULL) {
+		return EXIT_BAD_PASSPHRASE;
+	}
+	authenticator_parameters_t *params = NULL;
+	char error[FAILURE_MESSAGE_SIZE];
+	unsigned short int result =
+	    try_build_authenticator_parameters_from_deserialized_cleartext_and_key_and_mixin(
+	        keyfile->cleartext, key_bytes, state->invocation->mixin, &params,
+	        error, sizeof(error));
+	free_key(key_bytes);
+	key_bytes = NULL;
+	if (result != EXIT_SUCCESS) {
+		warnx("Skipping %s: %s", keyfile->path, error);
+		return result;
+	}
+
+	result = EXIT_BAD_INVOCATION;
+	if (params->derive_subkeys) {
+		warnx("Skipping %s: it was enrolled with --derive-subkeys, so gives a "
+		      "root secret rather than a key",
+		      keyfile->path);
+	} else {
+		result = ask_devices(state, keyfile, params, secret);
+		if (result != EXIT_SUCCESS) {
+			warnx("No connected authenticator was able to generate a valid "
+			      "secret for %s",
+			      keyfile->path);
+		}
+	}
+	free_parameters(params);
+	return result;
+}
+
+unsigned short int unlock_dir(invocation_state_t *invocation) {
+	unlock_state_t state = {
+	    .invocation = invocation,
+	    .keyfile_count = 0,
+	    .keyfiles = NULL,
+	    .passphrase_given = invocation->passphrase != NULL,
+	    .pin_given = invocation->authenticator_pin != NULL,
+	    .devices_list = NULL,
+	    .probed = NULL,
+	};
+	if (invocation->passphrase_attempts == 0) {
+		invocation->passphrase_attempts =
+		    DEFAULT_UNLOCK_DIR_PASSPHRASE_ATTEMPTS;
+	}
+
+	load_keyfiles(&state, invocation->file);
+	if (state.keyfile_count == 0) {
+		warnx("No keyfiles could be loaded from %s", invocation->file);
+		free_state(&state);
+		return EXIT_DESERIALIZATION_ERROR;
+	}
+
+	key_derivation_t *derivation = NULL;
+	bool found = open_devices_waiting_if_asked(&state, &derivation);
+	// The key derived while waiting is only any use if the authenticator
+	// connected could be the first keyfile's, and it takes enough memory that
+	// it should not be kept around otherwise
+	if (derivation != NULL &&
+	    (!found || !has_open_candidate(&state, state.keyfiles[0].cleartext))) {
+		cancel_key_derivation(derivation);
+		derivation = NULL;
+	}
+	if (!found) {
+		unsigned short int result = state.devices_list->count == 0
+		                                ? EXIT_NO_DEVICES
+		                                : EXIT_NO_VALID_AUTHENTICATOR;
+		warnx("Unable to find an appropriate authenticator for any keyfile "
+		      "in %s",
+		      invocation->file);
+		free_state(&state);
+		return result;
+	}
+
+	unsigned short int result = EXIT_NO_VALID_AUTHENTICATOR;
+	secret_t *secret = malloc_or_exit(sizeof(secret_t), "secret");
+	secret->secret = NULL;
+	secret->secret_size = 0;
+	for (size_t i = 0; i < state.keyfile_count; i++) {
+		unlock_keyfile_t *keyfile = &state.keyfiles[i];
+		// There is no point asking for the passphrase for, or deriving the
+		// key for, a keyfile whose authenticator is not connected
+		if (!has_open_candidate(&state, keyfile->cleartext)) {
+			continue;
+		}
+		// Any key derived while waiting is the first keyfile's, which is
+		// tried first if it is tried at all
+		result = unlock_keyfile(&state, keyfile, derivation, secret);
+		derivation = NULL;
+		if (result == EXIT_SUCCESS) {
+			print_hex(stdout, secret->secret, secret->secret_size);
+			fflush(stdout);
+			break;
+		}
+	}
+	free_secret(secret);
+	free_state(&state);
+	return result;
+}
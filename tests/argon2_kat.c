@@ -0,0 +1,299 @@
+/**
+ * Known-answer tests for our Argon2 implementation, which the key for every
+ * keyfile is derived with: a wrong answer here would lock people out of their
+ * keyfiles. This includes src/argon2.c so that it can see which compression
+ * function is in use (and reach the secret key and associated data which the
+ * RFC 9106 vectors need), and is built once for each compression function
+ * (see the test target in the Makefile).
+ */
+
+#include "argon2.c"
+
+#include <sodium.h>
+
+typedef struct argon2_vector_t {
+	int type;
+	const char *passphrase;
+	const char *salt;
+	uint32_t t_cost;
+	uint32_t m_cost_kib;
+	uint32_t lanes;
+	size_t output_size;
+	const char *expected_hex;
+} argon2_vector_t;
+
+// Computed with the reference implementation,
+// https://github.com/P-H-C/phc-winner-argon2, covering one and several lanes,
+// memory costs which are not a multiple of four blocks per lane (so that some
+// is left unused), and outputs longer than one BLAKE2b digest.
+static const argon2_vector_t reference_vectors[] = {
+    {ARGON2_TYPE_ID, "password", "somesalt", 2, 65536, 1, 32,
+     "09316115d5cf24ed5a15a31a3ba326e5cf32edc24702987c02b6566f61913cf7"},
+    {ARGON2_TYPE_I, "password", "somesalt", 2, 65536, 1, 32,
+     "c1628832147d9720c5bd1cfd61367078729f6dfb6f8fea9ff98158e0d7816ed0"},
+    {ARGON2_TYPE_ID, "correct horse battery staple", "khefin test salt", 1,
+     4096, 2, 32,
+     "915b78727150ac725deff04344290a96ab73c325472856f843b8d50af0e86947"},
+    {ARGON2_TYPE_ID, "correct horse battery staple", "khefin test salt", 3,
+     4099, 4, 32,
+     "7d27128a1f9cf3c88c67b32f6823fbd08040adad5b41e3f45d755fc30af02031"},
+    {ARGON2_TYPE_I, "correct horse battery staple", "khefin test salt", 3,
+     1000, 8, 32,
+     "9a159110356a298ff2a86c0ae555378e015df52f4a692894f7111042765ec482"},
+    {ARGON2_TYPE_ID, "", "khefin test salt", 2, 37, 3, 32,
+     "2d2e63275ebbecfb4c7c2ca1dd38a8fad99c277ddc6e739cf9fa01129ec84bf9"},
+    {ARGON2_TYPE_ID, "correct horse battery staple", "khefin test salt", 2,
+     2047, ARGON2_MAX_LANES, 32,
+     "83fb250436d46974fc14cacbf6a98b3d4c07fbd5b051ac6b810786a6b9c400b7"},
+    {ARGON2_TYPE_ID, "correct horse battery staple", "khefin test salt", 1,
+     513, 2, 100,
+     "f3ee2a0fc0e11403ac9ea603c3191847a82b562b6715fd2f6ff5df57fbf964d063be97bf"
+     "4c8f5ad763b74660b074c60ef523dbe00472c8d13c9a50d870dfe790e7617eb2320d37c7"
+     "e908cca708d6edf45ac0d1f710e1888a908b4e0b4c39e6874955b446"},
+    {ARGON2_TYPE_I, "correct horse battery staple", "khefin test salt", 4, 77,
+     5, 64,
+     "e10f476830a4bfd26e566348bb5143479502715a4c73f01a70e784742c7a38ae6ec4dbbc"
+     "abf4bb77f3f476aa6166ff5e87565407601b41237eb1b03c4cf2e529"},
+};
+
+// The Argon2i and Argon2id test vectors from RFC 9106 (sections 5.2 and 5.3),
+// which use a secret key and associated data; Argon2d is not implemented.
+static const struct {
+	int type;
+	const char *expected_hex;
+} rfc9106_vectors[] = {
+    {ARGON2_TYPE_I,
+     "c814d9d1dc7f37aa13f0d77f2494bda1c8de6b016dd388d29952a4c4672b6ce8"},
+    {ARGON2_TYPE_ID,
+     "0d640df58d78766c08c037a34a8b53c9d01ef0452d75b65eb52520e96b01e659"},
+};
+
+// Single-lane parameters which are also checked against crypto_pwhash(), which
+// version 1 keyfiles were derived with before we had our own implementation.
+// The memory limits are in bytes, as in a keyfile, and include some which are
+// not a whole number of KiB or of four blocks.
+static const struct {
+	int type;
+	unsigned long long opslimit;
+	size_t memlimit;
+	size_t output_size;
+} crypto_pwhash_comparisons[] = {
+    {ARGON2_TYPE_ID, 1, 8192, 32},
+    {ARGON2_TYPE_ID, 2, 8192 + 1023, 32},
+    {ARGON2_TYPE_ID, 3, (1024 * 1024) + (5 * 1024) + 3, 64},
+    {ARGON2_TYPE_ID, 4, 100 * 1024, 32},
+    {ARGON2_TYPE_I, 3, 8192 + 1023, 32},
+    {ARGON2_TYPE_I, 4, (1024 * 1024) + (5 * 1024) + 3, 64},
+};
+
+#define LONGEST_TEST_OUTPUT 128
+
+static unsigned int failures = 0;
+
+static void report_failure(const char *description,
+                           const unsigned char *output, size_t output_size,
+                           const char *expected_hex) {
+	char output_hex[(LONGEST_TEST_OUTPUT * 2) + 1];
+	sodium_bin2hex(output_hex, sizeof(output_hex), output, output_size);
+	printf("FAIL %s\n     got      %s\n     expected %s\n", description,
+	       output_hex, expected_hex);
+	failures++;
+}
+
+static void check_reference_vector(const argon2_vector_t *vector) {
+	unsigned char output[LONGEST_TEST_OUTPUT];
+	unsigned char expected[LONGEST_TEST_OUTPUT];
+	char description[128];
+	snprintf(description, sizeof(description),
+	         "reference vector: type %d, t %u, m %u KiB, %u lanes, %zu bytes",
+	         vector->type, vector->t_cost, vector->m_cost_kib, vector->lanes,
+	         vector->output_size);
+
+	if (sodium_hex2bin(expected, sizeof(expected), vector->expected_hex,
+	                   strlen(vector->expected_hex), NULL, NULL, NULL) != 0) {
+		printf("FAIL %s: invalid expected value\n", description);
+		failures++;
+		return;
+	}
+	if (argon2_hash(output, vector->output_size, vector->passphrase,
+	                strlen(vector->passphrase),
+	                (const unsigned char *)vector->salt, strlen(vector->salt),
+	                vector->t_cost, vector->m_cost_kib, vector->lanes,
+	                vector->type, NULL) != 0) {
+		printf("FAIL %s: argon2_hash() failed\n", description);
+		failures++;
+		return;
+	}
+	if (memcmp(output, expected, vector->output_size) != 0) {
+		report_failure(description, output, vector->output_size,
+		               vector->expected_hex);
+		return;
+	}
+	printf("ok   %s\n", description);
+}
+
+static void check_rfc9106_vector(int type, const char *expected_hex) {
+	unsigned char passphrase[32];
+	unsigned char salt[16];
+	unsigned char secret[8];
+	unsigned char ad[12];
+	memset(passphrase, 0x01, sizeof(passphrase));
+	memset(salt, 0x02, sizeof(salt));
+	memset(secret, 0x03, sizeof(secret));
+	memset(ad, 0x04, sizeof(ad));
+
+	unsigned char output[32];
+	unsigned char expected[32];
+	char description[64];
+	snprintf(description, sizeof(description), "RFC 9106 vector: type %d",
+	         type);
+
+	sodium_hex2bin(expected, sizeof(expected), expected_hex,
+	               strlen(expected_hex), NULL, NULL, NULL);
+	argon2_memory_t *memory = argon2_allocate_memory(32, 4);
+	if (memory == NULL ||
+	    hash_in_memory_with_secret_and_ad(
+	        output, sizeof(output), (const char *)passphrase,
+	        sizeof(passphrase), salt, sizeof(salt), secret, sizeof(secret), ad,
+	        sizeof(ad), 3, 32, 4, type, memory, NULL) != 0) {
+		printf("FAIL %s: hashing failed\n", description);
+		failures++;
+		argon2_free_memory(memory);
+		return;
+	}
+	argon2_free_memory(memory);
+	if (memcmp(output, expected, sizeof(output)) != 0) {
+		report_failure(description, output, sizeof(output), expected_hex);
+		return;
+	}
+	printf("ok   %s\n", description);
+}
+
+/**
+ * Checks a single-lane hash against crypto_pwhash(), converting the memory
+ * limit as derive_key() does. The same memory is then hashed into again, as
+ * it is when it has been prepared in advance, to check that what is left in
+ * it doesn't change the result.
+ */
+static void check_against_crypto_pwhash(int type, unsigned long long opslimit,
+                                        size_t memlimit, size_t output_size) {
+	static const char passphrase[] = "correct horse battery staple";
+	// crypto_pwhash() takes exactly crypto_pwhash_SALTBYTES of salt
+	static const char salt[crypto_pwhash_SALTBYTES + 1] = "khefin test salt";
+	unsigned char output[LONGEST_TEST_OUTPUT];
+	unsigned char expected[LONGEST_TEST_OUTPUT];
+	char expected_hex[(LONGEST_TEST_OUTPUT * 2) + 1];
+	char description[128];
+	snprintf(description, sizeof(description),
+	         "crypto_pwhash(): type %d, t %llu, memlimit %zu bytes, %zu bytes",
+	         type, opslimit, memlimit, output_size);
+
+	if (crypto_pwhash(expected, output_size, passphrase, strlen(passphrase),
+	                  (const unsigned char *)salt, opslimit, memlimit,
+	                  type == ARGON2_TYPE_ID ? crypto_pwhash_ALG_ARGON2ID13
+	                                         : crypto_pwhash_ALG_ARGON2I13) !=
+	    0) {
+		printf("FAIL %s: crypto_pwhash() failed\n", description);
+		failures++;
+		return;
+	}
+	sodium_bin2hex(expected_hex, sizeof(expected_hex), expected, output_size);
+
+	uint32_t m_cost_kib = (uint32_t)(memlimit / 1024);
+	argon2_memory_t *memory = argon2_allocate_memory(m_cost_kib, 1);
+	if (memory == NULL) {
+		printf("FAIL %s: unable to allocate memory\n", description);
+		failures++;
+		return;
+	}
+	for (int reused = 0; reused < 2; reused++) {
+		if (argon2_hash_in_memory(output, output_size, passphrase,
+		                          strlen(passphrase),
+		                          (const unsigned char *)salt,
+		                          crypto_pwhash_SALTBYTES, (uint32_t)opslimit, m_cost_kib, 1, type,
+		                          memory) != 0) {
+			printf("FAIL %s: argon2_hash_in_memory() failed\n", description);
+			failures++;
+			break;
+		}
+		if (memcmp(output, expected, output_size) != 0) {
+			report_failure(description, output, output_size, expected_hex);
+			break;
+		}
+		printf("ok   %s%s\n", description, reused ? " (reused memory)" : "");
+	}
+	argon2_free_memory(memory);
+}
+
+static void check_invalid_parameters_are_refused(void) {
+	static const struct {
+		uint32_t m_cost_kib;
+		uint32_t lanes;
+	} invalid[] = {
+	    {8, 0},
+	    {2 * ARGON2_SYNC_POINTS * 2 - 1, 2},
+	    {4096, ARGON2_MAX_LANES + 1},
+	};
+	unsigned char output[32];
+	unsigned int failures_before = failures;
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		if (argon2_hash(output, sizeof(output), "", 0, NULL, 0, 1,
+		                invalid[i].m_cost_kib, invalid[i].lanes,
+		                ARGON2_TYPE_ID, NULL) != -1) {
+			printf("FAIL m %u KiB with %u lanes was accepted\n",
+			       invalid[i].m_cost_kib, invalid[i].lanes);
+			failures++;
+		}
+	}
+	if (failures == failures_before) {
+		printf("ok   invalid parameters are refused\n");
+	}
+}
+
+static const char *fill_block_name(argon2_fill_block_t fill_block) {
+#ifdef ARGON2_HAVE_AVX2
+	if (fill_block == fill_block_avx2) {
+		return "AVX2";
+	}
+#endif
+#ifdef ARGON2_HAVE_SSE2
+	if (fill_block == fill_block_default) {
+		return "SSE2";
+	}
+#endif
+	return fill_block == fill_block_default ? "portable" : "unknown";
+}
+
+int main(void) {
+	if (sodium_init() < 0) {
+		printf("FAIL unable to initialize libsodium\n");
+		return 1;
+	}
+	printf("Testing Argon2 with the %s compression function\n",
+	       fill_block_name(choose_fill_block()));
+
+	for (size_t i = 0;
+	     i < sizeof(reference_vectors) / sizeof(reference_vectors[0]); i++) {
+		check_reference_vector(&reference_vectors[i]);
+	}
+	for (size_t i = 0; i < sizeof(rfc9106_vectors) / sizeof(rfc9106_vectors[0]);
+	     i++) {
+		check_rfc9106_vector(rfc9106_vectors[i].type,
+		                     rfc9106_vectors[i].expected_hex);
+	}
+	for (size_t i = 0; i < sizeof(crypto_pwhash_comparisons) /
+	                           sizeof(crypto_pwhash_comparisons[0]);
+	     i++) {
+		check_against_crypto_pwhash(crypto_pwhash_comparisons[i].type,
+		                            crypto_pwhash_comparisons[i].opslimit,
+		                            crypto_pwhash_comparisons[i].memlimit,
+		                            crypto_pwhash_comparisons[i].output_size);
+	}
+	check_invalid_parameters_are_refused();
+
+	if (failures > 0) {
+		printf("%u failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+#!/bin/bash
+
+set +xv -euo pipefail
+umask 077
+
+# Times unlocking a LUKS2 image on a loop device through the khefin token
+# plugin, in-process, against piping khefin generate into cryptsetup as the
+# keyscripts do. Both only test the key (cryptsetup open --test-passphrase), so
+# no device is mapped.
+
+repository="$(cd "$(dirname "$0")/.." && pwd)"
+binary="${KHEFIN:-$repository/dist/bin/khefin}"
+runs="${RUNS:-5}"
+
+help() {
+	printf "Usage: %s <encrypted-keyfile>\n\n" "$0"
+	fold -w 80 -s <<HELPEOF
+Benchmarks unlocking a LUKS2 image on a loop device, using <encrypted-keyfile>, which must have been generated by khefin enrol without --derive-subkeys, with an authenticator which has no PIN, which must be connected. The authenticator is asked for the secret twice for each run, so may need to be touched that many times.
+
+The passphrase is read from the terminal, or from the PASSPHRASE environment variable if it is set. RUNS sets how many times each way is timed (by default 5).
+
+cryptsetup only loads token plugins from its own directory, so libcryptsetup-token-khefin.so must have been installed there (make cryptsetup-token and make install). Needs the binary built by make release (or set KHEFIN to its path).
+
+This script must be run as root.
+HELPEOF
+}
+
+if [ $# -ne 1 ] || [ "$1" == "-h" ] || [ "$1" == "--help" ] ||
+	[ "$(id -u)" -ne 0 ]; then
+	help
+	exit 1
+fi
+
+keyfile="$(realpath "$1")"
+
+missing() {
+	printf "SKIP %s\n" "$1"
+	exit 77
+}
+
+[ -r "$keyfile" ] || missing "cannot read $keyfile"
+[ -x "$binary" ] || missing "cannot find $binary (run make release)"
+command -v cryptsetup >/dev/null || missing "cannot find cryptsetup"
+
+if [ -z "${PASSPHRASE+set}" ]; then
+	read -r -s -p "Passphrase for $keyfile: " PASSPHRASE
+	printf "\n"
+fi
+
+work_directory="$(mktemp -d)"
+image="$work_directory/luks.img"
+loop_device=""
+
+cleanup() {
+	set +e
+	if [ -n "$loop_device" ]; then
+		losetup -d "$loop_device"
+	fi
+	rm -rf "$work_directory"
+}
+trap cleanup EXIT TERM INT
+
+# The keyslots use a cheap PBKDF, so that the times are mostly khefin's
+cheap_pbkdf=(--pbkdf pbkdf2 --pbkdf-force-iterations 1000)
+
+printf "Touch the authenticator if it flashes\n"
+head -c 32 /dev/urandom >"$work_directory/initial.key"
+printf "%s\n" "$PASSPHRASE" |
+	"$binary" generate --file "$keyfile" >"$work_directory/secret"
+truncate -s 32M "$image"
+cryptsetup luksFormat --batch-mode --type luks2 "${cheap_pbkdf[@]}" \
+	--key-file "$work_directory/initial.key" "$image"
+cryptsetup luksAddKey "${cheap_pbkdf[@]}" --key-slot 1 \
+	--key-file "$work_directory/initial.key" "$image" "$work_directory/secret"
+printf '{"type":"khefin","keyslots":["1"],"keyfile":"%s"}' \
+	"$(base64 -w 0 "$keyfile")" | cryptsetup token import --json-file - "$image"
+: >"$work_directory/secret"
+loop_device="$(losetup --find --show "$image")"
+
+unlock_with_token() {
+	printf "%s\n" "$PASSPHRASE" |
+		cryptsetup open --test-passphrase --token-only "$loop_device"
+}
+
+unlock_with_generate() {
+	printf "%s\n" "$PASSPHRASE" | "$binary" generate --file "$keyfile" |
+		cryptsetup open --test-passphrase --key-file - "$loop_device"
+}
+
+# Prints the mean wall clock time, in milliseconds, of RUNS calls of $1
+mean_milliseconds() {
+	local total=0 start
+	for ((i = 0; i < runs; i++)); do
+		start="$(date +%s%N)"
+		"$1"
+		total=$((total + $(date +%s%N) - start))
+	done
+	printf "%u\n" $((total / runs / 1000000))
+}
+
+printf "token:    %s ms\n" "$(mean_milliseconds unlock_with_token)"
+printf "generate: %s ms\n" "$(mean_milliseconds unlock_with_generate)"
@@ -0,0 +1,157 @@
+#!/bin/bash
+
+set +xv -euo pipefail
+umask 077
+
+# Runs pam_khefin through a real PAM stack with pamtester, using pam_wrapper
+# (https://cwrap.org/pam_wrapper.html) so that the service files can live in a
+# temporary directory rather than /etc/pam.d and nothing needs root.
+
+repository="$(cd "$(dirname "$0")/.." && pwd)"
+binary="${KHEFIN:-$repository/dist/bin/khefin}"
+module="${PAM_KHEFIN:-$repository/dist/lib/security/pam_khefin.so}"
+pam_wrapper="${PAM_WRAPPER_LIBRARY:-$(ldconfig -p 2>/dev/null |
+	awk '$1 == "libpam_wrapper.so" { print $NF; exit }')}"
+user="$(id -un)"
+
+help() {
+	printf "Usage: %s <encrypted-keyfile>\n\n" "$0"
+	fold -w 80 -s <<HELPEOF
+Tests pam_khefin.so against <encrypted-keyfile>, which must have been generated by khefin enrol without --derive-subkeys, using an authenticator holding its credential, which must be connected. The authenticator is asked for the secret several times, so may need to be touched several times.
+
+The passphrase is read from the terminal, or from the PASSPHRASE environment variable if it is set. If the authenticator has a PIN, set the PIN environment variable to it.
+
+Needs pamtester, libpam_wrapper.so (or set PAM_WRAPPER_LIBRARY to its path), and the module and binary built by make pam and make release (or set PAM_KHEFIN and KHEFIN to their paths).
+
+Exits with status 0 if every check passed, 1 if any failed, and 77 if something needed was missing.
+HELPEOF
+}
+
+if [ $# -ne 1 ] || [ "$1" == "-h" ] || [ "$1" == "--help" ]; then
+	help
+	exit 1
+fi
+
+keyfile="$(realpath "$1")"
+
+missing() {
+	printf "SKIP %s\n" "$1"
+	exit 77
+}
+
+[ -r "$keyfile" ] || missing "cannot read $keyfile"
+[ -x "$binary" ] || missing "cannot find $binary (run make release)"
+[ -r "$module" ] || missing "cannot find $module (run make pam)"
+command -v pamtester >/dev/null || missing "cannot find pamtester"
+[ -r "$pam_wrapper" ] || missing "cannot find libpam_wrapper.so"
+
+work_directory="$(mktemp -d)"
+
+cleanup() {
+	rm -rf "$work_directory"
+}
+trap cleanup EXIT
+
+if [ -z "${PASSPHRASE+set}" ]; then
+	read -r -s -p "Passphrase for $keyfile: " PASSPHRASE
+	printf "\n"
+fi
+
+# The answers to every prompt the module might make, in order: the passphrase,
+# then the PIN if there is one
+answers() {
+	printf "%s\n" "$1"
+	if [ -n "${PIN:-}" ]; then
+		printf "%s\n" "$PIN"
+	fi
+}
+
+# Writes the verifier for the output of generate, given the rest of the
+# arguments, to $1
+make_verifier() {
+	local verifier="$1"
+	shift
+	local -a pin_options=()
+	if [ -n "${PIN:-}" ]; then
+		pin_options=(--pin "$PIN")
+	fi
+	printf "%s\n" "$PASSPHRASE" |
+		"$binary" generate --file "$keyfile" "${pin_options[@]}" "$@" |
+		sha256sum >"$verifier"
+}
+
+# Writes a service file called $1 with a single auth line passing the rest of
+# the arguments to the module
+make_service() {
+	local service="$1"
+	shift
+	printf "auth required %s %s\n" "$module" "$*" \
+		>"$work_directory/services/$service"
+}
+
+failures=0
+
+# Runs pamtester for service $2 with passphrase $3, and checks that it succeeds
+# (if $1 is "succeeds") or fails (if $1 is "fails")
+check() {
+	local expected="$1" service="$2" passphrase="$3" actual
+	if answers "$passphrase" |
+		PAM_WRAPPER=1 PAM_WRAPPER_SERVICE_DIR="$work_directory/services" \
+			LD_PRELOAD="$pam_wrapper" \
+			pamtester "$service" "$user" authenticate >/dev/null 2>&1; then
+		actual="succeeds"
+	else
+		actual="fails"
+	fi
+
+	if [ "$actual" == "$expected" ]; then
+		printf "ok   %s %s\n" "$service" "$expected"
+	else
+		printf "FAIL %s %s, expected it to %s\n" "$service" "$actual" \
+			"${expected%s}"
+		failures=$((failures + 1))
+	fi
+}
+
+mkdir -p "$work_directory/services"
+printf "Touch the authenticator if it flashes\n"
+make_verifier "$work_directory/right.verifier"
+make_verifier "$work_directory/mixin.verifier" --mixin pam
+printf "%064d\n" 0 >"$work_directory/wrong.verifier"
+cp "$keyfile" "$work_directory/$user.key"
+cp "$work_directory/right.verifier" "$work_directory/$user.verifier"
+
+make_service right keyfile="$keyfile" verifier="$work_directory/right.verifier"
+make_service wrong-verifier keyfile="$keyfile" \
+	verifier="$work_directory/wrong.verifier"
+make_service missing-verifier keyfile="$keyfile" \
+	verifier="$work_directory/missing.verifier"
+make_service missing-keyfile keyfile="$work_directory/missing.key" \
+	verifier="$work_directory/right.verifier"
+make_service user-paths keyfile="$work_directory/%u.key" \
+	verifier="$work_directory/%u.verifier"
+make_service mixin keyfile="$keyfile" mixin=pam \
+	verifier="$work_directory/mixin.verifier"
+make_service mixin-mismatch keyfile="$keyfile" mixin=pam \
+	verifier="$work_directory/right.verifier"
+make_service race keyfile="$keyfile" race \
+	verifier="$work_directory/right.verifier"
+make_service use-first-pass keyfile="$keyfile" use_first_pass \
+	verifier="$work_directory/right.verifier"
+
+check succeeds right "$PASSPHRASE"
+check fails right "not $PASSPHRASE"
+check fails wrong-verifier "$PASSPHRASE"
+check fails missing-verifier "$PASSPHRASE"
+check fails missing-keyfile "$PASSPHRASE"
+check succeeds user-paths "$PASSPHRASE"
+check succeeds mixin "$PASSPHRASE"
+check fails mixin-mismatch "$PASSPHRASE"
+check succeeds race "$PASSPHRASE"
+# No earlier module gave a password
+check fails use-first-pass "$PASSPHRASE"
+
+if [ $failures -ne 0 ]; then
+	printf "%u failed\n" $failures
+	exit 1
+fi